@@ -35,6 +35,7 @@ static int64 txbytes;
 static int64 rxbytes;
 
 static bool verbose;
+static int64 snap_usec;		// If >0, snapshot the trace when an RPC takes longer
 static FILE* logfile;
 static uint32 server_ipnum;
 static uint16 server_portnum;
@@ -190,10 +191,11 @@ bool SendCommand(int sockfd, uint32* randseed, const char* command,
 
   // rls 2020.08.23 record the method name for each outgoing RPC
   // We also pack in the request length
+  kutrace::rpc_sample(tempid);	// Name goes in only if this RPC is traced
   kutrace::addname(KUTRACE_METHODNAME, tempid, request.header->method);
 
   // Start tracing the outgoing RPC request
-  kutrace::addevent(KUTRACE_RPCIDREQ, (lglen8 << 16) | tempid);
+  kutrace::rpc_set((lglen8 << 16) | tempid);
 
   if (verbose) {fprintf(stdout, "client4: SendRequest:     "); PrintRPC(stdout, &request);}
   LogRPC(logfile, &request);
@@ -202,7 +204,7 @@ bool SendCommand(int sockfd, uint32* randseed, const char* command,
   ok &= SendRequest(sockfd, &request);
 
   // Stop tracing the outgoing RPC request
-  kutrace::addevent(KUTRACE_RPCIDREQ, 0);
+  kutrace::rpc_set(0);
 
   // Block here until the response comes back
   RPC response;
@@ -218,7 +220,7 @@ bool SendCommand(int sockfd, uint32* randseed, const char* command,
   lglen8 = response.header->lglen2;	// Respense length
 
   // Start tracing the incoming RPC response
-  kutrace::addevent(KUTRACE_RPCIDRESP, (lglen8 << 16) | tempid);   
+  kutrace::rpc_set((lglen8 << 16) | tempid, KUTRACE_RPCIDRESP);   
 
   if (verbose) {fprintf(stdout, "client4: ReceiveResponse: "); PrintRPC(stdout, &response);}
   LogRPC(logfile, &response);
@@ -234,6 +236,8 @@ bool SendCommand(int sockfd, uint32* randseed, const char* command,
   ++hist[FloorLg(usec)];
   ++rpc_count;
   total_usec += elapsed;
+  // Flight recorder: keep the trace around an unusually slow RPC
+  if ((snap_usec > 0) && (elapsed > snap_usec)) {kutrace::snapshot(command);}
   txbytes += sizeof(RPCMarker) + request.headerlen + request.datalen;
   rxbytes += sizeof(RPCMarker) + response.headerlen + response.datalen;
 
@@ -242,7 +246,7 @@ bool SendCommand(int sockfd, uint32* randseed, const char* command,
   FreeRPC(&response);
 
   // Stop tracing the incoming RPC response
-  kutrace::addevent(KUTRACE_RPCIDRESP, 0);
+  kutrace::rpc_set(0, KUTRACE_RPCIDRESP);
 
   return ok;
 }
@@ -288,7 +292,7 @@ bool SendQuit(int sockfd, uint32* randseed) {
 
 void Usage() {
   fprintf(stderr, 
-    "Usage: client4 server port [-rep number] [-k number] [-waitms number] [-verbose] [-seed1]\n"
+    "Usage: client4 server port [-rep number] [-k number] [-waitms number] [-verbose] [-seed1] [-snap usec]\n"
     "               command [-key \"keybase\" [+] [padlen]]  [-value \"valuebase\" [+] [padlen]]\n");
   fprintf(stderr, "       command: ping [-value \"valuebase\" [+] [padlen]]\n");
   fprintf(stderr, "       command: read  -key \"keybase\" [+] [padlen]\n");
@@ -333,6 +337,7 @@ int main (int argc, const char** argv) {
   bool key_incr = false;
   bool value_incr = false;
   verbose = false;
+  snap_usec = 0;
   uint32 randseed = 1;
   bool seed1 = false;		// If true, set seed to 1 every time for repeatability
   sink_value.clear();
@@ -357,12 +362,14 @@ int main (int argc, const char** argv) {
     else if(strcmp(argv[i], "-waitms") == 0) {if (i + 1 < argc) {wait_msec = atoi(argv[i + 1]); ++i;}}
     else if (strcmp(argv[i], "-verbose") == 0) {verbose = true;}
     else if (strcmp(argv[i], "-seed1") == 0) {seed1 = true;}
+    else if(strcmp(argv[i], "-snap") == 0) {if (i + 1 < argc) {snap_usec = atoi(argv[i + 1]); ++i;}}
     // Bare word is command if we haven't seen one yet
     else if ((argv[i][0] != '-') && (command == NULL)) {command = argv[i];}
     else {fprintf(stderr, "Bad token at argv[%d] %s\n", i, argv[i]); Usage();}
   }
 
   if (command == NULL) {fprintf(stderr, "No command\n"); Usage();}
+  if (snap_usec > 0) {kutrace::snapshot_arm(100, 1000);}	// 100 msec window, 1/sec max
   if ((strcmp(command, "read") == 0) && (key_base[0] =='\0')) {fprintf(stderr, "Missing -key for read\n"); Usage();}
   if ((strcmp(command, "write") == 0) && (key_base[0] =='\0')) {fprintf(stderr, "Missing -key for write\n"); Usage();}
   if ((strcmp(command, "sink") == 0) && (key_base[0] =='\0')) {fprintf(stderr, "Missing -key for sink\n"); Usage();}
@@ -123,6 +123,8 @@ bool ReadOneRPC(int sockfd, RPC* rpc, uint32* hash32) {
   ////uint32 rpcid16 = rpcid32_to_rpcid16(rpc->header->rpcid);
   ////uint32 hash16 = hash32_to_hash16(packet_hash);
   ////kutrace::addevent(KUTRACE_RX_USER, (rpcid16 << 16) | hash16);
+  // Sampled tracing decides per RPC, so decide before this first entry for it
+  kutrace::rpc_sample(rpcid32_to_rpcid16(rpc->header->rpcid));
   kutrace::addevent(KUTRACE_RX_USER, packet_hash);
 
   // Read the data
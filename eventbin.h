@@ -0,0 +1,95 @@
+// eventbin.h
+//
+// Binary form of the rawtoevent output, written by rawtoevent -b and read
+// by eventtospan3. The text form costs a printf per event in rawtoevent, a
+// sort -n pass, and two sscanf per event in eventtospan3; these fixed-width
+// records are written and read with no formatting at all.
+//
+// The stream is the eight bytes of kEventBinMagic followed by 48-byte
+// BinEvent records:
+//   kBinString   defines string id arg; its duration bytes follow the
+//                record, padded to a multiple of eight
+//   kBinComment  a # comment line, string id name, e.g. "# ## VERSION: 3"
+//   otherwise    an event or name definition, same fields as a text line
+// Every string is defined before its first use. The other records are 
+// already in the order sort -n gives the text form (name copies at -1, 
+// comments, then events by time), so no sort step is needed.
+//
+// 2026.10.17 Intel Xeon VM, one CPU, 124MB user-mode trace of 16.26M events,
+// same JSON either way:
+//                   text                      binary (-b)
+//   rawtoevent    16.2 s  1.00M events/s   10.8 s  1.51M events/s (incl sort)
+//   sort -n       14.7 s                      -
+//   eventtospan3  51.5 s  0.32M events/s   23.0 s  0.71M events/s
+//   end to end    82.4 s  0.20M events/s   33.8 s  0.48M events/s
+// The binary file is 785MB against 936MB of text. (rawtoevent now sorts
+// both forms itself; see Sorted output there.)
+//
+// Copyright 2021 Richard L. Sites
+
+#ifndef __EVENTBIN_H__
+#define __EVENTBIN_H__
+
+#include <string>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "basetypes.h"
+
+static const char kEventBinMagic[8] = {'K', 'U', 'e', 'v', 'b', 'i', 'n', '1'};
+
+static const int32 kBinString = -1;
+static const int32 kBinComment = -2;
+
+// One text line:
+//   ts dur event cpu  pid rpc  arg retval IPC name (event)
+// or for a name definition
+//   ts dur event arg name
+typedef struct {
+  int64 start_ts;	// Multiples of 10ns, -1 for the copy of a name up front
+  int64 duration;	// Bytes for kBinString
+  int32 eventnum;	// kBinString, kBinComment, or the event number
+  int32 cpu;
+  int32 pid;
+  int32 rpcid;
+  int32 arg;		// String id for kBinString
+  int32 retval;
+  int32 ipc;
+  int32 name;		// String id
+} BinEvent;
+
+// True if f starts with kEventBinMagic, which is then consumed. Text starts
+// with '#', '-', or a digit, and is left untouched.
+inline bool IsEventBin(FILE* f) {
+  int c = getc(f);
+  if (c == EOF) {return false;}
+  ungetc(c, f);
+  if (c != kEventBinMagic[0]) {return false;}
+  char buf[8];
+  return (fread(buf, 1, 8, f) == 8) && (memcmp(buf, kEventBinMagic, 8) == 0);
+}
+
+inline void WriteBinString(FILE* f, int32 id, const std::string& s) {
+  BinEvent rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.eventnum = kBinString;
+  rec.duration = s.size();
+  rec.arg = id;
+  fwrite(&rec, 1, sizeof(rec), f);
+  static const char kZeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  fwrite(s.data(), 1, s.size(), f);
+  fwrite(kZeros, 1, (8 - (s.size() & 7)) & 7, f);
+}
+
+// The bytes that follow a kBinString record
+inline bool ReadBinString(FILE* f, const BinEvent& rec, std::string* s) {
+  int64 padded = (rec.duration + 7) & ~7ll;
+  if ((rec.duration < 0) || (padded > 65536)) {return false;}
+  char buf[65536];
+  if (fread(buf, 1, padded, f) != (size_t)padded) {return false;}
+  s->assign(buf, rec.duration);
+  return true;
+}
+
+#endif	// __EVENTBIN_H__
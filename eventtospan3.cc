@@ -62,7 +62,7 @@
 // 2021.10.21 dsites Add pstate2 for Raspberry Pi
 // 2021.10.22 dsites Chanfe mwait to wfi for Raspberry Pi
 
-// Compile with  g++ -O2 eventtospan3.cc -o eventtospan3
+// Compile with  g++ -O2 -pthread eventtospan3.cc -o eventtospan3
 
 
 /*TODO: 
@@ -70,9 +70,12 @@
   spantotrim new ipc
 */
 
-#include <map>
+#include <algorithm>	// sort
 #include <string>
+#include <vector>
 
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>     // exit, random
 #include <string.h>
@@ -82,8 +85,11 @@
 #include <sys/types.h>
 
 #include "basetypes.h"
+#include "eventbin.h"
+#include "eventparse.h"
 #include "kutrace_control_names.h"
 #include "kutrace_lib.h"
+#include "spanjson.h"
 
 // Event numbers or related masks
 #define call_mask        0xc00
@@ -112,7 +118,7 @@
 
 static const char* kIdleName = "-idle-";
 static const char* kIdlelpName = "-idlelp-";
-static const int kMAX_CPUS = 80;
+static const int kMaxCpus = 256;	// CPU number is one byte in the raw trace
 static const int kNetworkMbitSec = 1000;	// Default: 1 Gb/s if not in trace
 
 static const uint64 kMIN_CEXIT_DURATION = 10LL;	//  0.100 usec in multiples of 10 nsec
@@ -175,9 +181,108 @@ static const double kPowerTwoTenths[10] = {
 };
 
 
-using std::map;
-using std::multimap;
 using std::string;
+using std::vector;
+
+
+// Interned names
+// Every span and stack name is a NameId, the index of its text in one table
+// of all the distinct names seen. Spans and per-PID stacks are copied and
+// compared for every event; with ids that is a 32-bit move or compare instead
+// of a std::string copy or strcmp, and a OneSpan is a plain 48-byte struct.
+// The text is looked up again only to write JSON or to build a new name.
+//
+// 2026.10.17 Intel Xeon VM, one CPU, same JSON either way, best of several runs:
+//                                  std::string names   NameId names
+//   4.01M events, 12K PIDs,        8.0 s  12.5 MB      7.6 s  10.8 MB
+//     names of 18-30 characters
+//   16.26M events, one PID,       13.3 s  10.7 MB     13.3 s  10.7 MB (in the noise)
+//     names of 15 or fewer
+// Short names already fit inside std::string itself, so the gain is for
+// traces with long process and kernel routine names.
+typedef int32 NameId;
+
+// Blocks of names by NameId. A block never moves once made, so a name's
+// text can be read without a lock while other names are being added
+static const int kNameBlockSize = 4096;
+string* name_blocks[1 << 19];
+int name_count = 0;
+vector<NameId> name_slots;	// Open-addressed hash over the names, -1 = empty
+
+// With -jN, several threads intern names. Only then does InternName lock
+bool names_shared = false;
+pthread_mutex_t name_lock = PTHREAD_MUTEX_INITIALIZER;
+
+inline const string& NameString(NameId id) {return name_blocks[id / kNameBlockSize][id % kNameBlockSize];}
+inline const char* NameStr(NameId id) {return NameString(id).c_str();}
+
+// FNV-1a
+inline uint32 NameHash(const char* s, int len) {
+  uint32 hash = 2166136261u;
+  for (int i = 0; i < len; ++i) {hash = (hash ^ (uint8)s[i]) * 16777619u;}
+  return hash;
+}
+
+// Put id in the first empty slot for its hash
+void NameSlotInsert(NameId id) {
+  const string& str = NameString(id);
+  uint32 mask = name_slots.size() - 1;
+  uint32 slot = NameHash(str.data(), str.size()) & mask;
+  while (name_slots[slot] >= 0) {slot = (slot + 1) & mask;}
+  name_slots[slot] = id;
+}
+
+NameId InternNameLocked(const char* s, int len) {
+  if (name_slots.empty()) {name_slots.resize(1024, -1);}
+  uint32 mask = name_slots.size() - 1;
+  uint32 slot = NameHash(s, len) & mask;
+  while (name_slots[slot] >= 0) {
+    const string& str = NameString(name_slots[slot]);
+    if ((str.size() == len) && (memcmp(str.data(), s, len) == 0)) {return name_slots[slot];}
+    slot = (slot + 1) & mask;
+  }
+  NameId id = name_count;
+  if ((id % kNameBlockSize) == 0) {name_blocks[id / kNameBlockSize] = new string[kNameBlockSize];}
+  name_blocks[id / kNameBlockSize][id % kNameBlockSize].assign(s, len);
+  ++name_count;
+  name_slots[slot] = id;
+  // Keep the table at most half full
+  if (name_slots.size() < 2 * name_count) {
+    name_slots.assign(2 * name_slots.size(), -1);
+    for (NameId i = 0; i < name_count; ++i) {NameSlotInsert(i);}
+  }
+  return id;
+}
+
+// Return the id for these len bytes, adding them to the table if new.
+// No allocation unless the name is new
+NameId InternName(const char* s, int len) {
+  if (!names_shared) {return InternNameLocked(s, len);}
+  pthread_mutex_lock(&name_lock);
+  NameId id = InternNameLocked(s, len);
+  pthread_mutex_unlock(&name_lock);
+  return id;
+}
+
+NameId InternName(const char* s) {return InternName(s, strlen(s));}
+NameId InternName(const string& s) {return InternName(s.data(), s.size());}
+
+// Names the code below looks for or makes up itself
+static const NameId idle_name = InternName(kIdleName);
+static const NameId idlelp_name = InternName(kIdlelpName);
+static const NameId sched_name = InternName("-sched-");
+static const NameId dummy_name = InternName("-dummy-");
+static const NameId wakeup_name = InternName("-wakeup-");
+static const NameId cexit_name = InternName("-c-exit-");
+static const NameId runnable_name = InternName("runnable");
+static const NameId freq_name = InternName("freq");
+static const NameId wfi_name = InternName("wfi");
+static const NameId clone_name = InternName("clone");
+static const NameId clone_retname = InternName("/clone");
+static const NameId fork_name = InternName("fork");
+static const NameId fork_retname = InternName("/fork");
+static const NameId reschedule_ipi_name = InternName("reschedule_ipi");
+static const NameId bh_hi_retname = InternName("/BH:hi");
 
 
 // Per-PID short stack of events to return to.
@@ -221,7 +326,7 @@ typedef struct {
   int dequeue_num_pending;	// For piecing together RPC waiting in a queue (-1 = inactive)
   int top;		        // Top of our small stack
   int eventnum[5];		// One or more event numbers that are stacked calls
-  string name[5];		// One or more event names that are stacked calls
+  NameId name[5];		// One or more event names that are stacked calls
 } PidState;
          
 
@@ -252,7 +357,7 @@ typedef struct {
   int arg;
   int retval;
   int ipc;
-  string name;
+  NameId name;
 } OneSpan;
 
 
@@ -283,14 +388,9 @@ typedef struct {
 } LockContend;
 
 
-// Per-CPU state: M sets of these for M CPUs
-// +---------------+
-// | cpu_stack   o-|--> current thread's PidState w/return stack
-// +---------------+    saved and restored across context switches
-//   cur_span:
-// +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----------+
-// | ts  | dur | cpu | pid | rpc |event| arg | ret | ipc |  name     |
-// +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----------+
+// Per-CPU state: M sets of these for M CPUs, one per CPU number seen so far
+// The small scalars come first so they share the first cache line, and each
+// CPU starts on its own line.
 // +---------------+
 // |prior_pstate_ts|
 // +---------------+
@@ -308,10 +408,15 @@ typedef struct {
 // +---------------+
 // | valid_span    |
 // +---------------+
+//   cur_span:
+// +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----------+
+// | ts  | dur | cpu | pid | rpc |event| arg | ret | ipc |  name     |
+// +-----+-----+-----+-----+-----+-----+-----+-----+-----+-----------+
+// +---------------+
+// | cpu_stack   o-|--> current thread's PidState w/return stack
+// +---------------+    saved and restored across context switches
 //
-typedef struct {
-  PidState cpu_stack;		// Current call stack & span for each of kMAX_CPUS CPUs
-  OneSpan cur_span;
+typedef struct alignas(64) {
   uint64 prior_pstate_ts;	// Used to assign duration to each pstate (CPU clock freq)
   uint64 prior_pstate_freq;	// Used to assign frequency to each pstate2 span
   uint64 prior_pc_samp_ts;	// Used to assign duration to each PC sample
@@ -322,23 +427,134 @@ typedef struct {
 				// Above two are used at scheduler exit if a wakeup of oldpid
 				//  occurs *during* scheduling
   bool valid_span;		// Not valid span at beginning of trace
+  OneSpan cur_span;
+  PidState cpu_stack;		// Current call stack & span for this CPU
 } CPUState;
 
+
+// Hash map from an integer key (PID, RPC id, lock or packet hash) to V, for
+// the per-PID and per-RPC state below that is looked up on nearly every event.
+// One flat array of slots with linear probing, kept at most half full, so a
+// lookup is a multiply and usually one cache line instead of a walk down a
+// red-black tree. Erase shifts later entries of the probe run back, so there
+// are no tombstones.
+// Unlike std::map, inserting can move every entry: do not keep a reference 
+// from operator[] across an insert into the same map. There is no ordered
+// iteration; keys() gives the keys to sort, where output order matters.
+//
+// 2026.10.17 Intel Xeon VM, one CPU, eventtospan3 on 3.94M events with 12K
+// PIDs, an RPC with packet correlation, queueing and a lock in every time 
+// slice, same JSON, best of three:
+//                    std::map              FlatMap
+//   runtime          7.9 s  2.0 usec/event  6.3 s  1.6 usec/event
+//   peak RSS         20.8 MB                23.3 MB
+template<typename K, typename V>
+class FlatMap {
+ public:
+  FlatMap() {Init(1024);}
+
+  bool contains(K key) const {return slots_[Find(key)].used;}
+
+  // Value for key, value-initialized if new, as std::map
+  V& operator[](K key) {
+    int i = Find(key);
+    if (slots_[i].used) {return slots_[i].value;}
+    if (slots_.size() < 2 * (count_ + 1)) {
+      Grow();
+      i = Find(key);
+    }
+    slots_[i].key = key;
+    slots_[i].used = true;
+    slots_[i].value = V();
+    ++count_;
+    return slots_[i].value;
+  }
+
+  void erase(K key) {
+    int i = Find(key);
+    if (!slots_[i].used) {return;}
+    // Move back any later entry in this probe run that may not be past the hole
+    for (int j = Next(i); slots_[j].used; j = Next(j)) {
+      int home = Home(slots_[j].key);
+      bool stays = (i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j));
+      if (stays) {continue;}
+      slots_[i] = slots_[j];
+      i = j;
+    }
+    slots_[i].used = false;
+    slots_[i].value = V();	// Let go of any string
+    --count_;
+  }
+
+  void clear() {Init(1024);}
+  int size() const {return count_;}
+
+  void keys(vector<K>* out) const {
+    out->clear();
+    for (int i = 0; i < slots_.size(); ++i) {
+      if (slots_[i].used) {out->push_back(slots_[i].key);}
+    }
+  }
+
+ private:
+  typedef struct {
+    K key;
+    bool used;
+    V value;
+  } Slot;
+
+  void Init(int nslots) {
+    slots_.assign(nslots, Slot());
+    mask_ = nslots - 1;
+    shift_ = 64;
+    for (int n = nslots; n > 1; n >>= 1) {--shift_;}
+    count_ = 0;
+  }
+
+  // Fibonacci hashing: the top bits of key * 2**64/phi
+  int Home(K key) const {return ((uint64)key * 0x9E3779B97F4A7C15llu) >> shift_;}
+  int Next(int i) const {return (i + 1) & mask_;}
+
+  // Slot holding key, or the empty slot where it would go
+  int Find(K key) const {
+    int i = Home(key);
+    while (slots_[i].used && (slots_[i].key != key)) {i = Next(i);}
+    return i;
+  }
+
+  void Grow() {
+    vector<Slot> old;
+    old.swap(slots_);
+    int n = count_;
+    Init(2 * old.size());
+    for (int i = 0; i < old.size(); ++i) {
+      if (old[i].used) {slots_[Find(old[i].key)] = old[i];}
+    }
+    count_ = n;
+  }
+
+  vector<Slot> slots_;
+  int mask_;
+  int shift_;
+  int count_;
+};
+
 //
 // Globals across all CPUs
 //
-typedef map<int, PidState> PerPidState;	// State of each suspended task, by PID
-typedef map<int, string> IntName;	// Name for each PID/lock/method
-typedef map<int, OneSpan> PidWakeup;	// Previous wakeup event, by PID
-typedef map<int, uint64> PidTime;	// Previous per-PID timestamp (span end, kernel-seen packet)
-typedef map<int, uint> PidLock;		// Previous per-PID lock hash number
-typedef map<int, uint> PidHash32;	// Previous per-PID pending user packet hash number
-typedef map<int, bool> PidRunning;	// Set of currently-running PIDs
-typedef map<uint64, LockContend> LockPending;	// Previous lock try&fail event, by lockhash&pid
+typedef FlatMap<int, PidState> PerPidState;	// State of each suspended task, by PID
+typedef FlatMap<int, string> IntName;	// Name for each PID/lock/method
+typedef FlatMap<int, OneSpan> PidWakeup;	// Previous wakeup event, by PID
+typedef FlatMap<int, int> PidRpc;		// Previous per-PID RPC id
+typedef FlatMap<int, uint64> PidTime;	// Previous per-PID timestamp (span end, kernel-seen packet)
+typedef FlatMap<int, uint> PidLock;		// Previous per-PID lock hash number
+typedef FlatMap<int, uint> PidHash32;	// Previous per-PID pending user packet hash number
+typedef FlatMap<int, bool> PidRunning;	// Set of currently-running PIDs
+typedef FlatMap<uint64, LockContend> LockPending;	// Previous lock try&fail event, by lockhash&pid
 						// Multiple threads can be wanting the same lock
-typedef map<uint32, PidCorr> PidToCorr;		// pid to <timestamp, rpcid, len>
-typedef map<uint32, HashCorr> HashToCorr;	// hash32 to <timestamp, pid>
-typedef map<uint32, uint64> RpcQueuetime;	// rpcid to enqueue timestamp
+typedef FlatMap<uint32, PidCorr> PidToCorr;		// pid to <timestamp, rpcid, len>
+typedef FlatMap<uint32, HashCorr> HashToCorr;	// hash32 to <timestamp, pid>
+typedef FlatMap<uint32, uint64> RpcQueuetime;	// rpcid to enqueue timestamp
 
 
 // RPC-to-packet correlation
@@ -482,6 +698,7 @@ string kernel_version;
 string cpu_model_name;
 string host_name;
 int mbit_sec = kNetworkMbitSec;	// Default
+int rpc_sample = 1;		// User RPC entries kept for 1 in rpc_sample RPCs
 int max_cpu_seen = 0;		// Keep track of how many CPUs there are
 
 
@@ -491,7 +708,7 @@ static int incoming_flags = 0;    // Incoming flags, if any, from ## FLAGS: 128
 IntName pidnames;		  // Current name for each PID, by pid# 
 IntName pidrownames;		  // Collected names for each PID (clone, execve, etc. rename a thread), by pid#
 PidWakeup pendingWakeup;	  // Any pending wakeup event, to make arc from wakeup to running
-PidWakeup priorPidEvent;	  // Any prior event for each PID, to make wait_xxx display
+PidRpc priorPidEvent;		  // RPC id of any prior event for each PID, to make wait_xxx display
 PidTime priorPidEnd;	 	  // Any prior span end for each PID, to make wait_xxx display
 PidLock priorPidLock;	 	  // Any prior lock hash number for each PID, to make wait_xxx display
 IntName locknames;		  // Incoming lock name definitions
@@ -510,6 +727,161 @@ double total_idle = 0.0;
 double total_kernelmode = 0.0;
 double total_other = 0.0;
 
+// Which of the totals a span adds to
+enum {kStatUser, kStatIdle, kStatKernel, kStatOther};
+
+
+//
+// -jN two-phase reconstruction. See "Main loop" above main for the scheme;
+// these are its pieces
+//
+static const int kChunkEvents = 65536;	// Events per chunk
+static const int kChunksInFlight = 4;	// Being read, reconstructed, reconciled, spare
+
+// What phase one would have done to the globals above, left for phase two
+// to do in trace order
+enum {
+  kOpPidEvent,		// RememberPidEvent(a, b)
+  kOpPidEnd,		// RememberPidEnd(a, ts)
+  kOpRunningPid,	// SwitchRunningPid(a, b)
+  kOpRpcidMid,		// WriteRpcidMidSpan(ts, a, b, c)
+  kOpLockTry,		// RememberLockTry(events[a])
+  kOpLock,		// DoLockEvent(events[a])
+  kOpWakeup,		// WakeupPid(events[a], c)
+  kOpResume,		// ResumePid of the event at ts, duration ts2, CPU a, PID b
+  kOpEnqueue,		// RememberEnqueue(a, ts)
+  kOpDequeue,		// WriteQueuedSpan(a, b, ts)
+  kOpCorrelate,		// CorrelatePackets(events[a])
+  kOpStderr,		// err up to a goes to stderr
+  kOpRunEnd,		// End of a run of this CPU's events
+};
+
+typedef struct {
+  uint32 text_end;	// This CPU's span lines and stats up to here come first
+  uint32 stat_end;
+  int kind;
+  int a;
+  int b;
+  int c;
+  uint64 ts;
+  uint64 ts2;
+} DeferredOp;
+
+// One event for phase one, with what phase zero worked out ahead for it
+typedef struct {
+  OneSpan event;
+  int save;		// Context switch: slot to save the old PID's stack in, -1 = none
+  int load;		// Context switch: slot with the new PID's stack, -1 = perpidstate
+  NameId name0;		// Context switch: the new stack[0] name
+  bool rename;		// Not an event: rename event.pid to event.name on this CPU's stack
+  bool run_end;		// Last event of a run of this CPU's events in trace order
+} QueuedEvent;
+
+typedef struct Chunk Chunk;
+
+// One CPU's part of a chunk
+typedef struct {
+  vector<QueuedEvent> queue;	// In trace order
+  vector<DeferredOp> ops;	// In trace order
+  vector<OneSpan> events;	// Whole events for kOpLock and the like
+  vector<uint32> stats;		// For each span written, stat class << 30 | duration
+  string text;			// Span lines written, as they would have gone to stdout
+  string err;			// Lines for stderr
+  FILE* out;			// Appends to text
+  uint64 span_count;
+  int next;			// Phase one: next entry of queue
+  int op_done;			// Phase two: ops done, and text, stats, err put out
+  uint32 text_done;
+  uint32 stat_done;
+  uint32 err_done;
+  Chunk* chunk;
+  const QueuedEvent* cur;	// Phase one: the event being reconstructed
+  bool pid_event_deferred;	// Phase one: kOpPidEvent already left for cur
+} CpuWork;
+
+// A method or queue name definition, which phase two makes in trace order
+typedef struct {
+  bool method;
+  int key;
+  string name;
+} GlobalName;
+
+struct Chunk {
+  CpuWork cpu[kMaxCpus];
+  int cpus;			// CPUs 0..cpus-1 may have events
+  int events;
+  vector<int> runs;		// CPU of each run of events in trace order, -1 = a GlobalName
+  vector<GlobalName> globals;
+  vector<PidState> slots;	// Stacks handed between context switches in this chunk
+  vector<int> slot_ready;	// Nonzero once slots[i] holds its stack
+  FlatMap<int, int> latest;	// Latest slot of each PID saved or branded in this chunk
+  int run_cpu;			// Phase zero: CPU of the run being added to, -1 = none
+  int run_last;			// Phase zero: its last event, in cpu[run_cpu].queue
+  int workers_done;		// Phase one: workers through this chunk
+};
+
+typedef struct {
+  vector<CPUState>* cpustate;
+  PerPidState* perpidstate;
+  int workers;
+  vector<pthread_t> threads;
+  Chunk* chunks[kChunksInFlight];
+  Chunk* filling;		// Phase zero: chunk being filled, if any
+  vector<int> cpu_pid;		// Phase zero: PID each CPU will have after its queued events
+  FlatMap<int, bool> stacked;	// Phase zero: PIDs with a stack in perpidstate or a slot
+  uint64 queued;		// Chunks handed to phase one
+  uint64 reconstructed;		// Chunks through phase one
+  uint64 reconciled;		// Chunks through phase two
+  bool stop;
+  int slot_waiters;		// Workers waiting for some slot to be filled
+  pthread_mutex_t lock;		// Covers the counts, stop, and workers_done
+  pthread_cond_t changed;
+  pthread_cond_t slot_filled;
+} Pipeline;
+
+Pipeline* pipeline = NULL;	// Set while -jN threads run
+
+// Set on a phase-one worker to the CPU it is reconstructing
+thread_local CpuWork* cpu_work = NULL;
+
+// Where span lines go: stdout, or in phase one the CPU's text
+inline FILE* SpanOut() {return (cpu_work == NULL) ? stdout : cpu_work->out;}
+
+// Phase one: leave an op for phase two, after what was written so far
+void Defer(int kind, int a, int b, int c, uint64 ts, uint64 ts2) {
+  DeferredOp op;
+  op.text_end = cpu_work->text.size();
+  op.stat_end = cpu_work->stats.size();
+  op.kind = kind;
+  op.a = a;
+  op.b = b;
+  op.c = c;
+  op.ts = ts;
+  op.ts2 = ts2;
+  cpu_work->ops.push_back(op);
+}
+
+// Same, for an op that needs the whole event
+void DeferEvent(int kind, const OneSpan& event, int c) {
+  cpu_work->events.push_back(event);
+  Defer(kind, cpu_work->events.size() - 1, 0, c, 0, 0);
+}
+
+// stderr, or in phase one the CPU's lines for phase two to put out in order
+void Complain(const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  if (cpu_work == NULL) {
+    vfprintf(stderr, fmt, args);
+  } else {
+    char temp[256];
+    vsnprintf(temp, sizeof(temp), fmt, args);
+    cpu_work->err += temp;
+    Defer(kOpStderr, cpu_work->err.size(), 0, 0, 0, 0);
+  }
+  va_end(args);
+}
+
 
 // Fold 32-bit rpcid to 16-bit one
 // 32-bit rpcid is never zero. If low bits are zero, use high bits
@@ -571,7 +943,7 @@ bool OnlyInKernelMode(const OneSpan& event) {
   if (event.eventnum == KUTRACE_USERPID) {return true;}		// context switch
   if (event.eventnum == KUTRACE_RUNNABLE) {return true;}	// make runnable
   if (event.eventnum == KUTRACE_IPI) {return true;}	// send IPI
-  if (event.eventnum == KUTRACE_PSTATE) {return true;}	// current CPU clock frequency
+  if ((event.eventnum == KUTRACE_PSTATE) && (event.retval == 0)) {return true;}	// current CPU clock frequency, unless from the user-mode sampler
   if (event.eventnum == KUTRACE_PSTATE2) {return true;}	// current CPU clock frequency
   if (event.eventnum == KUTRACE_PC_K) {return true;}	// kernel-mode PC sample in timer irq
   if (event.eventnum == KUTRACE_PC_U) {return true;}	// user-mode PC sample in timer irq 2020.11.06
@@ -590,6 +962,7 @@ bool OnlyInUserMode(const OneSpan& event) {
   if (event.eventnum == KUTRACE_MARKB) {return true;}	// Marks
   if (event.eventnum == KUTRACE_MARKC) {return true;}	// Marks
   if (event.eventnum == KUTRACE_MARKD) {return true;}	// Marks
+  if (event.eventnum == KUTRACE_COUNTER) {return true;}	// CounterScope deltas, just after a mark
   return false;
 }
 
@@ -696,13 +1069,13 @@ bool IsUserTxPktInt(int eventnum) {return (eventnum == KUTRACE_TX_USER);}
 // Incoming RPC request/response. Prior RX_USER has set up pidtocorr[pid]
 bool IsIncomingRpcReqResp(const OneSpan& event) {
   return IsRpcReqRespInt(event.eventnum) && (event.arg != 0) && 
-    (pidtocorr.find(event.pid) != pidtocorr.end());
+    (pidtocorr.contains(event.pid));
 }
 
 // Outgoing RPC request/response. No pending pidcorr[pid]
 bool IsOutgoingRpcReqResp(const OneSpan& event) {
   return IsRpcReqRespInt(event.eventnum) && (event.arg != 0) && 
-    (pidtocorr.find(event.pid) == pidtocorr.end());
+    (!pidtocorr.contains(event.pid));
 }
 
 
@@ -752,10 +1125,10 @@ bool IsOptimizedCall(const OneSpan& event) {  // Must be a call already
 bool IsNewRunnablePidSyscall(const OneSpan& event) {
   if (!IsACallOrReturn(event)) {return false;}
   if (!IsASyscallOrReturn(event)) {return false;}
-  if (event.name == "clone") {return true;}
-  if (event.name == "/clone") {return true;}
-  if (event.name == "fork") {return true;}
-  if (event.name == "/fork") {return true;}
+  if (event.name == clone_name) {return true;}
+  if (event.name == clone_retname) {return true;}
+  if (event.name == fork_name) {return true;}
+  if (event.name == fork_retname) {return true;}
   return false;
 }
 
@@ -868,23 +1241,27 @@ void InitPidState(PidState* t) {
   t->top = 0;
   for (int i = 0; i < 5; ++i) {
     t->eventnum[i] = event_idle;
-    t->name[i].clear();
-    t->name[i] = string(kIdleName);
+    t->name[i] = idle_name;
   }
 }
 
-void BrandNewPid(int newpid, const string& newname, PerPidState* perPidState) {
-  PidState temp;
-  InitPidState(&temp);
-  temp.top = 1;
-  temp.eventnum[0] = PidToEventnum(newpid);
-  temp.name[0] = newname;
+// Two-item stack of just user-mode pid and sched_syscall
+void BrandNewStack(int newpid, NameId newname, PidState* temp) {
+  InitPidState(temp);
+  temp->top = 1;
+  temp->eventnum[0] = PidToEventnum(newpid);
+  temp->name[0] = newname;
   // Use current name, not the possibly-bad one from rawtoevent
-  if (pidnames.find(newpid) != pidnames.end()) {
-    temp.name[0] = NameAppendPid(pidnames[newpid], newpid);
+  if (pidnames.contains(newpid)) {
+    temp->name[0] = InternName(NameAppendPid(pidnames[newpid], newpid));
   }
-  temp.eventnum[1] = sched_syscall;
-  temp.name[1] = "-sched-";
+  temp->eventnum[1] = sched_syscall;
+  temp->name[1] = sched_name;
+}
+
+void BrandNewPid(int newpid, NameId newname, PerPidState* perPidState) {
+  PidState temp;
+  BrandNewStack(newpid, newname, &temp);
   (*perPidState)[newpid] = temp;
 }
 
@@ -902,7 +1279,26 @@ void InitSpan(OneSpan* s, int i) {
   // s->arg = 0;	// idle(0) regular; idle(1) low-power after mwait
   // s->retval = 0;
   // s->ipc = 0;
-  s->name = kIdleName;
+  s->name = idle_name;
+}
+
+// Add per-CPU state for CPUs up to and including cpu, each -idle- with no history
+void GrowCPUState(int cpu, vector<CPUState>* cpustate) {
+  int i = cpustate->size();
+  cpustate->resize(cpu + 1);
+  for (; i <= cpu; ++i) {
+    CPUState* thiscpu = &(*cpustate)[i];
+    InitPidState(&thiscpu->cpu_stack);
+    InitSpan(&thiscpu->cur_span, i);
+    thiscpu->prior_pstate_ts = 0;
+    thiscpu->prior_pstate_freq = 0;
+    thiscpu->prior_pc_samp_ts = 0;
+    thiscpu->ctx_switch_ts = 0;
+    thiscpu->mwait_pending = 0;
+    thiscpu->oldpid = 0;
+    thiscpu->newpid = 0;
+    thiscpu->valid_span = false;		// Ignore initial span  
+  }
 }
 
 // Example:
@@ -917,17 +1313,17 @@ void InitSpan(OneSpan* s, int i) {
 void DumpSpan(FILE* f, const char* label, const OneSpan* span) {
   fprintf(f, "%s <%llu %llu %d  %d %d %d %d %d %d %s>\n", 
   label, span->start_ts, span->duration, span->cpu, 
-  span->pid, span->rpcid, span->eventnum, span->arg, span->retval, span->ipc, span->name.c_str());
+  span->pid, span->rpcid, span->eventnum, span->arg, span->retval, span->ipc, NameStr(span->name));
 }
 
 void DumpSpanShort(FILE* f,  const OneSpan* span) {
-  fprintf(f, "<%llu %llu ... %s> ", span->start_ts, span->duration, span->name.c_str());
+  fprintf(f, "<%llu %llu ... %s> ", span->start_ts, span->duration, NameStr(span->name));
 }
 
 void DumpStack(FILE* f, const char* label, const PidState* stack) {
   fprintf(f, "%s [%d] %d %d {\n", label, stack->top, stack->ambiguous, stack->rpcid);
   for (int i = 0; i < 5; ++i) {
-    fprintf(f, "  [%d] %05x %s\n",i, stack->eventnum[i], stack->name[i].c_str());
+    fprintf(f, "  [%d] %05x %s\n",i, stack->eventnum[i], NameStr(stack->name[i]));
   }
   fprintf(f, "}\n");
 }
@@ -935,7 +1331,7 @@ void DumpStack(FILE* f, const char* label, const PidState* stack) {
 void DumpStackShort(FILE* f, const PidState* stack) {
   fprintf(f, "%d{", stack->top);
   for (int i = 0; i <= stack->top; ++i) {
-    fprintf(f, "%s ", stack->name[i].c_str());
+    fprintf(f, "%s ", NameStr(stack->name[i]));
   }
   fprintf(f, "}%s %d ", stack->ambiguous ? "ambig" : "", stack->rpcid);
 }
@@ -943,7 +1339,7 @@ void DumpStackShort(FILE* f, const PidState* stack) {
 void DumpEvent(FILE* f, const char* label, const OneSpan& event) {
   fprintf(f, "%s [%llu %llu %d  %d %d %d %d %d %d %s]\n", 
   label, event.start_ts, event.duration, event.cpu, 
-  event.pid, event.rpcid, event.eventnum, event.arg, event.retval, event.ipc, event.name.c_str());
+  event.pid, event.rpcid, event.eventnum, event.arg, event.retval, event.ipc, NameStr(event.name));
 }
 
 
@@ -981,6 +1377,23 @@ int FloorLg(uint64 x) {
 }
 
 
+// Remember the RPC id of each PID's latest event, for wait_* spans
+void RememberPidEvent(int pid, int rpcid) {
+  if (cpu_work != NULL) {
+    // Every call for one trace event has the same pid and rpcid
+    if (!cpu_work->pid_event_deferred) {Defer(kOpPidEvent, pid, rpcid, 0, 0, 0);}
+    cpu_work->pid_event_deferred = true;
+    return;
+  }
+  priorPidEvent[pid] = rpcid;
+}
+
+// Remember the end of each PID's latest span, for wait_* spans
+void RememberPidEnd(int pid, uint64 end_ts) {
+  if (cpu_work != NULL) {Defer(kOpPidEnd, pid, 0, 0, end_ts, 0); return;}
+  priorPidEnd[pid] = end_ts;
+}
+
 // Close off the current span
 // Remember each user-mode PID end in priorPidEnd
 void FinishSpan(const OneSpan& event, OneSpan* span) {
@@ -1002,7 +1415,7 @@ void FinishSpan(const OneSpan& event, OneSpan* span) {
       // Force big positive span to medium positive
       // except, ignore spans starting at 0
       if (span->start_ts != 0) {
-        fprintf(stderr, "BUG %llu .. %llu, duration too big %lld\n", 
+        Complain("BUG %llu .. %llu, duration too big %lld\n", 
                 span->start_ts, event.start_ts, span->duration);
         span->duration = 1000000;	// 10 msec
       }
@@ -1026,7 +1439,7 @@ void FinishSpan(const OneSpan& event, OneSpan* span) {
 
   // Remember the end of last instance of each PID user-mode execution
   if ((span->pid > 0) && (span->cpu >= 0) /* && IsUserExecnum(span->eventnum) */ ) {
-    priorPidEnd[span->pid] = span->start_ts + span->duration;
+    RememberPidEnd(span->pid, span->start_ts + span->duration);
   }
 }
 
@@ -1060,7 +1473,7 @@ void MakeArcSpan(const OneSpan& event1, const OneSpan& event2, OneSpan* span) {
   span->arg = event2.cpu;
   span->retval = event2.pid;	// Added 2020.08.20
   span->ipc = 0;
-  span->name = "-wakeup-";
+  span->name = wakeup_name;
 }
 
 // Waiting on reason c from event1 to event2. For PID or RPC, not on any CPU
@@ -1088,12 +1501,12 @@ void MakeWaitSpan(char letter, uint64 start_ts, uint64 end_ts, int pid, int rpci
   span->arg = 0;
   span->retval = 0;
   span->ipc = 0;
-  span->name = kWAIT_NAMES[letter - 'a'];
+  span->name = InternName(kWAIT_NAMES[letter - 'a']);
 }
 
 // For PID only; not CPU- or RPC-specific
 void MakeLockSpan(bool dots, uint64 start_ts, uint64 end_ts, int pid, 
-                  int lockhash, const string& lockname, OneSpan* span) {
+                  int lockhash, NameId lockname, OneSpan* span) {
   span->start_ts = start_ts;
   span->duration = end_ts - start_ts;
   span->cpu = -1;
@@ -1121,7 +1534,7 @@ void MakeRpcidMidSpan(uint64 start_ts, int cpu, int pid, int rpcid, OneSpan* spa
   span->arg = rpcid;
   span->retval = 0;
   span->ipc = 0;
-  span->name = string(rpc_name);
+  span->name = InternName(rpc_name);
 }
 
 // To insert just after dequeuing an RPC
@@ -1136,7 +1549,7 @@ void MakeQueuedSpan(uint64 start_ts, uint64 end_ts, int queue_num, int rpcid, On
   span->arg = queue_num;
   span->retval = 0;
   span->ipc = 0;
-  span->name = string(queuenames[queue_num]);
+  span->name = InternName(queuenames[queue_num]);
 }
 
 
@@ -1145,7 +1558,7 @@ void MakeQueuedSpan(uint64 start_ts, uint64 end_ts, int queue_num, int rpcid, On
 void CexitBackToIdle(OneSpan* span) {
   if (span->eventnum != event_c_exit) {return;}
   span->eventnum = event_idle;
-  span->name = string(kIdleName);
+  span->name = idle_name;
 //fprintf(stdout, "CexitBackToIdle at %llu\n", span->start_ts);
 }
 
@@ -1153,10 +1566,10 @@ void CexitBackToIdle(OneSpan* span) {
 void CheckSpan(const char* label, const CPUState* thiscpu) {
   bool fail = false;
   const OneSpan* span = &thiscpu->cur_span;
-  if ((span->name == string(kIdleName)) && 
+  if ((span->name == idle_name) && 
       (span->eventnum != event_idle)) {fail = true;}
   for (int i = 0; i < 5; ++i) {
-    if ((thiscpu->cpu_stack.name[i] == string(kIdleName)) && 
+    if ((thiscpu->cpu_stack.name[i] == idle_name) && 
         (thiscpu->cpu_stack.eventnum[i] != event_idle)) {fail = true;}
   }
   if (fail) {
@@ -1167,6 +1580,21 @@ void CheckSpan(const char* label, const CPUState* thiscpu) {
   }
 }
 
+// Add one span to the statistics
+void AddToTotal(int stat_class, uint64 duration) {
+  // Change time from multiples of 10 nsec to seconds and fraction
+  double dur_sec = duration / 100000000.0;
+  if (stat_class == kStatUser) {
+    total_usermode += dur_sec;
+  } else if (stat_class == kStatIdle) {
+    total_idle += dur_sec;
+  } else if (stat_class == kStatKernel) {
+    total_kernelmode += dur_sec;
+  } else {
+    total_other += dur_sec;
+  }
+}
+
 // Write the current timespan and start a new one
 // Change time from multiples of 10ns to seconds
 // ts           dur       CPU tid  rpc event arg0 ret  name
@@ -1177,28 +1605,29 @@ void WriteSpanJson2(FILE* f, const OneSpan* span) {
 
   // Output
   // time dur cpu pid rpcid event arg retval ipc name
-  // Change time from multiples of 10 nsec to seconds and fraction
-  double ts_sec = span->start_ts / 100000000.0;
-  double dur_sec = span->duration / 100000000.0;
 //CHECK("f", *span);
-  //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],", 
-          ts_sec, dur_sec, span->cpu, 
+  //             ts dur cpu  pid rpc event  arg ret ipc  name
+  WriteSpanJson(f, span->start_ts, span->duration, span->cpu, 
           span->pid, span->rpcid, span->eventnum, 
-          span->arg, span->retval, span->ipc, span->name.c_str());
-  ++span_count;
-  fprintf(f, "\n");
+          span->arg, span->retval, span->ipc, NameStr(span->name));
  
   // Stastics
+  int stat_class = kStatOther;
   if (IsUserExecNonidlenum(span->eventnum)) {
-    total_usermode += dur_sec;
+    stat_class = kStatUser;
   } else if (IsAnIdlenum(span->eventnum)) {
-    total_idle += dur_sec;
+    stat_class = kStatIdle;
   } else if (IsKernelmodenum(span->eventnum)) {
-    total_kernelmode += dur_sec;
-  } else {
-    total_other += dur_sec;
+    stat_class = kStatKernel;
+  }
+  if (cpu_work != NULL) {
+    // Phase two adds these up in trace order. Duration is under 2**30
+    cpu_work->stats.push_back(((uint32)stat_class << 30) | span->duration);
+    ++cpu_work->span_count;
+    return;
   }
+  ++span_count;
+  AddToTotal(stat_class, span->duration);
 }
 
 void WriteSpanJson(FILE* f, const CPUState* thiscpu) {
@@ -1208,15 +1637,12 @@ void WriteSpanJson(FILE* f, const CPUState* thiscpu) {
 // Write a point event, so they aren't lost
 // Change time from multiples of 10 nsec to seconds and fraction
 void WriteEventJson(FILE* f, const OneSpan* event) {
-  double ts_sec = event->start_ts / 100000000.0;
-  double dur_sec = event->duration / 100000000.0;
 //CHECK("g", *event);
-  //                   ts dur cpu  pid rpc event  arg ret ipc  name
-  fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", 
-          ts_sec, dur_sec, event->cpu, 
+  //             ts dur cpu  pid rpc event  arg ret ipc  name
+  WriteSpanJson(f, event->start_ts, event->duration, event->cpu, 
           event->pid, event->rpcid, event->eventnum,
-          event->arg, event->retval, event->ipc, event->name.c_str());
-  ++span_count;
+          event->arg, event->retval, event->ipc, NameStr(event->name));
+  if (cpu_work != NULL) {++cpu_work->span_count;} else {++span_count;}
 }
 
 // Open the json variable and give inital values
@@ -1319,11 +1745,11 @@ int NestLevel(int eventnum) {
 void AdjustStackForPush(const OneSpan& event, CPUState* thiscpu) {
   while (NestLevel(event.eventnum) <= 
          NestLevel(thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top])) {
-fprintf(stdout,"AdjustStackForPush FAIL\n");
+fprintf(SpanOut(),"AdjustStackForPush FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 0) {break;}
 if (verbose) fprintf(stdout, "-%d  dummy return from %s\n", 
-event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
+event.cpu, NameStr(thiscpu->cpu_stack.name[thiscpu->cpu_stack.top]));
     --thiscpu->cpu_stack.top;
   }
 }
@@ -1331,23 +1757,23 @@ event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
 // This deals with unbalanced return
 void AdjustStackForPop(const OneSpan& event, CPUState* thiscpu) {
   if (thiscpu->cpu_stack.top == 0) {
-fprintf(stdout,"AdjustStackForPop FAIL\n");
+fprintf(SpanOut(),"AdjustStackForPop FAIL\n");
     // Trying to return above user mode. Push a dummy syscall
-if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, event.name.c_str());
+if (verbose) fprintf(stdout, "+%d dummy call to %s\n", event.cpu, NameStr(event.name));
     ++thiscpu->cpu_stack.top;
     thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top] = dummy_syscall;
-    thiscpu->cpu_stack.name[thiscpu->cpu_stack.top] = string("-dummy-");
+    thiscpu->cpu_stack.name[thiscpu->cpu_stack.top] = dummy_name;
   }
   // If returning from something lower nesting than top of stack,
   // pop the stack for a match. 
   int matching_call = event.eventnum & ~ret_mask;		// Turn off the return bit
   while (NestLevel(matching_call) < 
          NestLevel(thiscpu->cpu_stack.eventnum[thiscpu->cpu_stack.top])) {
-fprintf(stdout,"AdjustStackForPop FAIL\n");
+fprintf(SpanOut(),"AdjustStackForPop FAIL\n");
     // Insert dummy returns, i.e. pop, until the call is legal or we are at user-mode level
     if (thiscpu->cpu_stack.top == 1) {break;}
 if (verbose) fprintf(stdout, "-%d  dummy return from %s\n", 
-event.cpu, thiscpu->cpu_stack.name[thiscpu->cpu_stack.top].c_str());
+event.cpu, NameStr(thiscpu->cpu_stack.name[thiscpu->cpu_stack.top]));
     --thiscpu->cpu_stack.top;
   }
 }
@@ -1363,7 +1789,7 @@ string AppendPid(const string& name, uint64 pid) {
 }
 
 string EventNamePlusPid(const OneSpan& event) {
-  return AppendPid(event.name, event.pid); 
+  return AppendPid(NameString(event.name), event.pid); 
 }
 
 void DumpShort(FILE* f, const CPUState* thiscpu) {
@@ -1374,87 +1800,91 @@ void DumpShort(FILE* f, const CPUState* thiscpu) {
   fprintf(f, "\n");
 }
 
-// Insert wait_* span for reason that we were waiting
-void WaitBeforeWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* perPidState) {
-  CPUState* thiscpu = &cpustate[event.cpu];
-  int target_pid = event.arg;
-
-  // The wakeup has a target PID. We keep a list of the most recent user-mode event 
-  // mentioning that PID, if any. The time from last mention to now is the
-  // waiting time; the current wakeup event signals the end of that waiting.
-  // The top of the per-CPU call stack says what kernel routine is doing the wakeup.
-  // TRICKY: The target PID might actually be running or in the scheduler right now, 
-  // about to be context switched out. Inthat case, avoid any before-wakeup event.
-
-  // There is no priorPidEvent at the beginning of a trace. 
-  if (priorPidEvent.find(target_pid) == priorPidEvent.end()) {return;}
-
-  // If the target PID is currently executing, do not generate a wait
-  if (pidRunning.find(target_pid) != pidRunning.end()) {return;}
-
-  OneSpan& old_event = priorPidEvent[target_pid];
-  const PidState* stack = &thiscpu->cpu_stack;
-
+// Why a wakeup's target PID was waiting, from the kernel routine doing the
+// wakeup at the top of the per-CPU call stack. ' ' if unknown
+char WakeupLetter(const PidState* stack) {
   // Create wait_* events
   // Also see soft_irq_name in rawtoevent.cc
+  const string& topname = NameString(stack->name[stack->top]);
   char letter = ' ';		// Default = unknown reason for waiting
-  if (stack->name[stack->top] == "local_timer_vector") {	// timer
+  if (topname == "local_timer_vector") {	// timer
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "arch_timer") {		// Rpi time
+  } else if (topname == "arch_timer") {		// Rpi time
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "page_fault") {	// memory
+  } else if (topname == "page_fault") {	// memory
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "mmap") {
+  } else if (topname == "mmap") {
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "munmap") {
+  } else if (topname == "munmap") {
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "mprotect") {
+  } else if (topname == "mprotect") {
     letter = 'm';		// memory
-  } else if (stack->name[stack->top] == "futex") {	// lock
+  } else if (topname == "futex") {	// lock
     letter = 'l';		// lock
-  } else if (stack->name[stack->top] == "writev") {	// pipe
+  } else if (topname == "writev") {	// pipe
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "write") {
+  } else if (topname == "write") {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "sendto") {
+  } else if (topname == "sendto") {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top].substr(0,7) == "kworker") {
+  } else if (topname.compare(0, 7, "kworker") == 0) {
     letter = 'p';		// pipe
-  } else if (stack->name[stack->top] == "BH:hi") {	// tasklet
+  } else if (topname == "BH:hi") {	// tasklet
     letter = 'k';		// high prio tasklet or unknown BH fragment
-  } else if (stack->name[stack->top] == "BH:timer") {	// time
+  } else if (topname == "BH:timer") {	// time
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "BH:tx") {	// network
+  } else if (topname == "BH:tx") {	// network
     letter = 'n';		// network
-  } else if (stack->name[stack->top] == "BH:rx") {
+  } else if (topname == "BH:rx") {
     letter = 'n';		// network
-  } else if (stack->name[stack->top] == "BH:block") {	// disk
+  } else if (topname == "BH:block") {	// disk
     letter = 'd';		// disk/SSD
-  } else if (stack->name[stack->top] == "BH:irq_p") {
+  } else if (topname == "BH:irq_p") {
     letter = 'd';		// disk/SSD (iopoll)
-  } else if (stack->name[stack->top] == "syncfs") {
+  } else if (topname == "syncfs") {
     letter = 'd';		// disk/SSD 
-  } else if (stack->name[stack->top] == "BH:taskl") {
+  } else if (topname == "BH:taskl") {
     letter = 'k';		// normal tasklet
-  } else if (stack->name[stack->top] == "BH:sched") {	// sched
+  } else if (topname == "BH:sched") {	// sched
     letter = 's';		// scheduler (load balancing)
-  } else if (stack->name[stack->top] == "BH:hrtim") {
+  } else if (topname == "BH:hrtim") {
     letter = 't';		// timer
-  } else if (stack->name[stack->top] == "BH:rcu") {
+  } else if (topname == "BH:rcu") {
     letter = 't';		// read-copy-update release code
   }
 
+  return letter;
+}
+
+// Insert wait_* span for reason that we were waiting
+void WaitBeforeWakeup(const OneSpan& event, char letter) {
+  int target_pid = event.arg;
+
+  // The wakeup has a target PID. We keep a list of the most recent user-mode event 
+  // mentioning that PID, if any. The time from last mention to now is the
+  // waiting time; the current wakeup event signals the end of that waiting.
+  // The top of the per-CPU call stack says what kernel routine is doing the wakeup.
+  // TRICKY: The target PID might actually be running or in the scheduler right now, 
+  // about to be context switched out. Inthat case, avoid any before-wakeup event.
+
+  // There is no priorPidEvent at the beginning of a trace. 
+  if (!priorPidEvent.contains(target_pid)) {return;}
+
+  // If the target PID is currently executing, do not generate a wait
+  if (pidRunning.contains(target_pid)) {return;}
+
+  int old_rpcid = priorPidEvent[target_pid];
+
   if ((letter != ' ')) {
     // Make a wait_* display span
-    OneSpan temp_span = thiscpu->cur_span;	// Save
+    OneSpan temp_span;
     MakeWaitSpan(letter, priorPidEnd[target_pid], 
-      event.start_ts, target_pid, old_event.rpcid, &thiscpu->cur_span);
+      event.start_ts, target_pid, old_rpcid, &temp_span);
 
     // Don't clutter if the waiting is short (say < 10 usec)
-    if (thiscpu->cur_span.duration >= kMIN_WAIT_DURATION) {
-      WriteSpanJson(stdout, thiscpu);	// Standalone wait_cpu span
+    if (temp_span.duration >= kMIN_WAIT_DURATION) {
+      WriteSpanJson2(stdout, &temp_span);	// Standalone wait_cpu span
     }
-    thiscpu->cur_span = temp_span;		// Restore
   }
 }
 
@@ -1463,8 +1893,7 @@ void WaitAfterWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* perp
   int target_pid = event.arg;
 }
 
-void DoWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* perpidstate) {
-  CPUState* thiscpu = &cpustate[event.cpu];
+void DoWakeup(const OneSpan& event) {
   int target_pid = event.arg;
   // Remember the wakeup
   pendingWakeup[target_pid] = event;
@@ -1473,8 +1902,42 @@ void DoWakeup(const OneSpan& event, CPUState* cpustate, PerPidState* perpidstate
   priorPidEnd[target_pid] = event.start_ts + event.duration;
 }
 
-void SwapStacks(int oldpid, int newpid, const string& name, CPUState* thiscpu, PerPidState* perpidstate) {
+// Wakeup of PID event.arg, waiting for letter's reason
+void WakeupPid(const OneSpan& event, char letter) {
+  if (cpu_work != NULL) {DeferEvent(kOpWakeup, event, letter); return;}
+  WaitBeforeWakeup(event, letter);
+  DoWakeup(event);
+}
+
+// Phase one: tell any worker waiting for this slot that it is filled
+void FillSlot(Chunk* chunk, int slot) {
+  __atomic_store_n(&chunk->slot_ready[slot], 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pipeline->slot_waiters, __ATOMIC_SEQ_CST) == 0) {return;}
+  pthread_mutex_lock(&pipeline->lock);
+  pthread_cond_broadcast(&pipeline->slot_filled);
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Phase one: save and load stacks through the slots phase zero set up for
+// this context switch, so a stack can go from one worker's CPU to another's
+// within a chunk. The worker has waited for any slot to load to be filled
+void HandOffStack(int newpid, CPUState* thiscpu, PerPidState* perpidstate) {
+  const QueuedEvent* q = cpu_work->cur;
+  Chunk* chunk = cpu_work->chunk;
+  if (0 <= q->save) {
+    chunk->slots[q->save] = thiscpu->cpu_stack;
+    FillSlot(chunk, q->save);
+  }
+  if (0 <= q->load) {
+    thiscpu->cpu_stack = chunk->slots[q->load];
+  } else {
+    thiscpu->cpu_stack = (*perpidstate)[newpid];
+  }
+}
+
+void SwapStacks(int oldpid, int newpid, NameId name, CPUState* thiscpu, PerPidState* perpidstate) {
   if (oldpid == newpid) {return;}
+  if (cpu_work != NULL) {HandOffStack(newpid, thiscpu, perpidstate); return;}
 
   // Swap out the old thread's stack, but don't change the idle stack
   if (oldpid != 0) {
@@ -1484,7 +1947,7 @@ if (verbose) {
 fprintf(stdout, "SwapStacks old %d: ", oldpid);
 DumpStackShort(stdout, &thiscpu->cpu_stack);
 }
-  if (perpidstate->find(newpid) == perpidstate->end()) {
+  if (!perpidstate->contains(newpid)) {
     // Switching to a thread we haven't seen before. Should only happen at trace start.
     // Create a two-item stack of just user-mode pid and sched_syscall
     BrandNewPid(newpid, name, perpidstate);
@@ -1499,6 +1962,13 @@ if (verbose) {
  }
 }
 
+// Name for stack[0] of the PID a context switch goes to. Phase zero looks
+// it up ahead for phase one
+NameId CtxPidName(const OneSpan& event) {
+  if (cpu_work != NULL) {return cpu_work->cur->name0;}
+  return InternName(NameAppendPid(pidnames[event.pid], event.pid));
+}
+
 // An ambiguous call stack might be running in the current top or might be
 // running in user mode. We look at the terminating event of the current 
 // CPU span to try to resolve which it is.
@@ -1510,7 +1980,7 @@ void FixupAmbiguousSpan(const OneSpan& event,
 
 if (verbose) {
 DumpStackShort(stdout, &thiscpu->cpu_stack);
-fprintf(stdout, " ===ambiguous at %s :\n", event.name.c_str());
+fprintf(stdout, " ===ambiguous at %s :\n", NameStr(event.name));
 }
   if (OnlyInKernelMode(event)) {
     thiscpu->cpu_stack.ambiguous = 0;
@@ -1548,8 +2018,131 @@ void WriteFreqSpan(uint64 start_ts, uint64 end_ts, uint64 cpu, uint64 freq) {
   event.arg = freq;
   event.retval = 0;
   event.ipc = 0;
-  event.name = string("freq");
-  WriteEventJson(stdout, &event);
+  event.name = freq_name;
+  WriteEventJson(SpanOut(), &event);
+}
+
+// Keep track of which PIDs are currently running
+void SwitchRunningPid(int oldpid, int newpid) {
+  if (cpu_work != NULL) {Defer(kOpRunningPid, oldpid, newpid, 0, 0, 0); return;}
+  pidRunning.erase(oldpid);
+  pidRunning[newpid] = true;
+}
+
+// Restore nonzero rpcid for a preempted task that we are returning to
+void WriteRpcidMidSpan(uint64 ts, int cpu, int pid, int rpcid) {
+  if (cpu_work != NULL) {Defer(kOpRpcidMid, cpu, pid, rpcid, ts, 0); return;}
+  OneSpan temp_span;
+  MakeRpcidMidSpan(ts, cpu, pid, rpcid, &temp_span);
+  WriteSpanJson2(stdout, &temp_span);
+}
+
+// Remember any failed lock acquire event, for wait_lock
+void RememberLockTry(const OneSpan& event) {
+  if (cpu_work != NULL) {DeferEvent(kOpLockTry, event, 0); return;}
+  pendingLock[event.arg] = event;
+  priorPidLock[event.pid] = event.arg;
+//fprintf(stdout, "~~priorPidLock[%d] = %d\n", event.pid, event.arg);
+}
+
+// Draw lock lines for a lock try, acquire, or release (wakeup) point event.
+// See "Drawing lock-held lines" in ProcessEvent
+void DoLockEvent(const OneSpan& event) {
+  if (cpu_work != NULL) {DeferEvent(kOpLock, event, 0); return;}
+  // Remember any failed lock acquire event if nothing is pending
+  if (event.eventnum == KUTRACE_LOCKNOACQUIRE) {
+    // Remember that this PID is trying to get this lock
+    int lockhash = event.arg;
+    uint64 subscr = PackLock(lockhash, event.pid);
+    LockContend lockcontend;
+    lockcontend.start_ts = event.start_ts;
+    lockcontend.pid = event.pid;
+    lockcontend.eventnum = event.eventnum;
+    lockpending[subscr] = lockcontend;
+  }
+
+  // Process any successful lock acquire event
+  if (event.eventnum == KUTRACE_LOCKACQUIRE) {
+    int lockhash = event.arg;
+    uint64 subscr = PackLock(lockhash, event.pid);
+    // If prior try, draw dots for this PID trying to get this lock
+    if ((lockpending.contains(subscr)) && 
+        (lockpending[subscr].eventnum == KUTRACE_LOCKNOACQUIRE)) {
+      uint64 start_ts = lockpending[subscr].start_ts;
+      uint64 end_ts = event.start_ts - 1;	// Stop 10 ns early
+      // Ignore contention < 250ns
+      if  (25 <= (end_ts - start_ts)) {
+        bool dots = true;
+        NameId lockname = InternName("~" + NameString(event.name).substr(4));	// Remove try_ acq_ rel_
+        OneSpan temp_span;
+        MakeLockSpan(dots, start_ts, end_ts, event.pid, 
+                     lockhash, lockname, &temp_span);
+        WriteSpanJson2(stdout, &temp_span);
+      }
+    }
+    // Remember that this PID now holds this lock
+    LockContend lockcontend;
+    lockcontend.start_ts = event.start_ts;
+    lockcontend.pid = event.pid;
+    lockcontend.eventnum = event.eventnum ;
+    lockpending[subscr] = lockcontend;
+  }
+
+  // Process any lock wakeup (release) event
+  if (event.eventnum == KUTRACE_LOCKWAKEUP) {
+    int lockhash = event.arg;
+    uint64 subscr = PackLock(lockhash, event.pid);
+    // If prior acq, draw line for this PID holding this lock
+    if ((lockpending.contains(subscr)) &&
+        (lockpending[subscr].eventnum == KUTRACE_LOCKACQUIRE)) {
+      uint64 start_ts = lockpending[subscr].start_ts;
+      uint64 end_ts = event.start_ts - 1;	// Stop 10 ns early
+      // Ignore contention < 250ns
+      if (25 <= (end_ts - start_ts)) {
+        bool dots = false;
+        NameId lockname = InternName("=" + NameString(event.name).substr(4));	// Remove try_ acq_ rel_
+        OneSpan temp_span;
+        MakeLockSpan(dots, start_ts, end_ts, event.pid, 
+                     lockhash, lockname, &temp_span);
+        WriteSpanJson2(stdout, &temp_span);
+      }
+    }
+    // This PID is no longer interested in the lock
+    lockpending.erase(subscr);
+  }
+}
+
+// Connect wakeup event to new span if the PID matches, and make a wait_cpu
+// display span from the wakeup to here
+void ResumePid(const OneSpan& event) {
+  if (cpu_work != NULL) {
+    Defer(kOpResume, event.cpu, event.pid, 0, event.start_ts, event.duration);
+    return;
+  }
+  if (pendingWakeup.contains(event.pid)) {
+    // We are at an event w/pid for which there is a pending wakeup, make-runnable
+    // Make a wakeup arc
+    OneSpan temp_span;
+    MakeArcSpan(pendingWakeup[event.pid], event, &temp_span);
+    WriteSpanJson2(stdout, &temp_span);	// Standalone arc span
+    // Consume the pending wakeup
+    pendingWakeup.erase(event.pid);
+  }
+
+  // Make a wait_cpu display span from the wakeup to here
+  if (priorPidEnd.contains(event.pid)) {
+    // We have been waiting for a CPU to become available and it did.
+    OneSpan temp_span;
+    MakeWaitSpan('c', priorPidEnd[event.pid], event.start_ts, event.pid, 0, &temp_span);
+
+    ////// Consume the pending wait
+    ////priorPidEnd.erase(event.pid);
+    priorPidEnd[event.pid] = event.start_ts + event.duration;
+    // Don't clutter if the waiting is short (say < 10 usec)
+    if (temp_span.duration >= kMIN_WAIT_DURATION) {
+      WriteSpanJson2(stdout, &temp_span);	// Standalone wait_cpu span
+    }
+  }
 }
 
       
@@ -1569,7 +2162,7 @@ void ProcessEvent(const OneSpan& event,
   if (verbose) {
     fprintf(stdout, "zz[%d] %llu %llu %03x(%d)=%d %s ", 
           event.cpu, event.start_ts, event.duration, 
-          event.eventnum, event.arg, event.retval, event.name.c_str());
+          event.eventnum, event.arg, event.retval, NameStr(event.name));
     DumpEvent(stdout, "", event);
     DumpShort(stdout, &cpustate[event.cpu]);
   }
@@ -1577,7 +2170,7 @@ void ProcessEvent(const OneSpan& event,
   // Remember last instance of each PID
   // We want to do this for the events that finish execution spans
   if ((event.pid > 0) && (event.cpu >= 0)) {
-    priorPidEvent[event.pid] = event;
+    RememberPidEvent(event.pid, event.rpcid);
 //fprintf(stdout, "~~ ~~ priorPidEvent[%d] = %llu\n", event.pid, event.start_ts);
   }
 
@@ -1589,14 +2182,11 @@ void ProcessEvent(const OneSpan& event,
 
   // Keep track of which PIDs are currently running
   if (IsSchedReturnEvent(event)) {
-    pidRunning.erase(thiscpu->oldpid);
-    pidRunning[thiscpu->newpid] = true;
+    SwitchRunningPid(thiscpu->oldpid, thiscpu->newpid);
 
     // Restore nonzero rpcid for a preempted task that we are returning to
     if (thiscpu->cpu_stack.rpcid != 0) {
-      OneSpan temp_span;
-      MakeRpcidMidSpan(event.start_ts, event.cpu, event.pid, thiscpu->cpu_stack.rpcid, &temp_span);
-      WriteSpanJson2(stdout, &temp_span);
+      WriteRpcidMidSpan(event.start_ts, event.cpu, event.pid, thiscpu->cpu_stack.rpcid);
     }
   }
 
@@ -1615,9 +2205,9 @@ void ProcessEvent(const OneSpan& event,
     if (thiscpu->valid_span) {
       // Prior span stops here 					--------^^^^^^^^
       FinishSpan(event, &thiscpu->cur_span);
-      WriteSpanJson(stdout, thiscpu);	// Previous span
+      WriteSpanJson(SpanOut(), thiscpu);	// Previous span
     }
-    WriteEventJson(stdout, &event);	// Standalone mark 
+    WriteEventJson(SpanOut(), &event);	// Standalone mark 
     
 // This is looking just like IsAMark
 // Just update the still-open span start
@@ -1650,7 +2240,7 @@ if (verbose) DumpStackShort(stdout, &thiscpu->cpu_stack);
       // Scheduler entered from within a kernel routine
       // stack such as: 2{mystery25.3950 read -sched- }0
       // Record the subscript of the ambiguous stack entry just before -sched-
-if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %s\n", event.name.c_str());
+if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %s\n", NameStr(event.name));
       thiscpu->cpu_stack.ambiguous = thiscpu->cpu_stack.top - 1;
     }
 
@@ -1668,7 +2258,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     // Turn context switch event into a user-mode-execution event at top of stack
     thiscpu->cpu_stack.eventnum[0] = PidToEventnum(event.pid);
     ////sthiscpu->cpu_stack.name[0] = EventNamePlusPid(event);
-    thiscpu->cpu_stack.name[0] = NameAppendPid(pidnames[event.pid], event.pid);
+    thiscpu->cpu_stack.name[0] = CtxPidName(event);
 
     // And also update the current span if we are at top
     if (thiscpu->cpu_stack.top == 0) {
@@ -1704,7 +2294,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
       OneSpan event1 = event;
       event1.start_ts = thiscpu->prior_pc_samp_ts;
       event1.duration = event.start_ts - event1.start_ts;
-      WriteEventJson(stdout, &event1);
+      WriteEventJson(SpanOut(), &event1);
     }
     thiscpu->prior_pc_samp_ts = event.start_ts;
     return;
@@ -1758,9 +2348,9 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     if (thiscpu->valid_span) {
       // Prior span stops here 					--------^^^^^^^^
       FinishSpan(event, &thiscpu->cur_span);
-      WriteSpanJson(stdout, thiscpu);	// Previous span
+      WriteSpanJson(SpanOut(), thiscpu);	// Previous span
     }
-    WriteEventJson(stdout, &event);	// Standalone mark/mwait/etc. 
+    WriteEventJson(SpanOut(), &event);	// Standalone mark/mwait/etc. 
     // Continue what we were doing, with new start_ts
     thiscpu->cur_span.start_ts = event.start_ts + event.duration;
 
@@ -1768,7 +2358,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
     if (IsAnMwait(event)) {
       thiscpu->mwait_pending = event.arg;
       thiscpu->cur_span.arg = 1;	// Mark continuing idle as low-power
-      thiscpu->cur_span.name = kIdlelpName;
+      thiscpu->cur_span.name = idlelp_name;
     }
 
     return; 
@@ -1776,7 +2366,7 @@ if (verbose) fprintf(stdout, " ===marking old stack ambiguous at ctx_switch to %
   // Do not touch current span
   //     userpid, rpc, runnable, ipi, [mwait], pstate, [mark], lock, pc, wait
   } else if (IsAPointEvent(event)) {	// Marks do not end up here due to test just above
-    WriteEventJson(stdout, &event);	// Standalone point event  
+    WriteEventJson(SpanOut(), &event);	// Standalone point event  
 //VERYTEMP
 //if (IsAnRpcMsg(event)) {DumpEvent(stderr, "rpcmsg:", event);}
 
@@ -1847,75 +2437,15 @@ acquiring process may encounter a hidden wakeup after its own fail, in which cas
 
 
     // Point event
-    // Remember any failed lock acquire event if nothing is pending
-    if (event.eventnum == KUTRACE_LOCKNOACQUIRE) {
-      // Remember that this PID is trying to get this lock
-      int lockhash = event.arg;
-      uint64 subscr = PackLock(lockhash, event.pid);
-      LockContend lockcontend;
-      lockcontend.start_ts = event.start_ts;
-      lockcontend.pid = event.pid;
-      lockcontend.eventnum = event.eventnum;
-      lockpending[subscr] = lockcontend;
-    }
-
-    // Process any successful lock acquire event
-    if (event.eventnum == KUTRACE_LOCKACQUIRE) {
-      int lockhash = event.arg;
-      uint64 subscr = PackLock(lockhash, event.pid);
-      // If prior try, draw dots for this PID trying to get this lock
-      if ((lockpending.find(subscr) != lockpending.end()) && 
-          (lockpending[subscr].eventnum == KUTRACE_LOCKNOACQUIRE)) {
-        uint64 start_ts = lockpending[subscr].start_ts;
-        uint64 end_ts = event.start_ts - 1;	// Stop 10 ns early
-        // Ignore contention < 250ns
-        if  (25 <= (end_ts - start_ts)) {
-          bool dots = true;
-          string lockname = "~" + event.name.substr(4);	// Remove try_ acq_ rel_
-          OneSpan temp_span;
-          MakeLockSpan(dots, start_ts, end_ts, event.pid, 
-                       lockhash, lockname, &temp_span);
-          WriteSpanJson2(stdout, &temp_span);
-        }
-      }
-      // Remember that this PID now holds this lock
-      LockContend lockcontend;
-      lockcontend.start_ts = event.start_ts;
-      lockcontend.pid = event.pid;
-      lockcontend.eventnum = event.eventnum ;
-      lockpending[subscr] = lockcontend;
-    }
-
-    // Process any lock wakeup (release) event
-    if (event.eventnum == KUTRACE_LOCKWAKEUP) {
-      int lockhash = event.arg;
-      uint64 subscr = PackLock(lockhash, event.pid);
-      // If prior acq, draw line for this PID holding this lock
-      if ((lockpending.find(subscr) != lockpending.end()) &&
-          (lockpending[subscr].eventnum == KUTRACE_LOCKACQUIRE)) {
-        uint64 start_ts = lockpending[subscr].start_ts;
-        uint64 end_ts = event.start_ts - 1;	// Stop 10 ns early
-        // Ignore contention < 250ns
-        if (25 <= (end_ts - start_ts)) {
-          bool dots = false;
-          string lockname = "=" + event.name.substr(4);	// Remove try_ acq_ rel_
-          OneSpan temp_span;
-          MakeLockSpan(dots, start_ts, end_ts, event.pid, 
-                       lockhash, lockname, &temp_span);
-          WriteSpanJson2(stdout, &temp_span);
-        }
-      }
-      // This PID is no longer interested in the lock
-      lockpending.erase(subscr);
+    // Lock try, acquire, and release spans
+    if (IsALockOneSpan(event)) {
+      DoLockEvent(event);
     }
 
-
-
     // Point event
     // Remember any make-runnable, aka wakeup, event by target pid, for drawing arc
     if (IsAWakeup(event)) {
-      WaitBeforeWakeup(event, cpustate, perpidstate);
-      DoWakeup(event, cpustate, perpidstate);
+      WakeupPid(event, WakeupLetter(&thiscpu->cpu_stack));
       WaitAfterWakeup(event, cpustate, perpidstate);
     }
 
@@ -1932,36 +2462,12 @@ acquiring process may encounter a hidden wakeup after its own fail, in which cas
     FinishSpan(event, &thiscpu->cur_span);
     // Suppress idle spans of length zero or exactly 10ns
     bool suppress = ((thiscpu->cur_span.duration <= 1) && IsAnIdlenum(thiscpu->cur_span.eventnum));
-    if (!suppress) {WriteSpanJson(stdout, thiscpu);}	// Previous span
+    if (!suppress) {WriteSpanJson(SpanOut(), thiscpu);}	// Previous span
   }
 
   // Connect wakeup event to new span if the PID matches
-  if (pendingWakeup.find(event.pid) != pendingWakeup.end()) {
-    // We are at an event w/pid for which there is a pending wakeup, make-runnable
-    // Make a wakeup arc
-    OneSpan temp_span = thiscpu->cur_span;	// Save
-    MakeArcSpan(pendingWakeup[event.pid], event, &thiscpu->cur_span);
-    WriteSpanJson(stdout, thiscpu);	// Standalone arc span
-    // Consume the pending wakeup
-    pendingWakeup.erase(event.pid);
-    thiscpu->cur_span = temp_span;		// Restore
-  }
-
   // Make a wait_cpu display span from the wakeup to here
-  if (priorPidEnd.find(event.pid) != priorPidEnd.end()) {
-    // We have been waiting for a CPU to become available and it did.
-    OneSpan temp_span = thiscpu->cur_span;	// Save
-    MakeWaitSpan('c', priorPidEnd[event.pid], event.start_ts, event.pid, 0, &thiscpu->cur_span);
-
-    ////// Consume the pending wait
-    ////priorPidEnd.erase(event.pid);
-    priorPidEnd[event.pid] = event.start_ts + event.duration;
-    // Don't clutter if the waiting is short (say < 10 usec)
-    if (thiscpu->cur_span.duration >= kMIN_WAIT_DURATION) {
-      WriteSpanJson(stdout, thiscpu);	// Standalone wait_cpu span
-    }
-    thiscpu->cur_span = temp_span;		// Restore
-  }
+  ResumePid(event);
 
   // Don't start new span quite yet.
   // If we have a return from foo and foo is on the stack, all is good.
@@ -1979,7 +2485,7 @@ acquiring process may encounter a hidden wakeup after its own fail, in which cas
       thiscpu->cur_span.duration = event.duration;
       // Note: Optimized call/ret, prior span ipc in ipc<3:0>, current span in ipc<7:4>
       thiscpu->cur_span.ipc = (event.ipc >> 4) & ipc_mask;
-      WriteSpanJson(stdout, thiscpu);	// Standalone call-return span
+      WriteSpanJson(SpanOut(), thiscpu);	// Standalone call-return span
       // Continue what we were doing, with new start_ts
       thiscpu->cur_span = oldspan;
       thiscpu->cur_span.start_ts = event.start_ts + event.duration;
@@ -2014,7 +2520,7 @@ acquiring process may encounter a hidden wakeup after its own fail, in which cas
   } else {
     // c-exit and other synthesized items
     // Make it a standalone span and go back to what was running
-    WriteEventJson(stdout, &event);  
+    WriteEventJson(SpanOut(), &event);  
     // Continue what we were doing, with new start_ts
     StartSpan(event, &thiscpu->cur_span);  // New start 	--------vvvvvvvv
     thiscpu->valid_span = true;
@@ -2039,8 +2545,8 @@ void InsertEvent(const OneSpan& event,
 int CallToRet(int eventnum) {return eventnum | ret_mask;}
 int RetToCall(int eventnum) {return eventnum & ~ret_mask;}
 
-string CallnameToRetname(string name) {return "/" + name;}	// Add '/'
-string RetnameToCallname(string name) {return name.substr(1);}  // Remove '/'
+NameId CallnameToRetname(NameId name) {return InternName("/" + NameString(name));}	// Add '/'
+NameId RetnameToCallname(NameId name) {return InternName(NameString(name).substr(1));}  // Remove '/'
 
 // Insert a dummy return at ts from TOS
 void InsertReturnAt(uint64 ts, 
@@ -2122,8 +2628,8 @@ bool FixupReturn(uint64 new_start_ts,
   if (thiscpu_stack->eventnum[thiscpu_stack->top] == matching_callnum) {return true;}
 
   // If TOS = reschedule_ipi and this = /BH:hi, let it match
-  if ((thiscpu_stack->name[thiscpu_stack->top] == "reschedule_ipi") && 
-      (event.name == "/BH:hi")) {return true;}
+  if ((thiscpu_stack->name[thiscpu_stack->top] == reschedule_ipi_name) && 
+      (event.name == bh_hi_retname)) {return true;}
 
   bool callfound = false;
   for (int i = 1; i <= thiscpu_stack->top; ++i) {
@@ -2131,7 +2637,6 @@ bool FixupReturn(uint64 new_start_ts,
   }
 
   // if X is on the stack, pop to it
-  OneSpan newevent;
   if (callfound) {
     // Insert dummy returns at now until TOS = X (we don't know the retval)
     while (thiscpu_stack->eventnum[thiscpu_stack->top] != matching_callnum) {
@@ -2179,7 +2684,7 @@ bool FixupResched(uint64 ts,
                  PerPidState* perpidstate) {
   CPUState* thiscpu = &cpustate[event.cpu];
   PidState* thiscpu_stack = &thiscpu->cpu_stack;
-  if (thiscpu_stack->name[thiscpu_stack->top] == "reschedule_ipi") {
+  if (thiscpu_stack->name[thiscpu_stack->top] == reschedule_ipi_name) {
     --thiscpu_stack->top;
   }
   return true;
@@ -2221,7 +2726,7 @@ bool FixupCexit(uint64 new_start_ts,
   bool good_mwait = (thiscpu->cpu_stack.top == 0); 	// Expecting to be in user-mode
   if (!good_mwait) {
     // No change -- we are not immediately after a switch to idle 
-    fprintf(stderr, "FixupCexit ignored %llu %llu %llu %d %05x\n", 
+    Complain("FixupCexit ignored %llu %llu %llu %d %05x\n", 
             new_start_ts, exit_latency, pending_span_latency,
             thiscpu->cpu_stack.top, thiscpu->cpu_stack.eventnum[0]);
     return true;
@@ -2251,13 +2756,13 @@ bool FixupCexit(uint64 new_start_ts,
   newevent.arg = 0;
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = "-c-exit-";
+  newevent.name = cexit_name;
   // Inserting the c-exit shortens the pending low-power idle
   InsertEvent(newevent, cpustate, perpidstate);	
 
   // After the c-exit, we are no longer low power
   thiscpu->cur_span.arg = 0;	// Mark continuing idle as normal power
-  thiscpu->cur_span.name = kIdleName;
+  thiscpu->cur_span.name = idle_name;
 
   return true;
 }      
@@ -2283,7 +2788,7 @@ bool FixupRunnable(uint64 new_start_ts,
   newevent.arg = event.retval;	// The target of clone/fork/etc.
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = "runnable";
+  newevent.name = runnable_name;
   InsertEvent(newevent, cpustate, perpidstate);
   return true;
 }
@@ -2319,8 +2824,13 @@ bool EmitRxTxMsg(const PidCorr& corr, CPUState* cpustate, PerPidState* perpidsta
   newevent.arg = msg_len;
   newevent.retval = 0;
   newevent.ipc = 0;
-  newevent.name = string(msg_name);
+  newevent.name = InternName(msg_name);
 //DumpEvent(stderr, "EmitRxTxMsg:", newevent);
+  // Phase two has no CPU state to insert into; inserting just writes the event
+  if (cpustate == NULL) {
+    WriteEventJson(stdout, &newevent);
+    return true;
+  }
   InsertEvent(newevent, cpustate, perpidstate);
   return true;
 }
@@ -2333,37 +2843,154 @@ uint64 FixupLength(uint64 lglen8) {
 }
 
 
-//---------------------------------------------------------------------------//
-// Preprocess cleans up the input events:
-//   - Insert any missing calls/ returns
-//   - Insert any missing make-runnable
-//   - Insert mwait sine waves
-//   - Insert any missing names
-//   - Insert wait_* events
-//   - Insert wakeup-to-exec arcs
-//
-void PreProcessEvent(const OneSpan& event, 
-                     CPUState* cpustate, 
-                     PerPidState* perpidstate) {
-  CPUState* thiscpu = &cpustate[event.cpu];
-  PidState* thiscpu_stack = &thiscpu->cpu_stack;
-
-  // Fixups may say to delete this event
-  bool keep = true;
+// Events that CorrelatePackets looks at
+bool IsCorrelatedInt(int eventnum) {
+  return IsRawPktHashInt(eventnum) || IsUserMsgHashInt(eventnum) || IsRpcReqRespInt(eventnum) ||
+         (eventnum == KUTRACE_MBIT_SEC) || (eventnum == KUTRACE_RPCSAMPLE);
+}
 
-  // The start_ts to insert fixups can be the current time, event.start_ts,
-  // or the start of the current span, thiscpu->cur_span.start_ts, but only
-  // if the current span is valid
-  uint64 span_start_time = thiscpu->cur_span.start_ts;
-  if (!thiscpu->valid_span) {span_start_time = event.start_ts;}
+// Remember when an RPC was put on a queue
+void RememberEnqueue(int rpcid, uint64 ts) {
+  if (cpu_work != NULL) {Defer(kOpEnqueue, rpcid, 0, 0, ts, 0); return;}
+  enqueuetime[rpcid] = ts;
+}
 
-  //--------------------------------------------//
-  // Things to insert BEFORE the current event  //
-  //--------------------------------------------//
+// A queued span for rpcid, from its enqueue until taken off queue_num at end_ts
+void WriteQueuedSpan(int queue_num, int rpcid, uint64 end_ts) {
+  if (cpu_work != NULL) {Defer(kOpDequeue, queue_num, rpcid, 0, end_ts, 0); return;}
+  OneSpan temp_span;
+  MakeQueuedSpan(enqueuetime[rpcid], end_ts, queue_num, rpcid, &temp_span); 
+  // Don't clutter if the queued waiting is short (say < 10 usec)
+  if (temp_span.duration >= kMIN_WAIT_DURATION) {
+    WriteSpanJson2(stdout, &temp_span);	// Standalone queued span
+  }
+}
 
-  //   - Insert any missing calls/ returns
-  // Fixup: return from X
-  // if TOS = call to X, all is good, else pop as needed
+// RPC-to-packet correlation, and the network speed and RPC sampling
+// metadata. In phase two, cpustate is NULL
+void CorrelatePackets(const OneSpan& event, CPUState* cpustate, PerPidState* perpidstate) {
+  if (cpu_work != NULL) {DeferEvent(kOpCorrelate, event, 0); return;}
+//
+// Begin RPC packet correlation
+//
+// NOTE: Must do incoming test before outgoing work
+//
+// Incoming event order
+// RX_PKT:	remember kernal timestamp in rx_hashtocorr[hash32]
+// RX_USER:	find k_ts in rx_hashtocorr[hash32], remember k_ts in pidtocorr[pid], 
+//		erase rx_hashtocorr[hash32]
+// RPCIDRE*:	have rpcid/length, find k_ts in pidtocorr[pid]; put out (rpcid/name/length/k_ts)
+//		pidtocorr[pid]
+  uint32 pkt_hash32 = (uint32)event.arg;
+
+  if (IsRawRxPktInt(event.eventnum)) {
+//DumpEvent(stderr, "IsRawRxPktInt:", event);
+    rx_hashtocorr[pkt_hash32] = inithashcorr;
+    rx_hashtocorr[pkt_hash32].k_timestamp = event.start_ts;
+  }
+
+  if (IsUserRxPktInt(event.eventnum)) {
+//DumpEvent(stderr, "IsUserRxPktInt:", event);
+    pidtocorr[event.pid] = initpidcorr;
+    if (rx_hashtocorr.contains(pkt_hash32)) {
+      pidtocorr[event.pid].k_timestamp = rx_hashtocorr[pkt_hash32].k_timestamp;
+    }
+    rx_hashtocorr.erase(pkt_hash32);
+    pidtocorr[event.pid].rx = true;
+  }
+
+  if (IsIncomingRpcReqResp(event)) {
+//DumpEvent(stderr, "IsIncomingRpcReqResp:", event);
+    uint32 msg_rpcid16 = event.arg & 0xffff;
+    uint16 msg_lglen8 = FixupLength((event.arg >> 16) & 0xff);
+    pidtocorr[event.pid].rpcid = msg_rpcid16;
+    pidtocorr[event.pid].lglen8 = msg_lglen8;
+    EmitRxTxMsg(pidtocorr[event.pid], cpustate, perpidstate);
+    pidtocorr.erase(event.pid);
+  }
+
+// Outgoing event order
+// RPCIDRE*:	remember rpcid/length in pidtocorr[pid]
+// TX_USER:	remember pid in tx_hashtocorr[hash32]
+// TX_PKT:	have kernel timestamp, have pid in tx_hashtocorr[hash32], rpcid/length in pidtocorr[pid]; 
+//		erase rx_hashtocorr[hash32]
+//              put out (rpcid/name/length/k_ts)
+//		erase pidtocorr[pid] 
+  if (IsOutgoingRpcReqResp(event)) {
+    // This creates a pidtocorr record. If the test for IsIncomingRpcReqResp
+    // follows this, it will erroneously return true. So we do the
+    // incoming correlation first, above.
+//DumpEvent(stderr, "IsOutgoingRpcReqResp:", event);
+    uint32 msg_rpcid16 = event.arg & 0xffff;
+    uint16 msg_lglen8 = FixupLength((event.arg >> 16) & 0xff);
+    pidtocorr[event.pid] = initpidcorr;
+    pidtocorr[event.pid].rpcid = msg_rpcid16;
+    pidtocorr[event.pid].lglen8 = msg_lglen8;
+    pidtocorr[event.pid].rx = false;
+  }
+
+  if (IsUserTxPktInt(event.eventnum)) {
+//DumpEvent(stderr, "IsUserTxPktInt:", event);
+    tx_hashtocorr[pkt_hash32] = inithashcorr;
+    tx_hashtocorr[pkt_hash32].pid = event.pid;
+  }
+
+  if (IsRawTxPktInt(event.eventnum)) {
+//DumpEvent(stderr, "IsRawTxPktInt:", event);
+    uint32 pid = 0;
+    if (tx_hashtocorr.contains(pkt_hash32)) {
+      pid = tx_hashtocorr[pkt_hash32].pid;
+    }
+    tx_hashtocorr.erase(pkt_hash32);
+    if (pidtocorr.contains(pid)) {
+      pidtocorr[pid].k_timestamp = event.start_ts;
+      EmitRxTxMsg(pidtocorr[pid], cpustate, perpidstate);
+    }
+    pidtocorr.erase(pid);
+  }
+// End RPC packet correlation
+
+
+  if (event.eventnum == KUTRACE_MBIT_SEC) {
+    mbit_sec = event.arg;
+  }
+
+  if (event.eventnum == KUTRACE_RPCSAMPLE) {
+    rpc_sample = event.arg;
+  }
+}
+
+//---------------------------------------------------------------------------//
+// Preprocess cleans up the input events:
+//   - Insert any missing calls/ returns
+//   - Insert any missing make-runnable
+//   - Insert mwait sine waves
+//   - Insert any missing names
+//   - Insert wait_* events
+//   - Insert wakeup-to-exec arcs
+//
+void PreProcessEvent(const OneSpan& event, 
+                     CPUState* cpustate, 
+                     PerPidState* perpidstate) {
+  CPUState* thiscpu = &cpustate[event.cpu];
+  PidState* thiscpu_stack = &thiscpu->cpu_stack;
+
+  // Fixups may say to delete this event
+  bool keep = true;
+
+  // The start_ts to insert fixups can be the current time, event.start_ts,
+  // or the start of the current span, thiscpu->cur_span.start_ts, but only
+  // if the current span is valid
+  uint64 span_start_time = thiscpu->cur_span.start_ts;
+  if (!thiscpu->valid_span) {span_start_time = event.start_ts;}
+
+  //--------------------------------------------//
+  // Things to insert BEFORE the current event  //
+  //--------------------------------------------//
+
+  //   - Insert any missing calls/ returns
+  // Fixup: return from X
+  // if TOS = call to X, all is good, else pop as needed
   // If X is not on the stack, insert call to it at span_start_ts
   if (IsAReturn(event)) { 
     keep &= FixupReturn(span_start_time, event, cpustate, perpidstate);
@@ -2410,7 +3037,7 @@ void PreProcessEvent(const OneSpan& event,
   // Remember last instance of each PID, for xxx
   // We want to do this for the events that finish execution spans
   if ((event.pid > 0) && (event.cpu >= 0)) {
-    priorPidEvent[event.pid] = event;
+    RememberPidEvent(event.pid, event.rpcid);
 //fprintf(stdout, "~~priorPidEvent[%d] = %llu\n", event.pid, event.start_ts);
   }
 
@@ -2434,9 +3061,7 @@ void PreProcessEvent(const OneSpan& event,
 
   // Remember any failed lock acquire event, for wait_lock
   if (event.eventnum == KUTRACE_LOCKNOACQUIRE) {
-    pendingLock[event.arg] = event;
-    priorPidLock[event.pid] = event.arg;
-//fprintf(stdout, "~~priorPidLock[%d] = %d\n", event.pid, event.arg);
+    RememberLockTry(event);
   }
 
   // Enqueue/dequeue processing: make a queue span per RPC
@@ -2458,108 +3083,29 @@ void PreProcessEvent(const OneSpan& event,
     if (0 <= thiscpu->cpu_stack.enqueue_num_pending) {
       // Switching away from an RPC. Remember that queued span starts here
       // Old rpcid is in event.rpcid
-      enqueuetime[event.rpcid] = event.start_ts + 1;	// Start used below
+      RememberEnqueue(event.rpcid, event.start_ts + 1);	// Start used below
       thiscpu->cpu_stack.enqueue_num_pending = -1;
     }
 
     if (0 <= thiscpu->cpu_stack.dequeue_num_pending) {
       // Switching to new RPC. Emit a queued span ending here
       // New rpcid is in event.arg
-      OneSpan temp_span;
-      MakeQueuedSpan(enqueuetime[event.arg], event.start_ts - 1, 
-                     thiscpu->cpu_stack.dequeue_num_pending, event.arg, &temp_span); 
+      WriteQueuedSpan(thiscpu->cpu_stack.dequeue_num_pending, event.arg, event.start_ts - 1);
       thiscpu->cpu_stack.dequeue_num_pending = -1;
-      // Don't clutter if the queued waiting is short (say < 10 usec)
-      if (temp_span.duration >= kMIN_WAIT_DURATION) {
-        WriteSpanJson2(stdout, &temp_span);	// Standalone queued span
-      }
     }
   }
 
 
-//
-// Begin RPC packet correlation
-//
-// NOTE: Must do incoming test before outgoing work
-//
-// Incoming event order
-// RX_PKT:	remember kernal timestamp in rx_hashtocorr[hash32]
-// RX_USER:	find k_ts in rx_hashtocorr[hash32], remember k_ts in pidtocorr[pid], 
-//		erase rx_hashtocorr[hash32]
-// RPCIDRE*:	have rpcid/length, find k_ts in pidtocorr[pid]; put out (rpcid/name/length/k_ts)
-//		pidtocorr[pid]
-  uint32 pkt_hash32 = (uint32)event.arg;
-
-  if (IsRawRxPktInt(event.eventnum)) {
-//DumpEvent(stderr, "IsRawRxPktInt:", event);
-    rx_hashtocorr[pkt_hash32] = inithashcorr;
-    rx_hashtocorr[pkt_hash32].k_timestamp = event.start_ts;
-  }
-
-  if (IsUserRxPktInt(event.eventnum)) {
-//DumpEvent(stderr, "IsUserRxPktInt:", event);
-    pidtocorr[event.pid] = initpidcorr;
-    if (rx_hashtocorr.find(pkt_hash32) != rx_hashtocorr.end()) {
-      pidtocorr[event.pid].k_timestamp = rx_hashtocorr[pkt_hash32].k_timestamp;
-    }
-    rx_hashtocorr.erase(pkt_hash32);
-    pidtocorr[event.pid].rx = true;
-  }
-
-  if (IsIncomingRpcReqResp(event)) {
-//DumpEvent(stderr, "IsIncomingRpcReqResp:", event);
-    uint32 msg_rpcid16 = event.arg & 0xffff;
-    uint16 msg_lglen8 = FixupLength((event.arg >> 16) & 0xff);
-    pidtocorr[event.pid].rpcid = msg_rpcid16;
-    pidtocorr[event.pid].lglen8 = msg_lglen8;
-    keep &= EmitRxTxMsg(pidtocorr[event.pid], cpustate, perpidstate);
-    pidtocorr.erase(event.pid);
-  }
-
-// Outgoing event order
-// RPCIDRE*:	remember rpcid/length in pidtocorr[pid]
-// TX_USER:	remember pid in tx_hashtocorr[hash32]
-// TX_PKT:	have kernel timestamp, have pid in tx_hashtocorr[hash32], rpcid/length in pidtocorr[pid]; 
-//		erase rx_hashtocorr[hash32]
-//              put out (rpcid/name/length/k_ts)
-//		erase pidtocorr[pid] 
-  if (IsOutgoingRpcReqResp(event)) {
-    // This creates a pidtocorr record. If the test for IsIncomingRpcReqResp
-    // follows this, it will erroneously return true. So we do the
-    // incoming correlation first, above.
-//DumpEvent(stderr, "IsOutgoingRpcReqResp:", event);
-    uint32 msg_rpcid16 = event.arg & 0xffff;
-    uint16 msg_lglen8 = FixupLength((event.arg >> 16) & 0xff);
-    pidtocorr[event.pid] = initpidcorr;
-    pidtocorr[event.pid].rpcid = msg_rpcid16;
-    pidtocorr[event.pid].lglen8 = msg_lglen8;
-    pidtocorr[event.pid].rx = false;
-  }
-
-  if (IsUserTxPktInt(event.eventnum)) {
-//DumpEvent(stderr, "IsUserTxPktInt:", event);
-    tx_hashtocorr[pkt_hash32] = inithashcorr;
-    tx_hashtocorr[pkt_hash32].pid = event.pid;
+  // RPC packet correlation, network speed, RPC sampling
+  if (IsCorrelatedInt(event.eventnum)) {
+    CorrelatePackets(event, cpustate, perpidstate);
   }
 
-  if (IsRawTxPktInt(event.eventnum)) {
-//DumpEvent(stderr, "IsRawTxPktInt:", event);
-    uint32 pid = 0;
-    if (tx_hashtocorr.find(pkt_hash32) != tx_hashtocorr.end()) {
-      pid = tx_hashtocorr[pkt_hash32].pid;
-    }
-    tx_hashtocorr.erase(pkt_hash32);
-    if (pidtocorr.find(pid) != pidtocorr.end()) {
-      pidtocorr[pid].k_timestamp = event.start_ts;
-      keep &= EmitRxTxMsg(pidtocorr[pid], cpustate, perpidstate);
-    }
-    pidtocorr.erase(pid);
+  if (event.eventnum == KUTRACE_MBIT_SEC) {
+    keep = false;		// Not a JSON event -- moved to JSON metadata
   }
-// End RPC packet correlation
-
 
-  if (event.eventnum == KUTRACE_MBIT_SEC) {
-    mbit_sec = event.arg;
+  if (event.eventnum == KUTRACE_RPCSAMPLE) {
     keep = false;		// Not a JSON event -- moved to JSON metadata
   }
 
@@ -2588,6 +3134,475 @@ void PreProcessEvent(const OneSpan& event,
 
 
 
+//---------------------------------------------------------------------------//
+// -jN two-phase reconstruction. See "Main loop" above main
+//
+// Phase zero is main, reading events into chunks; phase one is the workers,
+// each reconstructing its CPUs of a chunk; phase two is one thread that
+// reconciles each chunk in trace order
+//
+
+// Writes to a CpuWork's out go here
+ssize_t AppendToText(void* cookie, const char* buf, size_t size) {
+  reinterpret_cast<string*>(cookie)->append(buf, size);
+  return size;
+}
+
+void ResetChunk(Chunk* chunk) {
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    CpuWork* work = &chunk->cpu[cpu];
+    work->queue.clear();
+    work->ops.clear();
+    work->events.clear();
+    work->stats.clear();
+    work->text.clear();
+    work->err.clear();
+    work->span_count = 0;
+    work->next = 0;
+    work->op_done = 0;
+    work->text_done = 0;
+    work->stat_done = 0;
+    work->err_done = 0;
+    work->cur = NULL;
+  }
+  chunk->events = 0;
+  chunk->cpus = 0;
+  chunk->runs.clear();
+  chunk->globals.clear();
+  chunk->slots.clear();
+  chunk->slot_ready.clear();
+  chunk->latest.clear();
+  chunk->run_cpu = -1;
+  chunk->run_last = 0;
+  chunk->workers_done = 0;
+}
+
+Chunk* NewChunk() {
+  Chunk* chunk = new Chunk;
+  cookie_io_functions_t io = {NULL, AppendToText, NULL, NULL};
+  for (int cpu = 0; cpu < kMaxCpus; ++cpu) {
+    CpuWork* work = &chunk->cpu[cpu];
+    work->out = fopencookie(&work->text, "w", io);
+    setvbuf(work->out, NULL, _IONBF, 0);	// So text is always up to date
+    work->chunk = chunk;
+  }
+  ResetChunk(chunk);
+  return chunk;
+}
+
+// Phase zero: the chunk being filled, waiting for one to come free if need be
+Chunk* FillingChunk() {
+  Pipeline* p = pipeline;
+  if (p->filling != NULL) {return p->filling;}
+  pthread_mutex_lock(&p->lock);
+  while ((p->queued - p->reconciled) >= kChunksInFlight) {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+  p->filling = p->chunks[p->queued % kChunksInFlight];
+  ResetChunk(p->filling);
+  return p->filling;
+}
+
+// Phase zero: mark the end of the current run of one CPU's events
+void EndRun(Chunk* chunk) {
+  if (chunk->run_cpu < 0) {return;}
+  chunk->cpu[chunk->run_cpu].queue[chunk->run_last].run_end = true;
+  chunk->run_cpu = -1;
+}
+
+// Phase zero: hand the chunk being filled on to phase one
+void HandOnChunk() {
+  Pipeline* p = pipeline;
+  Chunk* chunk = p->filling;
+  if (chunk == NULL) {return;}
+  EndRun(chunk);
+  chunk->cpus = max_cpu_seen + 1;
+  p->filling = NULL;
+  pthread_mutex_lock(&p->lock);
+  ++p->queued;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Phase zero: a slot for a stack of pid, now its latest
+int NewSlot(Chunk* chunk, int pid) {
+  int slot = chunk->slots.size();
+  chunk->slots.push_back(PidState());
+  chunk->slot_ready.push_back(0);
+  chunk->latest[pid] = slot;
+  pipeline->stacked[pid] = true;
+  return slot;
+}
+
+// Phase zero: queue one event for phase one on its CPU
+// A context switch gets the slots its SwapStacks will use. The PID a CPU
+// switches away from is always the one its last context switch went to, so
+// every save and load is known here, before any stack exists
+void QueueEvent(const OneSpan& event) {
+  Pipeline* p = pipeline;
+  Chunk* chunk = FillingChunk();
+  QueuedEvent q;
+  q.event = event;
+  q.save = -1;
+  q.load = -1;
+  q.name0 = 0;
+  q.rename = false;
+  q.run_end = false;
+  if (IsAContextSwitch(event)) {
+    int oldpid = p->cpu_pid[event.cpu];
+    int newpid = event.pid;
+    p->cpu_pid[event.cpu] = EventnumToPid(PidToEventnum(newpid));
+    if (oldpid != newpid) {
+      // Swap out the old thread's stack, but don't change the idle stack
+      if (oldpid != 0) {q.save = NewSlot(chunk, oldpid);}
+      if (chunk->latest.contains(newpid)) {
+        q.load = chunk->latest[newpid];
+      } else if (!p->stacked.contains(newpid)) {
+        // Switching to a thread we haven't seen before
+        q.load = NewSlot(chunk, newpid);
+        BrandNewStack(newpid, event.name, &chunk->slots[q.load]);
+        chunk->slot_ready[q.load] = 1;
+      }
+    }
+    q.name0 = CtxPidName(event);
+  }
+
+  if (chunk->run_cpu != event.cpu) {
+    EndRun(chunk);
+    chunk->runs.push_back(event.cpu);
+    chunk->run_cpu = event.cpu;
+  }
+  CpuWork* work = &chunk->cpu[event.cpu];
+  chunk->run_last = work->queue.size();
+  work->queue.push_back(q);
+  if (kChunkEvents <= ++chunk->events) {HandOnChunk();}
+}
+
+// Phase zero: RecordPidName's update of the CPU stacks, which phase one
+// does in order with each CPU's events
+void QueueRename(int pid, NameId name) {
+  Chunk* chunk = FillingChunk();
+  QueuedEvent q;
+  memset(&q, 0, sizeof(q));
+  q.event.pid = pid;
+  q.event.name = name;
+  q.save = -1;
+  q.load = -1;
+  q.rename = true;
+  for (int cpu = 0; cpu <= max_cpu_seen; ++cpu) {chunk->cpu[cpu].queue.push_back(q);}
+  ++chunk->events;
+}
+
+// Phase zero: a method or queue name, which phase two defines in trace order
+void QueueGlobalName(bool method, int key, const char* name) {
+  Chunk* chunk = FillingChunk();
+  EndRun(chunk);
+  GlobalName global;
+  global.method = method;
+  global.key = key;
+  global.name = string(name);
+  chunk->globals.push_back(global);
+  chunk->runs.push_back(-1);
+}
+
+// Phase zero: wait until everything queued is through phase two
+// Nothing to wait for without -jN
+void DrainPipeline() {
+  Pipeline* p = pipeline;
+  if (p == NULL) {return;}
+  HandOnChunk();
+  pthread_mutex_lock(&p->lock);
+  while (p->reconciled < p->queued) {
+    pthread_cond_wait(&p->changed, &p->lock);
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+// Phase one: reconstruct one CPU's queued events until done or at a
+// context switch whose stack is not in its slot yet
+void ReconstructCpu(int cpu, CpuWork* work, CPUState* cpustate, PerPidState* perpidstate) {
+  Chunk* chunk = work->chunk;
+  CPUState* thiscpu = &cpustate[cpu];
+  cpu_work = work;
+  while (work->next < work->queue.size()) {
+    QueuedEvent* q = &work->queue[work->next];
+    if ((0 <= q->load) && !__atomic_load_n(&chunk->slot_ready[q->load], __ATOMIC_SEQ_CST)) {
+      break;
+    }
+    ++work->next;
+
+    if (q->rename) {
+      if (thiscpu->cpu_stack.eventnum[0] == PidToEventnum(q->event.pid)) {
+        thiscpu->cpu_stack.name[0] = q->event.name;
+      }
+      continue;
+    }
+
+    // Fix event.rpcid. rawtoevent does not carry them across context switches
+    q->event.rpcid = thiscpu->cpu_stack.rpcid;	// 2021.02.05
+    work->cur = q;
+    work->pid_event_deferred = false;
+    PreProcessEvent(q->event, cpustate, perpidstate);
+    if (q->run_end) {Defer(kOpRunEnd, 0, 0, 0, 0, 0);}
+  }
+  cpu_work = NULL;
+}
+
+// Phase one: true if some CPU of this worker can go on
+bool WorkerCanGoOn(const Chunk* chunk, int worker) {
+  for (int cpu = worker; cpu < chunk->cpus; cpu += pipeline->workers) {
+    const CpuWork* work = &chunk->cpu[cpu];
+    if (work->queue.size() <= work->next) {continue;}
+    int load = work->queue[work->next].load;
+    if ((load < 0) || __atomic_load_n(&chunk->slot_ready[load], __ATOMIC_SEQ_CST)) {return true;}
+  }
+  return false;
+}
+
+// Phase one: this worker's CPUs of the chunk, cpu = worker mod workers.
+// When all of them wait on slots, some other worker has the earliest
+// unfilled one still to do, so waiting cannot deadlock
+void ReconstructCpus(Chunk* chunk, int worker, CPUState* cpustate, PerPidState* perpidstate) {
+  Pipeline* p = pipeline;
+  while (true) {
+    bool left = false;
+    bool progress = false;
+    for (int cpu = worker; cpu < chunk->cpus; cpu += p->workers) {
+      CpuWork* work = &chunk->cpu[cpu];
+      int next = work->next;
+      ReconstructCpu(cpu, work, cpustate, perpidstate);
+      if (work->next != next) {progress = true;}
+      if (work->next < work->queue.size()) {left = true;}
+    }
+    if (!left) {return;}
+    if (progress) {continue;}
+
+    pthread_mutex_lock(&p->lock);
+    __atomic_add_fetch(&p->slot_waiters, 1, __ATOMIC_SEQ_CST);
+    while (!WorkerCanGoOn(chunk, worker)) {
+      pthread_cond_wait(&p->slot_filled, &p->lock);
+    }
+    __atomic_sub_fetch(&p->slot_waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// Phase one: each PID's latest stack in the chunk goes to perpidstate for
+// the chunks after it
+void FoldSlots(Chunk* chunk, PerPidState* perpidstate) {
+  vector<int> pids;
+  chunk->latest.keys(&pids);
+  for (int i = 0; i < pids.size(); ++i) {
+    (*perpidstate)[pids[i]] = chunk->slots[chunk->latest[pids[i]]];
+  }
+}
+
+// Phase one worker. Chunk n starts once chunk n-1 has been folded
+void* ReconstructWorker(void* arg) {
+  Pipeline* p = pipeline;
+  int worker = reinterpret_cast<intptr_t>(arg);
+  for (uint64 n = 0; ; ++n) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && ((p->queued <= n) || (p->reconstructed < n))) {
+      pthread_cond_wait(&p->changed, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (p->stop) {return NULL;}
+
+    Chunk* chunk = p->chunks[n % kChunksInFlight];
+    ReconstructCpus(chunk, worker, &(*p->cpustate)[0], p->perpidstate);
+
+    // The last worker done folds the stacks
+    pthread_mutex_lock(&p->lock);
+    bool last = (++chunk->workers_done == p->workers);
+    pthread_mutex_unlock(&p->lock);
+    if (last) {
+      FoldSlots(chunk, p->perpidstate);
+      pthread_mutex_lock(&p->lock);
+      ++p->reconstructed;
+      pthread_cond_broadcast(&p->changed);
+      pthread_mutex_unlock(&p->lock);
+    }
+  }
+}
+
+// Phase two: put out a CPU's span lines and add up its stats, to the ends given
+void PutOutCpuWork(CpuWork* work, uint32 text_end, uint32 stat_end) {
+  if (work->text_done < text_end) {
+    fwrite(work->text.data() + work->text_done, 1, text_end - work->text_done, stdout);
+    work->text_done = text_end;
+  }
+  for (; work->stat_done < stat_end; ++work->stat_done) {
+    uint32 stat = work->stats[work->stat_done];
+    AddToTotal(stat >> 30, stat & 0x3fffffff);
+  }
+}
+
+// Phase two: what phase one left undone. cpu_work is NULL here, so these
+// do the real work
+void DoDeferredOp(CpuWork* work, const DeferredOp& op) {
+  switch (op.kind) {
+  case kOpPidEvent:
+    RememberPidEvent(op.a, op.b);
+    break;
+  case kOpPidEnd:
+    RememberPidEnd(op.a, op.ts);
+    break;
+  case kOpRunningPid:
+    SwitchRunningPid(op.a, op.b);
+    break;
+  case kOpRpcidMid:
+    WriteRpcidMidSpan(op.ts, op.a, op.b, op.c);
+    break;
+  case kOpLockTry:
+    RememberLockTry(work->events[op.a]);
+    break;
+  case kOpLock:
+    DoLockEvent(work->events[op.a]);
+    break;
+  case kOpWakeup:
+    WakeupPid(work->events[op.a], op.c);
+    break;
+  case kOpResume: {
+    OneSpan event;
+    memset(&event, 0, sizeof(event));
+    event.start_ts = op.ts;
+    event.duration = op.ts2;
+    event.cpu = op.a;
+    event.pid = op.b;
+    ResumePid(event);
+    break;
+  }
+  case kOpEnqueue:
+    RememberEnqueue(op.a, op.ts);
+    break;
+  case kOpDequeue:
+    WriteQueuedSpan(op.a, op.b, op.ts);
+    break;
+  case kOpCorrelate:
+    CorrelatePackets(work->events[op.a], NULL, NULL);
+    break;
+  case kOpStderr:
+    fwrite(work->err.data() + work->err_done, 1, op.a - work->err_done, stderr);
+    work->err_done = op.a;
+    break;
+  default:
+    break;
+  }
+}
+
+// Phase two: one chunk, run by run in trace order
+void Reconcile(Chunk* chunk) {
+  int global = 0;
+  for (int i = 0; i < chunk->runs.size(); ++i) {
+    int cpu = chunk->runs[i];
+    if (cpu < 0) {
+      const GlobalName& name = chunk->globals[global++];
+      if (name.method) {
+        methodnames[name.key] = name.name;
+      } else {
+        queuenames[name.key] = name.name;
+      }
+      continue;
+    }
+    CpuWork* work = &chunk->cpu[cpu];
+    while (true) {
+      const DeferredOp& op = work->ops[work->op_done++];
+      PutOutCpuWork(work, op.text_end, op.stat_end);
+      if (op.kind == kOpRunEnd) {break;}
+      DoDeferredOp(work, op);
+    }
+  }
+  for (int cpu = 0; cpu < chunk->cpus; ++cpu) {span_count += chunk->cpu[cpu].span_count;}
+}
+
+// Phase two thread
+void* ReconcileWorker(void* arg) {
+  Pipeline* p = pipeline;
+  for (uint64 n = 0; ; ++n) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->stop && (p->reconstructed <= n)) {
+      pthread_cond_wait(&p->changed, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+    if (p->stop) {return NULL;}
+
+    Reconcile(p->chunks[n % kChunksInFlight]);
+
+    pthread_mutex_lock(&p->lock);
+    ++p->reconciled;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+// Done with the threads. Anything queued must have been drained
+void StopPipeline() {
+  Pipeline* p = pipeline;
+  if (p == NULL) {return;}
+  pthread_mutex_lock(&p->lock);
+  p->stop = true;
+  pthread_cond_broadcast(&p->changed);
+  pthread_mutex_unlock(&p->lock);
+  for (int t = 0; t < p->threads.size(); ++t) {pthread_join(p->threads[t], NULL);}
+  for (int i = 0; i < kChunksInFlight; ++i) {
+    for (int cpu = 0; cpu < kMaxCpus; ++cpu) {fclose(p->chunks[i]->cpu[cpu].out);}
+    delete p->chunks[i];
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->changed);
+  pthread_cond_destroy(&p->slot_filled);
+  delete p;
+  pipeline = NULL;
+  names_shared = false;
+}
+
+// Start workers reconstructing threads and the phase-two thread. Without
+// them, events are processed one at a time as before
+void StartPipeline(int workers, vector<CPUState>* cpustate, PerPidState* perpidstate) {
+  Pipeline* p = new Pipeline;
+  p->cpustate = cpustate;
+  p->perpidstate = perpidstate;
+  p->workers = 0;
+  for (int i = 0; i < kChunksInFlight; ++i) {p->chunks[i] = NewChunk();}
+  p->filling = NULL;
+  p->cpu_pid.assign(kMaxCpus, pid_idle);
+  p->stacked[pid_idle] = true;	// Branded in main
+  p->queued = 0;
+  p->reconstructed = 0;
+  p->reconciled = 0;
+  p->stop = false;
+  p->slot_waiters = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->changed, NULL);
+  pthread_cond_init(&p->slot_filled, NULL);
+  pipeline = p;
+
+  // Workers index CPU state without it ever growing under them
+  GrowCPUState(kMaxCpus - 1, cpustate);
+  names_shared = true;
+
+  // Nothing is queued until p->workers is final
+  for (int t = 0; t < workers; ++t) {
+    pthread_t thread;
+    void* arg = reinterpret_cast<void*>((intptr_t)p->threads.size());
+    if (pthread_create(&thread, NULL, ReconstructWorker, arg) == 0) {
+      p->threads.push_back(thread);
+    }
+  }
+  p->workers = p->threads.size();
+  pthread_t thread;
+  if ((p->workers == 0) || (pthread_create(&thread, NULL, ReconcileWorker, NULL) != 0)) {
+    fprintf(stderr, "eventtospan3: threads did not start, using one\n");
+    StopPipeline();
+    return;
+  }
+  p->threads.push_back(thread);
+}
+
+
+
 // Fix PID names
 // We do four things here:
 // (1) For each PID number, keep its current name, in time order
@@ -2635,9 +3650,13 @@ void RecordPidName(int64 temp_ts, int temp_arg, char* temp_name, CPUState* cpust
   }
 
   // Update this name on any pending CPU stack
+  if (pipeline != NULL) {
+    QueueRename(temp_arg, InternName(NameAppendPid(temp_name_str, temp_arg)));
+    return;
+  }
   for (int cpu = 0; cpu <= max_cpu_seen; ++cpu) {
     if(cpustatep[cpu].cpu_stack.eventnum[0] ==  PidToEventnum(temp_arg)) {
-      cpustatep[cpu].cpu_stack.name[0] = NameAppendPid(temp_name_str, temp_arg);
+      cpustatep[cpu].cpu_stack.name[0] = InternName(NameAppendPid(temp_name_str, temp_arg));
     }
   }
 }
@@ -2647,8 +3666,8 @@ void FixPidName(OneSpan* eventp) {
 
   // Force in the current name from pidnames[pid]
   int pid = EventnumToPid(eventp->eventnum);
-  if (pidnames.find(pid) != pidnames.end()) {
-    eventp->name = NameAppendPid(pidnames[pid], pid);
+  if (pidnames.contains(pid)) {
+    eventp->name = InternName(NameAppendPid(pidnames[pid], pid));
     // Also update the stacked name for this pid
     // also update the span name for this pid
     //stack->name[0]
@@ -2658,7 +3677,7 @@ void FixPidName(OneSpan* eventp) {
 // For Raspberry PI, change mwait to wfi
 void FixMwaitName(OneSpan* eventp) {
   if (is_rpi && IsAnMwait(*eventp)) {
-    eventp->name = string("wfi");
+    eventp->name = wfi_name;
   }
 
 }
@@ -2687,6 +3706,45 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
   return true;
 }
 
+// Binary input from rawtoevent -b. See eventbin.h
+std::vector<string> bin_strings;	// By id
+
+const char* BinName(int32 id) {
+  if ((id < 0) || (bin_strings.size() <= id)) {return "";}
+  return bin_strings[id].c_str();
+}
+
+// The name as sscanf %s picks it out of the text line: the first word, or 
+// the (event) that follows an empty name
+void BinNameWord(const BinEvent& rec, char* buf, int maxsize) {
+  const char* name = BinName(rec.name);
+  name += strspn(name, " \t");
+  int len = strcspn(name, " \t");
+  if (len == 0) {snprintf(buf, maxsize, "(%x)", rec.eventnum); return;}
+  if (maxsize <= len) {len = maxsize - 1;}
+  memcpy(buf, name, len);
+  buf[len] = '\0';
+}
+
+// Read the next record into rec, defining any strings on the way. A comment
+// comes back as its text in buffer, as from ReadLine; anything else leaves
+// buffer empty. Return false if no more.
+bool ReadBin(FILE* f, BinEvent* rec, char* buffer, int maxsize) {
+  while (fread(rec, sizeof(BinEvent), 1, f) == 1) {
+    if (rec->eventnum == kBinString) {
+      string s;
+      if (!ReadBinString(f, *rec, &s)) {return false;}
+      if (bin_strings.size() <= rec->arg) {bin_strings.resize(rec->arg + 1);}
+      bin_strings[rec->arg] = s;
+      continue;
+    }
+    buffer[0] = '\0';
+    if (rec->eventnum == kBinComment) {snprintf(buffer, maxsize, "%s", BinName(rec->name));}
+    return true;
+  }
+  return false;
+}
+
 // We assign every nanosecond of each CPUs time to some time span.
 // Initially, all CPUs are assumed to be executing the idle job, pid=0
 // Any syscall/irq/trap pushes into that kernel code
@@ -2703,13 +3761,16 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 // to make a correctly-nested set of time spans.
 
 //
-// Usage: eventtospan3 <event file name> [-v] [-t]
+// Usage: eventtospan3 <event file name> [-v] [-t] [-jN]
+// Reads text or rawtoevent -b binary events from stdin
 //
 int main (int argc, const char** argv) {
-  CPUState cpustate[kMAX_CPUS];	// Running state for each CPU
+  vector<CPUState> cpustate;	// Running state for each CPU, grows as CPUs appear
   PerPidState perpidstate;	// Saved PID call stacks, for context switching
+  UseBigOutputBuffer(stdout);
 
   OneSpan event;
+  int jobs = 0;
   string trace_label;
   string trace_timeofday;
   kernel_version.clear();
@@ -2731,22 +3792,11 @@ int main (int argc, const char** argv) {
     if (strcmp(argv[i], "-v") == 0) {verbose = true;}
     if (strcmp(argv[i], "-t") == 0) {trace = true;}
     if (strcmp(argv[i], "-rel0") == 0) {rel0 = true;}
+    if (memcmp(argv[i], "-j", 2) == 0) {jobs = atoi(argv[i] + 2);}
   } 
 
-  // Initialize CPU state
-  for (int i = 0; i < kMAX_CPUS; ++i) {
-    InitPidState(&cpustate[i].cpu_stack);
-    InitSpan(&cpustate[i].cur_span, i);
-    //InitSpan(&cpustate[i].prior_pc_sample, i);
-    cpustate[i].prior_pstate_ts = 0;
-    cpustate[i].prior_pstate_freq = 0;
-    cpustate[i].prior_pc_samp_ts = 0;
-    cpustate[i].ctx_switch_ts = 0;
-    cpustate[i].mwait_pending = 0;
-    cpustate[i].oldpid = 0;
-    cpustate[i].newpid = 0;
-    cpustate[i].valid_span = false;		// Ignore initial span  
-  }
+  // Initialize CPU state. More CPUs are added as their events show up
+  GrowCPUState(0, &cpustate);
 
   // Set idle name
   pidnames[pid_idle] = string(kIdleName);
@@ -2756,20 +3806,40 @@ int main (int argc, const char** argv) {
   // It can be in the midst of an interrupt when a context switch goes to another thread,
   // but the interrupt code is silently done.
   // Here we set the stacked idle task as inside sched, and we never change that elsewhere.
-  BrandNewPid(pid_idle, string(kIdleName), &perpidstate);
+  BrandNewPid(pid_idle, idle_name, &perpidstate);
+
+  // -jN reconstructs CPUs on N threads. -v and -t debug output is sequential
+  if ((0 < jobs) && !verbose && !trace) {StartPipeline(jobs, &cpustate, &perpidstate);}
 
 
   //
   // Main loop
+  // Sequentially, each event goes straight to PreProcessEvent. With -jN it is
+  // done in three phases over chunks of kChunkEvents events:
+  //  Phase zero, here, reads events and queues each on its CPU. The stack a
+  //   context switch saves is always that of the previous PID on the CPU, so
+  //   which PerPidState slot each switch saves and loads, and which PIDs are
+  //   brand new, is known here without reconstructing anything.
+  //  Phase one, N workers, reconstructs each CPU's spans. A worker waits only
+  //   where a context switch loads a stack another CPU saves earlier.
+  //  Phase two, one thread, replays in trace order what crosses CPUs: PID
+  //   events and ends, wakeups and WaitBeforeWakeup, lock hand-offs, RPC
+  //   enqueue/dequeue, packet hash correlation, and stderr lines. It then
+  //   writes each CPU's spans in the order the sequential pass would have.
+  // The output is byte-identical to the sequential pass.
   //
   uint64 lowest_ts = 0;
   uint64 prior_ts = 0;
   int linenum = 0;
   char buffer[kMaxBufferSize];
-  while (ReadLine(stdin, buffer, kMaxBufferSize)) {
+  bool binary_in = IsEventBin(stdin);
+  BinEvent rec;
+  while (binary_in ? ReadBin(stdin, &rec, buffer, kMaxBufferSize) : 
+                     ReadLine(stdin, buffer, kMaxBufferSize)) {
     ++linenum;
     int len = strlen(buffer);
-    if (buffer[0] == '\0') {continue;}
+    bool bin_event = binary_in && (buffer[0] == '\0');	// rec has it, no text
+    if ((buffer[0] == '\0') && !bin_event) {continue;}
 
     // Comments start with #, some are stylized and contain data
     if (buffer[0] == '#') {
@@ -2785,6 +3855,7 @@ int main (int argc, const char** argv) {
           // since the timestamps are all relative to a minute boundary
           trace_timeofday = string(buffer, 6, 17) + "00";
           //fprintf(stderr, "eventtospan3: trace_timeofday '%s'\n", trace_timeofday.c_str());
+          DrainPipeline();
           InitialJson(stdout, trace_label.c_str(), trace_timeofday.c_str());
       }
       // Pull version and flags out if present
@@ -2820,64 +3891,114 @@ int main (int argc, const char** argv) {
     int temp_eventnum = 0;
     int temp_arg = 0;
     char temp_name[64];
-    sscanf(buffer, "%lld %llu %d %d %[ -~]", &temp_ts, &temp_dur, &temp_eventnum, &temp_arg, temp_name);
+    const char* text_rest = NULL;	// After the first four numbers
+    if (bin_event) {
+      temp_ts = rec.start_ts;
+      temp_dur = rec.duration;
+      temp_eventnum = rec.eventnum;
+      temp_arg = rec.arg;
+      if (IsNamedef(temp_eventnum)) {snprintf(temp_name, sizeof(temp_name), "%s", BinName(rec.name));}
+    } else {
+      text_rest = ParseLineStart(buffer, &temp_ts, &temp_dur, &temp_eventnum, &temp_arg);
+      if (text_rest == NULL) {continue;}
+      if (IsNamedef(temp_eventnum)) {ParseNameText(text_rest, temp_name, sizeof(temp_name));}
+    }
     if (IsNamedef(temp_eventnum)) {
 //fprintf(stdout, "====%%%s\n", buffer);
       if (IsLockNameInt(temp_eventnum)) {		// Lock names
         locknames[temp_arg] = string(temp_name);
       } else if (IsKernelVerInt(temp_eventnum)) {
         kernel_version = string(temp_name);
-        if (temp_ts == -1) {fprintf(stderr, "kernel_version = %s\n", temp_name);}
+        if (temp_ts == -1) {
+          DrainPipeline();
+          fprintf(stderr, "kernel_version = %s\n", temp_name);
+        }
       } else if (IsModelNameInt(temp_eventnum)) {
         // If the model is Raspberry, set pstate_is_all_cpus
         if (strstr(temp_name, "Raspberry") != NULL) {
+          // A pstate then changes every CPU, so the rest is one at a time
+          DrainPipeline();
+          StopPipeline();
           is_rpi = true;
         }
         cpu_model_name = string(temp_name);
-        if (temp_ts == -1) {fprintf(stderr, "cpu_model_name = %s\n", temp_name);}
+        if (temp_ts == -1) {
+          DrainPipeline();
+          fprintf(stderr, "cpu_model_name = %s\n", temp_name);
+        }
       } else if (IsHostNameInt(temp_eventnum)) {
         host_name = string(temp_name);
-        if (temp_ts == -1) {fprintf(stderr, "host_name = %s\n", temp_name);}
+        if (temp_ts == -1) {
+          DrainPipeline();
+          fprintf(stderr, "host_name = %s\n", temp_name);
+        }
       ////} else if (IsUserExecNonidlenum(temp_arg)) {	// Just pick off PID names, accumulating if multiple ones
       } else if (IsPidNameInt(temp_eventnum)) {	// Just pick off PID names, accumulating if multiple ones
-        RecordPidName(temp_ts, temp_arg, temp_name, cpustate);
+        RecordPidName(temp_ts, temp_arg, temp_name, &cpustate[0]);
         // Update any active stack if name just changed
         // Update any current span if name just changed
       } else if (IsMethodNameInt(temp_eventnum)) {
 	// Step (0) of RPC-to-packet correlation
         int rpcid = temp_arg & 0xffff;
-        methodnames[rpcid] = string(temp_name);
+        if (pipeline != NULL) {
+          QueueGlobalName(true, rpcid, temp_name);
+        } else {
+          methodnames[rpcid] = string(temp_name);
+        }
       } else if (IsQueueNameInt(temp_eventnum)) {
-        queuenames[temp_arg] = string(temp_name);	// Queue number is a small integer
+        if (pipeline != NULL) {
+          QueueGlobalName(false, temp_arg, temp_name);
+        } else {
+          queuenames[temp_arg] = string(temp_name);	// Queue number is a small integer
+        }
       }
       // Ignore the rest of the names -- already handled by rawtoevent and sort
       continue;
     } 
 
     // Read the full non-name event
-    if (incoming_version < 2) {
-      int n = sscanf(buffer, "%llu %llu %d %d %d %d %d %d %s",
-                     &event.start_ts, &event.duration, &event.eventnum, &event.cpu, 
-                     &event.pid, &event.rpcid, &event.arg, &event.retval, name_buffer);
-      event.ipc = 0;
-      if (n != 9) {continue;}
+    if (bin_event) {
+      event.start_ts = rec.start_ts;
+      event.duration = rec.duration;
+      event.eventnum = rec.eventnum;
+      event.cpu = rec.cpu;
+      event.pid = rec.pid;
+      event.rpcid = rec.rpcid;
+      event.arg = rec.arg;
+      event.retval = rec.retval;
+      event.ipc = rec.ipc;
+      BinNameWord(rec, name_buffer, sizeof(name_buffer));
     } else {
-      int n = sscanf(buffer, "%llu %llu %d %d %d %d %d %d %d %s",
-                     &event.start_ts, &event.duration, &event.eventnum, &event.cpu, 
-                     &event.pid, &event.rpcid, &event.arg, &event.retval,  
-                     &event.ipc, name_buffer);
-      if (n != 10) {continue;}
+      // Version 1 has no ipc field
+      event.start_ts = temp_ts;
+      event.duration = temp_dur;
+      event.eventnum = temp_eventnum;
+      event.cpu = temp_arg;
+      if (!ParseEventRest(text_rest, incoming_version >= 2, &event.pid, &event.rpcid, 
+                          &event.arg, &event.retval, &event.ipc, 
+                          name_buffer, sizeof(name_buffer))) {
+        continue;
+      }
     }
-    event.name = string(name_buffer);
+    event.name = InternName(name_buffer);
+
+    if ((event.cpu < 0) || (kMaxCpus <= event.cpu)){
+      DrainPipeline();
+      fprintf(stderr, "FATAL: Bad CPU number at line[%d] '%s'\n", linenum, buffer);
+      exit(0);
+    }
+    if (cpustate.size() <= event.cpu) {GrowCPUState(event.cpu, &cpustate);}
 
     // Fix event.rpcid. rawtoevent does not carry them across context switches
-    event.rpcid = cpustate[event.cpu].cpu_stack.rpcid;	// 2021.02.05
+    // With -jN, phase one does this
+    if (pipeline == NULL) {event.rpcid = cpustate[event.cpu].cpu_stack.rpcid;}	// 2021.02.05
 
     // Fixup name of idle thread once and for all
-    if (IsAnIdle(event)) {event.name = string(kIdleName);}
+    if (IsAnIdle(event)) {event.name = idle_name;}
 
     // Input must be sorted by timestamp
     if (event.start_ts < prior_ts) {
+      DrainPipeline();
       fprintf(stderr, "rawtoevent: Timestamp out of order at line[%d] %s\n", linenum, buffer);
       exit(0);
     }
@@ -2885,7 +4006,7 @@ int main (int argc, const char** argv) {
 if (verbose) {
 fprintf(stdout, "\n%% [%d] %llu %llu %03x(%d)=%d %s ", 
         event.cpu, event.start_ts, event.duration, 
-        event.eventnum, event.arg, event.retval, event.name.c_str());
+        event.eventnum, event.arg, event.retval, NameStr(event.name));
 DumpShort(stdout, &cpustate[event.cpu]);
 }
 
@@ -2893,11 +4014,6 @@ DumpShort(stdout, &cpustate[event.cpu]);
       lowest_ts = event.start_ts;
     }
 
-    if (kMAX_CPUS <= event.cpu){
-      fprintf(stderr, "FATAL: Too-big CPU number at line[%d] '%s'\n", linenum, buffer);
-      exit(0);
-    }
-
     // Keep track of largest CPU number seen
     if (max_cpu_seen < event.cpu) {
       max_cpu_seen = event.cpu;
@@ -2915,7 +4031,7 @@ DumpShort(stdout, &cpustate[event.cpu]);
       if (true || strlen(maybe_better_name) > strlen(name_buffer)) {
         // Do the replacement
 //fprintf(stderr, "LOCK %d %s => %s\n", event.arg, name_buffer, maybe_better_name);
-        event.name = string(maybe_better_name);
+        event.name = InternName(maybe_better_name);
       }
     }
 
@@ -2924,7 +4040,7 @@ DumpShort(stdout, &cpustate[event.cpu]);
       if (strchr(name_buffer, '(') == NULL) {
         char temp[64];
         sprintf(temp, "%s(%d)", name_buffer, event.arg);
-        event.name = string(temp); 
+        event.name = InternName(temp); 
       } 
     }
 
@@ -2948,7 +4064,11 @@ DumpShort(stdout, &cpustate[event.cpu]);
     prior_ts = event.start_ts;
     
     // Now do the real work
-    PreProcessEvent(event, &cpustate[0], &perpidstate); 
+    if (pipeline != NULL) {
+      QueueEvent(event);
+    } else {
+      PreProcessEvent(event, &cpustate[0], &perpidstate); 
+    }
 
     if (trace) {
       fprintf(stderr, "\t");
@@ -2959,6 +4079,8 @@ DumpShort(stdout, &cpustate[event.cpu]);
   //
   // End main loop
   //
+  DrainPipeline();
+  StopPipeline();
 
   // Flush the last frequency spans here
   for (int i = 0; i <= max_cpu_seen; ++i) {
@@ -2971,15 +4093,19 @@ DumpShort(stdout, &cpustate[event.cpu]);
   
   // Keep any hardware description. Leading space is required.
   fprintf(stdout, " \"mbit_sec\" : %d,\n", mbit_sec);
-
-  // Put out any multi-named PID row names
-  for (IntName::const_iterator it = pidrownames.begin(); it != pidrownames.end(); ++it) {
-    int pid = it->first;
-    string rowname = it->second;
-    double lowest_sec = lowest_ts / 100000000.0;
+  if (1 < rpc_sample) {fprintf(stdout, " \"rpcSample\" : %d,\n", rpc_sample);}
+
+  // Put out any multi-named PID row names, by PID
+  vector<int> rowpids;
+  pidrownames.keys(&rowpids);
+  std::sort(rowpids.begin(), rowpids.end());
+  for (int i = 0; i < rowpids.size(); ++i) {
+    int pid = rowpids[i];
+    string rowname = pidrownames[pid];
     if (rowname.find("+") != string::npos) {
-      fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s.%d\"],\n", 
-          lowest_sec, 0.00000001, 0, pid, 0, KUTRACE_LEFTMARK, 0, 0, 0, rowname.c_str(), pid); 
+      // Duration 0.00000001
+      rowname += "." + IntToString(pid);
+      WriteSpanJson(stdout, lowest_ts, 1, 0, pid, 0, KUTRACE_LEFTMARK, 0, 0, 0, rowname.c_str()); 
     }
   }
 
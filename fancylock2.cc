@@ -368,6 +368,12 @@ int FancyLock2::Get90ile() {
   return Calc90ile(&fancy2struct_.wait);
 }
 
+// True if wait_us is above the declared expected (90th percentile) wait.
+// Compares at the same 3.5-bit log10 resolution as the histogram.
+bool FancyLock2::OverExpected(uint32 wait_us) {
+  return Log10As3dot5(wait_us) > fancy2struct_.wait.expected;
+}
+
 // Record waiting time and queue depth. Takes about 10-15 nsec on Intel i3 7100.
 // Called fairly frequently
 void FancyLock2::IncrCounts(uint32 wait_us) {
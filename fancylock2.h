@@ -73,6 +73,9 @@ class FancyLock2 {
   // Record waiting time and queue depth
   void IncrCounts(uint32 wait_us);
 
+  // True if wait_us is above the declared expected (90th percentile) wait
+  bool OverExpected(uint32 wait_us);
+
   // The only data
   FancyLock2Struct CACHEALIGNED fancy2struct_;
 };
@@ -74,9 +74,9 @@ static const int kIpcBufSize = kTraceBufSize >> 3;
 //   +-------------------------------+-------------------------------+
 //   +-------------------------------+-------------------------------+
 //   |           u n u s e d         |            PID                | 8  module
-//   +-------------------------------+-------------------------------+
-//   |                          u n u s e d                          | 9  module
-//   +-------------------------------+-------------------------------+
+//   +---------------+---------------+-------------------------------+
+//   | 0xCA1B magic  | usec fraction |  calibration slope            | 9  DoDump
+//   +---------------+---------------+-------------------------------+
 //   |                                                               | 10 module
 //   +                            pidname                            +
 //   |                                                               | 11 module
@@ -92,9 +92,9 @@ static const int kIpcBufSize = kTraceBufSize >> 3;
 //   | flags |                  gettimeofday                         | 1 DoDump
 //   +-------+-----------------------+-------------------------------+
 //   |           u n u s e d         |            PID                | 2 module
-//   +-------------------------------+-------------------------------+
-//   |                          u n u s e d                          | 3 module
-//   +-------------------------------+-------------------------------+
+//   +---------------+---------------+-------------------------------+
+//   | 0xCA1B magic  | usec fraction |  calibration slope            | 3 DoDump
+//   +---------------+---------------+-------------------------------+
 //   |                                                               | 4 module
 //   +                            pidname                            +
 //   |                                                               | 5 module
@@ -107,7 +107,7 @@ static const int kIpcBufSize = kTraceBufSize >> 3;
 
 void Usage() {
   fprintf(stderr, "usage: kutrace_control, with sysin lines\n");
-  fprintf(stderr, "  go, stop [<fname>], init, on, off, flush, reset, stat, dump, quit, wait <sec>\n");
+  fprintf(stderr, "  go, gostream, stop [<fname>], init, on, off, flush, reset, stat, dump, quit, wait <sec>\n");
   exit(0);
 }
 
@@ -136,6 +136,8 @@ bool ReadLine(FILE* f, char* buffer, int maxsize) {
 // Take a series of commands from stdin
 //
 //  go|goipc|goipcwrap|gowrap
+//  gostream|goipcstream  Like gowrap, but drain completed trace blocks to the 
+//                        trace file while tracing runs
 //  stop <filename>
 //  init	Initialize trace buffer with syscall/irq/trap names
 //  on	Turn on tracing
@@ -200,6 +202,11 @@ int main (int argc, const char** argv) {
       control_flags |= DO_WRAP; kutrace::DoReset(control_flags); kutrace::DoInit(argv[0]); kutrace::DoOn();
     } else if ((strcmp(buffer, "goipcwrap") == 0) || (strcmp(buffer, "gowrapipc") == 0)) {
       control_flags |= (DO_IPC | DO_WRAP); kutrace::DoReset(control_flags); kutrace::DoInit(argv[0]); kutrace::DoOn();
+    } else if ((strcmp(buffer, "gostream") == 0) || (strcmp(buffer, "goipcstream") == 0)) {
+      control_flags = DO_WRAP;
+      if (strcmp(buffer, "goipcstream") == 0) {control_flags |= DO_IPC;}
+      kutrace::DoReset(control_flags); kutrace::DoInit(argv[0]);
+      if (kutrace::DoStreamStart(fname, control_flags)) {kutrace::DoOn();}
     } else if (memcmp(buffer, "stop", 4) == 0) {
       /* After DoOff wait 20 msec for any pending tracing to finish */
       /* Pick off filename if any */
@@ -212,7 +219,7 @@ int main (int argc, const char** argv) {
       msleep(n * 1000);
     } else {
       fprintf(stdout, "Not recognized '%s'\n", buffer);
-      fprintf(stdout, "  go goipc stop init on off flush reset stat dump quit\n");
+      fprintf(stdout, "  go goipc gostream stop init on off flush reset stat dump quit\n");
     }
 
     fprintf(stdout, "control> ");
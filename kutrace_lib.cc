@@ -2,12 +2,24 @@
 // Copyright 2021 Richard L. Sites
 //
 
+#include <vector>
+
+#include <dirent.h>	// opendir readdir
+#include <errno.h>
+#include <fcntl.h>	// open O_DIRECT
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>     // exit, system
 #include <string.h>
 #include <time.h>	// nanosleep
 #include <unistd.h>     // getpid gethostname syscall
+#include <linux/perf_event.h>	// perf_event_attr
+#include <sys/mman.h>	// mmap
+#include <sys/prctl.h>	// prctl PR_GET_NAME
+#include <sys/resource.h>	// setpriority
+#include <sys/syscall.h>	// SYS_gettid
 #include <sys/time.h>   // gettimeofday
+#include <sys/utsname.h>	// uname
 #include <sys/types.h>	
 
 #if defined(__x86_64__)
@@ -54,8 +66,12 @@ int64 stop_cycles = 0;
 int64 start_usec = 0;
 int64 stop_usec = 0;
 
+// Bumped by DoReset so each thread's RPC context goes into the new trace
+int rpc_generation = 1;
+
 char kernelversion[256];
 char modelname[256];
+char hostname[256];
 
 // Useful utility routines
 int64 GetUsec() {
@@ -107,6 +123,230 @@ void GetTimePair(int64* cycles, int64* usec) {
 }
 
 
+//--------------------------------------------------------------------------//
+// User-mode backend                                                        //
+//--------------------------------------------------------------------------//
+//
+// On a kernel without the KUtrace patch, the same control commands can be 
+// implemented here in user space. Only events inserted by this process are 
+// recorded: marks, names, RPC ids, locks, etc. There are no syscall/irq/trap
+// events and no IPC.
+//
+// Selected at build time with -DKUTRACE_USERMODE or at run time by setting 
+// the environment variable KUTRACE_USERMODE=1. KUTRACE_USERMODE_MB sets the 
+// trace buffer size, default 64MB.
+//
+// Each thread is given its own virtual CPU number and fills its own 64KB 
+// trace blocks, so inserts are lock-free: the only shared write is an atomic 
+// increment to claim the next free block. The blocks have exactly the layout 
+// the kernel module produces, so DoDump, rawtoevent, and eventtospan3 are 
+// unchanged. 
+//
+// Differences from the kernel module:
+//  - A thread that has been idle for more than about half the 20-bit 
+//    timestamp range (10 msec on x86) starts a new block on its next event,
+//    since there are no timer interrupts to carry the high time bits along.
+//  - At most kMaxUserCpus threads are traced; events from any more are dropped.
+//  - The IPC flag is ignored.
+
+#if defined(KUTRACE_USERMODE)
+static const bool kUserModeDefault = true;
+#else
+static const bool kUserModeDefault = false;
+#endif
+
+// Virtual CPU numbers go in the one-byte CPU field of each block's first word
+static const int kMaxUserCpus = 256;
+
+// Default user-mode trace buffer size
+static const int kDefaultUserModeMB = 64;
+
+// Version number reported by the user-mode backend (has GETBLOCK)
+static const u64 kUserModeVersionNumber = 4;
+
+// Start a new block if a thread has been quiet for this many counts
+static const u64 kMaxUserGap = 0x80000;
+
+// Per-thread insertion state. When generation is behind user_generation, a 
+// reset or flush has happened and the thread must claim a new block.
+typedef struct {
+  u64* next;		// Next free word in this thread's current block
+  u64* limit;		// One past the end of the current block
+  u64 prior_cycles;	// Time of the most recent insert
+  u32 generation;	// Value of user_generation when the block was claimed
+  int cpu;		// Virtual CPU number, -1 if not yet assigned
+  int tid;		// Linux thread id
+} UserThread;
+
+static __thread UserThread user_thread = {NULL, NULL, 0, 0, -1, 0};
+
+int user_mode = -1;		// -1 = not yet decided
+u64* user_buffer = NULL;	// user_blockcount blocks of kTraceBufSize words
+u64 user_blockcount = 0;
+u64 user_next_block = 0;	// Monotonic; wraps via modulo when DO_WRAP
+u32 user_generation = 1;
+int user_next_cpu = 0;
+volatile u64 user_tracing = 0;	// Also the tracing-enabled word
+bool user_do_wrap = false;
+u64 user_dropped = 0;
+
+// Decide once whether to use the user-mode backend
+inline bool UserMode() {
+  if (user_mode < 0) {
+    const char* env = getenv("KUTRACE_USERMODE");
+    if (env == NULL) {
+      user_mode = kUserModeDefault ? 1 : 0;
+    } else {
+      user_mode = ((env[0] != '\0') && (strcmp(env, "0") != 0)) ? 1 : 0;
+    }
+  }
+  return (user_mode != 0);
+}
+
+// Allocate the user-mode trace buffer, once
+void UserAllocBuffer() {
+  if (user_buffer != NULL) {return;}
+  int mb = kDefaultUserModeMB;
+  const char* env = getenv("KUTRACE_USERMODE_MB");
+  if (env != NULL) {mb = atoi(env);}
+  if (mb < 1) {mb = 1;}
+  user_blockcount = mb * 16;	// 16 64KB blocks per MB
+  user_buffer = (u64*)calloc(user_blockcount * kTraceBufSize, sizeof(u64));
+  if (user_buffer == NULL) {
+    fprintf(stderr, "KUtrace user mode: could not allocate %dMB\n", mb);
+    user_blockcount = 0;
+  }
+}
+
+// Claim and initialize a new trace block for the calling thread.
+// Returns false if there is no room (tracing is then turned off, as the 
+// kernel module does) or no virtual CPU number is available.
+bool UserNewBlock(UserThread* ut, u64 now) {
+  if (ut->cpu < 0) {
+    ut->cpu = __atomic_fetch_add(&user_next_cpu, 1, __ATOMIC_RELAXED);
+    ut->tid = syscall(SYS_gettid);
+  }
+  ut->next = ut->limit = NULL;
+  ut->generation = user_generation;
+  if ((kMaxUserCpus <= ut->cpu) || (user_buffer == NULL)) {return false;}
+
+  u64 b = __atomic_fetch_add(&user_next_block, 1, __ATOMIC_RELAXED);
+  if (user_blockcount <= b) {
+    if (!user_do_wrap) {
+      user_tracing = false;
+      return false;
+    }
+    // Wraparound keeps block 0, which has the initial names
+    b = 1 + ((b - 1) % (user_blockcount - 1));
+  }
+
+  u64* block = &user_buffer[b * kTraceBufSize];
+  memset(block, 0, kTraceBufSize * sizeof(u64));
+  block[0] = ((u64)ut->cpu << 56) | (now & CLU(0x00ffffffffffffff));
+  block[1] = user_do_wrap ? (WRAP_Flag << 56) : 0;
+  // The very first block has six more words, filled in by DoDump
+  int k = (b == 0) ? 8 : 2;
+  // Then PID and pidname, just like the module
+  block[k + 0] = ut->tid;
+  block[k + 1] = 0;
+  prctl(PR_GET_NAME, (char*)&block[k + 2]);	// 16 bytes max
+  ut->next = &block[k + 4];
+  ut->limit = &block[kTraceBufSize];
+  return true;
+}
+
+// Insert n words at entry, timestamping the first one.
+// Returns n, or 0 if not inserted.
+u64 UserInsert(const u64* entry, int n, bool force) {
+  if (!user_tracing && !force) {return 0;}
+  UserThread* ut = &user_thread;
+  u64 now = ku_get_cycles();
+  if ((ut->generation != user_generation) || 
+      ((ut->limit - ut->next) < n) ||
+      ((now - ut->prior_cycles) >= kMaxUserGap)) {
+    // Rest of any old block is already zero, i.e. NOPs
+    if (!UserNewBlock(ut, now)) {
+      __atomic_fetch_add(&user_dropped, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+  ut->prior_cycles = now;
+  ut->next[0] = ((now & CLU(0xFFFFF)) << 44) | (entry[0] & CLU(0x00000FFFFFFFFFFF));
+  for (int i = 1; i < n; ++i) {ut->next[i] = entry[i];}
+  ut->next += n;
+  return n;
+}
+
+// The user-mode equivalent of the kutrace_control system call
+u64 UserControl(u64 command, u64 arg) {
+  // Complemented INSERT1/INSERTN insert even with tracing off
+  bool force = false;
+  if ((s64)command < 0) {command = ~command; force = true;}
+  switch (command) {
+  case KUTRACE_CMD_OFF:
+    user_tracing = false;
+    return 0;
+  case KUTRACE_CMD_ON:
+    UserAllocBuffer();
+    user_tracing = (user_buffer != NULL);
+    return user_tracing ? 1 : 0;
+  case KUTRACE_CMD_FLUSH:
+    // Every thread moves on to a new block. Unused words are already zero.
+    __atomic_fetch_add(&user_generation, 1, __ATOMIC_RELAXED);
+    return 0;
+  case KUTRACE_CMD_RESET:
+    UserAllocBuffer();
+    user_tracing = false;
+    user_do_wrap = ((arg & DO_WRAP) != 0);
+    user_next_block = 0;
+    user_dropped = 0;
+    __atomic_fetch_add(&user_generation, 1, __ATOMIC_RELAXED);
+    return 0;
+  case KUTRACE_CMD_STAT:
+    return (user_next_block < user_blockcount) ? user_next_block : user_blockcount;
+  case KUTRACE_CMD_GETCOUNT:
+    if (user_blockcount < user_next_block) {return ~(user_blockcount * kTraceBufSize);}
+    return user_next_block * kTraceBufSize;
+  case KUTRACE_CMD_GETWORD:
+    if ((user_buffer == NULL) || ((user_blockcount * kTraceBufSize) <= arg)) {return 0;}
+    return user_buffer[arg];
+  case KUTRACE_CMD_INSERT1:
+    return UserInsert(&arg, 1, force);
+  case KUTRACE_CMD_INSERTN: {
+    const u64* entry = (const u64*)arg;
+    int n = (entry[0] >> 36) & 0x0F;		// Length nibble of event number
+    if ((n < 1) || (8 < n)) {n = 1;}
+    return UserInsert(entry, n, force);
+  }
+  case KUTRACE_CMD_GETIPCWORD:
+    return 0;
+  case KUTRACE_CMD_TEST:
+    return user_tracing ? 1 : 0;
+  case KUTRACE_CMD_VERSION:
+    return kUserModeVersionNumber;
+  case KUTRACE_CMD_GETPOSITION: {
+    u64* args = (u64*)arg;
+    args[0] = user_next_block;
+    args[1] = user_blockcount;
+    return 1;
+  }
+  case KUTRACE_CMD_GETBLOCK: {
+    const u64* args = (const u64*)arg;
+    if ((user_buffer == NULL) || ((user_blockcount * kTraceBufSize) < (args[0] + args[1]))) {return 0;}
+    memcpy((u64*)args[2], &user_buffer[args[0]], args[1] * sizeof(u64));
+    return args[1];
+  }
+  default:
+    // Includes GETIPCBLOCK: there is no IPC data in user mode
+    return 0;
+  }
+}
+
+//--------------------------------------------------------------------------//
+// End user-mode backend                                                    //
+//--------------------------------------------------------------------------//
+
+
 // For the trace_control system call,
 // arg is declared to be u64. In reality, it is either a u64 or
 // a pointer to a u64, depending on the command. Caller casts as
@@ -123,7 +363,7 @@ void GetTimePair(int64* cycles, int64* usec) {
 #if defined(__ARM_ARCH_ISA_ARM) && !defined(__aarch64__)
 
 #define noinline        __attribute__((noinline))
-u64 noinline DoControl(u64 command, u64 arg)
+u64 noinline KernelControl(u64 command, u64 arg)
 {
 	/* gcc -O2 removes all the crap and makes 5 instructions! */
 	/* str r7; ldr r7; swi; ldr r7; bx */
@@ -148,13 +388,53 @@ u64 noinline DoControl(u64 command, u64 arg)
 
 #else
 
-u64 inline DoControl(u64 command, u64 arg)
+u64 inline KernelControl(u64 command, u64 arg)
 {
   return syscall(__NR_kutrace_control, command, arg);
 }
 
 #endif
 
+// All control commands go through here, to the kernel module or to the 
+// user-mode backend
+u64 inline DoControl(u64 command, u64 arg)
+{
+  if (UserMode()) {return UserControl(command, arg);}
+  return KernelControl(command, arg);
+}
+
+// The tracing-enabled word lets marks and events skip the system call when
+// tracing is off. Until we know better, it points at a constant 1, meaning
+// "maybe on, ask the module"; the first slow-path call maps the real word.
+// A stale read just means an event or two at the edges of on/off goes one 
+// way or the other, the same as racing with the control call itself.
+static const u64 kMaybeTracing = 1;
+const volatile u64* tracing_word = &kMaybeTracing;
+bool tracing_word_mapped = false;
+
+void MapTracingWord() {
+  tracing_word_mapped = true;
+  if (UserMode()) {
+    tracing_word = &user_tracing;
+    return;
+  }
+  int fd = open(KUTRACE_STATE_DEVICE, O_RDONLY);
+  if (fd < 0) {return;}			// Older module: always ask
+  void* p = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {return;}
+  tracing_word = (const volatile u64*)p;
+}
+
+// Fast check before building an event. False means tracing is surely off.
+inline bool MaybeTracing() {
+  if (*tracing_word != 0) {
+    if (!tracing_word_mapped) {MapTracingWord(); return (*tracing_word != 0);}
+    return true;
+  }
+  return false;
+}
+
 // X86-64 inline version
 //    u64 retval;
 //    asm volatile
@@ -166,6 +446,311 @@ u64 inline DoControl(u64 command, u64 arg)
 //    );
 //    return retval;
 
+// Per-thread staging of one-word events, inserted as a single KUTRACE_BATCH 
+// entry via INSERTN. words[0] is the batch header, words[1..7] staged events.
+typedef struct {
+  u64 words[8];
+  int count;		// Number of staged events, 0..7
+  int depth;		// Nesting of batch_begin/batch_end; staging if > 0
+  u64 first_cycles;	// Time of the oldest staged event
+} BatchState;
+
+static __thread BatchState batch_state;
+
+// Staged events keep their own timestamps, which are earlier than the 
+// timestamp on the batch header and possibly earlier than kernel entries
+// written in between. rawtoevent allows 4096 counts of going backwards 
+// before it decides the 20-bit time wrapped, so never hold events longer 
+// than half that.
+static const u64 kMaxBatchAge = 2048;
+
+// Insert any staged events for this thread
+void FlushBatch() {
+  BatchState* bs = &batch_state;
+  if (bs->count == 0) {return;}
+  u64 now = ku_get_cycles();
+  if ((now - bs->first_cycles) > kMaxBatchAge) {
+    // Too old to keep their original times safely; use the current time
+    for (int i = 1; i <= bs->count; ++i) {
+      bs->words[i] = ((now & CLU(0xFFFFF)) << 44) | 
+                     (bs->words[i] & CLU(0x00000FFFFFFFFFFF));
+    }
+  }
+  u64 n_with_length = KUTRACE_BATCH + ((bs->count + 1) << 4);
+  //                   T               N                       ARG
+  bs->words[0] = (CLU(0) << 44) | (n_with_length << 32) | bs->count;
+  DoControl(KUTRACE_CMD_INSERTN, (u64)&bs->words[0]);
+  bs->count = 0;
+}
+
+// Stage one event word with the current time in its timestamp field
+void StageEvent(u64 entry) {
+  BatchState* bs = &batch_state;
+  u64 now = ku_get_cycles();
+  if ((bs->count > 0) && ((now - bs->first_cycles) > kMaxBatchAge)) {FlushBatch();}
+  if (bs->count == 0) {bs->first_cycles = now;}
+  bs->words[++bs->count] = ((now & CLU(0xFFFFF)) << 44) | (entry & CLU(0x00000FFFFFFFFFFF));
+  if (bs->count == 7) {FlushBatch();}
+}
+
+void BatchBegin() {
+  ++batch_state.depth;
+}
+
+void BatchEnd() {
+  if (batch_state.depth == 0) {return;}
+  if (--batch_state.depth == 0) {FlushBatch();}
+}
+
+//--------------------------------------------------------------------------//
+// Sampled RPC tracing                                                      //
+//--------------------------------------------------------------------------//
+//
+// At high RPC rates the user-level entries for each RPC (method name, RPC 
+// ids, RX_USER/TX_USER hashes, marks) are much of the tracing overhead. With
+// a sample rate of n, a thread working on an RPC outside the sample holds 
+// those entries in a small per-thread buffer instead of inserting them. 
+// If that RPC is still going after slow_usec, the held entries go into the
+// trace with their original times and the rest of the RPC is traced as 
+// usual, so slow RPCs are always kept. Otherwise the held entries are 
+// dropped when the RPC ends (rpcid 0, whose entry is held too) or the thread
+// moves on to another RPC, and entries after that go in as usual.
+//
+// Held entries go in as KUTRACE_BATCH containers whose header says how far
+// back their times are. They land in the trace of whatever CPU the thread is
+// on when the RPC turns slow, normally the CPU it was on all along.
+//
+// The rate goes into each trace once, as a KUTRACE_RPCSAMPLE entry just 
+// ahead of the first sampled RPC, for spantoprof to scale its RPC totals.
+//
+
+static const int kMaxHoldWords = 48;
+static const u64 kMaxHoldGap = CLU(0x80000);	// Half a 20-bit timestamp wrap
+static const u64 kMaxHoldBack = CLU(0xFFFFFF);	// In units of 256 counts
+static const int kDefaultSlowUsec = 1000;
+
+typedef struct {
+  bool env_checked;
+  int n;		// Keep about one RPC in n; 1 keeps all
+  int slow_usec;
+  int generation;	// rpc_generation whose trace has the rate entry
+} RpcSampling;
+
+RpcSampling sampling = {false, 1, kDefaultSlowUsec, 0};
+
+typedef struct {
+  int generation;	// rpc_generation when rpcid was decided, else 0
+  u64 rpcid;		// Low 16 bits only
+  bool holding;		// Outside the sample and not yet slow
+  bool ending;		// rpcid 0 seen; its entry is the last one held
+  int64 start_usec;	// When this thread started on rpcid
+  int count;		// Held words
+  u64 words[kMaxHoldWords];
+  u64 cycles[kMaxHoldWords];	// Full time at each entry's first word
+  uint8 len[kMaxHoldWords];	// Entry length at its first word, else 0
+} RpcSampleState;
+
+static __thread RpcSampleState rpc_sample_state;
+
+void RpcSampleRate(int n, int slow_usec) {
+  sampling.n = (n > 1) ? n : 1;
+  sampling.slow_usec = (slow_usec >= 0) ? slow_usec : kDefaultSlowUsec;
+  sampling.env_checked = true;
+}
+
+// Every RPC is traced unless set here or from the environment
+inline int RpcSampleN() {
+  if (!sampling.env_checked) {
+    const char* env = getenv("KUTRACE_RPC_SAMPLE");
+    const char* comma = (env != NULL) ? strchr(env, ',') : NULL;
+    if (env != NULL) {RpcSampleRate(atoi(env), (comma != NULL) ? atoi(comma + 1) : -1);}
+    sampling.env_checked = true;
+  }
+  return sampling.n;
+}
+
+// Insert the held entries, oldest first, then trace this RPC normally
+void RpcSampleRelease(RpcSampleState* ss) {
+  ss->holding = false;
+  ss->ending = false;
+  if (ss->count == 0) {return;}
+  FlushBatch();		// Anything staged predates the hold
+  u64 now = ku_get_cycles();
+  u64 temp[8];
+  int i = 0;
+  while (i < ss->count) {
+    // Whole entries, each less than kMaxHoldGap after the one before
+    u64 first = ss->cycles[i];
+    u64 prior = first;
+    int n = 0;
+    while ((i < ss->count) && ((n + ss->len[i]) <= 7) && ((ss->cycles[i] - prior) < kMaxHoldGap)) {
+      memcpy(&temp[1 + n], &ss->words[i], ss->len[i] * sizeof(u64));
+      prior = ss->cycles[i];
+      n += ss->len[i];
+      i += ss->len[i];
+    }
+    u64 back = (now - first) >> 8;
+    if (back > kMaxHoldBack) {continue;}	// Too old to place; drop
+    u64 n_with_length = KUTRACE_BATCH + ((n + 1) << 4);
+    //          T             N                       ARG
+    temp[0] = (CLU(0) << 44) | (n_with_length << 32) | (back << 8) | n;
+    DoControl(KUTRACE_CMD_INSERTN, (u64)&temp[0]);
+  }
+  ss->count = 0;
+}
+
+// If the thread is holding entries for an RPC that has turned out slow,
+// insert them now
+inline void RpcSampleCheck(RpcSampleState* ss) {
+  if (!ss->holding) {return;}
+  if (ss->generation != rpc_generation) {
+    ss->holding = false;
+    ss->ending = false;
+    ss->count = 0;
+    return;
+  }
+  if ((GetUsec() - ss->start_usec) >= sampling.slow_usec) {RpcSampleRelease(ss);}
+}
+
+// The held RPC has ended with the entry just held. Insert everything if the
+// RPC was slow, else drop it. Either way the thread is no longer holding, 
+// and the next RPC, even the same id again, is decided afresh
+void RpcSampleEnd(RpcSampleState* ss) {
+  if ((GetUsec() - ss->start_usec) >= sampling.slow_usec) {
+    RpcSampleRelease(ss);
+  } else {
+    ss->holding = false;
+    ss->ending = false;
+    ss->count = 0;
+  }
+  ss->generation = 0;
+}
+
+// Decide whether the calling thread's entries for rpcid go into the trace.
+// Repeats for the same RPC just check for a slow RPC. rpcid 0 ends a held
+// RPC at the next entry, normally its RPCIDREQ 0
+void RpcSample(u64 rpcid) {
+  RpcSampleState* ss = &rpc_sample_state;
+  rpcid &= 0xFFFF;
+  bool known = (ss->generation == rpc_generation);
+  if (rpcid == 0) {
+    RpcSampleCheck(ss);
+    if (ss->holding) {ss->ending = true;}
+    return;
+  }
+  if (known && (ss->rpcid == rpcid)) {RpcSampleCheck(ss); return;}
+  int n = RpcSampleN();
+  if ((n <= 1) && !ss->holding) {return;}
+
+  // A different RPC. Anything still held was for a fast one
+  ss->generation = rpc_generation;
+  ss->rpcid = rpcid;
+  ss->count = 0;
+  ss->holding = !kutrace::rpc_in_sample(rpcid, n);
+  ss->ending = false;
+  ss->start_usec = GetUsec();
+
+  if (ss->holding || !MaybeTracing()) {return;}
+  if (__atomic_load_n(&sampling.generation, __ATOMIC_RELAXED) == rpc_generation) {return;}
+  //          T             N                                 ARG
+  u64 temp = (CLU(0) << 44) | ((u64)KUTRACE_RPCSAMPLE << 32) | n;
+  if ((s64)DoControl(KUTRACE_CMD_INSERT1, temp) > 0) {
+    __atomic_store_n(&sampling.generation, rpc_generation, __ATOMIC_RELAXED);
+  }
+}
+
+// Returns true if the n-word entry was held (or dropped when the buffer is
+// full) rather than being for the trace right now
+bool RpcSampleHold(const u64* entry, int n) {
+  RpcSampleState* ss = &rpc_sample_state;
+  if (!ss->holding) {return false;}
+  RpcSampleCheck(ss);
+  if (!ss->holding) {return false;}
+  if ((n <= 7) && ((ss->count + n) <= kMaxHoldWords)) {
+    u64 now = ku_get_cycles();
+    ss->cycles[ss->count] = now;
+    ss->len[ss->count] = n;
+    ss->words[ss->count] = ((now & CLU(0xFFFFF)) << 44) | (entry[0] & CLU(0x00000FFFFFFFFFFF));
+    for (int i = 1; i < n; ++i) {
+      ss->len[ss->count + i] = 0;
+      ss->words[ss->count + i] = entry[i];
+    }
+    ss->count += n;
+  }
+  if (ss->ending) {RpcSampleEnd(ss);}
+  return true;
+}
+
+//--------------------------------------------------------------------------//
+// End sampled RPC tracing                                                  //
+//--------------------------------------------------------------------------//
+
+// Name interning. client4 and queuetest add a method name for every RPC and
+// mutex2 adds a lock name at every contended acquire, so long traces used to
+// fill with duplicate name entries. addname now remembers what it has put 
+// into this trace in a lock-free open-addressing table keyed by a hash of 
+// (event type, number, name), and skips exact repeats.
+//
+// A name is recorded only after its INSERTN succeeds, so names offered while 
+// tracing is off are not lost. Two threads adding the same new name at once 
+// may both insert it, which is harmless. Names are re-inserted after about a 
+// second, so wraparound traces and snapshots that have lost the first copy 
+// still mostly get one. DoReset empties the table. If the table fills, 
+// further names are simply always inserted.
+static const int kInternSlots = 16384;		// Power of two
+static const int kInternProbes = 16;
+static const u64 kInternRefreshCycles = CLU(1) << 26;
+
+u64 intern_keys[kInternSlots];			// 0 = empty slot
+u64 intern_cycles[kInternSlots];		// When last inserted
+
+void InternReset() {
+  memset(intern_keys, 0, sizeof(intern_keys));
+  memset(intern_cycles, 0, sizeof(intern_cycles));
+}
+
+// FNV-1a over the name, then mix in event type (minus length) and number
+u64 InternKey(u64 eventnum, u64 number, const char* name, int bytelen) {
+  u64 hash = CLU(0xcbf29ce484222325);
+  for (int i = 0; i < bytelen; ++i) {
+    hash = (hash ^ (uint8)name[i]) * CLU(0x100000001b3);
+  }
+  hash ^= ((eventnum & 0xF0F) << 32) | (number & CLU(0xFFFFFFFF));
+  // Murmur3 finalizer
+  hash ^= (hash >> 33);
+  hash *= CLU(0xff51afd7ed558ccd);
+  hash ^= (hash >> 33);
+  return (hash == 0) ? 1 : hash;
+}
+
+// True if this name went into the trace recently
+bool InternSeen(u64 key, u64 now) {
+  for (int i = 0; i < kInternProbes; ++i) {
+    int k = (key + i) & (kInternSlots - 1);
+    u64 slotkey = __atomic_load_n(&intern_keys[k], __ATOMIC_RELAXED);
+    if (slotkey == 0) {return false;}
+    if (slotkey == key) {
+      return (now - __atomic_load_n(&intern_cycles[k], __ATOMIC_RELAXED)) < kInternRefreshCycles;
+    }
+  }
+  return false;
+}
+
+void InternRecord(u64 key, u64 now) {
+  for (int i = 0; i < kInternProbes; ++i) {
+    int k = (key + i) & (kInternSlots - 1);
+    u64 expected = 0;
+    __atomic_compare_exchange_n(&intern_keys[k], &expected, key, false, 
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    // expected is now the previous contents: 0 if we claimed it
+    if ((expected == 0) || (expected == key)) {
+      __atomic_store_n(&intern_cycles[k], now, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+  // Full around here. Not recording just means inserting again next time
+}
+
 // Sleep for n milliseconds
 void msleep(int msec) {
   struct timespec ts;
@@ -294,9 +879,303 @@ bool DoTest() {
   return (retval == 1);
 }
 
+//--------------------------------------------------------------------------//
+// Time calibration                                                         //
+//--------------------------------------------------------------------------//
+//
+// One start/stop slope lets late timestamps in a long trace drift by however
+// much the cycle counter and gettimeofday disagree. Instead, a low-priority
+// thread samples (cycles, usec) pairs about once a second while tracing is
+// on, and each dumped block gets its own piecewise-linear mapping from the
+// samples around it. See KUTRACE_CAL_MAGIC in kutrace_lib.h for the format.
+//
+
+static const int kCalSampleMsec = 1000;
+
+typedef struct {
+  int64 cycles;
+  int64 usec;
+} CalSample;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+  pthread_t sampler;
+  bool running;
+  bool stopping;
+  std::vector<CalSample> samples;	// Sorted by cycles
+} CalState;
+
+static CalState cal = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+void CalAdd(int64 cycles, int64 usec) {
+  if (usec == 0) {return;}
+  CalSample s = {cycles, usec};
+  pthread_mutex_lock(&cal.mutex);
+  // Nearly always appends; a snapshot or stop pair can race the sampler
+  int k = cal.samples.size();
+  while ((0 < k) && (cycles < cal.samples[k - 1].cycles)) {--k;}
+  if ((k == 0) || (cal.samples[k - 1].cycles != cycles)) {
+    cal.samples.insert(cal.samples.begin() + k, s);
+  }
+  pthread_mutex_unlock(&cal.mutex);
+}
+
+void CalReset() {
+  pthread_mutex_lock(&cal.mutex);
+  cal.samples.clear();
+  pthread_mutex_unlock(&cal.mutex);
+}
+
+// Sampler thread: one time pair per kCalSampleMsec until told to stop
+void* CalSampler(void* arg) {
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);	// Low priority
+  pthread_mutex_lock(&cal.mutex);
+  while (!cal.stopping) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += kCalSampleMsec / 1000;
+    ts.tv_nsec += (kCalSampleMsec % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {ts.tv_sec += 1; ts.tv_nsec -= 1000000000;}
+    pthread_cond_timedwait(&cal.wakeup, &cal.mutex, &ts);
+    if (cal.stopping) {break;}
+    pthread_mutex_unlock(&cal.mutex);
+    int64 cycles, usec;
+    GetTimePair(&cycles, &usec);
+    CalAdd(cycles, usec);
+    pthread_mutex_lock(&cal.mutex);
+  }
+  pthread_mutex_unlock(&cal.mutex);
+  return NULL;
+}
+
+void CalStart() {
+  if (cal.running) {return;}
+  cal.stopping = false;
+  cal.running = (pthread_create(&cal.sampler, NULL, CalSampler, NULL) == 0);
+}
+
+void CalStop() {
+  if (!cal.running) {return;}
+  pthread_mutex_lock(&cal.mutex);
+  cal.stopping = true;
+  pthread_cond_signal(&cal.wakeup);
+  pthread_mutex_unlock(&cal.mutex);
+  pthread_join(cal.sampler, NULL);
+  cal.running = false;
+}
+
+// Map cycles to usec along the calibration segment containing them,
+// extending the first or last segment outside the sampled range.
+// Returns false if there are not yet two samples.
+bool CalLookup(int64 cycles, double* usec, double* slope) {
+  pthread_mutex_lock(&cal.mutex);
+  int n = cal.samples.size();
+  if (n < 2) {
+    pthread_mutex_unlock(&cal.mutex);
+    return false;
+  }
+  int k = 1;
+  while ((k < n - 1) && (cal.samples[k].cycles <= cycles)) {++k;}
+  const CalSample& a = cal.samples[k - 1];
+  const CalSample& b = cal.samples[k];
+  *slope = (b.usec - a.usec) * 1.0 / (b.cycles - a.cycles);
+  *usec = a.usec + (cycles - a.cycles) * *slope;
+  pthread_mutex_unlock(&cal.mutex);
+  return true;
+}
+
+//--------------------------------------------------------------------------//
+// CPU frequency sampler                                                    //
+//--------------------------------------------------------------------------//
+//
+// For kernels that do not emit KUTRACE_PSTATE themselves. A low-priority 
+// thread polls every CPU's clock rate and inserts a PSTATE entry whenever one
+// changes. The entry lands in the sampler's own CPU block, so its arg names
+// the CPU it is about:
+// +-------------------+-----------+---------------+---------------+
+// | timestamp         | PSTATE    |  target CPU+1 |     MHz       |
+// +-------------------+-----------+---------------+---------------+
+//          20              12             16             16
+// APERF/MPERF through the msr driver give the average rate while running
+// over each interval; otherwise we read cpufreq's scaling_cur_freq.
+// Off unless kutrace::freq_sampler(msec) or KUTRACE_FREQ_MSEC=<msec>.
+//
+
+u64 DoEvent(u64 eventnum, u64 arg);	// Below
+
+static const int kMsrTsc = 0x10;
+static const int kMsrMperf = 0xE7;
+static const int kMsrAperf = 0xE8;
+
+typedef struct {
+  int msr_fd;		// /dev/cpu/<n>/msr, or -1
+  int cpufreq_fd;	// scaling_cur_freq, or -1
+  u64 prior_tsc;
+  u64 prior_mperf;
+  u64 prior_aperf;
+  int64 prior_usec;
+  u64 mhz;		// Last one inserted, 0 if none yet
+} FreqCpu;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t wakeup;
+  pthread_t sampler;
+  bool running;
+  bool stopping;
+  int msec;		// Sample period, 0 = off, -1 = not set yet
+  std::vector<FreqCpu> cpus;
+} FreqState;
+
+static FreqState freq = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 
+                         false, false, -1};
+
+bool ReadMsr(int fd, int msr, u64* value) {
+  return pread(fd, value, sizeof(u64), msr) == sizeof(u64);
+}
+
+void FreqOpen() {
+  int ncpus = sysconf(_SC_NPROCESSORS_CONF);
+  freq.cpus.resize(ncpus);
+  int msr_count = 0;
+  int cpufreq_count = 0;
+  for (int cpu = 0; cpu < ncpus; ++cpu) {
+    FreqCpu* fc = &freq.cpus[cpu];
+    memset(fc, 0, sizeof(FreqCpu));
+    char fname[256];
+    sprintf(fname, "/dev/cpu/%d/msr", cpu);
+    fc->msr_fd = open(fname, O_RDONLY);
+    u64 unused;
+    if ((0 <= fc->msr_fd) && !ReadMsr(fc->msr_fd, kMsrAperf, &unused)) {
+      close(fc->msr_fd);
+      fc->msr_fd = -1;
+    }
+    sprintf(fname, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_cur_freq", cpu);
+    fc->cpufreq_fd = (fc->msr_fd < 0) ? open(fname, O_RDONLY) : -1;
+    if (0 <= fc->msr_fd) {++msr_count;}
+    if (0 <= fc->cpufreq_fd) {++cpufreq_count;}
+  }
+  if ((msr_count + cpufreq_count) == 0) {
+    fprintf(stderr, "kutrace: no msr or cpufreq access, no CPU frequency samples\n");
+  }
+}
+
+void FreqClose() {
+  for (int cpu = 0; cpu < freq.cpus.size(); ++cpu) {
+    if (0 <= freq.cpus[cpu].msr_fd) {close(freq.cpus[cpu].msr_fd);}
+    if (0 <= freq.cpus[cpu].cpufreq_fd) {close(freq.cpus[cpu].cpufreq_fd);}
+  }
+  freq.cpus.clear();
+}
+
+// Current MHz for one CPU, or 0 if unknown this time
+u64 FreqSample(FreqCpu* fc) {
+  if (0 <= fc->msr_fd) {
+    u64 tsc, mperf, aperf;
+    int64 usec = GetUsec();
+    if (!ReadMsr(fc->msr_fd, kMsrTsc, &tsc) || !ReadMsr(fc->msr_fd, kMsrMperf, &mperf) ||
+        !ReadMsr(fc->msr_fd, kMsrAperf, &aperf)) {return 0;}
+    u64 delta_tsc = tsc - fc->prior_tsc;
+    u64 delta_mperf = mperf - fc->prior_mperf;
+    u64 delta_aperf = aperf - fc->prior_aperf;
+    int64 delta_usec = usec - fc->prior_usec;
+    bool first = (fc->prior_usec == 0);
+    fc->prior_tsc = tsc;
+    fc->prior_mperf = mperf;
+    fc->prior_aperf = aperf;
+    fc->prior_usec = usec;
+    // MPERF ticks at the TSC rate, but only while the CPU is not halted
+    if (first || (delta_usec <= 0) || (delta_mperf == 0)) {return 0;}
+    double tsc_mhz = delta_tsc * 1.0 / delta_usec;
+    return (u64)(tsc_mhz * delta_aperf / delta_mperf + 0.5);
+  }
+  if (0 <= fc->cpufreq_fd) {
+    char buf[32];
+    int n = pread(fc->cpufreq_fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0) {return 0;}
+    buf[n] = '\0';
+    return strtoull(buf, NULL, 10) / 1000;	// kHz
+  }
+  return 0;
+}
+
+void FreqInsert(int cpu, u64 mhz) {
+  DoEvent(KUTRACE_PSTATE, ((u64)(cpu + 1) << 16) | mhz);
+}
+
+// Sampler thread: every freq.msec, look for CPUs whose rate changed.
+// eventtospan takes a PSTATE as the rate since the prior one, so a change
+// inserts the old rate to close out its span; the new rate goes in at the 
+// next change or when the sampler stops.
+void* FreqSampler(void* arg) {
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);	// Low priority
+  pthread_mutex_lock(&freq.mutex);
+  while (!freq.stopping) {
+    pthread_mutex_unlock(&freq.mutex);
+    BatchBegin();
+    for (int cpu = 0; cpu < freq.cpus.size(); ++cpu) {
+      FreqCpu* fc = &freq.cpus[cpu];
+      u64 mhz = FreqSample(fc) & 0xffff;
+      if ((mhz == 0) || (mhz == fc->mhz)) {continue;}
+      FreqInsert(cpu, (fc->mhz != 0) ? fc->mhz : mhz);	// First one just starts a span
+      fc->mhz = mhz;
+    }
+    BatchEnd();
+    pthread_mutex_lock(&freq.mutex);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += freq.msec / 1000;
+    ts.tv_nsec += (freq.msec % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {ts.tv_sec += 1; ts.tv_nsec -= 1000000000;}
+    pthread_cond_timedwait(&freq.wakeup, &freq.mutex, &ts);
+  }
+  pthread_mutex_unlock(&freq.mutex);
+
+  // Close out the last span on each CPU
+  BatchBegin();
+  for (int cpu = 0; cpu < freq.cpus.size(); ++cpu) {
+    if (freq.cpus[cpu].mhz != 0) {FreqInsert(cpu, freq.cpus[cpu].mhz);}
+  }
+  BatchEnd();
+  return NULL;
+}
+
+void FreqSetPeriod(int msec) {
+  freq.msec = (msec < 0) ? 0 : msec;
+}
+
+void FreqStart() {
+  if (freq.msec < 0) {
+    const char* env = getenv("KUTRACE_FREQ_MSEC");
+    freq.msec = (env == NULL) ? 0 : atoi(env);
+  }
+  if (freq.running || (freq.msec <= 0)) {return;}
+  // The user-mode backend's CPUs are threads, not real CPUs
+  if (UserMode()) {return;}
+  FreqOpen();
+  freq.stopping = false;
+  freq.running = (pthread_create(&freq.sampler, NULL, FreqSampler, NULL) == 0);
+  if (!freq.running) {FreqClose();}
+}
+
+void FreqStop() {
+  if (!freq.running) {return;}
+  pthread_mutex_lock(&freq.mutex);
+  freq.stopping = true;
+  pthread_cond_signal(&freq.wakeup);
+  pthread_mutex_unlock(&freq.mutex);
+  pthread_join(freq.sampler, NULL);
+  freq.running = false;
+  FreqClose();
+}
+
 // Turn off tracing
 // Complain and return false if module is not loaded
 bool DoOff() {
+  FreqStop();
+  FlushBatch();
   u64 retval = DoControl(KUTRACE_CMD_OFF, 0);
 //fprintf(stderr, "DoOff DoControl = %016lx\n", retval);
 
@@ -308,6 +1187,8 @@ bool DoOff() {
   }
   // Get stop time pair with tracing off
   if (stop_usec == 0) {GetTimePair(&stop_cycles, &stop_usec);}
+  CalStop();
+  CalAdd(stop_cycles, stop_usec);
 //fprintf(stdout, "DoOff  GetTimePair %lx %lx\n", stop_cycles, stop_usec);
   return true;
 }
@@ -326,15 +1207,12 @@ bool DoOn() {
     fprintf(stderr, "KUtrace module/code not available\n");
     return false;
   }
+  CalAdd(start_cycles, start_usec);
+  CalStart();
+  FreqStart();
   return true;
 }
 
-void StripCRLF(char* s) {
-  int len = strlen(s);
-  if ((0 < len) && s[len - 1] == '\n') {s[len - 1] = '\0'; --len;}
-  if ((0 < len) && s[len - 1] == '\r') {s[len - 1] = '\0'; --len;}
-}
-
 
 // We want to run all this stuff at kutrace_control startup and/or at reset, but just once
 // per execution is sufficient once these values don't change until reboot.
@@ -354,110 +1232,187 @@ void StripCRLF(char* s) {
 //   Interrupt number to name mapping
 //
 
-// TODO: Get interrupt <number, name> pairs from /proc/interrupt
-// TODO: Get hostname from  system call gethostname
-// TODO: Get Ethernet link speed from /sys/class/net/*/speed
+// All of these use direct system calls and single reads of /proc and /sys
+// files -- no popen and no line-at-a-time stdio -- so the whole capture
+// step takes well under a millisecond.
+
+// Read up to len-1 bytes of a small /proc or /sys file with one read.
+// Returns the byte count, NUL-terminated, or 0 if the file is not there.
+int ReadSmallFile(const char* fname, char* buf, int len) {
+  buf[0] = '\0';
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {return 0;}
+  int n = read(fd, buf, len - 1);
+  close(fd);
+  if (n < 0) {n = 0;}
+  buf[n] = '\0';
+  return n;
+}
 
-/***
-// Get next interrupt description line from xxx, if any, and return 
-// interrupt number and name and return value of true.
-// If no more lines, return false
-//
+// Kernel version is what command uname -rv prints, release then version
+void GetKernelVersion(char* kernelversion, int len) {
+  kernelversion[0] = '\0';
+  struct utsname uts;
+  if (uname(&uts) != 0) {return;}
+  snprintf(kernelversion, len, "%s %s", uts.release, uts.version);
+}
+
+// Model name is in /proc/cpuinfo. The first CPU's description is near the 
+// front, so one read of the first few KB is enough.
+void GetModelName(char* modelname, int len) {
+  modelname[0] = '\0';
+  char buffer[8192];
+  if (ReadSmallFile("/proc/cpuinfo", buffer, sizeof(buffer)) == 0) {return;}
+  // Expecting something like
+  // model name	: ARMv7 Processor rev 3 (v7l)
+  const char* line = strstr(buffer, "model name");
+  if (line == NULL) {return;}
+  const char* colon = strchr(line, ':');
+  if (colon == NULL) {return;}
+  colon += 2;			// Skip the colon and the next space
+  const char* eol = strchr(colon, '\n');
+  int n = (eol == NULL) ? strlen(colon) : (eol - colon);
+  if (n > len - 1) {n = len - 1;}
+  memcpy(modelname, colon, n);
+  modelname[n] = '\0';
+}
+
+void GetHostName(char* hostname, int len) {
+  hostname[0] = '\0';
+  gethostname(hostname, len);
+  hostname[len - 1] = '\0';
+}
+
+// Ethernet link speed from /sys/class/net/*/speed. Take the fastest link 
+// that is up; interfaces that are down or virtual give an error or -1.
+// Returns 0 if none found.
+int GetMbitSec() {
+  DIR* dir = opendir("/sys/class/net");
+  if (dir == NULL) {return 0;}
+  int mbit_sec = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {continue;}
+    if (strcmp(entry->d_name, "lo") == 0) {continue;}
+    char fname[320];
+    char buffer[32];
+    snprintf(fname, sizeof(fname), "/sys/class/net/%s/speed", entry->d_name);
+    if (ReadSmallFile(fname, buffer, sizeof(buffer)) == 0) {continue;}
+    int speed = atoi(buffer);
+    if (mbit_sec < speed) {mbit_sec = speed;}
+  }
+  closedir(dir);
+  return mbit_sec;
+}
+
+// Interrupt number to name mapping for this machine, from /proc/interrupts.
 // Expecting:
-// cat /proc/interrupts
 //            CPU0       CPU1       
 //   0:         20          0   IO-APIC   2-edge      timer
 //   1:          3          0   IO-APIC   1-edge      i8042
 //   8:          1          0   IO-APIC   8-edge      rtc0
-
-bool NextIntr(FILE* procintrfile, int* intrnum, char* intrname) {
-  char buffer[kMaxBufferSize];
-  while (ReadLine(procintrfile, buffer, kMaxBufferSize)) {
-    int n = sscanf(buffer, "%d:", intrnum);
-    if (n != 1) {continue;}			// No intr on this line
-    const char* space = strrchr(buffer, ' ');
-    if (space == NULL) {continue;}		// No name on this line
-    if (space[1] == '\0') {continue;}		// Empty name on this line
-    strncpy(intrname, space + 1, kMaxBufferSize);
-    return true;
+// Lines without a number (NMI, LOC, ...) are skipped. The name is the last
+// blank-separated field. This overrides the built-in IrqNames table, which
+// is only right for the machine it came from.
+static const int kMaxLocalIrqs = 256;
+typedef struct {
+  int number;
+  char name[24];
+} LocalIrqName;
+
+LocalIrqName localirqnames[kMaxLocalIrqs];
+int localirqcount = 0;
+
+void GetLocalIrqNames() {
+  localirqcount = 0;
+  int fd = open("/proc/interrupts", O_RDONLY);
+  if (fd < 0) {return;}
+  // Lines get long with many CPUs; the whole file can be 100KB or more
+  int len = 0;
+  int size = 16384;
+  char* buffer = (char*)malloc(size);
+  if (buffer == NULL) {close(fd); return;}
+  int n;
+  while ((n = read(fd, buffer + len, size - 1 - len)) > 0) {
+    len += n;
+    if (len == size - 1) {
+      char* bigger = (char*)realloc(buffer, size * 2);
+      if (bigger == NULL) {break;}	// Keep what was read
+      buffer = bigger;
+      size *= 2;
+    }
   }
- 
-  return false;
-}
-
-// Litte code to read /proc/interrupts and capture names for each interrupt number
-// dsites 2017.12.15
-//
-// use InsertVariableEntry now 2020.11.12
-//
-void EmitLocalIrqNames(u64 n) {
-  FILE* procintrfile = fopen("/proc/interrupts", "r");
-  if (procintrfile == NULL) {return;}
-
-  u64 temp[9];		// One extra word for strcpy(56B + \n)
-  int intrnum;
-  char intrname[kMaxBufferSize];
-  while (NextIntr(procintrfile, &intrnum, intrname)) {
-    u64 bytelen = strlen(intrname);
-    if (bytelen > 55) {continue;}	// Error if too long. Drop
-    u64 wordlen = 1 + ((bytelen + 7) / 8);
-    // Build the initial word
-    u64 n_with_length = n + (wordlen * 16);
-    //         T             N                       ARG
-    temp[0] = (0ll << 44) | (n_with_length << 32) | (intrnum);
-    memset(&temp[1], 0, 8 * sizeof(u64));
-    strcpy((char*)&temp[1], intrname);
-    DoControl(~TRACE_INSERTN, (u64)&temp[0]);
+  close(fd);
+  buffer[len] = '\0';
+
+  char* line = buffer;
+  while ((line != NULL) && (*line != '\0') && (localirqcount < kMaxLocalIrqs)) {
+    char* eol = strchr(line, '\n');
+    if (eol != NULL) {*eol = '\0';}
+    int intrnum;
+    const char* space = strrchr(line, ' ');
+    if ((sscanf(line, "%d:", &intrnum) == 1) && (space != NULL) && (space[1] != '\0')) {
+      LocalIrqName* irq = &localirqnames[localirqcount++];
+      irq->number = intrnum;
+      strncpy(irq->name, space + 1, sizeof(irq->name));
+      irq->name[sizeof(irq->name) - 1] = '\0';
+    }
+    line = (eol == NULL) ? NULL : eol + 1;
   }
-  fclose(procintrfile);
+  free(buffer);
 }
-***/
-
 
-// Kernel version is the result of command: uname -rv
-void GetKernelVersion(char* kernelversion, int len) {
-  kernelversion[0] = '\0';
-  FILE *fp = popen("uname -rv", "r");
-  if (fp == NULL) {return;}
-  char* s = fgets(kernelversion, len, fp);
-  pclose(fp);
-  if (s != NULL) {
-    StripCRLF(kernelversion);
-  }
+// Pack short name entries (and one-word events) into KUTRACE_BATCH 
+// containers, so DoInit needs a few dozen INSERTN calls instead of hundreds.
+// Each packed entry gets the current timestamp, since there is no kernel 
+// INSERTN to stamp it. Entries of 8 words do not fit and go in alone.
+typedef struct {
+  u64 words[8];
+  int count;		// Payload words, 0..7
+} InitPack;
+
+void PackFlush(InitPack* pack) {
+  if (pack->count == 0) {return;}
+  u64 n_with_length = KUTRACE_BATCH + ((pack->count + 1) << 4);
+  //                   T               N                       ARG
+  pack->words[0] = (CLU(0) << 44) | (n_with_length << 32) | pack->count;
+  DoControl(~KUTRACE_CMD_INSERTN, (u64)&pack->words[0]);
+  pack->count = 0;
 }
 
-// Model number is in /proc/cpuinfo
-void GetModelName(char* modelname, int len) {
-  modelname[0] = '\0';
-  FILE *cpuinfo = fopen("/proc/cpuinfo", "rb");
-  if (cpuinfo == NULL) {return;}
-  char *arg = NULL;
-  size_t size = 0;
-  while(getline(&arg, &size, cpuinfo) != -1)
-  {
-    // Expecting something like
-    // model name	: ARMv7 Processor rev 3 (v7l)
-    if(memcmp(arg, "model name", 10) == 0) {
-      const char* colon = strchr(arg, ':');
-      if (colon != NULL) {	// Skip the colon and the next space
-        StripCRLF(arg);
-        strncpy(modelname, colon + 2, len);
-        modelname[len - 1] = '\0';
-        break;			// Just the first one, then get out
-      }
-    }
+void PackEntry(InitPack* pack, const u64* entry, int wordlen) {
+  if (wordlen > 7) {
+    DoControl(~KUTRACE_CMD_INSERTN, (u64)entry);
+    return;
   }
-  free(arg);
-  fclose(cpuinfo);
+  if ((pack->count + wordlen) > 7) {PackFlush(pack);}
+  u64 now = ku_get_cycles();
+  pack->words[pack->count + 1] = ((now & CLU(0xFFFFF)) << 44) | 
+                                 (entry[0] & CLU(0x00000FFFFFFFFFFF));
+  memcpy(&pack->words[pack->count + 2], &entry[1], (wordlen - 1) * sizeof(u64));
+  pack->count += wordlen;
 }
 
-// Inserts result of uname -rv
-void InsertKernelVersion(const char* kernelversion) {
-  InsertVariableEntry(kernelversion, KUTRACE_KERNEL_VER, 0);
+// Same layout as InsertVariableEntry, but packed
+void PackVariableEntry(InitPack* pack, const char* str, u64 event, u64 arg) {
+  u64 temp[8];		// Up to 56 bytes
+  u64 bytelen = strlen(str);
+  if (bytelen > 56) {bytelen = 56;}	// If too long, truncate
+  u64 wordlen = 1 + ((bytelen + 7) / 8);
+  u64 event_with_length = event + (wordlen * 16);
+  //         T               N                           ARG
+  temp[0] = (CLU(0) << 44) | (event_with_length << 32) | arg;
+  memset(&temp[1], 0, 7 * sizeof(u64));
+  memcpy((char*)&temp[1], str, bytelen);
+  PackEntry(pack, temp, wordlen);
 }
 
-void InsertModelName(const char* modelname) {
-  InsertVariableEntry(modelname, KUTRACE_MODEL_NAME, 0);
+void PackNames(InitPack* pack, const NumNamePair* ipair, u64 event) {
+  const NumNamePair* pair = ipair;
+  while (pair->name != NULL) {
+    PackVariableEntry(pack, pair->name, event, pair->number);
+    ++pair;
+  }
 }
 
 // Initialize trace buffer with syscall/irq/trap names
@@ -467,11 +1422,14 @@ void DoInit(const char* process_name) {
 //fprintf(stderr, "DoInit\n");
   if (!TestModule()) {return;}		// No module loaded
 
-  // AHHA. These take more than 10msec to execute. so 20-bit time can wrap.
-  // We need to capture the strings up front before creating the frist trace entry,
-  // then insert later.
-  GetKernelVersion(kernelversion, 256);		// Slow. Must do first
-  GetModelName(modelname, 256);			// Slow. Must do first
+  // Capture all the strings up front before creating the first trace entry,
+  // then insert them. This used to popen uname and take more than 10msec, 
+  // long enough for the 20-bit time to wrap.
+  GetKernelVersion(kernelversion, 256);
+  GetModelName(modelname, 256);
+  GetHostName(hostname, 256);
+  int mbit_sec = GetMbitSec();
+  GetLocalIrqNames();
   GetTimePair(&start_cycles, &start_usec);	// Now OK to look at time
 
 //fprintf(stderr, "DoInit GetTimePair %lx %lx\n", start_cycles, start_usec);
@@ -483,25 +1441,40 @@ void DoInit(const char* process_name) {
   // We want this to be the very first trace entry so we can find it easily
   InsertTimePair(start_cycles, start_usec); 
 
+  InitPack pack;
+  pack.count = 0;
+
   // A little trace environment information
-  InsertKernelVersion(kernelversion);
-  InsertModelName(modelname);
+  PackVariableEntry(&pack, kernelversion, KUTRACE_KERNEL_VER, 0);
+  PackVariableEntry(&pack, modelname, KUTRACE_MODEL_NAME, 0);
+  PackVariableEntry(&pack, hostname, KUTRACE_HOST_NAME, 0);
+  if (mbit_sec > 0) {
+    //         T             N                       ARG
+    u64 temp = (CLU(0) << 44) | ((u64)KUTRACE_MBIT_SEC << 32) | mbit_sec;
+    PackEntry(&pack, &temp, 1);
+  }
 
   // Put trap/irq/syscall names into front of trace
-  EmitNames(PidNames, KUTRACE_PIDNAME);
-  EmitNames(TrapNames, KUTRACE_TRAPNAME);
-  EmitNames(IrqNames, KUTRACE_INTERRUPTNAME);
-  EmitNames(Syscall64Names, KUTRACE_SYSCALL64NAME);
-  EmitNames(Syscall32Names, KUTRACE_SYSCALL32NAME);
+  PackNames(&pack, PidNames, KUTRACE_PIDNAME);
+  PackNames(&pack, TrapNames, KUTRACE_TRAPNAME);
+  PackNames(&pack, IrqNames, KUTRACE_INTERRUPTNAME);
+  // This machine's interrupt names, after the built-in ones so they win
+  for (int i = 0; i < localirqcount; ++i) {
+    PackVariableEntry(&pack, localirqnames[i].name, KUTRACE_INTERRUPTNAME, 
+                      localirqnames[i].number);
+  }
+  PackNames(&pack, Syscall64Names, KUTRACE_SYSCALL64NAME);
+  PackNames(&pack, Syscall32Names, KUTRACE_SYSCALL32NAME);
 
   // Put current pid name into front of real part of trace
   int pid = getpid() & 0x0000ffff;
-  InsertVariableEntry(process_name, KUTRACE_PIDNAME, pid);
+  PackVariableEntry(&pack, process_name, KUTRACE_PIDNAME, pid);
 
   // And then establish that pid on this CPU
   //         T             N                       ARG
   u64 temp = (CLU(0) << 44) | ((u64)KUTRACE_USERPID << 32) | (pid);
-  DoControl(~KUTRACE_CMD_INSERT1, temp);
+  PackEntry(&pack, &temp, 1);
+  PackFlush(&pack);
 }
 
 // With tracing off, zero out the rest of each partly-used traceblock
@@ -518,6 +1491,9 @@ void DoFlush() {
 void DoReset(u64 control_flags) {
   if (!TestModule()) {return;}		// No module loaded
   DoControl(KUTRACE_CMD_RESET, control_flags);
+  InternReset();	// Names need to go into the new trace
+  CalReset();
+  ++rpc_generation;
 
   start_usec = 0;
   stop_usec = 0;
@@ -539,8 +1515,10 @@ void DoStat(u64 control_flags) {
 
 // Called with the very first trace block, moduleversion >= 3
 // This block has 12 words on the front, then a 3-word TimePairNum trace entry
+static const int kTimePairWord = 12;	// In block 0
+
 void ExtractTimePair(u64* traceblock, int64* fallback_cycles, int64* fallback_usec) {
-  u64 entry0 =       traceblock[12];
+  u64 entry0 =       traceblock[kTimePairWord];
   u64 entry0_event = (entry0 >> 32) & 0xFFF;
   if ((entry0_event & 0xF0F) != KUTRACE_TIMEPAIR) {	// take out length nibble
     fprintf(stderr, "ExtractTimePair missing event\n");
@@ -548,8 +1526,8 @@ void ExtractTimePair(u64* traceblock, int64* fallback_cycles, int64* fallback_us
     *fallback_usec =   0;
     return;
   }
-  *fallback_cycles = traceblock[13];
-  *fallback_usec =   traceblock[14];
+  *fallback_cycles = traceblock[kTimePairWord + 1];
+  *fallback_usec =   traceblock[kTimePairWord + 2];
 }
 
 // F(cycles) gives usec = base_usec + (cycles - base_cycles) * m;
@@ -574,10 +1552,459 @@ int64 CyclesToUsec(int64 cycles, const CyclesToUsecParams& param) {
 
 
 
+// Copy count words starting at word number k into buf with a single 
+// GETBLOCK/GETIPCBLOCK call. Returns false if the module does not do bulk export.
+bool GetBlock(u64 command, u64 k, u64 count, u64* buf) {
+  u64 args[3];
+  args[0] = k;
+  args[1] = count;
+  args[2] = (u64)buf;
+  u64 retval = DoControl(command, (u64)&args[0]);
+  return (retval == count);
+}
+
+// Copy count words starting at word number k into buf.
+// Uses one bulk call if the module has it, else one GETWORD call per word.
+// *use_bulk is cleared the first time bulk export fails, so we only probe once.
+void GetWords(u64 bulk_command, u64 word_command, u64 k, u64 count, u64* buf, 
+              bool* use_bulk) {
+  if (*use_bulk) {
+    if (GetBlock(bulk_command, k, count, buf)) {return;}
+    *use_bulk = false;
+  }
+  for (int j = 0; j < count; ++j) {
+    buf[j] = DoControl(word_command, k++);
+  }
+}
+
+// Fill in the very first trace block: tracefile version, wrap flag, and the
+// start/stop time pairs. Also sets up params for the per-block gettimeofday.
+// The stop pair is passed in so snapshots can use their own.
+void FixupFirstBlock(u64* traceblock, bool did_wrap_around, 
+                     int64 stop_cycles, int64 stop_usec, CyclesToUsecParams* params) {
+  // Fill in the tracefile version 
+  traceblock[1] |= ((kTracefileVersionNumber & VERSION_MASK) << 56);
+  if (!did_wrap_around) {
+    // The kernel exports the wrap flag in the first block before 
+    // it is known whether the trace actually wrapped.
+    // It did not, so turn off that bit
+    traceblock[1] &= ~(WRAP_Flag << 56);
+  }
+  // Extract the fallback start timepair
+  int64 fallback_usec, fallback_cycles;
+  ExtractTimePair(traceblock, &fallback_cycles, &fallback_usec);
+  if (start_usec == 0) {
+    start_usec = fallback_usec;
+    start_cycles = fallback_cycles;
+  }
+
+  // For Arm-32, the "cycle" counter is only 32 bits at 54 MHz, so wraps about every 79 seconds.
+  // This can leave stop_cycles small by a few multiples of 4G. We do a temporary fix here
+  // for exactly 54 MHz. Later, we could find or take as input a different approximate
+  // frequency. We could also do something similar for a 40-bit counter.
+  bool has_32bit_cycles = ((start_cycles | stop_cycles) & 0xffffffff00000000llu) == 0;
+  if (has_32bit_cycles) {
+    uint64 elapsed_usec = (uint64)(stop_usec - start_usec);
+    uint64 elapsed_cycles = (uint64)(stop_cycles - start_cycles);
+    uint64 expected_cycles = elapsed_usec * mhz_32bit_cycles;
+    // Pick off the expected high bits
+    uint64 approx_hi = (start_cycles + expected_cycles) & 0xffffffff00000000llu;
+    // Put them in
+    stop_cycles |= (int64)approx_hi;
+    // Cross-check and change by 1 if right at a boundary
+    // and off by more than 12.5% from expected MHz
+    elapsed_cycles = (uint64)(stop_cycles - start_cycles);
+    uint64 ratio = elapsed_cycles / elapsed_usec;
+    if (ratio > (mhz_32bit_cycles + (mhz_32bit_cycles >> 3))) {stop_cycles -= 0x0000000100000000llu;}
+    if (ratio < (mhz_32bit_cycles - (mhz_32bit_cycles >> 3))) {stop_cycles += 0x0000000100000000llu;}
+    elapsed_cycles = (uint64)(stop_cycles - start_cycles);
+  }
+
+  // Get ready to reconstruct gettimeofday values for each traceblock
+  SetParams(start_cycles, start_usec, stop_cycles, stop_usec, params);
+
+  // Fill in the start/stop timepairs we are using, so
+  // downstream programs can also SetParams
+  traceblock[2] = start_cycles;
+  traceblock[3] = start_usec;
+  traceblock[4] = stop_cycles;
+  traceblock[5] = stop_usec;
+}
+
+// Fill in the gettimeofday value for this block in traceblock[1], and the
+// calibration word after its PID, so the block can be decoded on its own.
+// Uses the piecewise-linear calibration samples when there are any, else 
+// the single start/stop line in params (and then leaves the word zero).
+void SetBlockTime(u64* traceblock, bool very_first_block, const CyclesToUsecParams& params) {
+  int64 block_cycles = traceblock[0] & CLU(0x00ffffffffffffff);
+  int k = very_first_block ? 9 : 3;
+  traceblock[k] = 0;
+  bool has_32bit_cycles = (start_cycles & 0xffffffff00000000llu) == 0;
+  double usec, slope;
+  if (has_32bit_cycles || !CalLookup(block_cycles, &usec, &slope)) {
+    int64 block_usec = CyclesToUsec(block_cycles, params);
+    traceblock[1] |= (block_usec &  CLU(0x00ffffffffffffff));
+    return;
+  }
+  int64 block_usec = (int64)usec;
+  traceblock[1] |= (block_usec &  CLU(0x00ffffffffffffff));
+  u64 frac = (u64)((usec - block_usec) * 65536.0) & 0xffff;
+  double slope_fixed = slope * 1000.0 * (1 << 24);	// nsec per cycle << 24
+  if ((slope_fixed <= 0.0) || (CLU(0xffffffff) <= slope_fixed)) {return;}
+  traceblock[k] = (KUTRACE_CAL_MAGIC << 48) | (frac << 32) | (u64)slope_fixed;
+}
+
+//--------------------------------------------------------------------------//
+// Streaming dump                                                           //
+//--------------------------------------------------------------------------//
+//
+// Instead of a single DoDump after tracing stops, a low-priority drainer 
+// thread copies completed trace blocks out of the wraparound trace buffer 
+// while tracing runs, and appends them to the trace file. Trace length is 
+// then limited by disk space rather than by the size of the trace buffer.
+//
+// KUTRACE_CMD_GETPOSITION gives the number of blocks claimed since reset, 
+// which never wraps, plus the buffer size in blocks. Sequence number s is 
+// in buffer block s until the buffer wraps and in block 1 + (s-1) % (n-1)
+// after that; block 0 is never reused. A block is complete once its CPU has
+// claimed a later block. If the drainer falls more than n-1 blocks behind, 
+// the oldest blocks are overwritten before they are copied. Those are 
+// counted as dropped and reported at the end.
+//
+// The file format is what DoDump writes. Block 0 has to be first, but its 
+// start/stop time pairs are only known at the end, so its space is reserved 
+// up front and written last. The other blocks follow in the order they
+// complete. Output goes through two large page-aligned buffers: the drainer 
+// fills one while a writer thread writes the other.
+
+// How often the drainer looks for completed blocks
+static const int kStreamPollMsec = 10;
+
+// Trace blocks (plus their IPC blocks) per output buffer, 4.5MB
+static const int kStreamBufBlocks = 64;
+static const int kStreamBufBytes = kStreamBufBlocks * (kTraceBufSize + kIpcBufSize) * sizeof(u64);
+
+typedef struct {
+  bool active;
+  bool do_ipc;
+  volatile bool stopping;	// Tells the drainer to exit
+  bool writer_stop;		// Tells the writer to exit when idle
+  int fd;
+  pthread_t drainer;
+  pthread_t writer;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  char* buf[2];			// Double buffer, page aligned
+  u64 len[2];			// Bytes handed to the writer; 0 = free
+  int cur;			// Buffer the drainer is filling
+  u64 fill;			// Bytes in buf[cur]
+  u64* block0;			// Block 0 (and IPC), written at the end
+  bool have_block0;
+  u64 block0_bytes;
+  u64 next_seq;			// Next sequence number not yet pending
+  u64 prior_claimed;		// Claimed count at the previous drain pass
+  std::vector<u64> pending;	// Claimed but not yet copied, ascending
+  u64 blocks_written;
+  u64 blocks_dropped;
+  bool use_bulk;
+  bool use_bulk_ipc;
+  CyclesToUsecParams params;	// Provisional, for per-block gettimeofday
+  char fname[256];
+} StreamState;
+
+StreamState stream;
+
+// Write len bytes, dropping O_DIRECT if the file system refuses it
+void StreamWriteAll(int fd, const char* buf, u64 len, s64 offset) {
+  while (len > 0) {
+    ssize_t n = (offset < 0) ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+    if ((n < 0) && (errno == EINVAL) && ((fcntl(fd, F_GETFL) & O_DIRECT) != 0)) {
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      continue;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "%s write failed\n", stream.fname);
+      return;
+    }
+    buf += n;
+    len -= n;
+    if (offset >= 0) {offset += n;}
+  }
+}
+
+// Writer thread: write each full buffer in turn
+void* StreamWriter(void* arg) {
+  pthread_mutex_lock(&stream.mutex);
+  for (;;) {
+    int which = (stream.len[0] > 0) ? 0 : (stream.len[1] > 0) ? 1 : -1;
+    if (which < 0) {
+      if (stream.writer_stop) {break;}
+      pthread_cond_wait(&stream.cond, &stream.mutex);
+      continue;
+    }
+    u64 len = stream.len[which];
+    pthread_mutex_unlock(&stream.mutex);
+    StreamWriteAll(stream.fd, stream.buf[which], len, -1);
+    pthread_mutex_lock(&stream.mutex);
+    stream.len[which] = 0;
+    pthread_cond_broadcast(&stream.cond);
+  }
+  pthread_mutex_unlock(&stream.mutex);
+  return NULL;
+}
+
+// Hand the current buffer to the writer and switch to the other one,
+// waiting if the writer has not finished with it yet
+void StreamHandoff() {
+  if (stream.fill == 0) {return;}
+  pthread_mutex_lock(&stream.mutex);
+  stream.len[stream.cur] = stream.fill;
+  pthread_cond_broadcast(&stream.cond);
+  int other = 1 - stream.cur;
+  while (stream.len[other] > 0) {pthread_cond_wait(&stream.cond, &stream.mutex);}
+  pthread_mutex_unlock(&stream.mutex);
+  stream.cur = other;
+  stream.fill = 0;
+}
+
+inline u64 StreamBlockIndex(u64 seq, u64 nblocks) {
+  return (seq < nblocks) ? seq : 1 + ((seq - 1) % (nblocks - 1));
+}
+
+// Returns false if blocks claimed since reset cannot be read from the module
+bool StreamPosition(u64* claimed, u64* nblocks) {
+  u64 pos[2];
+  if (DoControl(KUTRACE_CMD_GETPOSITION, (u64)&pos[0]) != 1) {return false;}
+  *claimed = pos[0];
+  *nblocks = pos[1];
+  return (*nblocks > 1);
+}
+
+// Has sequence number seq been, or could it be being, overwritten?
+inline bool StreamOverwritten(u64 seq, u64 claimed, u64 nblocks) {
+  return (seq != 0) && ((claimed - seq) > (nblocks - 1));
+}
+
+// Copy one trace block (and its IPC block) into the output buffer.
+// Returns false if it was overwritten before or while we copied it.
+bool StreamCopyBlock(u64 seq, u64 nblocks) {
+  u64 b = StreamBlockIndex(seq, nblocks);
+  bool is_block0 = (seq == 0);
+  if (!is_block0 && ((kStreamBufBytes - stream.fill) < stream.block0_bytes)) {StreamHandoff();}
+  u64* traceblock = is_block0 ? stream.block0 : (u64*)(stream.buf[stream.cur] + stream.fill);
+  GetWords(KUTRACE_CMD_GETBLOCK, KUTRACE_CMD_GETWORD, b * kTraceBufSize, kTraceBufSize, 
+           traceblock, &stream.use_bulk);
+  uint8 flags = traceblock[1] >> 56;
+  bool this_block_has_ipc = ((flags & IPC_Flag) != 0) && stream.do_ipc;
+  if (this_block_has_ipc) {
+    GetWords(KUTRACE_CMD_GETIPCBLOCK, KUTRACE_CMD_GETIPCWORD, b * kIpcBufSize, kIpcBufSize, 
+             traceblock + kTraceBufSize, &stream.use_bulk_ipc);
+  }
+
+  // If the writer lapped us during the copy, the data is suspect
+  u64 claimed, unused;
+  if (!StreamPosition(&claimed, &unused) || StreamOverwritten(seq, claimed, nblocks)) {
+    return false;
+  }
+
+  if (is_block0) {
+    // Finished at the very end, once the stop time pair is known
+    stream.have_block0 = true;
+  } else {
+    // Reconstruct the gettimeofday value for this block
+    SetBlockTime(traceblock, false, stream.params);
+    stream.fill += (kTraceBufSize + (this_block_has_ipc ? kIpcBufSize : 0)) * sizeof(u64);
+  }
+  ++stream.blocks_written;
+  return true;
+}
+
+// Copy out every complete block. With all true, tracing is off and flushed,
+// so every claimed block is complete.
+void StreamDrain(bool all) {
+  u64 claimed, nblocks;
+  if (!StreamPosition(&claimed, &nblocks)) {return;}
+  while (stream.next_seq < claimed) {stream.pending.push_back(stream.next_seq++);}
+
+  // Provisional time mapping for the per-block gettimeofday values
+  int64 now_cycles, now_usec;
+  GetTimePair(&now_cycles, &now_usec);
+  SetParams(start_cycles, start_usec, now_cycles, now_usec, &stream.params);
+
+  // Blocks claimed since the last pass may not have their headers filled in 
+  // yet, so only look at older ones. The latest of those on each CPU may 
+  // still be filling.
+  u64 settled = all ? claimed : stream.prior_claimed;
+  stream.prior_claimed = claimed;
+  s64 latest[256];
+  std::vector<u64> cpu_of(stream.pending.size());
+  for (int i = 0; i < 256; ++i) {latest[i] = -1;}
+  for (int i = 0; i < stream.pending.size(); ++i) {
+    u64 seq = stream.pending[i];
+    cpu_of[i] = 0;
+    if ((settled <= seq) || StreamOverwritten(seq, claimed, nblocks)) {continue;}
+    u64 b = StreamBlockIndex(seq, nblocks);
+    cpu_of[i] = DoControl(KUTRACE_CMD_GETWORD, b * kTraceBufSize) >> 56;
+    latest[cpu_of[i]] = seq;
+  }
+
+  std::vector<u64> still_pending;
+  for (int i = 0; i < stream.pending.size(); ++i) {
+    u64 seq = stream.pending[i];
+    if (StreamOverwritten(seq, claimed, nblocks)) {++stream.blocks_dropped; continue;}
+    bool complete = all || ((seq < settled) && (latest[cpu_of[i]] != (s64)seq));
+    if (!complete) {still_pending.push_back(seq); continue;}
+    if (!StreamCopyBlock(seq, nblocks)) {++stream.blocks_dropped;}
+  }
+  stream.pending.swap(still_pending);
+}
+
+// Drainer thread: poll for completed blocks until told to stop
+void* StreamDrainer(void* arg) {
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);	// Low priority
+  while (!stream.stopping) {
+    StreamDrain(false);
+    msleep(kStreamPollMsec);
+  }
+  return NULL;
+}
+
+// Start streaming completed trace blocks to fname.
+// Call after DoReset (which should include DO_WRAP) and DoInit, before DoOn.
+// Returns false if the module cannot stream.
+bool DoStreamStart(const char* fname, u64 control_flags) {
+  u64 claimed, nblocks;
+  if (!StreamPosition(&claimed, &nblocks)) {
+    fprintf(stderr, "KUtrace module/code cannot stream (no GETPOSITION)\n");
+    return false;
+  }
+  if (stream.active) {return false;}
+
+  strncpy(stream.fname, fname, sizeof(stream.fname));
+  stream.fname[sizeof(stream.fname) - 1] = '\0';
+  stream.fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (stream.fd < 0) {stream.fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);}
+  if (stream.fd < 0) {
+    fprintf(stderr, "%s did not open\n", fname);
+    return false;
+  }
+
+  stream.do_ipc = ((control_flags & DO_IPC) != 0);
+  stream.block0_bytes = (kTraceBufSize + (stream.do_ipc ? kIpcBufSize : 0)) * sizeof(u64);
+  void* p[3] = {NULL, NULL, NULL};
+  if ((posix_memalign(&p[0], 4096, kStreamBufBytes) != 0) ||
+      (posix_memalign(&p[1], 4096, kStreamBufBytes) != 0) ||
+      (posix_memalign(&p[2], 4096, stream.block0_bytes) != 0)) {
+    fprintf(stderr, "Streaming buffers did not allocate\n");
+    for (int i = 0; i < 3; ++i) {free(p[i]);}
+    close(stream.fd);
+    stream.fd = -1;
+    return false;
+  }
+  stream.buf[0] = (char*)p[0];
+  stream.buf[1] = (char*)p[1];
+  stream.block0 = (u64*)p[2];
+  memset(stream.block0, 0, stream.block0_bytes);
+  // Reserve space for block 0
+  lseek(stream.fd, stream.block0_bytes, SEEK_SET);
+
+  stream.stopping = false;
+  stream.writer_stop = false;
+  stream.len[0] = stream.len[1] = 0;
+  stream.cur = 0;
+  stream.fill = 0;
+  stream.have_block0 = false;
+  stream.next_seq = 0;
+  stream.prior_claimed = 0;
+  stream.pending.clear();
+  stream.blocks_written = 0;
+  stream.blocks_dropped = 0;
+  stream.use_bulk = true;
+  stream.use_bulk_ipc = true;
+  pthread_mutex_init(&stream.mutex, NULL);
+  pthread_cond_init(&stream.cond, NULL);
+  bool writer_ok = (pthread_create(&stream.writer, NULL, StreamWriter, NULL) == 0);
+  bool drainer_ok = writer_ok &&
+                    (pthread_create(&stream.drainer, NULL, StreamDrainer, NULL) == 0);
+  if (!drainer_ok) {
+    fprintf(stderr, "Streaming threads did not start\n");
+    if (writer_ok) {
+      pthread_mutex_lock(&stream.mutex);
+      stream.writer_stop = true;
+      pthread_cond_broadcast(&stream.cond);
+      pthread_mutex_unlock(&stream.mutex);
+      pthread_join(stream.writer, NULL);
+    }
+    free(stream.buf[0]);
+    free(stream.buf[1]);
+    free(stream.block0);
+    pthread_mutex_destroy(&stream.mutex);
+    pthread_cond_destroy(&stream.cond);
+    close(stream.fd);
+    stream.fd = -1;
+    return false;
+  }
+  stream.active = true;
+  return true;
+}
+
+// Finish streaming: copy out the rest, write block 0, close the file.
+// Tracing must be off and flushed. If fname differs, the file is renamed.
+void DoStreamStop(const char* fname) {
+  if (!stream.active) {return;}
+  stream.stopping = true;
+  pthread_join(stream.drainer, NULL);
+  StreamDrain(true);
+  StreamHandoff();
+
+  pthread_mutex_lock(&stream.mutex);
+  stream.writer_stop = true;
+  pthread_cond_broadcast(&stream.cond);
+  pthread_mutex_unlock(&stream.mutex);
+  pthread_join(stream.writer, NULL);
+
+  if (stream.have_block0) {
+    CyclesToUsecParams params;
+    FixupFirstBlock(stream.block0, false, stop_cycles, stop_usec, &params);
+    SetBlockTime(stream.block0, true, params);
+    StreamWriteAll(stream.fd, (const char*)stream.block0, stream.block0_bytes, 0);
+  } else {
+    fprintf(stderr, "%s is missing trace block 0\n", stream.fname);
+  }
+  close(stream.fd);
+
+  if ((fname != NULL) && (strcmp(fname, stream.fname) != 0)) {
+    if (rename(stream.fname, fname) == 0) {
+      strncpy(stream.fname, fname, sizeof(stream.fname));
+      stream.fname[sizeof(stream.fname) - 1] = '\0';
+    }
+  }
+  fprintf(stdout, "  %s written (%3.1fMB), %lld blocks dropped\n", 
+          stream.fname, stream.blocks_written / 16.0, stream.blocks_dropped);
+
+  free(stream.buf[0]);
+  free(stream.buf[1]);
+  free(stream.block0);
+  pthread_mutex_destroy(&stream.mutex);
+  pthread_cond_destroy(&stream.cond);
+  stream.pending.clear();
+  stream.active = false;
+
+  // Go ahead and set up for another trace
+  DoControl(KUTRACE_CMD_RESET, 0);
+}
+
+//--------------------------------------------------------------------------//
+// End streaming dump                                                       //
+//--------------------------------------------------------------------------//
+
+
 // Dump the trace buffer to filename
 // Module must be loaded. Tracing must be off
 void DoDump(const char* fname) {
   // if (!TestModule()) {return;}		// No module loaded
+  // If streaming, most of the trace is already in the file
+  if (stream.active) {DoStreamStop(fname); return;}
   DoControl(KUTRACE_CMD_FLUSH, 0);
 
   // Start timepair is set by DoInit
@@ -607,15 +2034,18 @@ void DoDump(const char* fname) {
 //fprintf(stderr, "wordcount = %ld\n", wordcount);
 //fprintf(stderr, "blockcount = %ld\n", blockcount);
 
+  // Try bulk export first; older modules only have one-word-per-call GETWORD
+  bool use_bulk = true;
+  bool use_bulk_ipc = true;
+
   // Loop on trace blocks
   for (int i = 0; i < blockcount; ++i) {
     u64 k = i * kTraceBufSize;  // Trace Word number to fetch next
     u64 k2 = i * kIpcBufSize;  	// IPC Word number to fetch next
 
     // Extract 64KB trace block
-    for (int j = 0; j < kTraceBufSize; ++j) {
-      traceblock[j] = DoControl(KUTRACE_CMD_GETWORD, k++);
-    }
+    GetWords(KUTRACE_CMD_GETBLOCK, KUTRACE_CMD_GETWORD, k, kTraceBufSize, 
+             traceblock, &use_bulk);
 
     // traceblock[0] has cpu number and cycle counter
     // traceblock[1] has flags in top byte, then zeros
@@ -627,69 +2057,18 @@ void DoDump(const char* fname) {
     // and clear traceblock[3], reserved for future use
     bool very_first_block = (i == 0);
     if (very_first_block) {
-      // Fill in the tracefile version 
-      traceblock[1] |= ((kTracefileVersionNumber & VERSION_MASK) << 56);
-      if (!did_wrap_around) {
-        // The kernel exports the wrap flag in the first block before 
-        // it is known whether the trace actually wrapped.
-        // It did not, so turn off that bit
-        traceblock[1] &= ~(WRAP_Flag << 56);
-      }
-      // Extract the fallback start timepair
-      int64 fallback_usec, fallback_cycles;
-      ExtractTimePair(traceblock, &fallback_cycles, &fallback_usec);
-      if (start_usec == 0) {
-        start_usec = fallback_usec;
-        start_cycles = fallback_cycles;
-      }
-
-      // For Arm-32, the "cycle" counter is only 32 bits at 54 MHz, so wraps about every 79 seconds.
-      // This can leave stop_cycles small by a few multiples of 4G. We do a temporary fix here
-      // for exactly 54 MHz. Later, we could find or take as input a different approximate
-      // frequency. We could also do something similar for a 40-bit counter.
-      bool has_32bit_cycles = ((start_cycles | stop_cycles) & 0xffffffff00000000llu) == 0;
-      if (has_32bit_cycles) {
-        uint64 elapsed_usec = (uint64)(stop_usec - start_usec);
-        uint64 elapsed_cycles = (uint64)(stop_cycles - start_cycles);
-        uint64 expected_cycles = elapsed_usec * mhz_32bit_cycles;
-        // Pick off the expected high bits
-        uint64 approx_hi = (start_cycles + expected_cycles) & 0xffffffff00000000llu;
-        // Put them in
-        stop_cycles |= (int64)approx_hi;
-        // Cross-check and change by 1 if right at a boundary
-        // and off by more than 12.5% from expected MHz
-        elapsed_cycles = (uint64)(stop_cycles - start_cycles);
-        uint64 ratio = elapsed_cycles / elapsed_usec;
-        if (ratio > (mhz_32bit_cycles + (mhz_32bit_cycles >> 3))) {stop_cycles -= 0x0000000100000000llu;}
-        if (ratio < (mhz_32bit_cycles - (mhz_32bit_cycles >> 3))) {stop_cycles += 0x0000000100000000llu;}
-        elapsed_cycles = (uint64)(stop_cycles - start_cycles);
-      }
-
-      uint64 block_0_cycle = traceblock[0] & CLU(0x00ffffffffffffff);
-
-      // Get ready to reconstruct gettimeofday values for each traceblock
-      SetParams(start_cycles, start_usec, stop_cycles, stop_usec, &params);
-
-      // Fill in the start/stop timepairs we are using, so
-      // downstream programs can also SetParams
-      traceblock[2] = start_cycles;
-      traceblock[3] = start_usec;
-      traceblock[4] = stop_cycles;
-      traceblock[5] = stop_usec;
+      FixupFirstBlock(traceblock, did_wrap_around, stop_cycles, stop_usec, &params);
     }
 
     // Reconstruct the gettimeofday value for this block
-    int64 block_cycles = traceblock[0] & CLU(0x00ffffffffffffff);
-    int64 block_usec = CyclesToUsec(block_cycles, params);
-    traceblock[1] |= (block_usec &  CLU(0x00ffffffffffffff));
+    SetBlockTime(traceblock, very_first_block, params);
     fwrite(traceblock, 1, sizeof(traceblock), f);
 
     // For each 64KB traceblock that has IPC_Flag set, also read the IPC bytes
     if (this_block_has_ipc) {
       // Extract 8KB IPC block
-      for (int j = 0; j < kIpcBufSize; ++j) {
-        ipcblock[j] = DoControl(KUTRACE_CMD_GETIPCWORD, k2++);
-      }
+      GetWords(KUTRACE_CMD_GETIPCBLOCK, KUTRACE_CMD_GETIPCWORD, k2, kIpcBufSize, 
+               ipcblock, &use_bulk_ipc);
       fwrite(ipcblock, 1, sizeof(ipcblock), f);
     }
   }
@@ -710,11 +2089,16 @@ void DoQuit() {
   exit(0);
 }
 
-// Add a name of type n, value number, to the trace
+// Add a name of type n, value number, to the trace, once
 void addname(uint64 eventnum, uint64 number, const char* name) {
-  u64 temp[8];		// Buffer for name entry
+  if (!MaybeTracing()) {return;}
   u64 bytelen = strlen(name);
   if (bytelen > 55) {bytelen = 55;}
+  u64 key = InternKey(eventnum, number, name, bytelen);
+  u64 now = ku_get_cycles();
+  if (InternSeen(key, now)) {return;}
+
+  u64 temp[8];		// Buffer for name entry
   u64 wordlen = 1 + ((bytelen + 7) / 8);
   // Build the initial word
   u64 n_with_length = eventnum + (wordlen * 16);
@@ -722,23 +2106,111 @@ void addname(uint64 eventnum, uint64 number, const char* name) {
   temp[0] = (CLU(0) << 44) | (n_with_length << 32) | (number);
   memset((char*)&temp[1], 0, 7 * sizeof(u64));
   memcpy((char*)&temp[1], name, bytelen);
-  kutrace::DoControl(KUTRACE_CMD_INSERTN, (u64)&temp[0]);
+  if (RpcSampleHold(temp, wordlen)) {return;}	// Not interned; may never go in
+
+  FlushBatch();		// Keep staged events in order ahead of the name
+  u64 retval = kutrace::DoControl(KUTRACE_CMD_INSERTN, (u64)&temp[0]);
+  if ((0 < (s64)retval) && ((s64)retval <= 8)) {InternRecord(key, now);}
 }
 
 // Create a Mark entry
 void DoMark(u64 n, u64 arg) {
+  if (!MaybeTracing()) {return;}
   //         T             N                       ARG
   u64 temp = (CLU(0) << 44) | (n << 32) | (arg &  CLU(0x00000000FFFFFFFF));
+  if (RpcSampleHold(&temp, 1)) {return;}
+  if (batch_state.depth > 0) {StageEvent(temp); return;}
   DoControl(KUTRACE_CMD_INSERT1, temp);
 }
 
 // Create an arbitrary entry, returning 1 if tracing is on, <=0 otherwise
 u64 DoEvent(u64 eventnum, u64 arg) {
+  if (!MaybeTracing()) {return 0;}
   //         T             N                       ARG
   u64 temp = ((eventnum & CLU(0xFFF)) << 32) | (arg & CLU(0x00000000FFFFFFFF));
+  if (RpcSampleHold(&temp, 1)) {return 1;}
+  if (batch_state.depth > 0) {StageEvent(temp); return 1;}
   return DoControl(KUTRACE_CMD_INSERT1, temp);
 }
 
+//--------------------------------------------------------------------------//
+// Per-thread RPC context                                                   //
+//--------------------------------------------------------------------------//
+//
+// Each thread remembers the RPCIDREQ/RPCIDRESP entry it last put into the 
+// trace, so setting the same id again inserts nothing. An entry that did 
+// not go in (tracing off) or went into an earlier trace is not remembered.
+//
+
+static const int kMaxRpcDepth = 8;
+
+typedef struct {
+  u64 eventnum;
+  u64 arg;
+} RpcId;
+
+typedef struct {
+  int generation;	// rpc_generation when cur went into the trace, else 0
+  RpcId cur;
+  int depth;
+  RpcId saved[kMaxRpcDepth];
+} RpcContext;
+
+static __thread RpcContext rpc_context;
+
+void RpcSet(u64 eventnum, u64 arg, bool force) {
+  RpcSample(arg);
+  RpcContext* rc = &rpc_context;
+  bool known = (rc->generation == rpc_generation);
+  bool same = (rc->cur.arg == arg) && ((rc->cur.eventnum == eventnum) || (arg == 0));
+  if (known && same && !force) {return;}
+  rc->cur.eventnum = eventnum;
+  rc->cur.arg = arg;
+  rc->generation = ((s64)DoEvent(eventnum, arg) > 0) ? rpc_generation : 0;
+}
+
+void RpcPush(u64 eventnum, u64 arg) {
+  RpcContext* rc = &rpc_context;
+  if (rc->depth < kMaxRpcDepth) {rc->saved[rc->depth] = rc->cur;}
+  ++rc->depth;
+  RpcSet(eventnum, arg, false);
+}
+
+void RpcPop() {
+  RpcContext* rc = &rpc_context;
+  if (rc->depth == 0) {return;}
+  --rc->depth;
+  RpcId prior = {KUTRACE_RPCIDREQ, 0};	// Back to no RPC if too deep to save
+  if (rc->depth < kMaxRpcDepth) {prior = rc->saved[rc->depth];}
+  RpcSet(prior.eventnum, prior.arg, false);
+}
+
+// eventtospan starts the queued span at the RPC change after an ENQUEUE,
+// and ends it at the RPC change after a DEQUEUE. The entries go in where
+// the caller does the queue operation, perhaps inside the queue's lock; 
+// the RPC changes once the hand-off is done.
+u64 RpcEnqueue(u64 queue_num) {
+  DoEvent(KUTRACE_ENQUEUE, queue_num);
+  return rpc_context.cur.arg;
+}
+
+void RpcEnqueued() {
+  RpcSet(rpc_context.cur.eventnum, 0, false);
+}
+
+void RpcDequeue(u64 queue_num, u64 arg) {
+  RpcSample(arg);	// DEQUEUE belongs to the incoming RPC
+  DoEvent(KUTRACE_DEQUEUE, queue_num);
+}
+
+void RpcDequeued(u64 arg) {
+  RpcSet(KUTRACE_RPCIDREQ, arg, true);	// Even if the same id, to end the queued span
+}
+
+//--------------------------------------------------------------------------//
+// End per-thread RPC context                                               //
+//--------------------------------------------------------------------------//
+
 // Uppercase are mapped to lowercase
 // All unexpected characters are mapped to '.'
 //   - = 0x2D . = 0x2E / = 0x2F
@@ -809,15 +2281,409 @@ u64 CharToBase40(const char* str) {
   return base40;
 }
 
+//--------------------------------------------------------------------------//
+// Flight-recorder snapshots                                                //
+//--------------------------------------------------------------------------//
+//
+// With tracing on in wraparound mode, snapshot(reason) writes just the last 
+// few milliseconds of the trace buffer to its own trace file, then lets 
+// tracing continue. A program calls it when it notices something rare and 
+// slow, e.g. an RPC over a latency threshold, so the trace around that 
+// event is kept without storing hours of trace.
+//
+// Snapshots do nothing until armed by snapshot_arm or by the environment
+// variable KUTRACE_SNAPSHOT_MSEC=<window msec>. They are rate-limited to one 
+// per min_gap_msec across all threads, and to kMaxSnapshots per run.
+//
+// Tracing is off for a couple of msec plus the time to copy out the 
+// selected blocks; the file is written after tracing is back on. The file
+// looks like a wrapped trace: block 0 (names, time pair) and then, for each
+// CPU, the blocks covering the window.
+
+static const int kDefaultSnapshotWindowMsec = 100;
+static const int kDefaultSnapshotGapMsec = 1000;
+static const int kMaxSnapshots = 100;
+// Long enough for any in-progress trace entries to finish
+static const int kSnapshotOffMsec = 2;
+
+typedef struct {
+  bool armed;
+  bool env_checked;
+  int window_msec;
+  int gap_msec;
+  int count;			// Snapshots written so far
+  volatile int busy;		// One snapshot at a time
+  int64 last_usec;		// Time of the previous snapshot
+} SnapshotState;
+
+SnapshotState snap = {false, false, kDefaultSnapshotWindowMsec, kDefaultSnapshotGapMsec, 0, 0, 0};
+
+void SnapshotArm(int window_msec, int min_gap_msec) {
+  snap.window_msec = (window_msec > 0) ? window_msec : kDefaultSnapshotWindowMsec;
+  snap.gap_msec = (min_gap_msec >= 0) ? min_gap_msec : kDefaultSnapshotGapMsec;
+  snap.env_checked = true;
+  snap.armed = true;
+}
+
+void SnapshotDisarm() {snap.armed = false; snap.env_checked = true;}
+
+// Snapshots are off unless armed in code or from the environment
+inline bool SnapshotArmed() {
+  if (!snap.env_checked) {
+    const char* env = getenv("KUTRACE_SNAPSHOT_MSEC");
+    if ((env != NULL) && (atoi(env) > 0)) {SnapshotArm(atoi(env), kDefaultSnapshotGapMsec);}
+    snap.env_checked = true;
+  }
+  return snap.armed;
+}
+
+// ku_..._pid.trace becomes ku_..._pid_snap<n>_<reason>.trace
+void MakeSnapshotFileName(const char* reason, int n, char* str) {
+  MakeTraceFileName("ku", str);
+  char* dot = strrchr(str, '.');
+  if (dot != NULL) {*dot = '\0';}
+  char cleanreason[32];
+  int len = 0;
+  for (const char* p = reason; (*p != '\0') && (len < 31); ++p) {
+    char c = *p;
+    bool ok = (('a' <= c) && (c <= 'z')) || (('A' <= c) && (c <= 'Z')) || 
+              (('0' <= c) && (c <= '9')) || (c == '-') || (c == '_');
+    cleanreason[len++] = ok ? c : '_';
+  }
+  cleanreason[len] = '\0';
+  sprintf(str + strlen(str), "_snap%d_%s.trace", n, cleanreason);
+}
+
+// Returns true if a snapshot file was written
+bool Snapshot(const char* reason) {
+  if (!SnapshotArmed()) {return false;}
+  int64 now_usec = GetUsec();
+  if ((now_usec - snap.last_usec) < (snap.gap_msec * CL(1000))) {return false;}
+  if (snap.count >= kMaxSnapshots) {return false;}
+  if (stream.active) {return false;}
+  if (!__sync_bool_compare_and_swap(&snap.busy, 0, 1)) {return false;}
+  snap.last_usec = now_usec;
+  if (DoControl(KUTRACE_CMD_TEST, 0) != 1) {snap.busy = 0; return false;}	// Not tracing
+
+  FlushBatch();
+  DoMark(KUTRACE_MARKA, CharToBase40(reason));
+
+  // Stop briefly so the blocks we copy are stable and flushed
+  DoControl(KUTRACE_CMD_OFF, 0);
+  msleep(kSnapshotOffMsec);
+  int64 snap_stop_cycles, snap_stop_usec;
+  GetTimePair(&snap_stop_cycles, &snap_stop_usec);
+  CalAdd(snap_stop_cycles, snap_stop_usec);
+  DoControl(KUTRACE_CMD_FLUSH, 0);
+
+  u64 wordcount = DoControl(KUTRACE_CMD_GETCOUNT, 0);
+  if ((s64)wordcount < 0) {wordcount = ~wordcount;}
+  u64 blockcount = wordcount >> 13;
+
+  // Window start, in cycles. The slope needs the trace's start time pair. 
+  // start_cycles/usec are only set if this process did DoInit or DoOn; when 
+  // kutrace_control started tracing, the pair is in block 0
+  int64 base_cycles = start_cycles;
+  int64 base_usec = start_usec;
+  if (base_usec == 0) {
+    u64 head[kTimePairWord + 3];
+    for (int i = kTimePairWord; i < kTimePairWord + 3; ++i) {
+      head[i] = DoControl(KUTRACE_CMD_GETWORD, i);
+    }
+    ExtractTimePair(head, &base_cycles, &base_usec);
+  }
+  CyclesToUsecParams params;
+  SetParams(base_cycles, base_usec, snap_stop_cycles, snap_stop_usec, &params);
+  int64 cutoff = 0;	// Everything, if there is no start pair
+  if ((base_usec != 0) && (params.m_slope > 0.0)) {
+    cutoff = snap_stop_cycles - (int64)((snap.window_msec * 1000.0) / params.m_slope);
+  }
+
+  // Keep blocks starting inside the window, plus for each CPU the last block 
+  // starting before it, which covers the window start
+  std::vector<u64> keep;
+  keep.push_back(0);
+  s64 before[256];
+  int64 before_cycles[256];
+  for (int i = 0; i < 256; ++i) {before[i] = -1; before_cycles[i] = 0;}
+  for (u64 b = 1; b < blockcount; ++b) {
+    u64 word0 = DoControl(KUTRACE_CMD_GETWORD, b * kTraceBufSize);
+    if (word0 == 0) {continue;}		// Never used
+    int cpu = word0 >> 56;
+    int64 block_cycles = word0 & CLU(0x00ffffffffffffff);
+    if (block_cycles >= cutoff) {
+      keep.push_back(b);
+    } else if ((before[cpu] < 0) || (before_cycles[cpu] < block_cycles)) {
+      before[cpu] = b;
+      before_cycles[cpu] = block_cycles;
+    }
+  }
+  int64 first_cycles = snap_stop_cycles;	// Earliest block kept
+  for (int i = 0; i < 256; ++i) {
+    if (before[i] < 0) {continue;}
+    keep.push_back(before[i]);
+    if (before_cycles[i] < first_cycles) {first_cycles = before_cycles[i];}
+  }
+
+  // Copy them out, then tracing can resume
+  u64 blocksize = kTraceBufSize + kIpcBufSize;
+  u64* copy = new u64[keep.size() * blocksize];
+  bool use_bulk = true;
+  bool use_bulk_ipc = true;
+  for (int i = 0; i < keep.size(); ++i) {
+    u64* traceblock = &copy[i * blocksize];
+    GetWords(KUTRACE_CMD_GETBLOCK, KUTRACE_CMD_GETWORD, keep[i] * kTraceBufSize, kTraceBufSize, 
+             traceblock, &use_bulk);
+    uint8 flags = traceblock[1] >> 56;
+    if ((flags & IPC_Flag) != 0) {
+      GetWords(KUTRACE_CMD_GETIPCBLOCK, KUTRACE_CMD_GETIPCWORD, keep[i] * kIpcBufSize, kIpcBufSize, 
+               traceblock + kTraceBufSize, &use_bulk_ipc);
+    }
+  }
+  DoControl(KUTRACE_CMD_ON, 0);
+
+  // Block 0 gets the snapshot stop time. Marking it wrapped tells rawtoevent 
+  // to take only names from it.
+  char fname[256];
+  MakeSnapshotFileName(reason, snap.count, fname);
+  FILE* f = fopen(fname, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "%s did not open\n", fname);
+    delete[] copy;
+    snap.busy = 0;
+    return false;
+  }
+  FixupFirstBlock(&copy[0], true, snap_stop_cycles, snap_stop_usec, &params);
+  for (int i = 0; i < keep.size(); ++i) {
+    u64* traceblock = &copy[i * blocksize];
+    SetBlockTime(traceblock, i == 0, params);
+    uint8 flags = traceblock[1] >> 56;
+    bool this_block_has_ipc = ((flags & IPC_Flag) != 0);
+    fwrite(traceblock, 1, (kTraceBufSize + (this_block_has_ipc ? kIpcBufSize : 0)) * sizeof(u64), f);
+  }
+  fclose(f);
+  delete[] copy;
+  // Kept blocks start at or before the window; a trace that has not 
+  // been running that long gives less
+  double covered_msec = (snap_stop_cycles - first_cycles) * params.m_slope / 1000.0;
+  fprintf(stderr, "  %s written (%3.1fMB), snapshot '%s', %3.1f of %d msec\n", 
+          fname, keep.size() / 16.0, reason, covered_msec, snap.window_msec);
+  bool long_enough = ((snap_stop_usec - base_usec) > (snap.window_msec * CL(1000)));
+  if (long_enough && (covered_msec < (snap.window_msec * 0.9))) {
+    fprintf(stderr, "  snapshot '%s' covers only %3.1f msec, time pair bad?\n", 
+            reason, covered_msec);
+  }
+
+  ++snap.count;
+  snap.last_usec = GetUsec();	// Gap counts from the end of this one
+  snap.busy = 0;
+  return true;
+}
+
+//--------------------------------------------------------------------------//
+// End flight-recorder snapshots                                            //
+//--------------------------------------------------------------------------//
+
+
+//--------------------------------------------------------------------------//
+// Region counters                                                          //
+//--------------------------------------------------------------------------//
+//
+// Each thread that uses a CounterScope opens its own perf_event group, so
+// one read() gets all its counters at once. The counters follow the thread,
+// not the CPU, and the group is closed when the thread exits. Kernel-mode 
+// counts are included where perf_event_paranoid allows, else just user mode.
+//
+
+typedef struct {
+  u32 type;
+  u64 config;
+} CounterDef;
+
+#define HW_CACHE(cache, result) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | ((result) << 16))
+
+// Same order as kCounterName in kutrace_lib.h
+static const CounterDef kCounterDef[16] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {PERF_TYPE_HW_CACHE, HW_CACHE(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+  {PERF_TYPE_HW_CACHE, HW_CACHE(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+  {PERF_TYPE_HW_CACHE, HW_CACHE(PERF_COUNT_HW_CACHE_ITLB, PERF_COUNT_HW_CACHE_RESULT_MISS)},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MIN},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ},
+  {PERF_TYPE_MAX, 0},
+  {PERF_TYPE_MAX, 0},
+};
+
+static const char* const kDefaultCounters = "llc_miss,br_miss,dtlb_miss";
+static const char* const kSoftwareCounters = "task_ns,faults,ctx_sw";
+
+typedef struct {
+  int n;
+  uint8 kind[KUTRACE_MAX_COUNTERS];
+} CounterList;
+
+typedef struct {
+  int generation;	// Bumped by SetCounters so threads reopen. 0 = not set yet
+  CounterList list;
+} CounterConfig;
+
+typedef struct {
+  int generation;	// counter_config.generation when opened
+  int fd[KUTRACE_MAX_COUNTERS];	// fd[0] is the group leader
+  CounterList list;
+} CounterThread;
+
+static CounterConfig counter_config;
+static __thread CounterThread counter_thread = {-1};
+static pthread_key_t counter_key;	// Its destructor closes a thread's group
+static pthread_once_t counter_key_once = PTHREAD_ONCE_INIT;
+
+// Parse "name,name,..." into kinds. Returns false if any name is unknown
+bool ParseCounters(const char* spec, CounterList* list) {
+  list->n = 0;
+  const char* p = spec;
+  while (*p != '\0') {
+    int len = strcspn(p, ",");
+    int kind = -1;
+    for (int k = 0; k < 16; ++k) {
+      if ((strlen(kCounterName[k]) == len) && (memcmp(kCounterName[k], p, len) == 0) && 
+          (kCounterDef[k].type != PERF_TYPE_MAX)) {kind = k;}
+    }
+    if (kind < 0) {
+      fprintf(stderr, "kutrace: unknown counter '%.*s'\n", len, p);
+      return false;
+    }
+    if (list->n < KUTRACE_MAX_COUNTERS) {list->kind[list->n++] = kind;}
+    p += len;
+    if (*p == ',') {++p;}
+  }
+  return true;
+}
+
+bool SetCounters(const char* spec) {
+  CounterList list;
+  if (!ParseCounters(spec, &list)) {return false;}
+  counter_config.list = list;
+  __atomic_add_fetch(&counter_config.generation, 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+void CloseCounters(CounterThread* ct) {
+  for (int i = 0; i < ct->list.n; ++i) {close(ct->fd[i]);}
+  ct->list.n = 0;
+}
+
+// At thread exit
+void CounterThreadExit(void* arg) {
+  CloseCounters(reinterpret_cast<CounterThread*>(arg));
+}
+
+void MakeCounterKey() {
+  pthread_key_create(&counter_key, CounterThreadExit);
+}
+
+// Open one group for the calling thread. Returns false and leaves nothing
+// open if any counter in it cannot be opened.
+bool OpenCounters(const CounterList& list, CounterThread* ct) {
+  ct->list.n = 0;
+  for (int i = 0; i < list.n; ++i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = kCounterDef[list.kind[i]].type;
+    attr.config = kCounterDef[list.kind[i]].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+    int leader = (i == 0) ? -1 : ct->fd[0];
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (fd < 0) {
+      attr.exclude_kernel = 1;	// Unprivileged, perf_event_paranoid >= 2
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    }
+    if (fd < 0) {
+      CloseCounters(ct);
+      return false;
+    }
+    ct->fd[i] = fd;
+    ct->list.kind[i] = list.kind[i];
+    ct->list.n = i + 1;
+  }
+  return true;
+}
+
+int ReadCounters(u64* values) {
+  if (!MaybeTracing()) {return 0;}
+  CounterThread* ct = &counter_thread;
+  int generation = __atomic_load_n(&counter_config.generation, __ATOMIC_ACQUIRE);
+  if (generation == 0) {
+    const char* spec = getenv("KUTRACE_COUNTERS");
+    if ((spec == NULL) || !SetCounters(spec)) {SetCounters(kDefaultCounters);}
+    generation = __atomic_load_n(&counter_config.generation, __ATOMIC_ACQUIRE);
+  }
+  if (ct->generation != generation) {
+    CloseCounters(ct);
+    ct->generation = generation;
+    if (!OpenCounters(counter_config.list, ct)) {
+      CounterList fallback;
+      ParseCounters(kSoftwareCounters, &fallback);
+      OpenCounters(fallback, ct);
+    }
+    if (0 < ct->list.n) {
+      pthread_once(&counter_key_once, MakeCounterKey);
+      pthread_setspecific(counter_key, ct);
+    }
+  }
+  if (ct->list.n == 0) {return 0;}
+
+  // PERF_FORMAT_GROUP: count, then one value per counter
+  u64 buf[1 + KUTRACE_MAX_COUNTERS];
+  if (read(ct->fd[0], buf, sizeof(buf)) < (int)sizeof(u64)) {return 0;}
+  int n = (buf[0] < ct->list.n) ? buf[0] : ct->list.n;
+  memcpy(values, &buf[1], n * sizeof(u64));
+  return n;
+}
+
+void EmitCounters(int n, const u64* before, const u64* after) {
+  CounterThread* ct = &counter_thread;
+  if (ct->list.n < n) {n = ct->list.n;}
+  BatchBegin();
+  for (int i = 0; i < n; ++i) {
+    u64 delta = after[i] - before[i];
+    if (CLU(0x0FFFFFFF) < delta) {delta = CLU(0x0FFFFFFF);}
+    DoEvent(KUTRACE_COUNTER, ((u64)ct->list.kind[i] << 28) | delta);
+  }
+  BatchEnd();
+}
+
+//--------------------------------------------------------------------------//
+// End region counters                                                      //
+//--------------------------------------------------------------------------//
+
 }  // End anonymous namespace
 
 bool kutrace::test() {return ::TestModule();}
 void kutrace::go(const char* process_name) {::DoReset(0); ::DoInit(process_name); ::DoOn();}
 void kutrace::goipc(const char* process_name) {::DoReset(1); ::DoInit(process_name); ::DoOn();}
 void kutrace::stop(const char* fname) {::DoOff(); ::DoFlush(); ::DoDump(fname); ::DoQuit();}
-void kutrace::mark_a(const char* label) {::DoMark(KUTRACE_MARKA, ::CharToBase40(label));}
-void kutrace::mark_b(const char* label) {::DoMark(KUTRACE_MARKB, ::CharToBase40(label));}
-void kutrace::mark_c(const char* label) {::DoMark(KUTRACE_MARKC, ::CharToBase40(label));}
+// Check before packing the label, so marks cost almost nothing with tracing off
+void kutrace::mark_a(const char* label) {
+  if (::MaybeTracing()) {::DoMark(KUTRACE_MARKA, ::CharToBase40(label));}
+}
+void kutrace::mark_b(const char* label) {
+  if (::MaybeTracing()) {::DoMark(KUTRACE_MARKB, ::CharToBase40(label));}
+}
+void kutrace::mark_c(const char* label) {
+  if (::MaybeTracing()) {::DoMark(KUTRACE_MARKC, ::CharToBase40(label));}
+}
 void kutrace::mark_d(uint64 n) {::DoMark(KUTRACE_MARKD, n);}
 
 // Returns number of words inserted 1..8, or
@@ -826,6 +2692,35 @@ u64 kutrace::addevent(uint64 eventnum, uint64 arg) {return ::DoEvent(eventnum, a
 
 void kutrace::addname(uint64 eventnum, uint64 number, const char* name) {::addname(eventnum, number, name);}
 
+void kutrace::rpc_set(u64 arg, u64 eventnum) {::RpcSet(eventnum, arg, false);}
+u64 kutrace::rpc_current() {return ::rpc_context.cur.arg;}
+void kutrace::rpc_push(u64 arg, u64 eventnum) {::RpcPush(eventnum, arg);}
+void kutrace::rpc_pop() {::RpcPop();}
+u64 kutrace::rpc_enqueue(u64 queue_num) {return ::RpcEnqueue(queue_num);}
+void kutrace::rpc_enqueued() {::RpcEnqueued();}
+void kutrace::rpc_dequeue(u64 queue_num, u64 arg) {::RpcDequeue(queue_num, arg);}
+void kutrace::rpc_dequeued(u64 arg) {::RpcDequeued(arg);}
+void kutrace::rpc_sample_rate(int n, int slow_usec) {::RpcSampleRate(n, slow_usec);}
+void kutrace::rpc_sample(u64 rpcid) {::RpcSample(rpcid);}
+
+void kutrace::batch_begin() {::BatchBegin();}
+void kutrace::batch_flush() {::FlushBatch();}
+void kutrace::batch_end() {::BatchEnd();}
+
+bool kutrace::snapshot(const char* reason) {return ::Snapshot(reason);}
+void kutrace::snapshot_arm(int window_msec, int min_gap_msec) {
+  ::SnapshotArm(window_msec, min_gap_msec);
+}
+void kutrace::snapshot_disarm() {::SnapshotDisarm();}
+
+bool kutrace::set_counters(const char* spec) {return ::SetCounters(spec);}
+int kutrace::read_counters(u64* values) {return ::ReadCounters(values);}
+void kutrace::emit_counters(int n, const u64* before, const u64* after) {
+  ::EmitCounters(n, before, after);
+}
+
+void kutrace::freq_sampler(int msec) {::FreqSetPeriod(msec);}
+
 void kutrace::msleep(int msec) {::msleep(msec);}
 int64 kutrace::readtime() {return ::ku_get_cycles();}
 
@@ -837,6 +2732,10 @@ u64 kutrace::DoControl(u64 command, u64 arg) {
   return ::DoControl(command, arg);
 }
 void kutrace::DoDump(const char* fname) {::DoDump(fname);}
+bool kutrace::DoStreamStart(const char* fname, u64 control_flags) {
+  return ::DoStreamStart(fname, control_flags);
+}
+void kutrace::DoStreamStop(const char* fname) {::DoStreamStop(fname);}
 u64  kutrace::DoEvent(u64 eventnum, u64 arg) {return ::DoEvent(eventnum, arg);}
 void kutrace::DoFlush() {::DoFlush();}
 void kutrace::DoInit(const char* process_name) {::DoInit(process_name);}
@@ -37,6 +37,41 @@ typedef struct {
 #define KUTRACE_CMD_GETIPCWORD 9
 #define KUTRACE_CMD_TEST 10
 #define KUTRACE_CMD_VERSION 11
+#define KUTRACE_CMD_GETBLOCK 12		/* Module version 4 and later */
+#define KUTRACE_CMD_GETIPCBLOCK 13	/* Module version 4 and later */
+#define KUTRACE_CMD_GETPOSITION 14	/* Module version 4 and later */
+
+// Bulk export. The arg to GETBLOCK/GETIPCBLOCK points to three u64 words:
+//   [0] first word number to copy (same numbering as GETWORD/GETIPCWORD)
+//   [1] number of words to copy
+//   [2] user-space address of the destination buffer
+// Returns the number of words copied. Older modules return zero or a
+// negative errno, in which case callers fall back to one GETWORD per word.
+//
+// Streaming. The arg to GETPOSITION points to two u64 words that it fills in:
+//   [0] number of trace blocks claimed since reset; does not wrap
+//   [1] size of the trace buffer in blocks
+// Returns 1. Block sequence number s is in buffer block s until the buffer
+// wraps, then in block 1 + (s - 1) % (size - 1). Block 0 is never reused.
+//
+// Tracing-enabled word. Module version 4 and later also provide a device 
+// that can be mapped read-only; its first u64 is nonzero while tracing is
+// on. kutrace_lib checks it so that marks and events cost a load and a 
+// branch, not a system call, when tracing is off. If the device is not 
+// there, every call goes to the module as before.
+#define KUTRACE_STATE_DEVICE "/dev/kutrace_state"
+
+// DoDump fills in the otherwise-unused word after each block's PID (word 3,
+// or word 9 in the very first block) with that block's own time calibration,
+// so blocks can be decoded independently of block 0:
+// +---------------+---------------+-------------------------------+
+// |  0xCA1B magic | usec fraction |  slope, nsec per cycle << 24  |
+// +---------------+---------------+-------------------------------+
+//         16              16                    32
+// The block's cycle counter (word 0) maps to the gettimeofday value in word 1
+// plus fraction/65536 usec, and the slope applies from there. A word without
+// the magic means use the trace-wide start/stop pairs in block 0.
+#define KUTRACE_CAL_MAGIC     CLU(0xCA1B)
 
 
 
@@ -95,6 +130,24 @@ typedef struct {
 #define KUTRACE_HOST_NAME     0x104 	/* CPU host name */
 #define KUTRACE_QUEUE_NAME    0x105 	/* Queue name */
 #define KUTRACE_RES_NAME      0x106 	/* Arbitrary resource name */
+#define KUTRACE_BATCH         0x107 	/* Container for batched user events */
+
+// Batch of user events, inserted with one INSERTN (added 2026.10)
+// The payload words are ordinary entries, each with its own timestamp taken 
+// when it was staged: one-word events, or whole name entries packed by 
+// DoInit. Postprocessing skips just the header.
+// back is zero except for entries held by RPC sampling, which can be much
+// older than the header. Then the first payload word is within 256 counts 
+// before header time - back * 256, and each later payload word is less than 
+// half a 20-bit timestamp wrap after the one before it.
+// +-------------------+-----------+-----------------------+-------+
+// | timestamp         | event     |  back (256 counts)    | words |
+// +-------------------+-----------+-----------------------+-------+
+// | timestamp 1       | event 1   |              arg 1            |
+// +-------------------+-----------+-------------------------------+
+// ~                                                               ~
+// +-------------------+-----------+-------------------------------+
+//          20              12                    32 
 
 // Specials are point events. Hex 200-220 currently. PC sample is outside this range
 #define KUTRACE_USERPID       0x200	/* Context switch */
@@ -107,6 +160,7 @@ typedef struct {
 #define KUTRACE_IPI           0x207	/* Send IPI */
 #define KUTRACE_MWAIT         0x208	/* C-states: how deep to sleep */
 #define KUTRACE_PSTATE        0x209	/* P-states: cpu freq sample in MHz increments */
+					/*  arg<31:16> nonzero is target CPU+1, from kutrace_lib's sampler */
 
 
 // MARK_A,B,C arg is six base-40 chars NUL, A-Z, 0-9, . - /
@@ -139,10 +193,22 @@ typedef struct {
 #define KUTRACE_ENQUEUE	 	 0x21A  /* Put RPC on a work queue; arg says which queue */
 #define KUTRACE_DEQUEUE	 	 0x21B  /* Remove RPC from a queue; arg says which queue */
 #define KUTRACE_PSTATE2          0x21C	/* P-states: cpu freq change, new in MHz increments */
+#define KUTRACE_COUNTER          0x21D	/* Counter delta over a user region, see below */
+#define KUTRACE_RPCSAMPLE        0x21E	/* User entries kept for 1 RPC in arg, see rpc_sample_rate */
 
 
 #define KUTRACE_MAX_SPECIAL      0x27F	// Last special, range 200..27F
 
+// Counter delta, emitted by kutrace::CounterScope just after its closing mark
+// kind indexes kCounterName. delta saturates at 0x0FFFFFFF
+// +-------------------+-----------+-------+-----------------------+
+// | timestamp         | event     | kind  |         delta         |
+// +-------------------+-----------+-------+-----------------------+
+//          20              12         4              28 
+
+// Most counters read together by one CounterScope
+#define KUTRACE_MAX_COUNTERS     4
+
 // Extra events have duration, but are otherwise similar to specials
 // PC sample. Not a special
 #define KUTRACE_PC_U             0x280	/* added 2020.01.29 */
@@ -187,7 +253,7 @@ static const char* const kNameName[32] = {
   "syscall32", "syscall32", "syscall32", "syscall32",
 
   "packet", "pctmp", "kernv", "cpum",
-  "host", "", "", "",
+  "host", "", "", "batch",
   "", "", "", "",
   "", "", "", "",
 };
@@ -201,7 +267,15 @@ static const char* const kSpecialName[32] = {
   "try_", "acq_", "rel_", "-213-",		// Locks
   "rx", "tx", "urx", "utx",
   "mbs", "res", "enq", "deq",
-  "-21c-", "-21d-", "-21e-", "-21f-",
+  "-21c-", "ctr", "samp", "-21f-",
+};
+
+// Names for KUTRACE_COUNTER kinds 0-15. Also the names kutrace::set_counters takes
+static const char* const kCounterName[16] = {
+  "cycles", "instrs", "llc_ref", "llc_miss",
+  "br_miss", "dtlb_miss", "l1d_miss", "itlb_miss",
+  "task_ns", "faults", "ctx_sw", "migr",
+  "minflt", "majflt", "-14-", "-15-",
 };
 
 // Names for events 210-3FF could be added when one of these code points is
@@ -251,8 +325,97 @@ namespace kutrace {
   // Returns number of words inserted 1..8, or
   //   0 if tracing is off, negative if module is not not loaded 
   u64 addevent(u64 eventnum, u64 arg);
+  // Each distinct (eventnum, number, name) goes into a trace once; repeats 
+  // are skipped, apart from a refresh about once a second for wraparound 
+  // traces. DoReset starts over.
   void addname(u64 eventnum, u64 number, const char* name);
 
+  // Current RPC for the calling thread. arg is the rpcid, optionally with
+  // lglen8 in bits <23:16>; eventnum is KUTRACE_RPCIDREQ or KUTRACE_RPCIDRESP.
+  // An entry goes into the trace only when the thread's RPC actually 
+  // changes, so use these instead of addevent for RPC ids.
+  //   rpc_set     switch to arg (0 = no RPC)
+  //   rpc_push    switch to arg, and rpc_pop switches back to what it was
+  // Handing the current RPC to work queue queue_num takes two steps each way,
+  // so the entries land where the queue operation really happens:
+  //   rpc_enqueue  ENQUEUE entry, at the insert (inside the queue's lock if
+  //                that is where the work is handed off). Returns the RPC's
+  //                arg to keep with the work item
+  //   rpc_enqueued once the hand-off is done, leave this thread with no RPC
+  //   rpc_dequeue  DEQUEUE entry for arg, at the removal
+  //   rpc_dequeued take up arg on the receiving thread
+  // eventtospan draws the time queued from the ENQUEUE/DEQUEUE entries to 
+  // the RPC change after each.
+  void rpc_set(u64 arg, u64 eventnum = KUTRACE_RPCIDREQ);
+  u64 rpc_current();
+  void rpc_push(u64 arg, u64 eventnum = KUTRACE_RPCIDREQ);
+  void rpc_pop();
+  u64 rpc_enqueue(u64 queue_num);
+  void rpc_enqueued();
+  void rpc_dequeue(u64 queue_num, u64 arg);
+  void rpc_dequeued(u64 arg);
+
+  // Sampled RPC tracing. With n > 1, only about one RPC in n gets its 
+  // user-level entries (method name, RPC ids, RX_USER/TX_USER, marks) into 
+  // the trace, plus every RPC that is still going after slow_usec. Kernel 
+  // entries are unaffected. Default is KUTRACE_RPC_SAMPLE=n[,slow_usec], 
+  // else n = 1, tracing every RPC.
+  // rpc_set decides for each new RPC id; call rpc_sample first if the RPC's
+  // entries start before that, e.g. naming its method.
+  void rpc_sample_rate(int n, int slow_usec = 1000);
+  void rpc_sample(u64 rpcid);
+
+  // The choice for rpcid, which uses only the low 16 bits. Client and server
+  // agree without talking, and spantoprof can tell afterward.
+  inline bool rpc_in_sample(u64 rpcid, u64 n) {
+    if (n <= 1) {return true;}
+    u64 hash = ((rpcid & 0xFFFF) * CLU(0x9E3779B97F4A7C15)) >> 32;
+    return (hash % n) == 0;
+  }
+
+  // Opt-in batching for the calling thread. While a batch is open, 
+  // addevent and mark_a..d calls are staged locally with their own 
+  // timestamps and inserted seven at a time with one INSERTN. Staged events
+  // are flushed when seven accumulate, by batch_flush, by batch_end, by 
+  // addname, and by DoOff.
+  void batch_begin();
+  void batch_flush();
+  void batch_end();
+
+  // Batch for the lifetime of a scope
+  class Batch {
+   public:
+    Batch() {batch_begin();}
+    ~Batch() {batch_end();}
+  };
+
+  // Flight recorder. With tracing on in wraparound mode, snapshot writes 
+  // the last window_msec of trace to its own uniquely named file and lets 
+  // tracing continue. It does nothing unless armed here or by environment 
+  // variable KUTRACE_SNAPSHOT_MSEC=<window msec>, and at most one snapshot 
+  // is taken per min_gap_msec. Returns true if a file was written.
+  bool snapshot(const char* reason);
+  void snapshot_arm(int window_msec, int min_gap_msec);
+  void snapshot_disarm();
+
+  // Per-thread counter groups for kutrace::CounterScope in kutrace_scope.h.
+  // spec is a comma-separated list of up to KUTRACE_MAX_COUNTERS names from
+  // kCounterName. Without a call here, the list comes from environment 
+  // variable KUTRACE_COUNTERS, else "llc_miss,br_miss,dtlb_miss". Where the 
+  // hardware counters cannot be opened (no PMU, as in many VMs), a thread 
+  // gets "task_ns,faults,ctx_sw" instead. Returns false if a name is unknown.
+  bool set_counters(const char* spec);
+  // Reads the calling thread's counters into values, returning how many.
+  // Returns 0 if tracing is off or no counters could be opened.
+  int read_counters(u64* values);
+  // One KUTRACE_COUNTER event per counter, after[i] - before[i]
+  void emit_counters(int n, const u64* before, const u64* after);
+
+  // Sample every CPU's clock rate each msec while tracing is on, inserting
+  // KUTRACE_PSTATE entries for kernels that do not. Takes effect at the 
+  // next DoOn. 0 turns it off. Default is KUTRACE_FREQ_MSEC, else off.
+  void freq_sampler(int msec);
+
   void msleep(int msec);
   int64 readtime();
 
@@ -261,6 +424,11 @@ namespace kutrace {
 
   u64 DoControl(u64 command, u64 arg);
   void DoDump(const char* fname);
+  // Streaming: a drainer thread appends completed blocks to fname while 
+  // tracing runs. DoStreamStart goes after DoReset(DO_WRAP...) and DoInit;
+  // DoStreamStop (or DoDump) after DoOff and DoFlush.
+  bool DoStreamStart(const char* fname, u64 control_flags);
+  void DoStreamStop(const char* fname);
   u64 DoEvent(u64 eventnum, u64 arg);
   void DoFlush();
   void DoInit(const char* process_name);
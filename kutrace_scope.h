@@ -0,0 +1,154 @@
+// kutrace_scope.h
+//
+// Header-only helpers on top of kutrace_lib for the common patterns
+//   kutrace::mark_a("copy"); ... kutrace::mark_a("/copy");
+//   kutrace::addevent(KUTRACE_RPCIDREQ, id); ... kutrace::addevent(KUTRACE_RPCIDREQ, 0);
+//
+// Labels are packed to base40 at compile time, so a mark is just an
+// integer constant, with no strlen and no per-character loop at run time.
+// Scopes emit the closing event from their destructor, so early returns
+// cannot leave a span open.
+//
+//   void CopyIt() {
+//     kutrace::Scope<'A'> scope(KUTRACE_LABEL("copy"));	// mark_a copy ... /copy
+//     ...
+//   }
+//
+//   {
+//     kutrace::RpcScope rpc(tempid);		// RPCIDREQ tempid ... back to the outer RPC
+//     ...
+//   }
+//
+//   {
+//     kutrace::CounterScope scope(KUTRACE_LABEL("simp"));	// as Scope<'A'>, plus
+//     ...				// llc_miss=n br_miss=n dtlb_miss=n at /simp
+//   }
+//
+// Compile with -DKUTRACE_DISABLE to remove all of these at zero cost: the
+// classes become empty and the calls compile to nothing. (kutrace_lib.cc
+// itself is still needed for any direct kutrace:: calls.)
+//
+// Copyright 2021 Richard L. Sites
+
+#ifndef __KUTRACE_SCOPE_H__
+#define __KUTRACE_SCOPE_H__
+
+#include <type_traits>		// integral_constant
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+
+namespace kutrace {
+
+// Same mapping as CharToBase40 in kutrace_lib.cc
+// Base40 characters are _abcdefghijklmnopqrstuvwxyz0123456789-./
+//                       0         1         2         3
+// Uppercase are mapped to lowercase. All unexpected characters map to '.'
+constexpr u64 Base40Char(char c) {
+  return (c == '\0') ? 0 :
+         (('a' <= c) && (c <= 'z')) ? (c - 'a' + 1) :
+         (('A' <= c) && (c <= 'Z')) ? (c - 'A' + 1) :
+         (('0' <= c) && (c <= '9')) ? (c - '0' + 27) :
+         (c == '-') ? 37 :
+         (c == '/') ? 39 : 38;
+}
+
+// Pack up to six characters into 32 bits. First character goes in last,
+// comes out first, as in CharToBase40
+constexpr u64 Base40(const char* str, int i = 0) {
+  return ((i >= 6) || (str[i] == '\0')) ? 0 :
+         Base40Char(str[i]) + (40 * Base40(str, i + 1));
+}
+
+// "/" followed by the first five characters of the label
+constexpr u64 Base40Close(u64 base40) {
+  return 39 + (40 * (base40 % (CLU(40) * 40 * 40 * 40 * 40)));
+}
+
+// Event number for mark_a/b/c/d by letter
+constexpr u64 MarkEvent(char kind) {
+  return (kind == 'A') ? KUTRACE_MARKA :
+         (kind == 'B') ? KUTRACE_MARKB :
+         (kind == 'C') ? KUTRACE_MARKC : KUTRACE_MARKD;
+}
+
+}  // End namespace kutrace
+
+// Forces the packing to happen at compile time
+#define KUTRACE_LABEL(str) (std::integral_constant<u64, kutrace::Base40(str)>::value)
+
+namespace kutrace {
+
+#ifndef KUTRACE_DISABLE
+
+// One mark, label already packed: kutrace::mark<'A'>(KUTRACE_LABEL("copy"))
+template<char kind>
+inline void mark(u64 label) {DoMark(MarkEvent(kind), label);}
+
+// mark_a/b/c label at construction, /label at destruction
+template<char kind>
+class Scope {
+ public:
+  explicit Scope(u64 label) : label_(label) {DoMark(MarkEvent(kind), label_);}
+  ~Scope() {DoMark(MarkEvent(kind), Base40Close(label_));}
+ private:
+  u64 label_;
+};
+
+// RPC id for the lifetime of a scope, then back to whatever the thread was
+// working on before (usually no RPC). See kutrace::rpc_push
+class RpcScope {
+ public:
+  explicit RpcScope(u64 arg, u64 eventnum = KUTRACE_RPCIDREQ) {rpc_push(arg, eventnum);}
+  ~RpcScope() {rpc_pop();}
+};
+
+// mark_a label ... /label like Scope<'A'>, and also the calling thread's
+// counter deltas over the region as KUTRACE_COUNTER events just after the
+// closing mark. See kutrace::set_counters for which counters.
+class CounterScope {
+ public:
+  explicit CounterScope(u64 label) : label_(label) {
+    DoMark(KUTRACE_MARKA, label_);
+    n_ = read_counters(before_);
+  }
+  ~CounterScope() {
+    u64 after[KUTRACE_MAX_COUNTERS];
+    int n = read_counters(after);
+    if (n < n_) {n_ = n;}
+    Batch batch;	// Closing mark and counters go in together
+    DoMark(KUTRACE_MARKA, Base40Close(label_));
+    emit_counters(n_, before_, after);
+  }
+ private:
+  u64 label_;
+  int n_;
+  u64 before_[KUTRACE_MAX_COUNTERS];
+};
+
+#else	// KUTRACE_DISABLE
+
+template<char kind>
+inline void mark(u64 label) {}
+
+template<char kind>
+class Scope {
+ public:
+  explicit Scope(u64 label) {}
+};
+
+class RpcScope {
+ public:
+  explicit RpcScope(u64 arg, u64 eventnum = 0) {}
+};
+
+class CounterScope {
+ public:
+  explicit CounterScope(u64 label) {}
+};
+
+#endif	// KUTRACE_DISABLE
+
+}  // End namespace kutrace
+
+#endif	// __KUTRACE_SCOPE_H__
@@ -6,6 +6,7 @@
 #include <sys/time.h>	// gettimeofday
 #include "basetypes.h"
 #include "kutrace_lib.h"
+#include "kutrace_scope.h"
 #include "timecounters.h"
 
 // compile with g++ -O2 matrix.cc  kutrace_lib.cc  -o matrix_ku 
@@ -343,7 +344,11 @@ bool EqualArray(const double* arr1, const double* arr2) {
 void TimeMe(const char* label, MulProc f, const double* a, const double* b, double* c) {
   InitTags();
   int64 start_usec = GetUsec();
-  f(a, b, c);  
+  {
+    // Real LLC/branch/dTLB misses for the multiply, next to the simulated ones
+    kutrace::CounterScope scope(KUTRACE_LABEL("mul"));
+    f(a, b, c);  
+  }
   int64 stop_usec = GetUsec();
   double duration_usec = stop_usec - start_usec;
   fprintf(stdout, "%s\t%5.3f seconds, sum=%18.9f\n", label, duration_usec/1000000.0, SimpleSum(c)); 
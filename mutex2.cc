@@ -17,30 +17,15 @@
 static const int SPIN_ITER = 8;
 static const int SPIN_USEC = 5;
 
-// Global variable. This only has 0->1 transitions after startup and we don't 
-// mind losing a few of those, so no threading issues
-// 16K bits in this array -- we don't use the two high bits of lnamehash
-static uint64 lock_name_added[256] = { 0 };
+// Set when this thread's last contended acquire waited longer than the lock's 
+// expected 90th percentile. The flight-recorder snapshot is taken at release, 
+// so it does not lengthen the lock hold time.
+static __thread const char* snapshot_lock = NULL;
 
+// Add the name of this lock to the trace. kutrace::addname keeps track of
+// which names are already in this trace.
 void TraceLockName(uint16 lnamehash, const char* filename) {
-  // We are tracing. Add the name of this lock if not already added
-  uint64 bitmask = 1 << (lnamehash & 63);
-  int subscr = (lnamehash >> 6) & 255;
-  if ((lock_name_added[subscr] & bitmask) != 0) {return;}
-
-  // Remember that we added the name (do this first to mostly avoid 2 threads bothering)
-  lock_name_added[subscr] |= bitmask;
-  // Add the lock name to the the KUtrace
-  uint64 temp[8];
-  memset(temp, 0, 8 * sizeof(u64));
-  memcpy((char*)(&temp[1]), filename, 22);
-  u64 wordlen = 4;
-  u64 n_with_length = KUTRACE_LOCKNAME + (wordlen * 16);
-  // Build the initial word
-  //         T             N                       ARG
-  temp[0] = (0l << 44) | (n_with_length << 32) | (lnamehash);
-  kutrace::DoControl(KUTRACE_CMD_INSERTN, (u64)&temp[0]);
-fprintf(stderr, "Lock name[%04x] %s\n", lnamehash, (const char*)&temp[1]);
+  kutrace::addname(KUTRACE_LOCKNAME, lnamehash, filename);
 }
 
 // Spin a little until lock is available or enough usec pass
@@ -148,6 +133,7 @@ int32 Acquirelock(int whoami, FancyLock2* flock) {
  
   flock->IncrCounts(elapsed_acquire);
   kutrace::mark_d(elapsed_acquire);	// Microseconds to acquire
+  if (flock->OverExpected(elapsed_acquire)) {snapshot_lock = fstruct->filename;}
   return elapsed_acquire;
 }
 
@@ -167,6 +153,12 @@ void Releaselock(FancyLock2* flock) {
     syscall(SYS_futex, &fstruct->lock, FUTEX_WAKE, 4, NULL, NULL, 0);
     //kutrace::mark_b("/wake");
   }
+
+  // Keep the trace around a slow acquire, if snapshots are armed
+  if (snapshot_lock != NULL) {
+    kutrace::snapshot(snapshot_lock);
+    snapshot_lock = NULL;
+  }
 }
 
 
@@ -3,7 +3,7 @@
 
 export LC_ALL=C
 
-cat $1.trace  |./rawtoevent |sort -n |./eventtospan3 "$2" |sort >$1.json 
+./rawtoevent $1.trace |./eventtospan3 "$2" |sort >$1.json 
 echo "  $1.json written"
 
 trim_arg='0'
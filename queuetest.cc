@@ -304,7 +304,7 @@ void EnqueueBad(Work* item, Queue* queue, int queue_num) {
   }
   queue->tail = item;
   ++queue->count;
-  kutrace::addevent(KUTRACE_ENQUEUE, queue_num);
+  kutrace::rpc_enqueue(queue_num);
   syscall(SYS_futex, &queue->count, FUTEX_WAKE, 0, NULL, NULL, 0);
   // BUG
   // We are still holding the spinlock when FUTEX_WAKE returns. Awakening process
@@ -326,7 +326,7 @@ void EnqueueFixed(Work* item, Queue* queue, int queue_num) {
     ++queue->count;
   } while(false);
   // Spinlock is now released. 
-  kutrace::addevent(KUTRACE_ENQUEUE, queue_num);
+  kutrace::rpc_enqueue(queue_num);
   syscall(SYS_futex, &queue->count, FUTEX_WAKE, 0, NULL, NULL, 0);
 }
 
@@ -338,7 +338,7 @@ inline void Enqueue(Work* item, Queue* queue, int queue_num) {EnqueueBad(item, q
 
 Work* Dequeue(Queue* queue, int queue_num) {
   PlainSpinLock spinlock(&queue->lock);
-  kutrace::addevent(KUTRACE_DEQUEUE, queue_num);
+  kutrace::rpc_dequeue(queue_num, queue->head->log.rpcid);
 
   Work* item = queue->head;
   queue->head = item->next;	// Note: When this goes NULL, tail is garbage
@@ -417,9 +417,9 @@ void GenerateLoop(int n, uint32 rate, bool skew, Queue* primaryqueue) {
     Work* work = CreateWork(i, &rand, skew);
 
     kutrace::addname(KUTRACE_METHODNAME, work->log.rpcid, work->log.method);
-    kutrace::addevent(KUTRACE_RPCIDREQ, work->log.rpcid);
+    kutrace::rpc_set(work->log.rpcid);
     Enqueue(work, primaryqueue, 0);
-    kutrace::addevent(KUTRACE_RPCIDREQ, 0);
+    kutrace::rpc_enqueued();
 
     // Wait xx microseconds
     uint32 wait_usec = GetDelayRand(rand, max_delay_usec, skew);
@@ -476,7 +476,7 @@ void* PrimaryTask(void* arg) {
     // We have a real work item now
     // No locks are needed around pending_count because we are the only thread that changes it.
     Work* item = Dequeue(myqueue, ii);
-    kutrace::addevent(KUTRACE_RPCIDREQ, item->log.rpcid);
+    kutrace::rpc_dequeued(item->log.rpcid);
 ////fprintf(stderr, "PrimaryTask[%d], pending %d\n", ii, pending_count);
 ////DumpWork(stderr, item, true);
 
@@ -488,7 +488,7 @@ void* PrimaryTask(void* arg) {
       if (pending_count <= kMaxTransInFlight) {
         // Not too busy. Move the item to another queue
         Enqueue(item, &queue[next_q], next_q);
-        kutrace::addevent(KUTRACE_RPCIDREQ,0);
+        kutrace::rpc_enqueued();
         continue;
       } else {
         ++dropped_count;
@@ -505,7 +505,7 @@ void* PrimaryTask(void* arg) {
     transaction_times[item->trans_num] = item->log.resp_rcv_timestamp - item->log.req_send_timestamp;
     --pending_count;
     DeleteWork(item);
-    kutrace::addevent(KUTRACE_RPCIDREQ,0);
+    kutrace::rpc_set(0);
   } while (true);
 }
 
@@ -546,7 +546,7 @@ void* WorkerTask(void* arg) {
     Work* item = Dequeue(myqueue, ii);
 ////fprintf(stderr, "WorkerTask[%d]\n", ii);
 ////DumpWork(stderr, item, true);
-    kutrace::addevent(KUTRACE_RPCIDREQ, item->log.rpcid);
+    kutrace::rpc_dequeued(item->log.rpcid);
     uint32 for_q = item->onework[0].queue_num;
     if (for_q != ii) {
       fprintf(stderr, "BUG. Work for queue %d but on queue %d\n", for_q, ii);
@@ -566,7 +566,7 @@ void* WorkerTask(void* arg) {
     // On to the next queue; queue[0] will terminate item
     uint32 next_q = item->onework[0].queue_num;
     Enqueue(item, &queue[next_q], next_q);
-    kutrace::addevent(KUTRACE_RPCIDREQ, 0);
+    kutrace::rpc_enqueued();
   } while (true);
 }
 
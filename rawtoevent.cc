@@ -4,27 +4,50 @@
 //
 // Input has filename like 
 //   kutrace_control_20170821_095154_dclab-1_2056.trace
+// The file is mapped and read in place. It can also come on stdin.
 //
-// Compile with g++ -O2 rawtoevent.cc from_base40.cc kutrace_lib.cc -o rawtoevent
+// Compile with g++ -O2 -pthread rawtoevent.cc from_base40.cc kutrace_lib.cc -o rawtoevent
+//
+// The output comes out already in sort -n order, so no sort step is needed.
+// -b writes the binary form in eventbin.h instead of text, for eventtospan3 
+// to read directly:
+//   rawtoevent foo.trace |eventtospan3 "label"
+//   rawtoevent -b foo.trace |eventtospan3 "label"
+// -v and -h give the old unsorted listing with debugging lines mixed in.
+// -jN decodes blocks on N threads. See Parallel block decoding below.
+//
+// -start <sec> -stop <sec> -cpus <list> decode only the blocks that overlap
+// that window, in the same seconds as the JSON, for those CPUs (e.g. 0,4-7).
+// They use a block index kept next to the trace as foo.trace.idx, built on 
+// first use; -idx just (re)builds it. See Block index below.
 //
 //  od -Ax -tx8z -w32 foo.trace
 //
 
 
 
+#include <algorithm>
 #include <map>
+#include <queue>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
 #include <time.h>
 #include <unistd.h>     // getpid gethostname
+#include <pthread.h>
+#include <sys/mman.h>   // mmap madvise
+#include <sys/stat.h>
 #include <sys/time.h>   // gettimeofday
 #include <sys/types.h>
 
 #include "basetypes.h"
+#include "eventbin.h"
 #include "from_base40.h"
 #include "kutrace_control_names.h"
 #include "kutrace_lib.h"
@@ -41,6 +64,26 @@
 bool verbose = false;
 bool hexevent = false;
 
+// The output is already in sort -n order. -v and -h instead give the events
+// in trace order, interleaved with their debugging lines, as before
+bool sorted_out = true;
+bool names_pass = false;	// First of the two passes when sorted_out
+
+// What each block contributes to a -start/-stop/-cpus window, by block 
+// number. Empty means every block is used in full
+enum {kUseHeader = 0, kUseReplay, kUseAll};
+std::vector<uint8> block_use;
+bool index_pass = false;	// Pass that only builds the block index
+
+// Threads decoding blocks, rawtoevent -jN
+int decode_threads = 1;
+
+// Binary output, rawtoevent -b
+bool binary_out = false;
+std::vector<std::string> bin_strings;		// By id
+std::vector<int32> bin_string_slots;		// Open-addressed hash over bin_strings, -1 = empty
+int bin_strings_written = 0;
+
 
 //VERYTEMP
 //static const uint64 FINDME = 1305990942;
@@ -48,7 +91,18 @@ static const uint64 FINDME = 0;
 
 static const bool TRACEWRAP = false;
 
-static const int kMAX_CPUS = 80;
+// The CPU number is the top byte of each block's word 0
+static const int kMaxCpus = 256;
+
+// What carries from block to block for each CPU, sized to the CPUs present
+typedef struct {
+  uint64 current_pid;		// Keep track of current PID on each core
+  uint64 current_rpc;		// Keep track of current rpcid on each core
+  uint64 prior_timer_irq_nsec10;	// For moving PC sample start_ts back
+  bool at_first_cpu_block;	// To special-case the initial PID of each CPU in trace
+} CpuState;
+
+static const CpuState kInitialCpuState = {0, 0, 0, true};
 
 static const int mhz_32bit_cycles = 54;
 
@@ -158,6 +212,8 @@ static const char* kIdleName = "-idle-";
 using std::map;
 using std::set;
 using std::string;
+using std::unordered_map;
+using std::vector;
 
 static double kDefaultSlope = 0.000285714;  // 1/3500, dclab-3 at 3.5 GHz
 
@@ -220,8 +276,28 @@ int64 CyclesToUsec(int64 cycles, const CyclesToUsecParams& params) {
   return params.base_usec + delta_usec;
 }
 
+// Per-block time calibration left by DoDump, see KUTRACE_CAL_MAGIC in kutrace_lib.h.
+// Maps this block's base cycle to its own gettimeofday value (in 10ns units 
+// past base_minute_usec) and uses its own slope from there, so late blocks in a 
+// long trace do not inherit the drift of one trace-wide slope.
+// Leaves params alone if the block has no calibration.
+void SetBlockParams10(uint64 calword, uint64 base_cycle, uint64 gtod, 
+                      uint64 base_minute_usec, CyclesToUsecParams* params) {
+  if ((calword >> 48) != KUTRACE_CAL_MAGIC) {return;}
+  uint64 frac = (calword >> 32) & 0xffff;		// 1/65536 usec
+  double slope_nsec = (calword & 0xffffffff) / 16777216.0;	// nsec per cycle
+  params->base_cycles10 = base_cycle;
+  params->base_nsec10 = (gtod - base_minute_usec) * 100 + ((frac * 100) >> 16);
+  params->m_slope_nsec10 = slope_nsec / 10.0;
+  if (verbose) {
+    fprintf(stdout, "SetBlockParams10 maps %16lldcy ==> %lldns10, %f ns/cy\n", 
+            base_cycle, params->base_nsec10, slope_nsec);
+  }
+}
+
 uint64 CyclesToNsec10(uint64 cycles, CyclesToUsecParams& params) {
-  int64 delta_nsec10 = (cycles - params.base_cycles10) * params.m_slope_nsec10;
+  // Entries can be a little before a block's base cycle, so signed
+  int64 delta_nsec10 = (int64)(cycles - params.base_cycles10) * params.m_slope_nsec10;
   return params.base_nsec10 + delta_nsec10;
 }
 
@@ -274,6 +350,7 @@ uint64 EventToPid(uint64 event) {return event & 0xFFFF;}
 // Event tests
 inline bool is_cpu_description(uint64 event) {
   if (event == KUTRACE_MBIT_SEC) {return true;}
+  if (event == KUTRACE_RPCSAMPLE) {return true;}
   return false;
 }
 
@@ -298,6 +375,9 @@ inline bool is_return(uint64 event) {return (event <= 0xffff) && (KUTRACE_TRAP <
 // Return true if the event is a time pair
 inline bool is_timepair(uint64 event) {return (event & ~0x0f0) == KUTRACE_TIMEPAIR;}
 
+// Return true if the event is a batch of user events
+inline bool is_batch(uint64 event) {return (event & 0xf0f) == KUTRACE_BATCH;}
+
 // Return true if the event is a name definition
 inline bool is_namedef(uint64 event) {return (0x010 <= event) && (event <= 0x1ff) && (event != KUTRACE_PC_TEMP);}
 
@@ -443,6 +523,283 @@ void OutputName(FILE* f, uint64 nsec10, uint64 nameinsert, uint32 argall, const
 }
 #endif
 
+//--------------------------------------------------------------------------//
+// Binary output                                                            //
+//--------------------------------------------------------------------------//
+
+// FNV-1a
+inline uint32 NameHash(const char* s, int len) {
+  uint32 hash = 2166136261u;
+  for (int i = 0; i < len; ++i) {hash = (hash ^ (uint8)s[i]) * 16777619u;}
+  return hash;
+}
+
+// Put id in the first empty slot for its hash
+void BinSlotInsert(int32 id) {
+  const string& str = bin_strings[id];
+  uint32 mask = bin_string_slots.size() - 1;
+  uint32 slot = NameHash(str.data(), str.size()) & mask;
+  while (bin_string_slots[slot] >= 0) {slot = (slot + 1) & mask;}
+  bin_string_slots[slot] = id;
+}
+
+// The id of these len bytes, whose NameHash is hash, adding them if new.
+// Decode threads hash the names, so ProcessTrace only probes
+int32 BinStringId(const char* str, int len, uint32 hash) {
+  if (bin_string_slots.empty()) {bin_string_slots.resize(1024, -1);}
+  uint32 mask = bin_string_slots.size() - 1;
+  uint32 slot = hash & mask;
+  while (bin_string_slots[slot] >= 0) {
+    const string& s = bin_strings[bin_string_slots[slot]];
+    if ((s.size() == len) && (memcmp(s.data(), str, len) == 0)) {return bin_string_slots[slot];}
+    slot = (slot + 1) & mask;
+  }
+  int32 id = bin_strings.size();
+  bin_strings.push_back(string(str, len));
+  bin_string_slots[slot] = id;
+  // Keep the table at most half full
+  if (bin_string_slots.size() < 2 * bin_strings.size()) {
+    bin_string_slots.assign(2 * bin_string_slots.size(), -1);
+    for (int32 i = 0; i < bin_strings.size(); ++i) {BinSlotInsert(i);}
+  }
+  return id;
+}
+
+int32 BinStringId(const char* str) {
+  int len = strlen(str);
+  return BinStringId(str, len, NameHash(str, len));
+}
+
+// The text line for rec, exactly as OutputName/OutputEvent print it
+void BinToText(const BinEvent& rec, char* buf, int len) {
+  const char* name = bin_strings[rec.name].c_str();
+  if ((KUTRACE_VARLENLO <= rec.eventnum) && (rec.eventnum <= KUTRACE_VARLENHI)) {
+    snprintf(buf, len, "%lld %lld %d %d %s", 
+             rec.start_ts, rec.duration, rec.eventnum, rec.arg, name);
+  } else {
+    snprintf(buf, len, "%lld %lld %d %u  %u %u  %u %u %d %s (%x)", 
+             rec.start_ts, rec.duration, rec.eventnum, rec.cpu, 
+             rec.pid, rec.rpcid, rec.arg, rec.retval, rec.ipc, name, rec.eventnum);
+  }
+}
+
+// Decimal digits in x
+inline int DigitCount(uint64 x) {
+  int n = 1;
+  while (x >= 10) {x /= 10; ++n;}
+  return n;
+}
+
+// How two decimal fields compare as text, byte by byte, when a space 
+// follows each: <0, 0, >0. Where one is a prefix of the other, the space 
+// sorts ahead of the next digit; a minus sign sorts ahead of any digit
+int TextCompare(uint64 a, uint64 b) {
+  if (a == b) {return 0;}
+  int na = DigitCount(a);
+  int nb = DigitCount(b);
+  uint64 lead_a = a;
+  uint64 lead_b = b;
+  for (int i = nb; i < na; ++i) {lead_a /= 10;}
+  for (int i = na; i < nb; ++i) {lead_b /= 10;}
+  if (lead_a != lead_b) {return (lead_a < lead_b) ? -1 : 1;}
+  return (na < nb) ? -1 : 1;
+}
+
+int SignedTextCompare(int64 a, int64 b) {
+  if ((a < 0) != (b < 0)) {return (a < 0) ? -1 : 1;}
+  if (a < 0) {return TextCompare(-(uint64)a, -(uint64)b);}
+  return TextCompare(a, b);
+}
+
+// Same order as sort -n on the text: by timestamp, then ties by the whole
+// line, byte by byte. The numbers are compared as BinToText would print 
+// them; only if they all match are the lines formatted, for the name
+bool BinLess(const BinEvent& a, const BinEvent& b) {
+  if (a.start_ts != b.start_ts) {return a.start_ts < b.start_ts;}
+  int c = SignedTextCompare(a.duration, b.duration);
+  if (c == 0) {c = SignedTextCompare(a.eventnum, b.eventnum);}
+  if (c == 0) {
+    if ((KUTRACE_VARLENLO <= a.eventnum) && (a.eventnum <= KUTRACE_VARLENHI)) {
+      c = SignedTextCompare(a.arg, b.arg);
+    } else {
+      // %u fields
+      c = TextCompare((uint32)a.cpu, (uint32)b.cpu);
+      if (c == 0) {c = TextCompare((uint32)a.pid, (uint32)b.pid);}
+      if (c == 0) {c = TextCompare((uint32)a.rpcid, (uint32)b.rpcid);}
+      if (c == 0) {c = TextCompare((uint32)a.arg, (uint32)b.arg);}
+      if (c == 0) {c = TextCompare((uint32)a.retval, (uint32)b.retval);}
+      if (c == 0) {c = SignedTextCompare(a.ipc, b.ipc);}
+    }
+  }
+  if (c != 0) {return c < 0;}
+  if (a.name == b.name) {return false;}
+  char abuf[256];
+  char bbuf[256];
+  BinToText(a, abuf, sizeof(abuf));
+  BinToText(b, bbuf, sizeof(bbuf));
+  return strcmp(abuf, bbuf) < 0;
+}
+
+//--------------------------------------------------------------------------//
+// End binary output                                                        //
+//--------------------------------------------------------------------------//
+
+//--------------------------------------------------------------------------//
+// Sorted output                                                            //
+//--------------------------------------------------------------------------//
+//
+// This replaces rawtoevent |sort -n, for text and binary output alike.
+// Each CPU's blocks are already close to time order; batches, held RPC 
+// entries, and PC samples moved back to their timer interrupt go back a 
+// little. So each CPU keeps its pending events in a small heap, and a heap
+// over the CPUs merges them.
+//
+// The first pass over the trace only finds the earliest timestamp in each 
+// block and collects the name copies at -1 and the # comments, which go out 
+// ahead of everything. In the second pass, no block later in the file has 
+// anything before the earliest of the remaining blocks, so everything before
+// that is released as each block starts. What is pending is roughly the 
+// last block of each CPU.
+//
+// 2026.10.17 Intel Xeon VM, one CPU, 124MB user-mode trace of 16.26M events,
+// identical output either way:
+//   rawtoevent |sort -n    16.9 s + 14.8 s
+//   rawtoevent (sorted)    24.4 s            13.8MB max RSS
+//   rawtoevent -b          13.3 s -> 11.0 s  1.1GB -> 13.8MB max RSS
+
+static const int64 kNoTime = 0x7FFFFFFFFFFFFFFFll;
+
+struct BinGreater {
+  bool operator()(const BinEvent& a, const BinEvent& b) const {return BinLess(b, a);}
+};
+typedef std::priority_queue<BinEvent, std::vector<BinEvent>, BinGreater> EventHeap;
+
+std::vector<BinEvent> name_copies;	// The -1 copies, from the first pass
+std::vector<std::string> comments;	// From the first pass
+std::vector<int64> block_lo;		// Earliest timestamp in each block and later
+int current_block = 0;
+std::vector<EventHeap> pending;		// By CPU, second pass
+
+// Orders CPUs by their earliest pending event
+struct CpuGreater {
+  bool operator()(int a, int b) const {return BinLess(pending[b].top(), pending[a].top());}
+};
+
+// One record, text or binary. Strings are defined just ahead of first use
+void WriteSorted(FILE* f, const BinEvent& rec) {
+  if (binary_out) {
+    while (bin_strings_written <= rec.name) {
+      WriteBinString(f, bin_strings_written, bin_strings[bin_strings_written]);
+      ++bin_strings_written;
+    }
+    fwrite(&rec, 1, sizeof(rec), f);
+    return;
+  }
+  if (rec.eventnum == kBinComment) {
+    fputs(bin_strings[rec.name].c_str(), f);
+    fputc('\n', f);
+    return;
+  }
+  char buf[256];
+  BinToText(rec, buf, sizeof(buf));
+  fputs(buf, f);
+  fputc('\n', f);
+}
+
+// name_hash, if not NULL, is NameHash of name
+void SortedOutput(int64 nsec10, int64 duration, uint64 event, uint64 cpu, 
+                  uint64 pid, uint64 rpc, uint64 arg, uint64 retval, int ipc, 
+                  const char* name, const uint32* name_hash) {
+  if (names_pass && (0 <= nsec10)) {
+    if (nsec10 < block_lo[current_block]) {block_lo[current_block] = nsec10;}
+    return;
+  }
+  if (!names_pass && (nsec10 < 0)) {return;}	// Already out, from the first pass
+
+  BinEvent rec;
+  rec.start_ts = nsec10;
+  rec.duration = duration;
+  rec.eventnum = event;
+  rec.cpu = cpu;
+  rec.pid = pid;
+  rec.rpcid = rpc;
+  rec.arg = arg;
+  rec.retval = retval;
+  rec.ipc = ipc;
+  if (name_hash == NULL) {
+    rec.name = BinStringId(name);
+  } else {
+    rec.name = BinStringId(name, strlen(name), *name_hash);
+  }
+  if (names_pass) {name_copies.push_back(rec); return;}
+  if (pending.size() <= cpu) {pending.resize(cpu + 1);}
+  pending[cpu].push(rec);
+}
+
+// Everything pending before lo, in order
+void ReleaseBefore(FILE* f, int64 lo) {
+  std::priority_queue<int, std::vector<int>, CpuGreater> cpus;
+  for (int cpu = 0; cpu < pending.size(); ++cpu) {
+    if (!pending[cpu].empty() && (pending[cpu].top().start_ts < lo)) {cpus.push(cpu);}
+  }
+  while (!cpus.empty()) {
+    int cpu = cpus.top();
+    cpus.pop();
+    WriteSorted(f, pending[cpu].top());
+    pending[cpu].pop();
+    if (!pending[cpu].empty() && (pending[cpu].top().start_ts < lo)) {cpus.push(cpu);}
+  }
+}
+
+// At the start of each block, and with the block count after the last one
+void SortedBlock(FILE* f, int blocknumber) {
+  if (!sorted_out) {return;}
+  current_block = blocknumber;
+  if (names_pass) {
+    if (block_lo.size() <= blocknumber) {block_lo.resize(blocknumber + 1, kNoTime);}
+    return;
+  }
+  ReleaseBefore(f, (blocknumber < block_lo.size()) ? block_lo[blocknumber] : kNoTime);
+}
+
+// Between the passes: the name copies, then the comments, as sort -n has 
+// them (numerically 0, and '#' sorts ahead of digits). See eventbin.h
+void SortedFront(FILE* f) {
+  for (int i = (int)block_lo.size() - 2; 0 <= i; --i) {
+    if (block_lo[i + 1] < block_lo[i]) {block_lo[i] = block_lo[i + 1];}
+  }
+  if (binary_out) {fwrite(kEventBinMagic, 1, sizeof(kEventBinMagic), f);}
+  std::stable_sort(name_copies.begin(), name_copies.end(), BinLess);
+  for (int i = 0; i < name_copies.size(); ++i) {WriteSorted(f, name_copies[i]);}
+  std::sort(comments.begin(), comments.end());
+  BinEvent rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.eventnum = kBinComment;
+  for (int i = 0; i < comments.size(); ++i) {
+    rec.name = BinStringId(comments[i].c_str());
+    WriteSorted(f, rec);
+  }
+}
+
+//--------------------------------------------------------------------------//
+// End sorted output                                                        //
+//--------------------------------------------------------------------------//
+
+// A # line. fmt includes the newline
+void OutputComment(FILE* f, const char* fmt, ...) {
+  if (index_pass) {return;}
+  char buf[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (!sorted_out) {fputs(buf, f); return;}
+  if (!names_pass) {return;}	// Already out, from the first pass
+  int len = strlen(buf);
+  if ((0 < len) && (buf[len - 1] == '\n')) {buf[--len] = '\0';}
+  comments.push_back(string(buf));
+}
+
 // Change any spaces and non-Ascii to underscore
 // time dur event pid name(event)
 void OutputName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char* name) {
@@ -457,16 +814,22 @@ void OutputName(FILE* f, uint64 nsec10, uint64 event, uint32 argall, const char*
   uint64 len = ((strlen(name) + 7) >> 3) + 1;
   event = (event & 0xF0F) | (len << 4);		// Set name length
 
+  if (sorted_out) {
+    SortedOutput(nsec10, dur, event, 0, 0, 0, argall, 0, 0, name, NULL);
+    SortedOutput(-1, dur, event, 0, 0, 0, argall, 0, 0, name, NULL);
+    return;
+  }
   fprintf(f, "%lld %lld %lld %d %s\n", nsec10, dur, event, argall, name);
   // Also put the name at the very front of the sorted event list
   fprintf(f, "%lld %lld %lld %d %s\n", -1ll, dur, event, argall, name);
 }
 
 // time dur event cpu  pid rpc  arg retval IPC name(event)
+// name_hash is for SortedOutput, or NULL
 void OutputEvent(FILE* f, 
                  uint64 nsec10, uint64 duration, uint64 event, uint64 current_cpu,
                  uint64 pid, uint64 rpc, 
-                 uint64 arg, uint64 retval, int ipc, const char* name) {
+                 uint64 arg, uint64 retval, int ipc, const char* name, const uint32* name_hash) {
   // Avoid crazy big times
   bool fail = false;
   if (nsec10 >= 99900000000LL) {fail = true;}
@@ -477,6 +840,10 @@ void OutputEvent(FILE* f,
     return;
   }
 
+  if (sorted_out) {
+    SortedOutput(nsec10, duration, event, current_cpu, pid, rpc, arg, retval, ipc, name, name_hash);
+    return;
+  }
   fprintf(f, "%lld %lld %lld %lld  %lld %lld  %lld %lld %d %s (%llx)\n", 
           nsec10, duration, event, current_cpu, 
           pid, rpc, 
@@ -537,10 +904,1041 @@ string ReduceSpaces(string s) {
   return s.substr(0, k);
 }
 
+//--------------------------------------------------------------------------//
+// Trace file                                                               //
+//--------------------------------------------------------------------------//
 //
-// Usage: rawtoevent <trace file name>
+// The trace is mapped read-only and its blocks are decoded in place, with no
+// copying. Each 64KB block is followed by 8KB of IPC bytes if its flags say
+// so, and the place of every block is worked out once up front, so both 
+// passes and the decode threads can go straight to any block. A pipe on 
+// stdin is first copied to an unnamed temporary file, which is then mapped.
 //
-int main (int argc, const char** argv) {
+// 2026.10.17 Intel Xeon VM, 124MB trace in the page cache, rawtoevent -b:
+// system time 0.19 s with fread, 0.08 s mapped. The total, about 9.5 s, is
+// the same within run-to-run noise; reading was never much of it.
+
+static const size_t kTraceBlockBytes = kTraceBufSize * sizeof(uint64);
+static const uint8 kNoIpc[kTraceBufSize] = {0};	// Default if no IPC data
+
+// Where one block is
+typedef struct {
+  const uint64* traceblock;
+  const uint8* ipcblock;
+  uint64 offset;			// In the file
+} BlockPlace;
+
+typedef struct {
+  const uint8* base;
+  size_t size;
+  int64 mtime;				// To tell if a block index is stale
+  std::vector<BlockPlace> blocks;		// In file order
+  std::vector<std::vector<uint64> > tails;	// Zero-padded copy of a short last block
+} TraceFile;
+
+// len bytes at offset, in place, or a zero-padded copy if the file ends first
+const void* TraceBytes(TraceFile* trace, size_t offset, size_t len) {
+  if ((offset + len) <= trace->size) {return trace->base + offset;}
+  trace->tails.push_back(std::vector<uint64>((len + 7) / 8, 0));
+  memcpy(trace->tails.back().data(), trace->base + offset, trace->size - offset);
+  return trace->tails.back().data();
+}
+
+// False if f is not a regular file that maps
+bool MapTrace(FILE* f, TraceFile* trace) {
+  struct stat st;
+  int fd = fileno(f);
+  if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)) {return false;}
+  trace->base = NULL;
+  trace->size = st.st_size;
+  trace->mtime = st.st_mtime;
+  trace->blocks.clear();
+  if (trace->size == 0) {return true;}
+
+  void* p = mmap(NULL, trace->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {return false;}
+  // Hints only. Huge pages of a page-cache file need kernel support
+  madvise(p, trace->size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(p, trace->size, MADV_HUGEPAGE);
+#endif
+  trace->base = reinterpret_cast<const uint8*>(p);
+
+  size_t offset = 0;
+  while (offset < trace->size) {
+    BlockPlace place;
+    place.offset = offset;
+    place.traceblock = reinterpret_cast<const uint64*>(TraceBytes(trace, offset, kTraceBlockBytes));
+    place.ipcblock = kNoIpc;
+    offset += kTraceBlockBytes;
+    // For each 64KB traceblock that has IPC_Flag set, also the IPC bytes
+    if (HasIPC(place.traceblock[1] >> 56) && (offset < trace->size)) {
+      place.ipcblock = reinterpret_cast<const uint8*>(TraceBytes(trace, offset, kTraceBufSize));
+      offset += kTraceBufSize;
+    }
+    trace->blocks.push_back(place);
+  }
+  return true;
+}
+
+// Copy a pipe to an unnamed temporary file, to map
+FILE* CopyToTemp(FILE* f) {
+  FILE* temp = tmpfile();
+  if (temp == NULL) {
+    fprintf(stderr, "rawtoevent: no temporary file to hold stdin\n");
+    exit(0);
+  }
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) != 0) {fwrite(buf, 1, n, temp);}
+  fflush(temp);
+  return temp;
+}
+
+// One more than the largest CPU number in any block
+int CpuCount(const TraceFile& trace) {
+  int count = 1;
+  for (int k = 0; k < trace.blocks.size(); ++k) {
+    int cpu = trace.blocks[k].traceblock[0] >> 56;
+    if (count <= cpu) {count = cpu + 1;}
+  }
+  return count;
+}
+
+//--------------------------------------------------------------------------//
+// End trace file                                                           //
+//--------------------------------------------------------------------------//
+
+//--------------------------------------------------------------------------//
+// Block time decoding                                                      //
+//--------------------------------------------------------------------------//
+//
+// Turning each entry's 20-bit timestamp into multiples of 10ns needs only 
+// the block itself and the time base from block 0. DecodeTimes does it for
+// a whole block at once, and it is the one place that knows how entries are
+// laid out: it lists where each real entry starts, past NOPs, batch headers,
+// the rest of a name, and the PC word of a PC sample. The main loop walks 
+// that list, and the block index takes each block's times and contents from
+// the same pass.
+
+// What a block has in it besides ordinary events, for the block index
+static const uint32 kHasIpc = 0x01;
+static const uint32 kHasNames = 0x02;		// Or hardware description
+static const uint32 kHasRpc = 0x04;
+static const uint32 kHasTimerIrq = 0x08;
+static const uint32 kHasSwitch = 0x10;
+
+// From block 0, for decoding all the others
+typedef struct {
+  bool unshifted_word_0;
+  uint8 first_flags;
+  uint64 base_minute_usec;
+  CyclesToUsecParams file_params;
+} TimeBase;
+
+// One block in place, plus its decoded times
+typedef struct {
+  const uint64* traceblock;		// 8 bytes per trace entry
+  const uint8* ipcblock;		// One byte per trace entry
+  int number;				// Block number in the file
+  uint64 base_nsec10;			// Block base cycle count
+  int64 first_nsec10;			// Earliest and latest entry times
+  int64 last_nsec10;
+  uint32 contents;			// kHasNames etc.
+  uint64 nsec10[kTraceBufSize];		// Start time of the entry at each word
+  uint64 opt_nsec10[kTraceBufSize];	// End time of an optimized call
+  int entries;				// Real entries in the block
+  uint16 entry[kTraceBufSize];		// Word where each one starts
+} TraceBlock;
+
+// Fill in blk's entries and their times. Blocks outside a -start/-stop/-cpus
+// window need only the base time, for the PID name at the front
+void DecodeTimes(const TimeBase& tb, bool very_first_block, TraceBlock* blk) {
+  const uint64* traceblock = blk->traceblock;
+  blk->first_nsec10 = kNoTime;
+  blk->last_nsec10 = 0;
+  blk->entries = 0;
+  blk->contents = HasIPC(traceblock[1] >> 56) ? kHasIpc : 0;
+  bool has_block_header = (TracefileVersion(tb.first_flags) >= 3) && !tb.unshifted_word_0;
+  int first_real_entry = 2;
+  if (very_first_block) {first_real_entry = tb.unshifted_word_0 ? 6 : 8;}
+
+  // Pick out times for converting to 100Mhz
+  uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
+  uint64 gtod = traceblock[1] & 0x00fffffffffffffful;
+  if (tb.unshifted_word_0) {base_cycle >>= OLD_RDTSC_SHIFT;}
+  uint64 prepend = base_cycle & ~0xfffff;
+
+  // Use this block's own time calibration if it has one
+  CyclesToUsecParams params = tb.file_params;
+  if (has_block_header) {
+    SetBlockParams10(traceblock[first_real_entry + 1], base_cycle, gtod, 
+                     tb.base_minute_usec, &params);
+  }
+  blk->base_nsec10 = CyclesToNsec10(base_cycle, params);
+  if (!block_use.empty() && (block_use[blk->number] == kUseHeader)) {return;}
+
+  // The base cycle count for this block may well be a bit later than the truncated time
+  // in the first real entry, and may have wrapped in its low 20 bits. If so, the high bits 
+  // we want to prepend should be one smaller.
+  uint64 first_timestamp = traceblock[first_real_entry] >> 44;
+  uint64 prior_t = first_timestamp;
+  bool keep_just_names = HasWraparound(tb.first_flags) && very_first_block;
+  if (has_block_header) {first_real_entry += 4;}
+
+  // We wrapped if high bit of first_timestamp is 1 and high bit of base is 0
+  if (Wrapped(first_timestamp, base_cycle)) {
+    prepend -= 0x100000; 
+    if (TRACEWRAP) {fprintf(stdout, "  Wrap0 %05llx %05llx\n", first_timestamp, base_cycle);}
+  }
+
+  // While inside the payload of a batch of held RPC entries, their own 
+  // time base, and the block's to go back to after payload_end
+  int payload_end = -1;
+  uint64 saved_prepend = 0;
+  uint64 saved_prior_t = 0;
+
+  for (int i = first_real_entry; i < kTraceBufSize; ++i) {
+    if ((0 <= payload_end) && (payload_end <= i)) {
+      prepend = saved_prepend;
+      prior_t = saved_prior_t;
+      payload_end = -1;
+    }
+    if (traceblock[i] == 0LLU) {continue;}
+    if (traceblock[i] == 0xffffffffffffffffLLU) {break;}
+
+    uint64 t = traceblock[i] >> 44;			// Timestamp
+    uint64 n = (traceblock[i] >> 32) & 0xfff;		// event number
+    uint64 argall = traceblock[i] & 0xffffffff;
+    uint64 delta_t = (traceblock[i] >> 24) & 0xff;	// Opt syscall return timestamp
+    if ((t == 0xFFFFF) && (n == 0xFFF)) {continue;}
+
+    // A batch header is just a container. Its payload words are ordinary 
+    // entries with their own (earlier) timestamps, so skip only the header
+    // and leave prior_t alone.
+    // Held RPC entries can be far older than the header. For those, back
+    // gives the approximate time of the first payload word, and the payload
+    // wraps on its own from there.
+    if (is_batch(n)) {
+      uint64 back = argall >> 8;
+      uint64 words = argall & 0xff;
+      if ((back == 0) || (words == 0) || (kTraceBufSize <= (i + words))) {continue;}
+      if (Wrapped(prior_t, t)) {prepend += 0x100000;}
+      prior_t = t;
+      saved_prepend = prepend;
+      saved_prior_t = prior_t;
+      payload_end = i + 1 + words;
+
+      // Pick the wrap of the first payload word closest to the approximate time
+      uint64 approx = (prepend | t) - (back << 8);
+      uint64 t1 = traceblock[i + 1] >> 44;
+      uint64 t1full = (approx & ~0xfffffllu) | t1;
+      if (t1full > (approx + 0x80000)) {t1full -= 0x100000;}
+      else if ((t1full + 0x80000) < approx) {t1full += 0x100000;}
+      prepend = t1full & ~0xfffffllu;
+      prior_t = t1;
+      continue;
+    }
+
+
+    // Convert truncated start time to full-width start time
+    // Increment the prepend if truncated time rolls over
+    if (Wrapped(prior_t, t)) {prepend += 0x100000;}
+    prior_t = t;
+
+    // tfull is increments of cycles from the base minute for this trace, 
+    // also expressed as increments of cycles
+    uint64 tfull = prepend | t;
+
+    // nsec10 is increments of 10ns from the base minute.
+    // For a trace starting at 50 seconds into a minute and spanning 99 seconds, 
+    // this reaches 14,900,000,000 which means the 
+    // base minute + 149.000 000 00 seconds. More than 32 bits.
+    blk->entry[blk->entries++] = i;
+    blk->nsec10[i] = CyclesToNsec10(tfull, params);
+    if (is_opt_call(n, delta_t)) {
+      blk->opt_nsec10[i] = CyclesToNsec10(tfull + delta_t, params);
+    }
+    if ((int64)blk->nsec10[i] < blk->first_nsec10) {blk->first_nsec10 = blk->nsec10[i];}
+    if (blk->last_nsec10 < (int64)blk->nsec10[i]) {blk->last_nsec10 = blk->nsec10[i];}
+    if (is_namedef(n) || is_cpu_description(n)) {blk->contents |= kHasNames;}
+    if (has_rpcid(n)) {blk->contents |= kHasRpc;}
+    if (is_timer_irq(n)) {blk->contents |= kHasTimerIrq;}
+    if (is_contextswitch(n)) {blk->contents |= kHasSwitch;}
+
+    // Skip the rest of a name, or the PC word of a PC sample
+    if (is_namedef(n)) {
+      int len = (n >> 4) & 0x00f;
+      if ((len < 1) || (8 < len)) {continue;}
+      i += (len - 1);
+      continue;
+    }
+    if (is_pc_sample(n) && !keep_just_names) {++i;}
+  }
+}
+
+//--------------------------------------------------------------------------//
+// End block time decoding                                                  //
+//--------------------------------------------------------------------------//
+
+//--------------------------------------------------------------------------//
+// Parallel block decoding                                                  //
+//--------------------------------------------------------------------------//
+//
+// Decoding a block's entries -- times, args, and the name of each event --
+// needs only the block, the time base from block 0, and the names defined
+// ahead of it. rawtoevent -jN does that on N threads, each block into its
+// own vector of decoded entries. The main loop in ProcessTrace is then the
+// ordered merge. In file order it carries what really is sequential: each
+// CPU's current pid and rpcid, the timer interrupt a PC sample moves back
+// to, pstate samples about other CPUs, the statistics, and the output.
+//
+// The names come first. A quick pass on the same threads collects the names
+// each block defines, including the PID name at its front. An entry then
+// sees the latest definition from any earlier block, or its own block's so
+// far. The names pass before sorted output keeps them for the output pass.
+// Without -j the names are added as each block is decoded. -v and -h
+// always decode on one thread, since their debugging lines are in trace
+// order.
+//
+// 2026.10.17 Intel Xeon VM with ONE CPU, 300MB trace of 37.5M events in the
+// page cache, rawtoevent -b, output identical for every N:
+//   before -j 18.7 s, -j1 16.6 s, -j2 17.8 s, -j4 19.6 s,
+//   -j8 17.8 s, -j16 17.4 s
+// One CPU can only show the overhead, 5-18% over -j1. Thread CPU times at -j2
+// say where more CPUs would help: merge 8.6 s, decode threads 8.7 s. So
+// wall time should come down to about the merge, half, at two CPUs and
+// stay there. Text output at -j4 is merge 28.8 s, decode 10.3 s, since the
+// text formatting is in the merge.
+
+static const int kMaxDecodeThreads = 64;
+static const int kBlocksAhead = 4;	// Per thread, decoded ahead of the merge
+
+// One entry of a block, as decoding the block alone gives it
+typedef struct {
+  uint64 nsec10;	// Before a PC sample is moved back to its timer interrupt
+  uint64 duration;
+  uint64 event;		// As output; a PC sample becomes KUTRACE_PC_K/U
+  uint64 arg;
+  uint64 retval;
+  uint64 freq_mhz;	// CPU frequency from a PC sample, or 0
+  int name;		// In the block's text, or -1
+  uint8 ipc;
+  bool has_arg;		// For -h
+} DecodedEntry;
+
+// A name as a block defines it, keyed by PID#, RPC# etc. with high type nibble
+typedef struct {
+  uint64 key;
+  string name;
+} NameDef;
+
+// One definition of a name, by the block it is in
+typedef struct {
+  int block;
+  string name;
+} NameAt;
+
+// Each name's definitions in file order
+typedef unordered_map<uint64, vector<NameAt> > NameHistory;
+
+// The names as one entry sees them: its block's own so far, then the
+// latest from earlier blocks
+typedef struct {
+  int block;
+  U64toString own;
+} NameView;
+
+// One block in place, plus everything decoded from it
+typedef struct {
+  TraceBlock block;
+  vector<DecodedEntry> decoded;		// One per block.entry[]
+  vector<string> text;			// Event names; [0] is empty
+  vector<uint32> text_hash;		// NameHash of each
+  vector<NameDef> defs;			// Names this block defines, in order
+} DecodedBlock;
+
+// Where ProcessTrace is in the trace, and the threads decoding ahead of it.
+// With threads, block k is decoded into slots[k % slots.size()]
+typedef struct {
+  const TraceFile* trace;
+  TimeBase timebase;
+  vector<DecodedBlock> slots;
+  int position;				// Next block for ProcessTrace
+  bool all_names;			// name_history has every block's names
+  vector<pthread_t> threads;
+  pthread_mutex_t lock;			// Covers the rest
+  pthread_cond_t changed;
+  int next_decode;			// Next block for a thread
+  int merged;				// Blocks ProcessTrace is done with
+  vector<bool> ready;			// By slot
+} BlockReader;
+
+// For the names pass over blocks first, first + decode_threads, ...
+typedef struct {
+  BlockReader* reader;
+  int first;
+  vector<vector<NameDef> >* defs;	// By block
+} NamesArg;
+
+NameHistory name_history;		// For the current pass
+bool name_history_full = false;		// Every block's, kept for later passes
+
+// A block with a crazy gettimeofday is skipped
+bool CrazyGtod(const uint64* traceblock) {
+  static const uint64 usec_per_100_years = 1000000LL * 86400 * 365 * 100;  // Thru ~2070
+  return usec_per_100_years <= (traceblock[1] & 0x00fffffffffffffful);
+}
+
+// The PID at the front of a block and its name, which the block defines
+string BlockPidName(const uint64* traceblock, int first_real_entry, uint64* pid) {
+  *pid = traceblock[first_real_entry + 0] & 0x00000000ffffffffLLU;
+  char pidname[24];
+  memcpy(pidname, reinterpret_cast<const char*>(&traceblock[first_real_entry + 2]), 16);
+  pidname[16] = '\0';
+  // Don't change pid 0
+  if (*pid == 0) {strcpy(pidname, kIdleName);}
+  return MakeSafeAscii(string(pidname));
+}
+
+// The name a name definition at word i gives. False if none
+bool NameDefAt(const uint64* traceblock, int i, NameDef* def) {
+  uint64 n = (traceblock[i] >> 32) & 0xfff;
+  uint64 arg = traceblock[i] & 0x0000ffff;
+  // Remap the raw numbering to unique ranges in names[]
+  uint64 nameinsert;
+  if (is_pidnamedef(n)) {
+    nameinsert = PidToEvent(arg); 	  // Processes 0..64K
+  } else if (is_locknamedef(n)) {
+    nameinsert = arg | 0x20000;		  // Lock names
+  } else if (is_methodnamedef(n)) {
+    nameinsert = arg | 0x30000;		  // RPC method names; arg_hi may be TenLg msg len
+  } else if (is_kernelnamedef(n)) {
+    nameinsert = arg | 0x40000;		  // Kernel version
+  } else if (is_modelnamedef(n)) {
+    nameinsert = arg | 0x50000;		  // CPU model
+  } else if (is_hostnamedef(n)) {
+    nameinsert = arg | 0x60000;		  // CPU host name
+  } else if (is_queuenamedef(n)) {
+    nameinsert = arg | 0x70000;		  // Queue name
+  } else if (is_resnamedef(n)) {
+    nameinsert = arg | 0x80000;		  // Resource name
+  } else {
+    nameinsert = ((n & 0x00f) << 8) | arg;  // Syscall, etc. Include type of name
+  }
+
+  int len = (n >> 4) & 0x00f;
+  if ((len < 1) || (8 < len)) {return false;}
+  // Ignore any timepair but keep the names
+  if (is_timepair(n)) {return false;}
+  char tempstring[64];
+  memset(tempstring, 0, 64);
+  memcpy(tempstring, &traceblock[i + 1], (len - 1) * 8);
+  // Don't change pid 0
+  if (nameinsert == 0x10000) {strcpy(tempstring, kIdleName);}
+  string name = string(tempstring);
+  if (is_kernelnamedef(n) || is_modelnamedef(n)) {
+    name = ReduceSpaces(name);
+  }
+  name = MakeSafeAscii(name);
+  // Throw away the empty name
+  if (name.empty()) {return false;}
+  def->key = nameinsert;
+  def->name = name;
+  return true;
+}
+
+// Only the idle process, pid 0, is named at the start
+void StartNames() {
+  name_history.clear();
+  NameAt idle = {-1, string(kIdleName)};
+  name_history[0x10000].push_back(idle);
+}
+
+// A later definition in the same block replaces an earlier one
+void AddNames(int block, const vector<NameDef>& defs) {
+  for (int k = 0; k < defs.size(); ++k) {
+    vector<NameAt>& at = name_history[defs[k].key];
+    if (!at.empty() && (at.back().block == block)) {
+      at.back().name = defs[k].name;
+    } else {
+      NameAt def = {block, defs[k].name};
+      at.push_back(def);
+    }
+  }
+}
+
+// The name for key as an entry sees it, or NULL if none yet
+const string* FindName(const NameView& view, uint64 key) {
+  U64toString::const_iterator mine = view.own.find(key);
+  if (mine != view.own.end()) {return &mine->second;}
+  NameHistory::const_iterator it = name_history.find(key);
+  if (it == name_history.end()) {return NULL;}
+  // The last definition in a block before this one
+  const vector<NameAt>& at = it->second;
+  int lo = 0;
+  int hi = at.size();
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (at[mid].block < view.block) {lo = mid + 1;} else {hi = mid;}
+  }
+  return (lo == 0) ? NULL : &at[lo - 1].name;
+}
+
+// The name, or empty if none yet
+string NameOrEmpty(const NameView& view, uint64 key) {
+  const string* name = FindName(view, key);
+  return (name == NULL) ? string("") : *name;
+}
+
+// Index of s, moved to the end of the block's text. Empty is always 0
+int BlockText(DecodedBlock* db, string* s) {
+  if (s->empty()) {return 0;}
+  int k = db->text.size();
+  db->text.push_back(string());
+  db->text.back().swap(*s);
+  db->text_hash.push_back(NameHash(db->text[k].data(), db->text[k].size()));
+  return k;
+}
+
+// Decode the entries of db, whose times are done, into db->decoded, and
+// list the names it defines in db->defs. With just_names, only the latter.
+// Everything here depends only on the block and the names before it; what
+// carries from block to block per CPU is left to ProcessTrace
+void DecodeEntries(const TimeBase& tb, bool very_first_block, bool just_names,
+                   DecodedBlock* db) {
+  const TraceBlock* blk = &db->block;
+  const uint64* traceblock = blk->traceblock;
+  const uint8* ipcblock = blk->ipcblock;
+  db->decoded.clear();
+  db->text.assign(1, string(""));
+  db->text_hash.assign(1, NameHash("", 0));
+  db->defs.clear();
+  if (CrazyGtod(traceblock)) {return;}
+  int use = block_use.empty() ? kUseAll : block_use[blk->number];
+  bool keep_just_names = HasWraparound(tb.first_flags) && very_first_block;
+
+  NameView view;
+  view.block = blk->number;
+  // Every block has PID and pidname at the front
+  if ((TracefileVersion(tb.first_flags) >= 3) && !tb.unshifted_word_0) {
+    int first_real_entry = very_first_block ? 8 : 2;
+    NameDef def;
+    uint64 pid;
+    def.name = BlockPidName(traceblock, first_real_entry, &pid);
+    def.key = PidToEvent(pid);
+    view.own[def.key] = def.name;
+    db->defs.push_back(def);
+  }
+
+  if (!just_names) {db->decoded.resize(blk->entries);}
+  for (int k = 0; k < blk->entries; ++k) {
+    int i = blk->entry[k];
+    uint64 n = (traceblock[i] >> 32) & 0xfff;		// event number
+    if (just_names) {
+      NameDef def;
+      if (is_namedef(n) && NameDefAt(traceblock, i, &def)) {db->defs.push_back(def);}
+      continue;
+    }
+
+    DecodedEntry* e = &db->decoded[k];
+    e->nsec10 = blk->nsec10[i];		// Full start time, from DecodeTimes
+    e->freq_mhz = 0;
+    e->name = -1;
+    bool has_arg = false;	// Set true if low 32 bits are used
+    uint8 ipc = ipcblock[i];
+    uint64 arg    = traceblock[i] & 0x0000ffff;	// syscall/ret arg/retval
+    uint64 argall = traceblock[i] & 0xffffffff;	// mark_a/b/c/d, etc.
+    uint64 delta_t = (traceblock[i] >> 24) & 0xff;	// Opt syscall return timestamp
+    uint64 retval = (traceblock[i] >> 16) & 0xff;	// Opt syscall retval
+
+    // Sign extend optimized retval [-128..127] from 8 bits to 16
+    retval = (uint64)(((int64)(retval << 56)) >> 56) & 0xffff;
+
+    if (n == KUTRACE_USERPID) {has_arg = true;}	// Context switch
+    // 2019.03.18 Go back to preserving KUTRACE_USERPID for eventtospan
+    uint64 event = n;
+    uint64 duration = 0;
+    if (has_rpcid(n)) {has_arg = true;}
+
+    // Pick out any name definitions
+    if (is_namedef(n)) {
+      NameDef def;
+      if (NameDefAt(traceblock, i, &def)) {
+        view.own[def.key] = def.name;
+        db->defs.push_back(def);
+        string text = def.name;
+        e->name = BlockText(db, &text);
+      }
+      continue;
+    }
+
+    // Only events that are written out need more
+    if (keep_just_names || (use != kUseAll)) {continue;}
+    // PSTATE about another CPU: ProcessTrace has all it needs
+    if ((n == KUTRACE_PSTATE) && ((argall >> 16) != 0)) {continue;}
+
+    // Here n is the original 12-bit event; event is (pid | 64K) if n is user-mode code
+    string name = string("");
+
+    // Put in name of event
+    if (is_return(n)) {
+      uint64 call_event = event & ~0x0200;
+      const string* call_name = FindName(view, call_event);
+      if (call_name != NULL) {name.append("/" + *call_name);}
+    } else {
+      const string* event_name = FindName(view, event);
+      if (event_name != NULL) {name.append(*event_name);}
+    }
+
+    if (is_contextswitch(n)) {
+      has_arg = true;
+      const string* target_name = FindName(view, PidToEvent(arg));
+      if (target_name != NULL) {name.append(*target_name);}
+      name = AppendNum(name, arg);
+    }
+
+    if (is_usermode(event)) {
+      const string* event_name = FindName(view, event);
+      if (event_name != NULL) {name.append(*event_name);}
+      name = AppendNum(name, EventToPid(event));
+    }
+
+    // If this is an optimized call, pick out the duration and leave return value
+    // The ipc value for this is two 4-bit values:
+    //   low bits IPC before call, high bits IPC within call
+    if (is_opt_call(n, delta_t)) {
+      has_arg = true;
+      // Optimized call with delta_t and retval
+      duration = blk->opt_nsec10[i] - e->nsec10;
+      if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
+    } else {
+      retval = 0;
+    }
+
+    // A PC sample is the entry plus a second word with the PC. See the
+    // layout in ProcessTrace, which also moves it back to its timer interrupt
+    if (is_pc_sample(n)) {
+      has_arg = true;
+      uint64 pc_sample = traceblock[i + 1];	// The second word, the PC sample
+      // Change to PC eventnum, either kernel or user sample address
+      event = n = (pc_sample & 0x8000000000000000LLU) ? KUTRACE_PC_K : KUTRACE_PC_U;
+      e->freq_mhz = arg;
+      // Put a hash of the PC name into arg, so HTML display can choose colors quickly
+      arg = (pc_sample >> 6) & 0xFFFF;	// Initial hash just uses PC bits <21:6>
+						// This is used for drawing color
+						// If addrtoline is used later, reset arg
+      retval = 0;
+      ipc = 0;
+      char temp_hex[24];
+      sprintf(temp_hex, "PC=%012llx", pc_sample);	// Normally 48-bit PC
+      name = string(temp_hex);
+    }
+
+    // If this is a special event marker, keep the name and arg
+    if (is_special(n)) {
+      has_arg = true;
+      name.append(string(kSpecialName[n & 0x001f]));
+      if (has_rpcid(n)) {
+        name = AppendNum(NameOrEmpty(view, arg | 0x30000), arg);	// method.rpcid
+      } else if (is_lock(n)) {
+        name = string(kSpecialName[n & 0x001f]) + NameOrEmpty(view, arg | 0x20000);  // try_lockname etc.
+      } else if (is_raw_pkt_hash(n)  || is_user_msg_hash(n)) {
+        uint64 hash16 = ((argall >> 16) ^ argall) & 0xffffLLU;	// HTML shows this 16-bit hash
+        name = AppendHexNum(name, hash16);
+      } else if (n == KUTRACE_RUNNABLE) {
+        // Include which PID is being made runnable, from arg
+        name = AppendNum(name, arg);
+      } else if (n == KUTRACE_COUNTER) {
+        // Counter kind and delta, e.g. llc_miss=1234, with the delta as arg
+        arg = argall & 0x0fffffff;
+        char temp[24];
+        sprintf(temp, "=%lld", arg);
+        name = string(kCounterName[argall >> 28]) + string(temp);
+      }
+      if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
+    }
+
+    // If this is an unoptimized return, move the arg value to retval
+    if (is_return(n)) {
+      has_arg = true;
+      retval = arg;
+      arg = 0;
+    }
+
+    // If this is a call to an irq bottom half routine, name it
+    if (is_bottom_half(n)) {
+      has_arg = true;
+      name.append(":");
+      name.append(string(soft_irq_name[arg & 0x000f]));
+    }
+
+    // If this is a packet rx or tx, remember the time
+    // Step (1) of RPC-to-packet correlation
+    // NOTE: the hash stored in KUTRACE_RX_PKT KUTRACE_TX_PKT is 32 bits
+    // Convention: hash16 is always shown in hex caps. Other numbers in decimal
+    if (is_raw_pkt_hash(n) || is_user_msg_hash(n)) {
+      arg = argall;	// Retain all 32 bits in output
+    }
+
+    // If this packet is an RPC processing start, look to create the message span
+    // arg is the rpcid and arg_hi is the 16-bit packet-beginning hash
+    // Step (3) of RPC-to-packet correlation
+    if (is_rpc_msg(n) && (arg != 0)) {
+      arg = argall;	// Retain all 32 bits in output
+    }
+
+    // MARK_A,B,C arg is six base-40 chars NUL, A_Z, 0-9, . - /
+    // MARK_D     arg is unsigned int
+    // +-------------------+-----------+-------------------------------+
+    // | timestamp         | event     |              arg              |
+    // +-------------------+-----------+-------------------------------+
+    //          20              12                    32
+    if (is_mark_abc(n)) {
+      has_arg = true;
+      // Include the marker label string, from all 32 bits af argument
+      arg = argall;	// Retain all 32 bits in output
+      name += "=";
+      char temp[8];
+      name += Base40ToChar(arg, temp);
+    }
+
+    e->duration = duration;
+    e->event = event;
+    e->arg = arg;
+    e->retval = retval;
+    e->ipc = ipc;
+    e->has_arg = has_arg;
+    // The first pass writes no event names, just where each block starts
+    e->name = names_pass ? 0 : BlockText(db, &name);
+  }
+}
+
+// Times, then entries. The index pass needs just the times
+void DecodeBlock(const TimeBase& tb, bool very_first_block, DecodedBlock* db) {
+  DecodeTimes(tb, very_first_block, &db->block);
+  if (!index_pass) {DecodeEntries(tb, very_first_block, false, db);}
+}
+
+// Point db at block k, not yet decoded
+void PlaceBlock(const TraceFile& trace, int k, DecodedBlock* db) {
+  db->block.traceblock = trace.blocks[k].traceblock;
+  db->block.ipcblock = trace.blocks[k].ipcblock;
+  db->block.number = k;
+}
+
+// The names each block from first on defines, every decode_threads blocks
+void* NamesWorker(void* arg) {
+  NamesArg* names = reinterpret_cast<NamesArg*>(arg);
+  BlockReader* reader = names->reader;
+  DecodedBlock* db = &reader->slots[names->first];	// Not in use yet
+  for (int k = 1 + names->first; k < reader->trace->blocks.size(); k += decode_threads) {
+    PlaceBlock(*reader->trace, k, db);
+    DecodeTimes(reader->timebase, false, &db->block);
+    DecodeEntries(reader->timebase, false, true, db);
+    (*names->defs)[k].swap(db->defs);
+  }
+  return NULL;
+}
+
+// Take the next block, decode it, and mark its slot ready, until the end.
+// Stays at most slots.size() blocks ahead of ProcessTrace
+void* DecodeWorker(void* arg) {
+  BlockReader* reader = reinterpret_cast<BlockReader*>(arg);
+  int total = reader->trace->blocks.size();
+  int size = reader->slots.size();
+  pthread_mutex_lock(&reader->lock);
+  while (true) {
+    while ((reader->next_decode < total) &&
+           ((reader->merged + size) <= reader->next_decode)) {
+      pthread_cond_wait(&reader->changed, &reader->lock);
+    }
+    if (total <= reader->next_decode) {break;}
+    int k = reader->next_decode++;
+    pthread_mutex_unlock(&reader->lock);
+
+    DecodedBlock* db = &reader->slots[k % size];
+    PlaceBlock(*reader->trace, k, db);
+    DecodeBlock(reader->timebase, false, db);
+
+    pthread_mutex_lock(&reader->lock);
+    reader->ready[k % size] = true;
+    pthread_cond_broadcast(&reader->changed);
+  }
+  pthread_mutex_unlock(&reader->lock);
+  return NULL;
+}
+
+void StartReader(const TraceFile& trace, BlockReader* reader) {
+  reader->trace = &trace;
+  reader->slots.resize((decode_threads > 1) ? kBlocksAhead * decode_threads : 1);
+  reader->position = 0;
+  reader->all_names = name_history_full;
+  reader->threads.clear();
+  reader->next_decode = 1;
+  reader->merged = 0;
+  reader->ready.assign(reader->slots.size(), false);
+  if (!reader->all_names) {StartNames();}
+}
+
+// Once block 0 is done: every block's names, unless an earlier pass has
+// them, then the decode threads. If none start, the blocks are decoded one
+// at a time as before
+void StartThreads(const TimeBase& tb, BlockReader* reader) {
+  reader->timebase = tb;
+  if (!index_pass && !reader->all_names) {
+    vector<vector<NameDef> > defs(reader->trace->blocks.size());
+    vector<NamesArg> args(decode_threads);
+    vector<pthread_t> threads;
+    for (int t = 0; t < decode_threads; ++t) {
+      args[t].reader = reader;
+      args[t].first = t;
+      args[t].defs = &defs;
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, NamesWorker, &args[t]) == 0) {
+        threads.push_back(thread);
+      } else {
+        NamesWorker(&args[t]);
+      }
+    }
+    for (int t = 0; t < threads.size(); ++t) {pthread_join(threads[t], NULL);}
+    for (int k = 1; k < defs.size(); ++k) {AddNames(k, defs[k]);}
+    reader->all_names = true;
+    name_history_full = true;
+  }
+
+  pthread_mutex_init(&reader->lock, NULL);
+  pthread_cond_init(&reader->changed, NULL);
+  for (int t = 0; t < decode_threads; ++t) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, DecodeWorker, reader) == 0) {
+      reader->threads.push_back(thread);
+    }
+  }
+  if (reader->threads.empty()) {
+    fprintf(stderr, "rawtoevent: decode threads did not start, using one\n");
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->changed);
+  }
+}
+
+// The next block with everything decoded, or NULL at the end. The block
+// returned before is then done with. Block 0 comes undecoded (tb is NULL),
+// since it sets up the time base; ProcessTrace decodes it
+DecodedBlock* NextBlock(const TraceFile& trace, const TimeBase* tb, BlockReader* reader) {
+  int k = reader->position;
+  if ((k == 1) && (decode_threads > 1)) {StartThreads(*tb, reader);}
+  bool threaded = !reader->threads.empty();
+  if (trace.blocks.size() <= k) {
+    if (threaded) {
+      for (int t = 0; t < reader->threads.size(); ++t) {pthread_join(reader->threads[t], NULL);}
+      reader->threads.clear();
+      pthread_mutex_destroy(&reader->lock);
+      pthread_cond_destroy(&reader->changed);
+    }
+    return NULL;
+  }
+  ++reader->position;
+
+  if (!threaded) {
+    DecodedBlock* db = &reader->slots[0];
+    PlaceBlock(trace, k, db);
+    if (tb != NULL) {
+      DecodeBlock(*tb, false, db);
+      if (!reader->all_names && !index_pass) {AddNames(k, db->defs);}
+    }
+    return db;
+  }
+
+  int size = reader->slots.size();
+  pthread_mutex_lock(&reader->lock);
+  reader->ready[(k - 1) % size] = false;
+  reader->merged = k;
+  pthread_cond_broadcast(&reader->changed);
+  while (!reader->ready[k % size]) {
+    pthread_cond_wait(&reader->changed, &reader->lock);
+  }
+  pthread_mutex_unlock(&reader->lock);
+  return &reader->slots[k % size];
+}
+
+//--------------------------------------------------------------------------//
+// End parallel block decoding                                              //
+//--------------------------------------------------------------------------//
+
+//--------------------------------------------------------------------------//
+// Block index                                                              //
+//--------------------------------------------------------------------------//
+//
+// rawtoevent -start/-stop/-cpus decodes just the blocks that overlap the 
+// window. To find them, foo.trace.idx has for each block its file offset, 
+// CPU, earliest and latest full-width entry times, and what it holds besides
+// ordinary events. Building it is one pass that only decodes block times.
+// It is rebuilt if the trace's size or modification time no longer match.
+//
+// The window needs a little more than its own blocks to come out right:
+//   every block's PID name, from its header alone
+//   every name and hardware description entry, wherever it is
+//   each CPU's rpcid, PID, and last timer interrupt going into the window,
+//     from its last earlier block with each of those
+// Those blocks are replayed for names and per-CPU state, with no events 
+// written. Each CPU's first block in the window then starts with the PID 
+// it is running, as at the start of a trace. The window is whole blocks, so
+// it can run a little past -start and -stop; spantotrim cuts it exactly.
+//
+// 2026.10.17 Intel Xeon VM, one CPU, 124MB user-mode trace of 16.26M events 
+// spanning 0.84 s, rawtoevent -b:
+//   whole trace                  9.1 s
+//   build foo.trace.idx (62KB)   0.11 s
+//   -start 9.5 -stop 9.55        0.62 s
+//   -start 9.5 -stop 9.6         1.15 s
+// Inside the window every event matches the whole-trace output.
+
+static const char kTraceIdxMagic[8] = {'K', 'U', 't', 'i', 'd', 'x', '1', '\0'};
+
+// One block
+typedef struct {
+  uint64 offset;		// In the trace file
+  int64 first_nsec10;		// kNoTime if no entries
+  int64 last_nsec10;
+  uint32 cpu;
+  uint32 contents;		// kHasNames etc.
+} BlockIndex;
+
+// Followed by one BlockIndex per block
+typedef struct {
+  char magic[8];
+  uint64 trace_size;
+  int64 trace_mtime;
+  uint64 blocks;
+} IndexHeader;
+
+std::vector<BlockIndex> block_index;	// By block number
+
+// -start/-stop/-cpus
+int64 window_start = 0;
+int64 window_stop = kNoTime;
+std::vector<bool> window_cpus;		// Empty means all
+
+// Empty entries for the index pass to fill in. Blocks that fail their 
+// sanity checks stay empty
+void StartIndex(const TraceFile& trace) {
+  block_index.resize(trace.blocks.size());
+  for (int k = 0; k < trace.blocks.size(); ++k) {
+    BlockIndex* b = &block_index[k];
+    b->offset = trace.blocks[k].offset;
+    b->first_nsec10 = kNoTime;
+    b->last_nsec10 = 0;
+    b->cpu = trace.blocks[k].traceblock[0] >> 56;
+    b->contents = 0;
+  }
+}
+
+// From the index pass
+void IndexBlock(int blocknumber, const TraceBlock* blk) {
+  BlockIndex* b = &block_index[blocknumber];
+  b->first_nsec10 = blk->first_nsec10;
+  b->last_nsec10 = blk->last_nsec10;
+  b->contents = blk->contents;
+}
+
+// False if there is no index for this trace, or it is stale
+bool ReadIndex(const char* fname, const TraceFile& trace) {
+  FILE* f = fopen(fname, "rb");
+  if (f == NULL) {return false;}
+  IndexHeader hdr;
+  bool ok = (fread(&hdr, 1, sizeof(hdr), f) == sizeof(hdr)) &&
+            (memcmp(hdr.magic, kTraceIdxMagic, 8) == 0) &&
+            (hdr.trace_size == trace.size) &&
+            (hdr.trace_mtime == trace.mtime) &&
+            (hdr.blocks == trace.blocks.size());
+  if (ok) {
+    block_index.resize(hdr.blocks);
+    size_t len = hdr.blocks * sizeof(BlockIndex);
+    ok = (fread(block_index.data(), 1, len, f) == len);
+  }
+  fclose(f);
+  return ok;
+}
+
+void WriteIndex(const char* fname, const TraceFile& trace) {
+  FILE* f = fopen(fname, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "rawtoevent: %s not written\n", fname);
+    return;
+  }
+  IndexHeader hdr;
+  memcpy(hdr.magic, kTraceIdxMagic, 8);
+  hdr.trace_size = trace.size;
+  hdr.trace_mtime = trace.mtime;
+  hdr.blocks = block_index.size();
+  fwrite(&hdr, 1, sizeof(hdr), f);
+  fwrite(block_index.data(), 1, block_index.size() * sizeof(BlockIndex), f);
+  fclose(f);
+  fprintf(stderr, "rawtoevent: %s written, %d blocks\n", fname, (int)block_index.size());
+}
+
+// CPU numbers like 0,4-7. False if malformed
+bool ParseCpus(const char* list) {
+  window_cpus.assign(kMaxCpus, false);
+  const char* p = list;
+  while (*p != '\0') {
+    char* end;
+    long lo = strtol(p, &end, 10);
+    long hi = lo;
+    if (end == p) {return false;}
+    p = end;
+    if (*p == '-') {
+      hi = strtol(p + 1, &end, 10);
+      if (end == p + 1) {return false;}
+      p = end;
+    }
+    if ((lo < 0) || (hi < lo) || (kMaxCpus <= hi)) {return false;}
+    for (long cpu = lo; cpu <= hi; ++cpu) {window_cpus[cpu] = true;}
+    if (*p == ',') {++p;}
+    else if (*p != '\0') {return false;}
+  }
+  return true;
+}
+
+// Fill in block_use from the index and the window
+void ChooseBlocks() {
+  int n = block_index.size();
+  block_use.assign(n, kUseHeader);
+  // Per CPU, the last block not in the window with each kind of state, 
+  // since the previous one that was
+  std::vector<int> last_rpc(kMaxCpus, -1);
+  std::vector<int> last_timer(kMaxCpus, -1);
+  std::vector<int> last_switch(kMaxCpus, -1);
+  for (int k = 0; k < n; ++k) {
+    const BlockIndex& b = block_index[k];
+    int cpu = b.cpu;
+    bool in_window = (window_cpus.empty() || window_cpus[cpu]) &&
+                     (b.first_nsec10 <= b.last_nsec10) &&
+                     (b.first_nsec10 <= window_stop) && (window_start <= b.last_nsec10);
+    if (in_window) {
+      block_use[k] = kUseAll;
+      if (0 <= last_rpc[cpu]) {block_use[last_rpc[cpu]] = kUseReplay;}
+      if (0 <= last_timer[cpu]) {block_use[last_timer[cpu]] = kUseReplay;}
+      if (0 <= last_switch[cpu]) {block_use[last_switch[cpu]] = kUseReplay;}
+      last_rpc[cpu] = last_timer[cpu] = last_switch[cpu] = -1;
+      continue;
+    }
+    if (b.contents & kHasNames) {block_use[k] = kUseReplay;}
+    if (b.contents & kHasRpc) {last_rpc[cpu] = k;}
+    if (b.contents & kHasTimerIrq) {last_timer[cpu] = k;}
+    if (b.contents & kHasSwitch) {last_switch[cpu] = k;}
+  }
+  // Block 0 always, for the time base
+  if ((0 < n) && (block_use[0] == kUseHeader)) {block_use[0] = kUseReplay;}
+}
+
+//--------------------------------------------------------------------------//
+// End block index                                                          //
+//--------------------------------------------------------------------------//
+
+// One pass over all the blocks of the trace
+void ProcessTrace(const TraceFile& trace) {
   // Some statistics
   uint64 base_usec_timestamp;
   uint64 event_count = 0;
@@ -554,14 +1952,12 @@ int main (int argc, const char** argv) {
   memset(events_by_type, 0, 16 * sizeof(uint64));
 
   uint64 current_cpu = 0;
-  uint64 traceblock[kTraceBufSize];	// 8 bytes per trace entry
-  uint8 ipcblock[kTraceBufSize];	// One byte per trace entry
+  BlockReader reader;			// The blocks, decoded ahead of here
+  TimeBase timebase;			// From block 0, for decoding the rest
+  bool have_timebase = false;
+  StartReader(trace, &reader);
 
-  uint64 current_pid[kMAX_CPUS];	// Keep track of current PID on each of 16+ cores
-  uint64 current_rpc[kMAX_CPUS]; 	// Keep track of current rpcid on each of 1+6 cores
-  uint64 prior_timer_irq_nsec10[kMAX_CPUS];	// For moving PC sample start_ts back
-  bool at_first_cpu_block[kMAX_CPUS];	// To special-case the initial PID of each CPU in trace
-  U64toString names;			// Name keyed by PID#, RPC# etc. with high type nibble
+  std::vector<CpuState> cpus(CpuCount(trace), kInitialCpuState);	// Just the CPUs in the trace
 
   // Start timepair is set by DoInit
   // Stop timepair is set by DoOff
@@ -569,43 +1965,22 @@ int main (int argc, const char** argv) {
   // which was done in some earlier run of this program. In that case, go 
   // find the start pair as the first real trace entry in the first trace block.
   CyclesToUsecParams params;
+  CyclesToUsecParams file_params;	// From block 0, for blocks without their own
 
   // Events are 0..64K-1 for everything except context switch.
   // Context switch events are 0x10000 + pid
-  // Initialize idle process name, pid 0
-  names[0x10000] = string(kIdleName);
+  // Names, keyed by PID#, RPC# etc. with high type nibble, are looked up
+  // as each block is decoded. StartReader names the idle process, pid 0
   
-  for (int i = 0; i < kMAX_CPUS; ++i) {
-    current_pid[i] = 0; 
-    current_rpc[i] = 0;
-    prior_timer_irq_nsec10[i] = 0;
-    at_first_cpu_block[i] = true;
-  }
-
   // For converting cycle counts to multiples of 100ns
   double m = kDefaultSlope;
 
-  FILE* f = stdin;
-  if (argc >= 2) {
-    f = fopen(argv[1], "rb");
-    if (f == NULL) {
-      fprintf(stderr, "%s did not open\n", argv[1]);
-      exit(0);
-    }
-  }
-
-  // Pick up flags
-  for (int i = 1; i < argc; ++i) {
-    if (strcmp(argv[i], "-v") == 0) {verbose = true;}
-    if (strcmp(argv[i], "-h") == 0) {hexevent = true;}
-  }
-
   int blocknumber = 0;
   uint64 base_minute_usec, base_minute_cycle, base_minute_shift;
   bool unshifted_word_0 = false;
 
   // Need this to sort in front of allthe timestamps
-  fprintf(stdout, "# ## VERSION: %d\n", kRawVersionNumber);
+  OutputComment(stdout, "# ## VERSION: %d\n", kRawVersionNumber);
   uint8 all_flags = 0;	// They should all be the same
   uint8 first_flags;	// Just first block has tracefile version number
 
@@ -613,18 +1988,27 @@ int main (int argc, const char** argv) {
   //--------------------------------------------------------------------------//
   // Outer loop over blocks                                                   //
   //--------------------------------------------------------------------------//
-  while (fread(traceblock, 1, sizeof(traceblock), f) != 0) {
+  DecodedBlock* db;
+  while ((db = NextBlock(trace, have_timebase ? &timebase : NULL, &reader)) != NULL) {
+    const TraceBlock* blk = &db->block;
+    const uint64* traceblock = blk->traceblock;
+    const uint8* ipcblock = blk->ipcblock;
+    blocknumber = blk->number;
+    // Outside a -start/-stop/-cpus window, just names and per-CPU state
+    int use = block_use.empty() ? kUseAll : block_use[blocknumber];
+    SortedBlock(stdout, blocknumber);
+
     // Need first [1] line to get basetime in later steps
     // TODO: Move this to a stylized BASETIME comment
-    fprintf(stdout, "# blocknumber %d\n", blocknumber);
-    fprintf(stdout, "# [0] %016llx\n", traceblock[0]);
-    fprintf(stdout, "# [1] %s %02llx\n", 
+    OutputComment(stdout, "# blocknumber %d\n", blocknumber);
+    OutputComment(stdout, "# [0] %016llx\n", traceblock[0]);
+    OutputComment(stdout, "# [1] %s %02llx\n", 
             FormatUsecDateTime(traceblock[1] & 0x00fffffffffffffful),
             traceblock[1] >> 56);
-    fprintf(stdout, 
+    OutputComment(stdout, 
             "# TS      DUR EVENT CPU PID RPC ARG0 RETVAL IPC NAME (t and dur multiples of 10ns)\n");
 
-    if (verbose || hexevent) {
+    if ((verbose || hexevent) && !index_pass) {
        fprintf(stdout, "%% %02llx %014llx\n", traceblock[0] >> 56, traceblock[0] & 0x00fffffffffffffful);
        fprintf(stdout, "%% %02llx %014llx\n", traceblock[1] >> 56, traceblock[1] & 0x00fffffffffffffful);
     }
@@ -636,7 +2020,6 @@ int main (int argc, const char** argv) {
 
     // Pick out CPU number for this traceblock
     current_cpu = traceblock[0] >> 56;
-    uint64 base_cycle = traceblock[0] & 0x00fffffffffffffful;
 
     // traceblock[1] has flags in top byte. 
     uint8 flags = traceblock[1] >> 56;
@@ -646,10 +2029,7 @@ int main (int argc, const char** argv) {
     static const uint64 usec_per_100_years = 1000000LL * 86400 * 365 * 100;  // Thru ~2070
 
     bool fail = false;
-    if (kMAX_CPUS <= current_cpu) {
-      fprintf(stderr, "FAIL: block[%d] CPU number %lld > max %d\n", blocknumber, current_cpu, kMAX_CPUS);
-      fail = true;
-    }
+    // No constraints on the CPU number; per-CPU state is sized to the trace
     // No constraints on base_cycle
     // No constraints on flags
     if (usec_per_100_years <= gtod) {
@@ -659,15 +2039,6 @@ int main (int argc, const char** argv) {
   
 
     all_flags |= flags;
-    bool this_block_has_ipc = (HasIPC(flags));
-
-    // For each 64KB traceblock that has IPC_Flag set, also read the IPC bytes
-    if (this_block_has_ipc) {
-      // Extract 8KB IPC block
-      int n = fread(ipcblock, 1, sizeof(ipcblock), f);
-    } else {
-      memset(ipcblock, 0, sizeof(ipcblock));	// Default if no IPC data
-    }
 
 // WRAPAROUND PROBLEM:
 // We pick base_minute_usec here in block 0, but it can be
@@ -720,7 +2091,7 @@ fprintf(stderr, "  ratio  %lld\n", ratio);
 fprintf(stderr, "  elapsed cycles  %lld\n", elapsed_cycles);
       }
 
-      if (verbose || hexevent) {
+      if ((verbose || hexevent) && !index_pass) {
         fprintf(stdout, "%% %016llx = %lldcy %lldus (%lld mod 1min)\n", 
           traceblock[2], start_cycles, start_usec, start_usec % 60000000l);
         fprintf(stdout, "%% %016llx\n", traceblock[3]);
@@ -794,8 +2165,15 @@ fprintf(stderr, "  elapsed cycles  %lld\n", elapsed_cycles);
 
       // Now instead map base_minute_cycle <==> 0
       SetParams10(base_minute_cycle, 0, &params);
+      file_params = params;
 
       first_flags = flags;
+
+      timebase.unshifted_word_0 = unshifted_word_0;
+      timebase.first_flags = first_flags;
+      timebase.base_minute_usec = base_minute_usec;
+      timebase.file_params = file_params;
+      have_timebase = true;
 //fprintf(stderr, "first_flags %02x\n", first_flags);
     }	// End of block[0] preprocessing
 
@@ -809,17 +2187,19 @@ fprintf(stderr, "  elapsed cycles  %lld\n", elapsed_cycles);
 
     // Pick out CPU number for this traceblock
     current_cpu = traceblock[0] >> 56;
-    unique_cpus.insert(current_cpu);	// stats
+    if (use == kUseAll) {unique_cpus.insert(current_cpu);}	// stats
 
-    // Pick out times for converting to 100Mhz
-    if (unshifted_word_0) {base_cycle >>= OLD_RDTSC_SHIFT;}
-    uint64 prepend = base_cycle & ~0xfffff;
+    // Block 0 was read alone, before there was a time base to decode it
+    if (very_first_block) {
+      DecodeBlock(timebase, true, db);
+      if (!index_pass && !reader.all_names) {AddNames(0, db->defs);}
+    }
 
-    // The base cycle count for this block may well be a bit later than the truncated time
-    // in the first real entry, and may have wrapped in its low 20 bits. If so, the high bits 
-    // we want to prepend should be one smaller.
-    uint64 first_timestamp = traceblock[first_real_entry] >> 44;
-    uint64 prior_t = first_timestamp;
+    if (index_pass) {
+      IndexBlock(blocknumber, blk);
+      ++blocknumber;
+      continue;
+    }
 
     // If wraparound trace and in very_first_block, suppress everything except name entries
     // and hardware description
@@ -830,17 +2210,16 @@ fprintf(stderr, "  elapsed cycles  %lld\n", elapsed_cycles);
       /* CPU frequency may be in the first block per CPU, in the high half of pid */
       uint64 pid = traceblock[first_real_entry + 0] & 0x00000000ffffffffLLU;
       uint64 freq_mhz = traceblock[first_real_entry + 0] >> 32;
-      uint64 unused = traceblock[first_real_entry + 1];
       char pidname[24];
-      memcpy(pidname, reinterpret_cast<char*>(&traceblock[first_real_entry + 2]), 16);
+      memcpy(pidname, reinterpret_cast<const char*>(&traceblock[first_real_entry + 2]), 16);
       pidname[16] = '\0';
-if (at_first_cpu_block[current_cpu]) {
+if (cpus[current_cpu].at_first_cpu_block && !names_pass && (use == kUseAll)) {
 fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz, pidname);
 }
 
-      if (verbose || hexevent) {
+      if ((verbose || hexevent) && (use == kUseAll)) {
         fprintf(stdout, "%% %016llx pid %lld\n", traceblock[first_real_entry + 0], pid);
-        fprintf(stdout, "%% %016llx unused\n",  traceblock[first_real_entry + 1]);
+        fprintf(stdout, "%% %016llx calibration\n",  traceblock[first_real_entry + 1]);
         fprintf(stdout, "%% %016llx name %s\n", traceblock[first_real_entry + 2], pidname);
         fprintf(stdout, "%% %016llx name\n",    traceblock[first_real_entry + 3]);
         fprintf(stdout, "\n");
@@ -852,28 +2231,25 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
 //   | flags |                  gettimeofday                         | 1 DoDump
 //   +-------------------------------+-------------------------------+
 //   |           u n u s e d         |            PID                | 2 or 8  module
-//   +-------------------------------+-------------------------------+
-//   |                          u n u s e d                          | 3 or 9  module
-//   +-------------------------------+-------------------------------+
+//   +---------------+---------------+-------------------------------+
+//   | 0xCA1B magic  | usec fraction |  calibration slope            | 3 or 9  DoDump
+//   +---------------+---------------+-------------------------------+
 //   |                                                               | 4 or 10 module
 //   +                            pidname                            +
 //   |                                                               | 5 or 11 module
 //   +-------------------------------+-------------------------------+
 
-      // Remember the name for this pid, except don't change pid 0
-      uint64 nameinsert = PidToEvent(pid);
-      if (pid == 0) {strcpy(pidname, kIdleName);}
-      string name = MakeSafeAscii(string(pidname));
-      names[nameinsert] = name;
+      // The block's decode has remembered the name for this pid
+      string name = BlockPidName(traceblock, first_real_entry, &pid);
       
       // To allow updates of the reconstruction stack in eventtospan
-      uint64 nsec10 = CyclesToNsec10(base_cycle, params);
+      uint64 nsec10 = blk->base_nsec10;
       OutputName(stdout, nsec10, KUTRACE_PIDNAME, pid, name.c_str());
 
       // New user-mode process id, pid
       unique_pids.insert(pid);	// stats
-      if (current_pid[current_cpu] != pid) {++ctx_switches;}	// stats
-      current_pid[current_cpu] = pid;
+      if (cpus[current_cpu].current_pid != pid) {++ctx_switches;}	// stats
+      cpus[current_cpu].current_pid = pid;
 
       uint64 event = KUTRACE_USERPID;	// Context switch
       uint64 duration = 1;
@@ -899,13 +2275,13 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
         // dsites 2021.07.26
         // Output the very first block's context switch to the running process at trace startup
         // dsites 2021.10.20 Output initial CPU frequency if nonzero
-        if (at_first_cpu_block[current_cpu]) {
-          at_first_cpu_block[current_cpu] = false;
+        if (cpus[current_cpu].at_first_cpu_block && (use == kUseAll)) {
+          cpus[current_cpu].at_first_cpu_block = false;
           OutputEvent(stdout, nsec10, duration, KUTRACE_USERPID, current_cpu, 
-                      pid, 0,  0, 0, 0, name.c_str());
+                      pid, 0,  0, 0, 0, name.c_str(), NULL);
           if (0 < freq_mhz) {
           OutputEvent(stdout, nsec10, duration, KUTRACE_PSTATE, current_cpu, 
-                      pid, 0,  freq_mhz, 0, 0, "freq");
+                      pid, 0,  freq_mhz, 0, 0, "freq", NULL);
            }
         }
       }
@@ -913,48 +2289,41 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
       first_real_entry += 4;
     }	// End of each block preprocessing
 
-
-    // We wrapped if high bit of first_timestamp is 1 and high bit of base is 0
-    if (Wrapped(first_timestamp, base_cycle)) {
-      prepend -= 0x100000; 
-      if (TRACEWRAP) {fprintf(stdout, "  Wrap0 %05llx %05llx\n", first_timestamp, base_cycle);}
+    if (use == kUseHeader) {
+      ++blocknumber;
+      continue;
     }
 
+
     //------------------------------------------------------------------------//
     // Inner loop over eight-byte entries                                     //
     //------------------------------------------------------------------------//
-    for (int i = first_real_entry; i < kTraceBufSize; ++i) {
-      int entry_i = i;		// Always the first word, even if i subsequently incremented
-      bool has_arg = false;	// Set true if low 32 bits are used
+    // DecodeTimes has listed where each entry starts, past NOPs, batch 
+    // headers, and the extra words of names and PC samples. DecodeEntries
+    // has done what needs only the block; here is what carries across blocks
+    for (int k = 0; k < blk->entries; ++k) {
+      int i = blk->entry[k];
+      int entry_i = i;
+      const DecodedEntry& e = db->decoded[k];
       bool extra_word = false;	// Set true if entry is at least two words
       bool deferred_rpcid0 = false;
       uint8 ipc = ipcblock[i];
 
-      // Completely skip any all-zero NOP entries
-      if (traceblock[i] == 0LLU) {continue;}
-
-      // Skip the entire rest of the block if all-ones entry found
-      if (traceblock[i] == 0xffffffffffffffffLLU) {break;}
-
       // +-------------------+-----------+---------------+-------+-------+
       // | timestamp         | event     | delta | retval|      arg0     |
       // +-------------------+-----------+---------------+-------+-------+
       //          20              12         8       8           16 
-      
+
       uint64 t = traceblock[i] >> 44;			// Timestamp
       uint64 n = (traceblock[i] >> 32) & 0xfff;		// event number
       uint64 arg    = traceblock[i] & 0x0000ffff;	// syscall/ret arg/retval
       uint64 argall = traceblock[i] & 0xffffffff;	// mark_a/b/c/d, etc.
-      uint64 arg_hi = (traceblock[i] >> 16) & 0xffff;	// rx_pkt tx_pkt lglen8
       uint64 delta_t = (traceblock[i] >> 24) & 0xff;	// Opt syscall return timestamp
       uint64 retval = (traceblock[i] >> 16) & 0xff;	// Opt syscall retval
 
-      // Completely skip any mostly-FFFF entries, but keep return of 32-bit -sched-
-      if ((t == 0xFFFFF) && (n == 0xFFF)) {continue;}
-
       // Sign extend optimized retval [-128..127] from 8 bits to 16
       retval = (uint64)(((int64)(retval << 56)) >> 56) & 0xffff;
-      if (verbose) {
+      if (verbose && (use == kUseAll)) {
         fprintf(stdout, "%% [%d,%d] %05llx %03llx %04llx %04llx = %lld %lld %lld, %lld %lld %02x\n", 
                 blocknumber, i,
                 (traceblock[i] >> 44) & 0xFFFFF, 
@@ -964,112 +2333,47 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
 		t, n, delta_t, retval, arg, ipc);
       }
 
-      if (is_mark(n)) {
-        ++total_marks;	// stats
-      } else {
-        ++events_by_type[n >> 8];	// stats
-      }
-
-      uint64 event;
-      if (n == KUTRACE_USERPID) {	// Context switch
-        has_arg = true;
-        // Change event to new process id + 64k
-        event = PidToEvent(arg);
-      } else {
-        // Anything else 0..64K-1
-        event = n;
+      if (use == kUseAll) {
+        if (is_mark(n)) {
+          ++total_marks;	// stats
+        } else {
+          ++events_by_type[n >> 8];	// stats
+        }
       }
 
-      // 2019.03.18 Go back to preserving KUTRACE_USERPID for eventtospan
-      event = n;
-
-      // Convert truncated start time to full-width start time
-      // Increment the prepend if truncated time rolls over
-      if (Wrapped(prior_t, t)) {prepend += 0x100000;}
-      prior_t = t;
-
-      // tfull is increments of cycles from the base minute for this trace, 
-      // also expressed as increments of cycles
-      uint64 tfull = prepend | t;
-
-      // nsec10 is increments of 10ns from the base minute.
-      // For a trace starting at 50 seconds into a minute and spanning 99 seconds, 
-      // this reaches 14,900,000,000 which means the 
-      // base minute + 149.000 000 00 seconds. More than 32 bits.
-      uint64 nsec10 = CyclesToNsec10(tfull, params);
-      uint64 duration = 0;
+      // Full start time, from DecodeTimes
+      uint64 nsec10 = e.nsec10;
 
       if (has_rpcid(n)) {
         // Working on this RPC until one with arg=0
-        has_arg = true;
         // Defer switching to zero until after the OutputEvent
-        if (arg != 0) {current_rpc[current_cpu] = arg;}
+        if (arg != 0) {cpus[current_cpu].current_rpc = arg;}
         else {deferred_rpcid0 = true;}
       }
 
-      // Pick out any name definitions 
+      // Name definitions went into the names as the block was decoded
       if (is_namedef(n)) {
-        has_arg = true;
-        // We have a name or other variable-length entry
-        // Remap the raw numbering to unique ranges in names[]
-        uint64 nameinsert;
-        uint64 rpcid;
-        uint8 lglen8;
-        if (is_pidnamedef(n)) {
-          nameinsert = PidToEvent(arg); 	  // Processes 0..64K
-        } else if (is_locknamedef(n)) {
-          nameinsert = arg | 0x20000;		  // Lock names
-        } else if (is_methodnamedef(n)) {
-          rpcid = arg & 0xffff;			  // RPC method names
-          lglen8 = arg_hi;	  		  //  may include TenLg msg len
-          nameinsert = rpcid | 0x30000;
-        } else if (is_kernelnamedef(n)) {
-          nameinsert = arg | 0x40000;		  // Kernel version
-        } else if (is_modelnamedef(n)) {
-          nameinsert = arg | 0x50000;		  // CPU model
-        } else if (is_hostnamedef(n)) {
-          nameinsert = arg | 0x60000;		  // CPU host name
-        } else if (is_queuenamedef(n)) {
-          nameinsert = arg | 0x70000;		  // Queue name
-        } else if (is_resnamedef(n)) {
-          nameinsert = arg | 0x80000;		  // Resource name
-        } else {
-          nameinsert = ((n & 0x00f) << 8) | arg;  // Syscall, etc. Include type of name
-        }
-
-        char tempstring[64];
-        int len = (n >> 4) & 0x00f;
-        if ((len < 1) || (8 < len)) {continue;}
-        // Ignore any timepair but keep the names
-        if (!is_timepair(n)) {
-          memset(tempstring, 0, 64);
-          memcpy(tempstring, &traceblock[i + 1], (len - 1) * 8);
-          // Remember the name, except don't change pid 0
-          // And throw away the empty name
-          if (nameinsert == 0x10000) {strcpy(tempstring, kIdleName);}
-          string name = string(tempstring);
-          if (is_kernelnamedef(n) || is_modelnamedef(n)) {
-            name = ReduceSpaces(name);
-          }
-          name = MakeSafeAscii(name);
-          if (!name.empty()) {
-            names[nameinsert] = name;
-            ////OutputName(stdout, nsec10, nameinsert, argall, name.c_str());
-            OutputName(stdout, nsec10, n, argall, name.c_str());
-          }
+        if (0 <= e.name) {
+          OutputName(stdout, nsec10, n, argall, db->text[e.name].c_str());
         }
-        i += (len - 1);	// Skip over the rest of the name event
-        extra_word = true;
         continue;
       }
-      
+
       if (is_cpu_description(n)) {	// Just pass it on to eventtospan
-        OutputEvent(stdout, nsec10, 1, event, current_cpu, 
-                    0, 0, argall, 0, 0, "");
+        OutputEvent(stdout, nsec10, 1, n, current_cpu,
+                    0, 0, argall, 0, 0, "", NULL);
       }
 
       if (keep_just_names) {continue;}
 
+      // A block replayed ahead of a window just carries each CPU's state forward
+      if (use == kUseReplay) {
+        if (is_contextswitch(n)) {cpus[current_cpu].current_pid = arg;}
+        if (is_timer_irq(n)) {cpus[current_cpu].prior_timer_irq_nsec10 = nsec10;}
+        if (deferred_rpcid0) {cpus[current_cpu].current_rpc = 0;}
+        continue;
+      }
+
       //========================================================================
       // Name definitions above skip this code, so do not affect lo/hi 
       if (lo_timestamp > nsec10) {lo_timestamp = nsec10;}	// stats
@@ -1077,51 +2381,14 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
 
       // Look for new user-mode process id, pid
       if (is_contextswitch(n)) {
-        has_arg = true;
         unique_pids.insert(arg);	// stats
-        if (current_pid[current_cpu] != arg) {++ctx_switches;}	// stats
-        current_pid[current_cpu] = arg;
-      }
-
-      // Nothing else, so dump in decimal
-      // Here n is the original 12-bit event; event is (pid | 64K) if n is user-mode code
-      string name = string("");
-
-      // Put in name of event
-      if (is_return(n)) {
-        uint64 call_event = event & ~0x0200;
-        if (names.find(call_event) != names.end()) {name.append("/" + names[call_event]);}
-      } else {
-        if (names.find(event) != names.end()) {name.append(names[event]);}
-      }
-
-      if (is_contextswitch(n)) {
-        has_arg = true;
-        uint64 target = PidToEvent(arg);
-        if (names.find(target) != names.end()) {name.append(names[target]);}
-        name = AppendNum(name, arg);
-     }
-
-      if (is_usermode(event)) {
-        if (names.find(event) != names.end()) {name.append(names[event]);}
-        name = AppendNum(name, EventToPid(event));
-      }
-
-      // If this is an optimized call, pick out the duration and leave return value
-      // The ipc value for this is two 4-bit values:
-      //   low bits IPC before call, high bits IPC within call
-      if (is_opt_call(n, delta_t)) {
-        has_arg = true;
-        // Optimized call with delta_t and retval
-        duration = CyclesToNsec10(tfull + delta_t, params) - nsec10;
-        if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
-      } else {
-        retval = 0;
+        if (cpus[current_cpu].current_pid != arg) {++ctx_switches;}	// stats
+        cpus[current_cpu].current_pid = arg;
       }
 
       // Remember timer interrupt start time, for PC sample fixup below
       if (is_timer_irq(n)) {
-          prior_timer_irq_nsec10[current_cpu] = nsec10;
+          cpus[current_cpu].prior_timer_irq_nsec10 = nsec10;
       }
 
       // Pick off non-standard PC values here
@@ -1143,99 +2410,37 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
       //
       // 2021.04.05 We now include the CPU frequency sample as arg0 in this entry if nonzero.
       //   Extract it as a separate KUTRACE_PSTATE event.
-      // 
+      //
       if (is_pc_sample(n)) {
-        has_arg = true;
         extra_word = true;
-        uint64 pc_sample = traceblock[++i];	// Consume second word, the PC sample
-        // Change to PC eventnum, either kernel or user sample address
-        event = n = (pc_sample & 0x8000000000000000LLU) ? KUTRACE_PC_K : KUTRACE_PC_U;
-
         // The PC sample is generated after the local_timer interrupt, but we really 
         // want its sample time to be just before that interrupt. We move it back here.
-        if (prior_timer_irq_nsec10[current_cpu] != 0) {
-          nsec10 = prior_timer_irq_nsec10[current_cpu] - 1;	// 10 nsec before timer IRQ
+        if (cpus[current_cpu].prior_timer_irq_nsec10 != 0) {
+          nsec10 = cpus[current_cpu].prior_timer_irq_nsec10 - 1;	// 10 nsec before timer IRQ
         }
-        uint64 freq_mhz = arg;
-        // Put a hash of the PC name into arg, so HTML display can choose colors quickly
-        arg = (pc_sample >> 6) & 0xFFFF;	// Initial hash just uses PC bits <21:6>
-						// This is used for drawing color
-						// If addrtoline is used later, reset arg
-        retval = 0;
-        ipc = 0; 
-        char temp_hex[24];
-        sprintf(temp_hex, "PC=%012llx", pc_sample);	// Normally 48-bit PC
-        name = string(temp_hex); 
 
         // Output the frequency event first if nonzero
-        if (0 < freq_mhz) { 
+        if (0 < e.freq_mhz) {
           OutputEvent(stdout, nsec10, 1, KUTRACE_PSTATE, current_cpu, 
-                      current_pid[current_cpu], current_rpc[current_cpu], 
-                      freq_mhz, 0, 0, "freq");
+                      cpus[current_cpu].current_pid, cpus[current_cpu].current_rpc, 
+                      e.freq_mhz, 0, 0, "freq", NULL);
           ++event_count;	// stats
         }
       }
 
-      // If this is a special event marker, keep the name and arg
-      if (is_special(n)) {
-        has_arg = true;
-        name.append(string(kSpecialName[n & 0x001f]));
-        if (has_rpcid(n)) {
-          name = AppendNum(names[arg | 0x30000], arg);	// method.rpcid
-        } else if (is_lock(n)) {
-          name = string(kSpecialName[n & 0x001f]) + names[arg | 0x20000];  // try_lockname etc.
-        } else if (is_raw_pkt_hash(n)  || is_user_msg_hash(n)) {
-          uint64 hash16 = ((argall >> 16) ^ argall) & 0xffffLLU;	// HTML shows this 16-bit hash
-          name = AppendHexNum(name, hash16);
-        } else if (n == KUTRACE_RUNNABLE) {
-          // Include which PID is being made runnable, from arg
-          name = AppendNum(name, arg);
+      // A PSTATE from kutrace_lib's frequency sampler is about the CPU in
+      // arg<31:16> - 1, not the one whose block it is in. retval=1 tells
+      // eventtospan that it says nothing about what that CPU was running.
+      if ((n == KUTRACE_PSTATE) && ((argall >> 16) != 0)) {
+        uint64 target_cpu = (argall >> 16) - 1;
+        if (target_cpu < kMaxCpus) {
+          if (cpus.size() <= target_cpu) {cpus.resize(target_cpu + 1, kInitialCpuState);}
+          OutputEvent(stdout, nsec10, 1, KUTRACE_PSTATE, target_cpu, 
+                      cpus[target_cpu].current_pid, cpus[target_cpu].current_rpc, 
+                      arg, 1, 0, "freq", NULL);
+          ++event_count;	// stats
         }
-        if (duration == 0) {duration = 1;}	// We enforce here a minimum duration of 10ns
-      }
-
-      // If this is an unoptimized return, move the arg value to retval
-      if (is_return(n)) {
-        has_arg = true;
-        retval = arg;
-        arg = 0;
-      }
-
-      // If this is a call to an irq bottom half routine, name it
-      if (is_bottom_half(n)) {
-        has_arg = true;
-        name.append(":");
-        name.append(string(soft_irq_name[arg & 0x000f]));
-      }
-
-      // If this is a packet rx or tx, remember the time
-      // Step (1) of RPC-to-packet correlation
-      // NOTE: the hash stored in KUTRACE_RX_PKT KUTRACE_TX_PKT is 32 bits
-      // Convention: hash16 is always shown in hex caps. Other numbers in decimal
-      if (is_raw_pkt_hash(n) || is_user_msg_hash(n)) {
-        arg = argall;	// Retain all 32 bits in output
-      }
-
-      // If this packet is an RPC processing start, look to create the message span
-      // arg is the rpcid and arg_hi is the 16-bit packet-beginning hash
-      // Step (3) of RPC-to-packet correlation
-      if (is_rpc_msg(n) && (arg != 0)) {
-        arg = argall;	// Retain all 32 bits in output
-      }
-
-      // MARK_A,B,C arg is six base-40 chars NUL, A_Z, 0-9, . - /
-      // MARK_D     arg is unsigned int
-      // +-------------------+-----------+-------------------------------+
-      // | timestamp         | event     |              arg              |
-      // +-------------------+-----------+-------------------------------+
-      //          20              12                    32 
-      if (is_mark_abc(n)) {
-        has_arg = true;
-        // Include the marker label string, from all 32 bits af argument
-        arg = argall;	// Retain all 32 bits in output
-        name += "=";
-        char temp[8];
-        name += Base40ToChar(arg, temp);
+        continue;
       }
 
       // Debug output. Raw 64-bit event in hex
@@ -1243,7 +2448,7 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
         fprintf(stdout, "%05llx.%03llx ", 
           (traceblock[entry_i] >> 44) & 0xFFFFF, 
           (traceblock[entry_i] >> 32) & 0xFFF);
-        if (has_arg) {
+        if (e.has_arg) {
           fprintf(stdout, " %04llx%04llx ", 
             (traceblock[entry_i] >> 16) & 0xFFFF, 
             (traceblock[entry_i] >> 0) & 0xFFFF);
@@ -1255,9 +2460,9 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
       // Output the trace event
       // Output format:
       // time dur event cpu  pid rpc  arg retval IPC name(event)
-      OutputEvent(stdout, nsec10, duration, event, current_cpu, 
-                  current_pid[current_cpu], current_rpc[current_cpu], 
-                  arg, retval, ipc, name.c_str());
+      OutputEvent(stdout, nsec10, e.duration, e.event, current_cpu,
+                  cpus[current_cpu].current_pid, cpus[current_cpu].current_rpc, 
+                  e.arg, e.retval, e.ipc, db->text[e.name].c_str(), &db->text_hash[e.name]);
       // Update some statistics
       ++event_count;	// stats
 
@@ -1266,7 +2471,7 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
       }
 
       // Do deferred switch to rpcid = 0
-      if (deferred_rpcid0) {current_rpc[current_cpu] = 0;}
+      if (deferred_rpcid0) {cpus[current_cpu].current_rpc = 0;}
 
     }
     //------------------------------------------------------------------------//
@@ -1279,12 +2484,12 @@ fprintf(stderr, "cpu %lld pid %lld freq %lld %s\n", current_cpu, pid, freq_mhz,
   //--------------------------------------------------------------------------//
   // End outer loop over blocks                                               //
   //--------------------------------------------------------------------------//
+  if (index_pass) {return;}
 
-
-  fclose(f);
+  SortedBlock(stdout, blocknumber);
 
   // Pass along the OR of all incoming raw traceblock flags, in particular IPC_Flag 
-  fprintf(stdout, "# ## FLAGS: %d\n", all_flags);
+  OutputComment(stdout, "# ## FLAGS: %d\n", all_flags);
 
 
   // Reduce timestamps to start at no more than 60 seconds after the base minute.
@@ -1306,7 +2511,8 @@ if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_s
     total_seconds = 1.0;	// avoid zdiv
   }
   // Pass along the time bounds 
-  fprintf(stdout, "# ## TIMES: %10.8f %10.8f\n", lo_seconds, hi_seconds);
+  OutputComment(stdout, "# ## TIMES: %10.8f %10.8f\n", lo_seconds, hi_seconds);
+  if (names_pass) {return;}
 
 
   uint64 total_cpus = unique_cpus.size();
@@ -1335,3 +2541,88 @@ if (hi_seconds > 999.0) {fprintf(stderr,"BUG: hi_seconds > 999.0 %12.8f\n", hi_s
 
 }
 
+// Flags followed by a value
+bool HasValue(const char* flag) {
+  return (strcmp(flag, "-start") == 0) || (strcmp(flag, "-stop") == 0) || 
+         (strcmp(flag, "-cpus") == 0);
+}
+
+//
+// Usage: rawtoevent [-b] [-v] [-h] [-start <sec>] [-stop <sec>] [-cpus <list>] 
+//                   [-idx] [-jN] <trace file name>
+//
+int main (int argc, const char** argv) {
+  // The trace file is the first argument that is not a flag
+  FILE* f = stdin;
+  int fname_i = 1;
+  while ((fname_i < argc) && (argv[fname_i][0] == '-')) {
+    if (HasValue(argv[fname_i])) {++fname_i;}
+    ++fname_i;
+  }
+  if (fname_i < argc) {
+    f = fopen(argv[fname_i], "rb");
+    if (f == NULL) {
+      fprintf(stderr, "%s did not open\n", argv[fname_i]);
+      exit(0);
+    }
+  }
+
+  // Pick up flags
+  bool windowed = false;
+  bool build_index = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-v") == 0) {verbose = true;}
+    if (strcmp(argv[i], "-h") == 0) {hexevent = true;}
+    if (strcmp(argv[i], "-b") == 0) {binary_out = true;}
+    if (strcmp(argv[i], "-idx") == 0) {build_index = true;}
+    if (strncmp(argv[i], "-j", 2) == 0) {decode_threads = atoi(argv[i] + 2);}
+    if (HasValue(argv[i]) && (i + 1 < argc)) {
+      windowed = true;
+      if (strcmp(argv[i], "-start") == 0) {window_start = atof(argv[i + 1]) * 100000000.0;}
+      if (strcmp(argv[i], "-stop") == 0) {window_stop = atof(argv[i + 1]) * 100000000.0;}
+      if ((strcmp(argv[i], "-cpus") == 0) && !ParseCpus(argv[i + 1])) {
+        fprintf(stderr, "rawtoevent: bad -cpus list '%s'\n", argv[i + 1]);
+        exit(0);
+      }
+      ++i;
+    }
+  }
+  if (binary_out) {verbose = hexevent = false;}	// Those are text only
+  if (verbose || hexevent) {sorted_out = false;}	// Debug lines go in trace order
+  if (verbose || hexevent || (decode_threads < 1)) {decode_threads = 1;}
+  if (decode_threads > kMaxDecodeThreads) {decode_threads = kMaxDecodeThreads;}
+
+  TraceFile trace;
+  if (!MapTrace(f, &trace)) {
+    FILE* temp = CopyToTemp(f);
+    if (!MapTrace(temp, &trace)) {
+      fprintf(stderr, "rawtoevent: trace did not map\n");
+      exit(0);
+    }
+    fclose(temp);
+  }
+  fclose(f);
+
+  // Index of the blocks, from the .idx next to the trace if it is current
+  if (windowed || build_index) {
+    string idxname = (fname_i < argc) ? string(argv[fname_i]) + ".idx" : string("");
+    if (build_index || idxname.empty() || !ReadIndex(idxname.c_str(), trace)) {
+      StartIndex(trace);
+      index_pass = true;
+      ProcessTrace(trace);
+      index_pass = false;
+      if (!idxname.empty()) {WriteIndex(idxname.c_str(), trace);}
+    }
+    if (build_index) {return 0;}
+    ChooseBlocks();
+  }
+
+  if (sorted_out) {
+    names_pass = true;
+    ProcessTrace(trace);
+    names_pass = false;
+    SortedFront(stdout);
+  }
+  ProcessTrace(trace);
+  return 0;
+}
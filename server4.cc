@@ -289,7 +289,7 @@ void* SocketLoop(void* arg) {
 
       // Start tracing the incoming RPC request
       // We also pack in the 16-bit hash over the first 32 bytes of the packet payload
-      kutrace::addevent(KUTRACE_RPCIDREQ, (lglen8 << 16) | tempid);
+      kutrace::rpc_set((lglen8 << 16) | tempid);
 
       if (verbose) {
         fprintf(stdout, "server4: ReceiveRequest:   "); 
@@ -340,7 +340,7 @@ void* SocketLoop(void* arg) {
       else {ok &= DoError(shareddata, &request, &response);}
 
       // Stop tracing the RPC request
-      kutrace::addevent(KUTRACE_RPCIDREQ, 0);
+      kutrace::rpc_set(0);
 
 
       // Prepare response
@@ -350,7 +350,7 @@ void* SocketLoop(void* arg) {
       hdr->type = RespSendType;
 
       // Start tracing response
-      kutrace::addevent(KUTRACE_RPCIDRESP, (lglen8 << 16) | tempid);
+      kutrace::rpc_set((lglen8 << 16) | tempid, KUTRACE_RPCIDRESP);
 
       if (verbose) {fprintf(stdout, "server4: SendResponse:     "); PrintRPC(stdout, &response);}
       LogRPC(shareddata->logfile, &response);
@@ -362,7 +362,7 @@ void* SocketLoop(void* arg) {
       FreeRPC(&response);
 
       // Stop tracing the outgoing RPC response
-      kutrace::addevent(KUTRACE_RPCIDRESP, 0);
+      kutrace::rpc_set(0, KUTRACE_RPCIDRESP);
  
       if (!ok) {break;}		// Most likely, client dropped the connection
     }
@@ -0,0 +1,182 @@
+// spanjson.h
+//
+// Span lines of the JSON files written by eventtospan3, spantospan,
+// spantotrim, and spantoprof:
+//   [ts, dur, cpu, pid, rpcid, event, arg, retval, ipc, "name"],
+// These give byte-for-byte what
+//   fprintf(f, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", ...)
+// gives, without printf. Times are 10 nsec ticks printed as fixed point, so
+// no floating-point formatting; integers come two digits at a time from a
+// table; the line is built in a local buffer and goes out with one fwrite.
+// Call UseBigOutputBuffer(stdout) before any output so the stream itself
+// does few, large writes.
+//
+// A time given as a double is converted to ticks only when that is exactly
+// what %.8f would print. Anything else (negative, huge, too close to half a
+// tick to be sure) still goes through snprintf, so output never changes.
+//
+// 2026.10.17 Intel Xeon VM, one CPU, same bytes, best of two or three runs.
+// 16.25M span lines to /dev/null:
+//   fprintf, 4KB stdio buffer      20.0 s   1.23 usec/line
+//   WriteSpanJson, 1MB buffer       1.65 s  0.10 usec/line
+// Whole programs on the 16.25M events of a 124MB trace (1.2GB of JSON):
+//   eventtospan3                   27.5 s -> 6.5 s
+//   spantotrim 0                   46.0 s -> 22.7 s (the rest is sscanf)
+//   spantospan 10                  no change beyond noise; it writes half
+//                                  the lines and its time is in sscanf
+//
+// Copyright 2021 Richard L. Sites
+
+#ifndef __SPANJSON_H__
+#define __SPANJSON_H__
+
+#include <math.h>	// floor, signbit
+#include <stdio.h>
+#include <string.h>
+
+#include "basetypes.h"
+
+static const int kSpanJsonBufferSize = 1 << 20;	// Output stream buffer
+static const int kSpanLineSize = 256;		// Longer names are written separately
+
+// 00 01 02 ... 99
+static const char kTwoDigits[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Must come before the first output on f
+inline void UseBigOutputBuffer(FILE* f) {
+  setvbuf(f, NULL, _IOFBF, kSpanJsonBufferSize);
+}
+
+// Decimal digits of x, at p. Returns the end
+inline char* PutDecimal(char* p, uint64 x) {
+  char temp[24];
+  char* t = temp + sizeof(temp);
+  while (x >= 100) {
+    t -= 2;
+    memcpy(t, &kTwoDigits[(x % 100) * 2], 2);
+    x /= 100;
+  }
+  if (x >= 10) {
+    t -= 2;
+    memcpy(t, &kTwoDigits[x * 2], 2);
+  } else {
+    *--t = '0' + x;
+  }
+  int len = temp + sizeof(temp) - t;
+  memcpy(p, t, len);
+  return p + len;
+}
+
+// As %d
+inline char* PutInt(char* p, int x) {
+  if (x < 0) {
+    *p++ = '-';
+    return PutDecimal(p, -(int64)x);
+  }
+  return PutDecimal(p, x);
+}
+
+// Ticks of 10 nsec as seconds, as %*.8f of ticks / 100000000.0
+inline char* PutTicks(char* p, int width, uint64 ticks) {
+  if (ticks >= CLU(1000000000000000)) {	// Past where the double is exact enough
+    return p + snprintf(p, 64, "%*.8f", width, ticks / 100000000.0);
+  }
+  char temp[32];
+  char* t = PutDecimal(temp, ticks / 100000000);
+  *t++ = '.';
+  uint64 frac = ticks % 100000000;
+  for (int i = 3; i >= 0; --i) {
+    memcpy(t + (2 * i), &kTwoDigits[(frac % 100) * 2], 2);
+    frac /= 100;
+  }
+  t += 8;
+  int len = t - temp;
+  for (int i = len; i < width; ++i) {*p++ = ' ';}
+  memcpy(p, temp, len);
+  return p + len;
+}
+
+// Seconds as %*.8f. Ticks when certain to round the same way, else snprintf
+inline char* PutSecs(char* p, int width, double sec) {
+  double scaled = sec * 100000000.0;
+  if (!signbit(sec) && (scaled < 1.0e12)) {		// Under 10000 seconds, error < 0.001 tick
+    double ticks = floor(scaled + 0.5);
+    double off = scaled - ticks;
+    if ((-0.499 < off) && (off < 0.499)) {return PutTicks(p, width, (uint64)ticks);}
+  }
+  return p + snprintf(p, 64, "%*.8f", width, sec);
+}
+
+// The rest of the line after "[ts, dur": the seven integers, the name, and
+// a newline. A quoted name is followed by "],"; otherwise name is the rest
+// of an input line, with its own quotes and trailing punctuation.
+inline void FinishSpanLine(FILE* f, char* buf, char* p,
+                           int cpu, int pid, int rpcid, int eventnum,
+                           int arg, int retval, int ipc,
+                           const char* name, bool quote) {
+  const int fields[7] = {cpu, pid, rpcid, eventnum, arg, retval, ipc};
+  for (int i = 0; i < 7; ++i) {
+    *p++ = ',';
+    *p++ = ' ';
+    p = PutInt(p, fields[i]);
+  }
+  *p++ = ',';
+  *p++ = ' ';
+  if (quote) {*p++ = '"';}
+  int len = strlen(name);
+  if (buf + kSpanLineSize - 8 < p + len) {	// Too long to copy
+    fwrite(buf, 1, p - buf, f);
+    fwrite(name, 1, len, f);
+    p = buf;
+  } else {
+    memcpy(p, name, len);
+    p += len;
+  }
+  if (quote) {
+    memcpy(p, "\"],", 3);
+    p += 3;
+  }
+  *p++ = '\n';
+  fwrite(buf, 1, p - buf, f);
+}
+
+// ts and dur in 10 nsec ticks, quoted name
+inline void WriteSpanJson(FILE* f, uint64 ts, uint64 dur,
+                          int cpu, int pid, int rpcid, int eventnum,
+                          int arg, int retval, int ipc, const char* name) {
+  char buf[kSpanLineSize];
+  char* p = buf;
+  *p++ = '[';
+  p = PutTicks(p, 12, ts);
+  *p++ = ',';
+  *p++ = ' ';
+  p = PutTicks(p, 10, dur);
+  FinishSpanLine(f, buf, p, cpu, pid, rpcid, eventnum, arg, retval, ipc, name, true);
+}
+
+// ts and dur in seconds. name quoted if quote, else written as given
+inline void WriteSpanJsonSecs(FILE* f, double ts, double dur,
+                              int cpu, int pid, int rpcid, int eventnum,
+                              int arg, int retval, int ipc,
+                              const char* name, bool quote) {
+  char buf[kSpanLineSize];
+  char* p = buf;
+  *p++ = '[';
+  p = PutSecs(p, 12, ts);
+  *p++ = ',';
+  *p++ = ' ';
+  p = PutSecs(p, 10, dur);
+  FinishSpanLine(f, buf, p, cpu, pid, rpcid, eventnum, arg, retval, ipc, name, quote);
+}
+
+#endif	// __SPANJSON_H__
@@ -18,6 +18,7 @@
 
 #include "basetypes.h"
 #include "kutrace_lib.h"
+#include "spanjson.h"
 
 
 using std::map;
@@ -113,6 +114,7 @@ typedef struct {
   double hi_ts;
   int rownum;
   int rowcount;		// The number of rows merged together here
+  double weight;	// Rows these stand for, more than rowcount if RPCs were sampled
   bool proper_row_name;
   string row_name;
   RowSummary rowsummary;
@@ -152,6 +154,7 @@ static bool dorow = true;	// default to -row
 static bool dogroup = false;
 static bool doall = false;	// if true, show even one-row merges
 static bool verbose = false;
+static int rpc_sample = 1;	// From the JSON rpcSample, if any
 
 static int output_events = 0;
 
@@ -448,17 +451,19 @@ double dmax(double a, double b) {return (a > b) ? a : b;}
 
 
 // Event keys are event names
-void MergeEventInRow(const EventTotal& eventtotal, RowSummary* aggpereventsummary) {
+void MergeEventInRow(const EventTotal& eventtotal, double weight, RowSummary* aggpereventsummary) {
   if (aggpereventsummary->find(eventtotal.event_name) == aggpereventsummary->end()) {
     // Add new event 
-    (*aggpereventsummary)[eventtotal.event_name] = eventtotal;
-    return;
+    EventTotal temp = eventtotal;
+    temp.duration = 0.0;
+    temp.ipcsum = 0.0;
+    (*aggpereventsummary)[eventtotal.event_name] = temp;
   }
 
   EventTotal* es = &(*aggpereventsummary)[eventtotal.event_name];
   // The real action
-  es->duration += eventtotal.duration;
-  es->ipcsum += eventtotal.ipcsum; 
+  es->duration += eventtotal.duration * weight;
+  es->ipcsum += eventtotal.ipcsum * weight; 
 }
 
 bool CheckRowname(const char* label, const string& rowname) {
@@ -470,8 +475,9 @@ bool CheckRowname(const char* label, const string& rowname) {
 }
 
 // Merge rowtotal into groupaggregate[key], making a row as needed
+// weight is how many rows rowtotal stands for
 void MergeOneRow(int rownum, const string& key, 
-                 const string& rowname, const RowTotal& rowtotal, 
+                 const string& rowname, const RowTotal& rowtotal, double weight,
                  GroupSummary2* groupaggregate) {
   if (groupaggregate->find(key) == groupaggregate->end()) {
     // Add new row and name it
@@ -480,6 +486,7 @@ void MergeOneRow(int rownum, const string& key,
     temp.hi_ts = 0.0;
     temp.rownum = rownum;	// The cpu/pid/rpc# first encountered for this new row
     temp.rowcount = 0;
+    temp.weight = 0.0;
     temp.proper_row_name = true;
     temp.row_name.clear();
     temp.row_name = rowname;
@@ -494,13 +501,14 @@ void MergeOneRow(int rownum, const string& key,
 
   RowTotal* aggrowsumm = &(*groupaggregate)[key];
   ++aggrowsumm->rowcount;	// Count how many rows are merged together here
+  aggrowsumm->weight += weight;
 
   // Merge in the individual events per row
   for (RowSummary::const_iterator it = rowtotal.rowsummary.begin(); 
          it != rowtotal.rowsummary.end(); 
          ++it) {
     const EventTotal& eventtotal = it->second;
-    MergeEventInRow(eventtotal, &aggrowsumm->rowsummary);
+    MergeEventInRow(eventtotal, weight, &aggrowsumm->rowsummary);
   }
 }
 
@@ -512,8 +520,8 @@ void DivideByRowcount(RowTotal* rowtotal) {
          it != rowtotal->rowsummary.end(); 
          ++it) {
     EventTotal* eventtotal = &it->second;
-    eventtotal->duration /= rowtotal->rowcount;
-    eventtotal->ipcsum /= rowtotal->rowcount;
+    eventtotal->duration /= rowtotal->weight;
+    eventtotal->ipcsum /= rowtotal->weight;
   }
 }
 
@@ -528,9 +536,13 @@ string Basename(const string& name, const char* delim) {
 }
 
 // Total up rows by name prefix, i.e. up to a period
-void MergeGroupRows(const GroupSummary& groupsummary, GroupSummary2* groupaggregate) {
+// With RPC sampling, an RPC row in the hash sample stands for sample RPCs.
+// The others were kept only for being slow, and stand for just themselves.
+void MergeGroupRows(const GroupSummary& groupsummary, int sample, GroupSummary2* groupaggregate) {
   for (GroupSummary::const_iterator it = groupsummary.begin(); it != groupsummary.end(); ++it) {
     const RowTotal* rowtotal = &it->second;
+    double weight = 1.0;
+    if (kutrace::rpc_in_sample(rowtotal->rownum, sample)) {weight = sample;}
     double row_duration = rowtotal->hi_ts - rowtotal->lo_ts;
 //if (row_duration < 0.0) {
 //fprintf(stderr, "Bad duration_row\n");
@@ -556,22 +568,28 @@ void MergeGroupRows(const GroupSummary& groupsummary, GroupSummary2* groupaggreg
 
     // Level 1 row summary
     int row_basenum = rowtotal->rownum;
-    MergeOneRow(row_basenum, key_name, visible_name, *rowtotal, groupaggregate);
+    MergeOneRow(row_basenum, key_name, visible_name, *rowtotal, weight, groupaggregate);
 
     // Level 2 group summary
     // Offset row number from the first-order row numbers
     if (is_cpu_number) {
-      MergeOneRow(row_basenum, "CPU_AVG",   "CPU_AVG", *rowtotal, groupaggregate);
+      MergeOneRow(row_basenum, "CPU_AVG",   "CPU_AVG", *rowtotal, weight, groupaggregate);
     } else {
       MergeOneRow(row_basenum, row_basename + "_AVG", 
-                  row_basename + "_AVG", *rowtotal, groupaggregate);
+                  row_basename + "_AVG", *rowtotal, weight, groupaggregate);
     }
   }
 
   // Now go back and divide all the aggregated durations by rowcount
   for (GroupSummary2::iterator it = groupaggregate->begin(); it != groupaggregate->end(); ++it) {
     RowTotal* aggrowtotal = &it->second;
-    if (1 < aggrowtotal->rowcount) {
+    if (aggrowtotal->rowcount < aggrowtotal->weight) {
+      // Some rows stand for unsampled ones; show the estimated total too
+      char temp[48];
+      sprintf(temp, " (%d ~%1.0f)", aggrowtotal->rowcount, aggrowtotal->weight);
+      aggrowtotal->row_name += temp;
+      DivideByRowcount(aggrowtotal);
+    } else if (1 < aggrowtotal->rowcount) {
       char temp[24];
       sprintf(temp, " (%d)", aggrowtotal->rowcount);
       aggrowtotal->row_name += temp;
@@ -585,9 +603,9 @@ void MergeGroupRows(const GroupSummary& groupsummary, GroupSummary2* groupaggreg
 // and also making one grand total (overall average per group).
 void MergeRows(Summary* summ) {
 //fprintf(stderr, "MergeRows\n");
-  MergeGroupRows(summ->cpuprof, &summ->cpuprof2);
-  MergeGroupRows(summ->pidprof, &summ->pidprof2);
-  MergeGroupRows(summ->rpcprof, &summ->rpcprof2);
+  MergeGroupRows(summ->cpuprof, 1, &summ->cpuprof2);
+  MergeGroupRows(summ->pidprof, 1, &summ->pidprof2);
+  MergeGroupRows(summ->rpcprof, rpc_sample, &summ->rpcprof2);
 }
 
 void Prune2(GroupSummary2* groupsummary) {
@@ -841,20 +859,17 @@ void WriteOneRowJson(FILE* f, int type, const RowTotal& rowtotal, int new_rownum
     }
     switch (type) {
     case SUMM_CPU:
-      //                   ts dur cpu  pid rpc event  arg ret ipc  name
-      fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", 
-          ts_sec, dur_sec,   new_rownum, -1, -1,   eventtotal->eventnum,
-          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str());
+      //                          ts dur cpu  pid rpc event  arg ret ipc  name
+      WriteSpanJsonSecs(f, ts_sec, dur_sec,   new_rownum, -1, -1,   eventtotal->eventnum,
+          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str(), true);
       break;
     case SUMM_PID:
-      fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", 
-          ts_sec, dur_sec,   -1, new_rownum, -1,   eventtotal->eventnum,
-          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str());
+      WriteSpanJsonSecs(f, ts_sec, dur_sec,   -1, new_rownum, -1,   eventtotal->eventnum,
+          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str(), true);
       break;
     case SUMM_RPC:
-      fprintf(f, "[%12.8lf, %10.8lf, %d, %d, %d, %d, %d, %d, %d, \"%s\"],\n", 
-          ts_sec, dur_sec,   -1, -1, new_rownum,   eventtotal->eventnum,
-          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str());
+      WriteSpanJsonSecs(f, ts_sec, dur_sec,   -1, -1, new_rownum,   eventtotal->eventnum,
+          eventtotal->arg, 0, ipc, eventtotal->event_name.c_str(), true);
       break;
     }
     ++output_events;
@@ -1156,6 +1171,7 @@ int main (int argc, const char** argv) {
     else if (strcmp(argv[i], "-v") == 0) {verbose = true;}
     else Usage();
   }
+  UseBigOutputBuffer(stdout);
   
   // expecting:
   //    ts           dur       cpu  pid  rpc event arg ret  ipc name--------------------> 
@@ -1184,6 +1200,8 @@ int main (int argc, const char** argv) {
         needs_presorted = false;
       }
       fprintf(stdout, "%s\n", buffer);
+      // RPC user entries were kept for only about 1 in rpc_sample RPCs
+      sscanf(buffer, " \"rpcSample\" : %d", &rpc_sample);
       continue;
     }
 
@@ -14,16 +14,19 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #include <stdio.h>
 #include <stdlib.h>     // exit
 #include <string.h>
 #include "basetypes.h"
+#include "spanjson.h"
 
 #define UserPidNum       0x200
 
 using std::string;
 using std::map;
+using std::vector;
 
 typedef struct {
   double start_ts;	// Seconds
@@ -48,6 +51,8 @@ typedef struct {
   SpanMap spanmap;
 } CPUstate;
 
+static const int kMaxCpus = 256;	// CPU number is one byte in the raw trace
+
 
 int output_events = 0;
 
@@ -108,10 +113,10 @@ void ProcessSpan(int64 output_granularity_ns,
     int64 duration_ns = Round(subspan->duration_ns, output_granularity_ns);
     if (duration_ns <= 0) {break;}
     // Name has trailing punctuation, including ],
-    fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
+    WriteSpanJsonSecs(stdout, 
             cpustate[cpu].next_ts_ns / 1000000000.0, duration_ns / 1000000000.0,
             subspan->cpu, subspan->pid, subspan->rpcid, subspan->event, 
-            subspan->arg, subspan->retval, subspan->ipc, subspan->name);
+            subspan->arg, subspan->retval, subspan->ipc, subspan->name, false);
     ++output_events;
     subspan->duration_ns -= duration_ns;
     cpustate[cpu].next_ts_ns += duration_ns;
@@ -152,20 +157,19 @@ void Usage() {
 // Filter from stdin to stdout
 //
 int main (int argc, const char** argv) {
-  CPUstate cpustate[16];
+  vector<CPUstate> cpustate;	// Grows to the largest CPU number seen
   // Internally, we keep everything as integer nanoseconds to avoid roundoff 
   // error and to give clean truncation
   int64 output_granularity_ns = 1;
 
   if (argc < 2) {Usage();}
   output_granularity_ns = 1000 * atoi(argv[1]);
+  UseBigOutputBuffer(stdout);
 
-  // Initialize to half-full
-  for (int i = 0; i < 16; ++i) {
-    cpustate[i].next_ts_ns = -1;
-    cpustate[i].total_excess_ns = output_granularity_ns / 2;
-    cpustate[i].spanmap.clear();
-  }
+  // Each CPU starts out half-full
+  CPUstate initial;
+  initial.next_ts_ns = -1;
+  initial.total_excess_ns = output_granularity_ns / 2;
 
   // expecting:
   //    ts           dur        cpu pid  rpc event arg retval  ipc name 
@@ -199,10 +203,11 @@ int main (int argc, const char** argv) {
 
     if (onespan.start_ts >= 999.0) {break;}	// Always strip 999.0 end marker and stop
 
-    if (16 <= onespan.cpu){
+    if (kMaxCpus <= onespan.cpu){
       fprintf(stderr, "Bad CPU number at '%s'\n", buffer);
       exit(0);
     }
+    if (cpustate.size() <= onespan.cpu) {cpustate.resize(onespan.cpu + 1, initial);}
 
     // If the input span is a major marker (i.e. Mark_a _b or _c) keep it now
     // And chsange no other state
@@ -25,6 +25,7 @@
 #include <string.h>
 #include "basetypes.h"
 #include "from_base40.h"
+#include "spanjson.h"
 
 using std::string;
 using std::map;
@@ -90,6 +91,7 @@ int main (int argc, const char** argv) {
   bool next_inside_label_span = true;
 
   if (argc < 2) {Usage();}
+  UseBigOutputBuffer(stdout);
   
   if ('9' < argv[1][0]) {
     // Does not start with a digit. Assume it is a label and
@@ -153,10 +155,9 @@ int main (int argc, const char** argv) {
     if (!inside_label_span) {continue;}	
 
     // Name has trailing punctuation, including ],
-    fprintf(stdout, "[%12.8f, %10.8f, %d, %d, %d, %d, %d, %d, %d, %s\n",
-            onespan.start_ts, onespan.duration,
+    WriteSpanJsonSecs(stdout, onespan.start_ts, onespan.duration,
             onespan.cpu, onespan.pid, onespan.rpcid, onespan.event, 
-            onespan.arg, onespan.retval, onespan.ipc, onespan.name);
+            onespan.arg, onespan.retval, onespan.ipc, onespan.name, false);
     ++output_events;
 
     inside_label_span = next_inside_label_span;
@@ -8,6 +8,9 @@
 // Copyright 2021 Richard L. Sites
 
 // Compile with g++ -O2 time_getpid.cc kutrace_lib.cc -o time_getpid
+//
+// Usage: time_getpid [-go]
+//   -go turns tracing on within this program itself
 
 // Do 100k getpid() calls
 // so we can time these with and without tracing to see the tracing overhead
@@ -46,11 +49,37 @@
 // 100000 calls to getpid() took 68953 us (689 ns each)
 // 100000 calls to mark_a took 39218 us (392 ns each)
 
+// 2026.10.17 Intel Xeon VM, stock kernel, no KUtrace patch
+// no module (mark_a syscall fails with ENOSYS)
+// 100000 calls to getpid() took 13911 us (139 ns each)
+// 100000 calls to mark_a took 14655 us (146 ns each)
+// KUTRACE_USERMODE=1 user-mode backend, tracing off in this program
+// 100000 calls to mark_a took 1555 us (15 ns each)
+
+// 2026.10.17 Same machine, mark_a vs. kutrace::Batch staging seven per INSERTN
+// no module (each INSERT1/INSERTN is a failing syscall)
+// 100000 calls to mark_a took 17259 us (172 ns each)
+// 100000 calls to mark_a batched took 6255 us (62 ns each)
+// KUTRACE_USERMODE=1 ./time_getpid -go (no syscalls either way)
+// 100000 calls to mark_a took 4929 us (49 ns each)
+// 100000 calls to mark_a batched took 5410 us (54 ns each)
+//  Batching saves six of every seven syscalls; with no syscall to save, 
+//  staging is slightly slower
+
+// 2026.10.17 Same machine, marks check the tracing-enabled word first
+// KUTRACE_USERMODE=1, tracing off in this program (was 15ns above)
+// 100000 calls to mark_a took 245 us (2 ns each)
+// 100000 calls to mark_a batched took 202 us (2 ns each)
+// no module: there is no /dev/kutrace_state to map, so marks still make
+//  the failing syscall, about 150-190ns as before. With a module that has 
+//  the device, tracing off costs the same few ns as the user-mode line.
+
 
 #include <sys/types.h> 
 #include <unistd.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>	// gettimeofday
 #include "basetypes.h"
 
@@ -115,6 +144,10 @@ inline int64 DoGP(struct timeval* arg1, void* arg2)
 int main (int argc, const char** argv) {
   int64 bogus = 0;
 
+  // -go turns tracing on within this program, as needed for KUTRACE_USERMODE
+  bool self_trace = ((argc > 1) && (strcmp(argv[1], "-go") == 0));
+  if (self_trace) {kutrace::go(argv[0]);}
+
   // First warm up, to get the CPU clock up to speed
   // No timing here
   for (int i = 0; i < 50000 / 4; ++ i) {
@@ -149,6 +182,22 @@ int main (int argc, const char** argv) {
   }
   int64 stop_usec2 = GetUsec();
 
+  // Now time marker inserts staged and batched, seven per INSERTN
+  int64 start_usec3 = GetUsec();
+  {
+    kutrace::Batch batch;
+    for (int i = 0; i < 100000 / 4; ++ i) {
+      kutrace::mark_a("hello");
+      kutrace::mark_a("hello");
+      kutrace::mark_a("hello");
+      kutrace::mark_a("hello");
+    }
+  }
+  int64 stop_usec3 = GetUsec();
+
+  // Leave the trace buffer empty
+  if (self_trace) {kutrace::DoOff(); kutrace::DoReset(0);}
+
 
   // Print last to avoid printing extending timing
   int delta = stop_usec - start_usec;
@@ -158,5 +207,8 @@ int main (int argc, const char** argv) {
   int delta2 = stop_usec2 - start_usec2;
   fprintf(stdout, "100000 calls to mark_a took %d us (%d ns each)\n", delta2, delta2 / 100);
 
+  int delta3 = stop_usec3 - start_usec3;
+  fprintf(stdout, "100000 calls to mark_a batched took %d us (%d ns each)\n", delta3, delta3 / 100);
+
   return 0;
 }
@@ -0,0 +1,58 @@
+// Little program to time starting a trace: DoReset, DoInit, DoOn, and the 
+// first user event. DoInit gathers kernel version, CPU model, host name, 
+// link speed, and interrupt names, then inserts all the name entries, so
+// it dominates.
+// Copyright 2021 Richard L. Sites
+//
+// Usage: time_init [n]
+//   Starts and stops tracing n times (default 10) and reports the 
+//   go-to-first-event time for each, plus the minimum.
+//
+// Compile with g++ -O2 time_init.cc kutrace_lib.cc -o time_init
+//
+// 2026.10.17 Intel Xeon VM, 1 CPU, KUTRACE_USERMODE=1, minimum of 20 runs
+// Before: popen("uname -rv"), getline over /proc/cpuinfo, 400 INSERTN calls
+//   minimum go-to-first-event 1682 us (DoInit 1682 us)
+// After: uname(2), one read of cpuinfo, plus host name, link speed, and 
+//   /proc/interrupts names, packed into 184 INSERTN calls
+//   minimum go-to-first-event 238 us (DoInit 237 us)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "timecounters.h"
+
+int main (int argc, const char** argv) {
+  int n = 10;
+  if (argc > 1) {n = atoi(argv[1]);}
+  if (n <= 0) {n = 1;}
+
+  if (!kutrace::test()) {return 0;}
+
+  int64 min_usec = 0x7fffffffffffffffLL;
+  int64 min_init_usec = 0x7fffffffffffffffLL;
+  for (int i = 0; i < n; ++i) {
+    int64 start_usec = GetUsec();
+    kutrace::DoReset(0);
+    kutrace::DoInit(argv[0]);
+    int64 init_usec = GetUsec();
+    kutrace::DoOn();
+    kutrace::mark_a("first");
+    int64 stop_usec = GetUsec();
+    kutrace::DoOff();
+
+    fprintf(stdout, "go-to-first-event %lld us (DoInit %lld us)\n", 
+            stop_usec - start_usec, init_usec - start_usec);
+    if (min_usec > (stop_usec - start_usec)) {min_usec = stop_usec - start_usec;}
+    if (min_init_usec > (init_usec - start_usec)) {min_init_usec = init_usec - start_usec;}
+  }
+  fprintf(stdout, "minimum go-to-first-event %lld us (DoInit %lld us)\n", 
+          min_usec, min_init_usec);
+
+  // Leave the buffer ready for another trace
+  kutrace::DoControl(KUTRACE_CMD_RESET, 0);
+  return 0;
+}
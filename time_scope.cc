@@ -0,0 +1,67 @@
+// Little program to time a hand-written kutrace::mark_a("work") ... 
+// mark_a("/work") pair against kutrace::Scope<'A'> with a compile-time label.
+// Copyright 2021 Richard L. Sites
+//
+// Usage: time_scope [-go]
+//   -go turns tracing on within this program itself
+//
+// Compile with g++ -O2 time_scope.cc kutrace_lib.cc -o time_scope
+// and with -DKUTRACE_DISABLE to see the scopes compile away
+//
+// 2026.10.17 Intel Xeon VM, per pair/scope (two events), typical of 3 runs
+//                                 mark_a pair   Scope<'A'>
+// KUTRACE_USERMODE=1 -go              130 ns       95 ns
+// KUTRACE_USERMODE=1, tracing off       3 ns        4 ns
+// no module (two failing syscalls)    355 ns      315 ns
+// -DKUTRACE_DISABLE                     3 ns        0 ns
+// The scope saves the two CharToBase40 calls, about 35 ns per pair.
+//
+
+#include <stdio.h>
+#include <string.h>
+
+#include "basetypes.h"
+#include "kutrace_lib.h"
+#include "kutrace_scope.h"
+#include "timecounters.h"
+
+static const int kIter = 100000;
+
+int main (int argc, const char** argv) {
+  bool dogo = (argc > 1) && (strcmp(argv[1], "-go") == 0);
+
+  // Compile-time labels must match what the library packs at run time
+  if ((KUTRACE_LABEL("work") != kutrace::CharToBase40("work")) ||
+      (kutrace::Base40Close(KUTRACE_LABEL("work")) != kutrace::CharToBase40("/work"))) {
+    fprintf(stderr, "time_scope: compile-time base40 MISMATCH\n");
+    return 0;
+  }
+
+  if (dogo) {kutrace::go(argv[0]);}
+
+  for (int n = 0; n < 3; ++n) {
+    int64 start_usec = GetUsec();
+    for (int i = 0; i < kIter; ++i) {
+      kutrace::mark_a("work");
+      kutrace::mark_a("/work");
+    }
+    int64 stop_usec = GetUsec();
+
+    int64 start_usec2 = GetUsec();
+    for (int i = 0; i < kIter; ++i) {
+      kutrace::Scope<'A'> scope(KUTRACE_LABEL("work"));
+    }
+    int64 stop_usec2 = GetUsec();
+
+    int delta = stop_usec - start_usec;
+    int delta2 = stop_usec2 - start_usec2;
+    fprintf(stdout, "%d mark_a pairs took %d us (%d ns each)\n", 
+            kIter, delta, (delta * 1000) / kIter);
+    fprintf(stdout, "%d Scope<'A'> took   %d us (%d ns each)\n", 
+            kIter, delta2, (delta2 * 1000) / kIter);
+  }
+  fprintf(stdout, "  Note that each pair or scope generates TWO KUtrace events\n");
+
+  if (dogo) {kutrace::DoOff(); kutrace::DoReset(0);}
+  return 0;
+}